@@ -0,0 +1,243 @@
+#include "access.hpp"
+
+AccessList::AccessList(int default_actions){
+    nodes.emplace_back();
+    nodes[0].actions = default_actions;
+}
+
+/**
+ * @return Bit `index` (0 = most significant) of the 128-bit address.
+ */
+int AccessList::bit(uint64_t hi, uint64_t lo, int index){
+    return index < 64 ? (hi >> (63 - index)) & 1 : (lo >> (127 - index)) & 1;
+}
+
+/**
+ * Clears the bits of the address past the first `length`.
+ */
+void AccessList::mask(uint64_t& hi, uint64_t& lo, int length){
+    hi = length <= 0 ? 0 : length >= 64 ? hi : hi & ~(~0ULL >> length);
+    lo = length <= 64 ? 0 : length >= 128 ? lo : lo & ~(~0ULL >> (length - 64));
+}
+
+/**
+ * @return The number of leading bits two addresses share, at most `limit`.
+ */
+int AccessList::commonLength(uint64_t hi1, uint64_t lo1, uint64_t hi2, uint64_t lo2, int limit){
+    int common;
+    if(hi1 != hi2){
+        common = __builtin_clzll(hi1 ^ hi2);
+    } else if(lo1 != lo2){
+        common = 64 + __builtin_clzll(lo1 ^ lo2);
+    } else{
+        common = 128;
+    }
+    return common < limit ? common : limit;
+}
+
+/**
+ * Parses `1.2.3.0/24`, `2001:db8::/32` or a single address.
+ * @return `false` if the text is not a valid prefix.
+ */
+bool AccessList::parsePrefix(const string& text, uint64_t& hi, uint64_t& lo, int& length){
+    size_t slash = text.find('/');
+    string address = text.substr(0, slash);
+    unsigned char bytes[16] = {0};
+    int max_length;
+    struct in_addr v4;
+    if(inet_pton(AF_INET, address.c_str(), &v4) == 1){
+        bytes[10] = bytes[11] = 0xff;
+        memcpy(bytes + 12, &v4, 4);
+        max_length = 32;
+    } else if(inet_pton(AF_INET6, address.c_str(), bytes) == 1){
+        max_length = 128;
+    } else{
+        return false;
+    }
+    length = max_length;
+    if(slash != string::npos){
+        string digits = text.substr(slash + 1);
+        if(digits.empty() || digits.size() > 3 || digits.find_first_not_of("0123456789") != string::npos){
+            return false;
+        }
+        length = stoi(digits);
+        if(length > max_length){
+            return false;
+        }
+    }
+    if(max_length == 32){
+        length += 96;
+    }
+    hi = lo = 0;
+    for(int i = 0; i < 8; i++){
+        hi = (hi << 8) | bytes[i];
+        lo = (lo << 8) | bytes[i + 8];
+    }
+    mask(hi, lo, length);
+    return true;
+}
+
+/**
+ * Parses a comma-separated list of actions.
+ * @return The `ACL_*` flags; `allow` adds none.
+ * @throws `std::invalid_argument` for an unknown action.
+ */
+int AccessList::parseActions(const string& text){
+    int actions = 0;
+    istringstream ss(text);
+    string action;
+    while(getline(ss, action, ',')){
+        if(action == "allow"){
+        } else if(action == "deny"){
+            actions |= ACL_DENY;
+        } else if(action == "unlimited"){
+            actions |= ACL_UNLIMITED;
+        } else if(action == "nocache"){
+            actions |= ACL_NOCACHE;
+        } else{
+            throw invalid_argument("unknown action " + action + ", expected allow, deny, unlimited or nocache");
+        }
+    }
+    return actions;
+}
+
+/**
+ * Reads the rules of an `acl_file`: one per line, `#` starts a comment.
+ * @throws `std::runtime_error` if the file cannot be read.
+ */
+vector<string> AccessList::readFile(const string& filename){
+    ifstream file(filename);
+    if(!file.is_open()){
+        throw runtime_error("cannot read " + filename);
+    }
+    vector<string> lines;
+    string line;
+    while(getline(file, line)){
+        line = line.substr(0, line.find('#'));
+        if(line.find_first_not_of(" \t\r") != string::npos){
+            lines.push_back(line);
+        }
+    }
+    return lines;
+}
+
+/**
+ * Adds a prefix, replacing the actions of an equal one.
+ */
+void AccessList::insert(uint64_t hi, uint64_t lo, int length, int actions){
+    int32_t current = 0;
+    while(true){
+        if(nodes[current].length == length){
+            nodes[current].actions = actions;
+            return;
+        }
+        int side = bit(hi, lo, nodes[current].length);
+        int32_t next = nodes[current].child[side];
+        if(next < 0){
+            Node leaf;
+            leaf.hi = hi;
+            leaf.lo = lo;
+            leaf.length = length;
+            leaf.actions = actions;
+            nodes.push_back(leaf);
+            nodes[current].child[side] = nodes.size() - 1;
+            return;
+        }
+        int common = commonLength(nodes[next].hi, nodes[next].lo, hi, lo, min(nodes[next].length, length));
+        if(common == nodes[next].length){
+            current = next;
+            continue;
+        }
+
+        // The new prefix leaves the edge to `next` part way: split the edge at `common`
+        Node split;
+        split.hi = hi;
+        split.lo = lo;
+        mask(split.hi, split.lo, common);
+        split.length = common;
+        split.child[bit(nodes[next].hi, nodes[next].lo, common)] = next;
+        if(common == length){
+            split.actions = actions;
+        } else{
+            Node leaf;
+            leaf.hi = hi;
+            leaf.lo = lo;
+            leaf.length = length;
+            leaf.actions = actions;
+            nodes.push_back(leaf);
+            split.child[bit(hi, lo, common)] = nodes.size() - 1;
+        }
+        nodes.push_back(split);
+        nodes[current].child[side] = nodes.size() - 1;
+        return;
+    }
+}
+
+/**
+ * Compiles ACL rules.
+ *
+ * @param lines Rules, in any order; a later rule for the same prefix replaces an earlier one.
+ * @param default_actions The actions of addresses that match no rule.
+ * @throws `std::invalid_argument` for a malformed rule.
+ */
+AccessList AccessList::compile(const vector<string>& lines, int default_actions){
+    AccessList list(default_actions);
+    for(const string& line : lines){
+        istringstream ss(line);
+        string prefix, actions, extra;
+        if(!(ss >> prefix >> actions) || (ss >> extra)){
+            throw invalid_argument("expected <address>[/<length>] <action>[,<action>...]: " + line);
+        }
+        uint64_t hi, lo;
+        int length;
+        if(!parsePrefix(prefix, hi, lo, length)){
+            throw invalid_argument("bad address or prefix " + prefix);
+        }
+        list.insert(hi, lo, length, parseActions(actions));
+        list.rules++;
+    }
+    return list;
+}
+
+/**
+ * @return The actions of the longest prefix containing the address.
+ */
+int AccessList::lookup(uint64_t hi, uint64_t lo) const {
+    int actions = nodes[0].actions;
+    int32_t current = nodes[0].child[bit(hi, lo, 0)];
+    while(current >= 0){
+        const Node& node = nodes[current];
+        uint64_t masked_hi = hi, masked_lo = lo;
+        mask(masked_hi, masked_lo, node.length);
+        if(masked_hi != node.hi || masked_lo != node.lo){
+            break;
+        }
+        if(node.actions >= 0){
+            actions = node.actions;
+        }
+        if(node.length == 128){
+            break;
+        }
+        current = node.child[bit(hi, lo, node.length)];
+    }
+    return actions;
+}
+
+/**
+ * @param address A client address as in `sockaddr_in6`; IPv4 clients are IPv4-mapped.
+ */
+int AccessList::lookup(const in6_addr& address) const {
+    uint64_t hi = 0, lo = 0;
+    for(int i = 0; i < 8; i++){
+        hi = (hi << 8) | address.s6_addr[i];
+        lo = (lo << 8) | address.s6_addr[i + 8];
+    }
+    return lookup(hi, lo);
+}
+
+/**
+ * @return The number of rules compiled.
+ */
+size_t AccessList::size() const {
+    return rules;
+}
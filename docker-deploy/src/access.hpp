@@ -0,0 +1,64 @@
+#ifndef _ACCESS_HPP_
+#define _ACCESS_HPP_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <arpa/inet.h>
+
+using namespace std;
+
+// Actions of an ACL rule, combined as flags; a client matching no flag is allowed as usual
+#define ACL_DENY 1                      // close the connection with 403 right after accept()
+#define ACL_UNLIMITED 2                 // exempt from rate_limit
+#define ACL_NOCACHE 4                   // GETs skip the cache and are streamed from the origin
+
+/**
+ * Client access control: IPv4 and IPv6 prefixes with actions, compiled into a
+ * path-compressed binary radix trie over 128-bit addresses.
+ *
+ * IPv4 addresses and prefixes are stored IPv4-mapped (`::ffff:a.b.c.d`), as the dual-stack
+ * listener reports IPv4 clients, so both families share one trie. Each node holds the whole
+ * prefix it stands for and only branches where two rules differ, so a lookup visits at most
+ * one node per rule on the address's path (a few even with tens of thousands of rules) and
+ * compares two 64-bit words at each.
+ * The longest matching prefix decides; an address that matches no rule gets the default.
+ *
+ * A rule is `<address>[/<length>] <action>[,<action>...]` with the actions `allow`,
+ * `deny`, `unlimited` and `nocache`.
+ */
+class AccessList {
+private:
+    struct Node {
+        uint64_t hi{0};                     // prefix bits, zero past `length`
+        uint64_t lo{0};
+        int length{0};
+        int32_t child[2]{-1, -1};
+        int actions{-1};                    // -1 = no rule ends here
+    };
+
+    vector<Node> nodes;                     // nodes[0] is the root (::/0)
+    size_t rules{0};
+
+    static bool parsePrefix(const string& text, uint64_t& hi, uint64_t& lo, int& length);
+    static int bit(uint64_t hi, uint64_t lo, int index);
+    static void mask(uint64_t& hi, uint64_t& lo, int length);
+    static int commonLength(uint64_t hi1, uint64_t lo1, uint64_t hi2, uint64_t lo2, int limit);
+    void insert(uint64_t hi, uint64_t lo, int length, int actions);
+
+public:
+    explicit AccessList(int default_actions = 0);
+
+    static int parseActions(const string& text);
+    static vector<string> readFile(const string& filename);
+    static AccessList compile(const vector<string>& lines, int default_actions);
+    int lookup(uint64_t hi, uint64_t lo) const;
+    int lookup(const in6_addr& address) const;
+    size_t size() const;
+};
+
+#endif
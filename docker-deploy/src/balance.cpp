@@ -0,0 +1,234 @@
+#include "balance.hpp"
+
+Balancer::Balancer(unique_ptr<Logger>& logger) : logger(logger) {}
+
+Balancer::~Balancer(){
+    {
+        lock_guard<mutex> lock(balance_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if(checker.joinable()){
+        checker.join();
+    }
+}
+
+/**
+ * @return The address as `ip:port`.
+ */
+string Balancer::key(const struct addrinfo* info){
+    char ip[INET6_ADDRSTRLEN] = "";
+    int port = 0;
+    if(info->ai_family == AF_INET){
+        const struct sockaddr_in* in = (const struct sockaddr_in*)info->ai_addr;
+        inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+        port = ntohs(in->sin_port);
+        return string(ip) + ":" + to_string(port);
+    }
+    const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)info->ai_addr;
+    inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+    port = ntohs(in6->sin6_port);
+    return "[" + string(ip) + "]:" + to_string(port);
+}
+
+/**
+ * @return The entry for `key`, created from `info` if needed. Call with `balance_mutex` held.
+ */
+Balancer::Address& Balancer::find(const string& key, const struct addrinfo* info){
+    auto it = addresses.find(key);
+    if(it != addresses.end()){
+        return it->second;
+    }
+    if(addresses.size() >= BALANCE_MAX_ADDRESSES){
+        for(auto candidate = addresses.begin(); candidate != addresses.end(); candidate++){
+            if(candidate->second.outstanding == 0 && !candidate->second.ejected){
+                addresses.erase(candidate);
+                break;
+            }
+        }
+    }
+    Address& address = addresses[key];
+    memcpy(&address.addr, info->ai_addr, min<size_t>(info->ai_addrlen, sizeof(address.addr)));
+    address.length = info->ai_addrlen;
+    return address;
+}
+
+/**
+ * @return Whether `address` may take connections; an ejection that ran out is lifted.
+ */
+bool Balancer::healthy(Address& address, chrono::steady_clock::time_point now){
+    if(address.ejected && now >= address.ejected_until){
+        address.ejected = false;
+        address.consecutive_failures = 0;
+    }
+    return !address.ejected;
+}
+
+/**
+ * Ranks `resolved` for one connection attempt.
+ *
+ * @param mode `p2c` or `least`; anything else keeps the resolver's order.
+ * @return Indexes into `resolved`: the chosen address first, then the other healthy ones,
+ *         then the ejected ones (tried only if nothing else connects).
+ */
+vector<size_t> Balancer::order(const vector<struct addrinfo*>& resolved, const string& mode){
+    thread_local mt19937 random(random_device{}());
+    vector<size_t> healthy_indexes, ejected_indexes;
+    vector<pair<size_t, double>> load(resolved.size());
+    {
+        lock_guard<mutex> lock(balance_mutex);
+        auto now = chrono::steady_clock::now();
+        for(size_t i = 0; i < resolved.size(); i++){
+            Address& address = find(key(resolved[i]), resolved[i]);
+            load[i] = make_pair(address.outstanding, address.connect_time);
+            (healthy(address, now) ? healthy_indexes : ejected_indexes).push_back(i);
+        }
+    }
+    if(mode != "p2c" && mode != "least"){
+        healthy_indexes.insert(healthy_indexes.end(), ejected_indexes.begin(), ejected_indexes.end());
+        return healthy_indexes;
+    }
+
+    shuffle(healthy_indexes.begin(), healthy_indexes.end(), random);
+    shuffle(ejected_indexes.begin(), ejected_indexes.end(), random);
+    // p2c compares the first two of the shuffled list, least compares them all
+    size_t candidates = mode == "p2c" ? min<size_t>(2, healthy_indexes.size()) : healthy_indexes.size();
+    size_t best = 0;
+    for(size_t i = 1; i < candidates; i++){
+        if(load[healthy_indexes[i]] < load[healthy_indexes[best]]){
+            best = i;
+        }
+    }
+    if(!healthy_indexes.empty()){
+        swap(healthy_indexes[0], healthy_indexes[best]);
+    }
+    healthy_indexes.insert(healthy_indexes.end(), ejected_indexes.begin(), ejected_indexes.end());
+    return healthy_indexes;
+}
+
+/**
+ * Records a successful connect to `key`.
+ * @param lease Count an outstanding request on the address until `release()`.
+ */
+void Balancer::connected(const string& key, double seconds, bool lease){
+    lock_guard<mutex> lock(balance_mutex);
+    auto it = addresses.find(key);
+    if(it == addresses.end()){
+        return;
+    }
+    Address& address = it->second;
+    address.requests++;
+    address.consecutive_failures = 0;
+    address.ejected = false;
+    address.connect_time = address.requests == 1 ? seconds
+                           : (1 - BALANCE_EWMA_WEIGHT) * address.connect_time + BALANCE_EWMA_WEIGHT * seconds;
+    if(lease){
+        address.outstanding++;
+    }
+}
+
+/**
+ * Records a failed connect to `key` and ejects the address after too many in a row.
+ */
+void Balancer::failed(const string& key, const Config& config){
+    lock_guard<mutex> lock(balance_mutex);
+    auto it = addresses.find(key);
+    if(it == addresses.end()){
+        return;
+    }
+    Address& address = it->second;
+    address.failures++;
+    address.consecutive_failures++;
+    if(address.ejected || config.upstream_eject_failures == 0 || address.consecutive_failures < config.upstream_eject_failures){
+        return;
+    }
+    address.ejected = true;
+    address.ejected_until = chrono::steady_clock::now() +
+        chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(config.upstream_eject_time));
+    logger->log_note(-1, "Ejected origin address " + key + " after " + to_string(address.consecutive_failures) +
+                     " failed connects");
+    health_interval = config.upstream_health_interval;
+    if(health_interval > 0 && !checker.joinable() && !stopping){
+        checker = thread(&Balancer::check, this);
+    }
+}
+
+void Balancer::release(const string& key){
+    lock_guard<mutex> lock(balance_mutex);
+    auto it = addresses.find(key);
+    if(it != addresses.end() && it->second.outstanding > 0){
+        it->second.outstanding--;
+    }
+}
+
+vector<Balancer::Stats> Balancer::stats(){
+    lock_guard<mutex> lock(balance_mutex);
+    auto now = chrono::steady_clock::now();
+    vector<Stats> result;
+    for(auto& entry : addresses){
+        Address& address = entry.second;
+        bool ejected = !healthy(address, now);
+        result.push_back({entry.first, address.requests, address.failures, address.outstanding, address.connect_time, ejected});
+    }
+    return result;
+}
+
+/**
+ * The active health check thread: probes the ejected addresses every `health_interval`
+ * seconds and restores those that accept a connection.
+ */
+void Balancer::check(){
+    unique_lock<mutex> lock(balance_mutex);
+    while(!stopping){
+        wake.wait_for(lock, chrono::duration<double>(max(health_interval, 0.1)));
+        if(stopping){
+            break;
+        }
+        vector<pair<string, Address>> ejected;
+        for(auto& entry : addresses){
+            if(entry.second.ejected){
+                ejected.push_back(entry);
+            }
+        }
+        lock.unlock();
+        vector<string> restored;
+        for(auto& entry : ejected){
+            if(probe(entry.second.addr, entry.second.length)){
+                restored.push_back(entry.first);
+            }
+        }
+        lock.lock();
+        for(const string& key : restored){
+            auto it = addresses.find(key);
+            if(it != addresses.end() && it->second.ejected){
+                it->second.ejected = false;
+                it->second.consecutive_failures = 0;
+                logger->log_note(-1, "Restored origin address " + key + " after a health check");
+            }
+        }
+    }
+}
+
+/**
+ * @return Whether a TCP connect to the address succeeds within `BALANCE_PROBE_TIMEOUT`.
+ */
+bool Balancer::probe(const sockaddr_storage& addr, socklen_t length){
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(fd < 0){
+        return false;
+    }
+    bool connected = connect(fd, (const struct sockaddr*)&addr, length) == 0;
+    if(!connected && errno == EINPROGRESS){
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if(poll(&pfd, 1, BALANCE_PROBE_TIMEOUT * 1000) == 1){
+            int error = 0;
+            socklen_t error_length = sizeof(error);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+            connected = error == 0;
+        }
+    }
+    close(fd);
+    return connected;
+}
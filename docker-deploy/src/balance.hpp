@@ -0,0 +1,94 @@
+#ifndef _BALANCE_HPP_
+#define _BALANCE_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <condition_variable>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "config.hpp"
+#include "log.hpp"
+
+using namespace std;
+
+#define BALANCE_MAX_ADDRESSES 4096
+#define BALANCE_PROBE_TIMEOUT 1     // seconds an active health check waits for a connect
+#define BALANCE_EWMA_WEIGHT 0.2     // weight of a new connect time in the moving average
+
+/**
+ * Spreads origin connections over all healthy addresses a host resolves to.
+ *
+ * `order()` ranks the resolved addresses for one connection: with `upstream_balance = p2c`
+ * two random healthy addresses are compared, with `least` all of them, and the one with
+ * fewer outstanding requests (then the lower average connect time) goes first. The others
+ * follow as fallbacks, ejected addresses last.
+ *
+ * Passive health checks eject an address after `upstream_eject_failures` connect failures
+ * in a row, for `upstream_eject_time` seconds. An active check thread, started on the first
+ * ejection, tries a TCP connect to each ejected address every `upstream_health_interval`
+ * seconds and restores it as soon as one succeeds.
+ */
+class Balancer {
+public:
+    struct Stats {
+        string address;                     // ip:port
+        size_t requests;
+        size_t failures;
+        size_t outstanding;
+        double connect_time;                // seconds, moving average
+        bool ejected;
+    };
+
+private:
+    struct Address {
+        sockaddr_storage addr;
+        socklen_t length{0};
+        size_t requests{0};                 // successful connects
+        size_t failures{0};                 // failed connects, total
+        size_t consecutive_failures{0};
+        size_t outstanding{0};
+        double connect_time{0};
+        chrono::steady_clock::time_point ejected_until;
+        bool ejected{false};
+    };
+
+    unique_ptr<Logger>& logger;
+    mutex balance_mutex;
+    condition_variable wake;
+    map<string, Address> addresses;
+    thread checker;
+    bool stopping{false};
+    double health_interval{5};
+
+    Address& find(const string& key, const struct addrinfo* info);
+    bool healthy(Address& address, chrono::steady_clock::time_point now);
+    void check();
+    static bool probe(const sockaddr_storage& addr, socklen_t length);
+
+public:
+    explicit Balancer(unique_ptr<Logger>& logger);
+    ~Balancer();
+
+    static string key(const struct addrinfo* info);
+    vector<size_t> order(const vector<struct addrinfo*>& resolved, const string& mode);
+    void connected(const string& key, double seconds, bool lease);
+    void failed(const string& key, const Config& config);
+    void release(const string& key);
+    vector<Stats> stats();
+};
+
+#endif
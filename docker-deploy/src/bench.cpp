@@ -0,0 +1,295 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstring>
+#include <ctime>
+#include "request.hpp"
+#include "response.hpp"
+#include "cache.hpp"
+#include "log.hpp"
+
+using namespace std;
+
+/**
+ * Microbenchmarks for the proxy hot paths.
+ *
+ * usage:  `./bench [--filter <substring>] [--min-time <ms>] [--format json|csv] [--log <file>]`
+ *
+ * Every benchmark prints one record (JSON line by default, or CSV) with the
+ * average nanoseconds per operation, so two runs can be diffed to catch regressions.
+ */
+
+const char * const SAMPLE_REQUEST =
+    "GET http://www.example.com/static/app.js?v=3 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n"
+    "If-None-Match: \"5e8c-5a1b\"\r\n"
+    "If-Modified-Since: Wed, 21 Oct 2015 07:28:00 GMT\r\n"
+    "\r\n";
+
+// sampleResponse() adds a current Date, and there is no must-revalidate, so cached copies are VALID
+const char * const SAMPLE_RESPONSE_HEAD =
+    "HTTP/1.1 200 OK\r\n"
+    "Server: nginx\r\n"
+    "Content-Type: application/javascript\r\n"
+    "Cache-Control: public, max-age=3600\r\n"
+    "ETag: \"5e8c-5a1b\"\r\n"
+    "Last-Modified: Wed, 21 Oct 2015 07:28:00 GMT\r\n";
+
+struct BenchResult {
+    string name;
+    int threads;
+    long long iterations;
+    double ns_per_op;
+};
+
+struct BenchOptions {
+    string filter;
+    long long min_time_ms{200};
+    string format{"json"};
+    string log_file{"/dev/null"};
+};
+
+/**
+ * Build a sample origin response dated now, with a body of `body_len` bytes.
+ */
+string sampleResponse(size_t body_len){
+    string resp = SAMPLE_RESPONSE_HEAD;
+    time_t now = time(NULL);
+    char date[64];
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&now));
+    resp += "Date: " + string(date) + "\r\n";
+    resp += "Content-Length: " + to_string(body_len) + "\r\n\r\n";
+    resp += string(body_len, 'x');
+    return resp;
+}
+
+/**
+ * Run `op` repeatedly on `threads` threads until the minimum run time is reached.
+ * The iteration count doubles until one batch takes at least `min_time_ms`.
+ *
+ * @param op The operation to time. It receives the thread index and the iteration index.
+ * @return The timing of the last (long enough) batch.
+ */
+BenchResult runBench(const string& name, int threads, const BenchOptions& opts,
+                     const function<void(int, long long)>& op){
+    long long iterations = 16;
+    while(true){
+        atomic<bool> go(false);
+        vector<thread> workers;
+        for(int t = 0; t < threads; t++){
+            workers.emplace_back([&, t](){
+                while(!go.load()){this_thread::yield();}
+                for(long long i = 0; i < iterations; i++){
+                    op(t, i);
+                }
+            });
+        }
+        auto start = chrono::steady_clock::now();
+        go = true;
+        for(auto& w : workers){
+            w.join();
+        }
+        auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+        if(elapsed >= opts.min_time_ms * 1000000LL || iterations >= (1LL << 40)){
+            long long total_ops = iterations * threads;
+            return BenchResult{name, threads, total_ops, (double)elapsed / (double)total_ops};
+        }
+        iterations *= 2;
+    }
+}
+
+/**
+ * Print one benchmark record in the requested format.
+ */
+void report(const BenchResult& r, const BenchOptions& opts){
+    double ops_per_sec = r.ns_per_op > 0 ? 1e9 / r.ns_per_op : 0;
+    if(opts.format == "csv"){
+        cout << r.name << "," << r.threads << "," << r.iterations << ","
+             << fixed << setprecision(2) << r.ns_per_op << "," << ops_per_sec << endl;
+    } else{
+        cout << "{\"name\":\"" << r.name << "\",\"threads\":" << r.threads
+             << ",\"iterations\":" << r.iterations
+             << ",\"ns_per_op\":" << fixed << setprecision(2) << r.ns_per_op
+             << ",\"ops_per_sec\":" << ops_per_sec << "}" << endl;
+    }
+}
+
+bool selected(const string& name, const BenchOptions& opts){
+    return opts.filter.empty() || name.find(opts.filter) != string::npos;
+}
+
+// Prevents the compiler from discarding results of benchmarked calls
+atomic<size_t> sink(0);
+
+void benchParsing(const BenchOptions& opts){
+    if(selected("request.parse", opts)){
+        report(runBench("request.parse", 1, opts, [](int, long long){
+            Request request(SAMPLE_REQUEST);
+            request.parseRequest();
+            sink += request.url.size();
+        }), opts);
+    }
+
+    if(selected("request.line", opts)){
+        Request request(SAMPLE_REQUEST);
+        request.parseRequest();
+        report(runBench("request.line", 1, opts, [&](int, long long){
+            sink += request.Request_line().size();
+        }), opts);
+    }
+
+    for(size_t body_len : {0, 1024, 65536}){
+        string name = "response.parse/" + to_string(body_len);
+        if(!selected(name, opts)){continue;}
+        string raw = sampleResponse(body_len);
+        report(runBench(name, 1, opts, [&](int, long long){
+            Response response;
+            response.parseResponse(raw);
+            sink += response.getBody().size();
+        }), opts);
+    }
+
+    Response parsed;
+    parsed.parseResponse(sampleResponse(1024));
+
+    if(selected("response.cache_control", opts)){
+        report(runBench("response.cache_control", 1, opts, [&](int, long long){
+            parsed.parseCacheControl();
+            sink += parsed.getMaxAge();
+        }), opts);
+    }
+
+    if(selected("response.expire_time", opts)){
+        report(runBench("response.expire_time", 1, opts, [&](int, long long){
+            parsed.setExpiredTime();
+            sink += parsed.getExpireTime().size();
+        }), opts);
+    }
+
+    for(size_t body_len : {1024, 65536}){
+        string name = "response.to_string/" + to_string(body_len);
+        if(!selected(name, opts)){continue;}
+        Response response;
+        response.parseResponse(sampleResponse(body_len));
+        report(runBench(name, 1, opts, [&](int, long long){
+            sink += response.toString().size();
+        }), opts);
+    }
+}
+
+/**
+ * Cache benchmarks with a 90/10 get/put mix over a key space twice the cache size,
+ * so lookups see hits, misses and evictions under lock contention.
+ */
+void benchCache(const BenchOptions& opts, unique_ptr<Logger>& log){
+    Response prototype;
+    prototype.parseResponse(sampleResponse(1024));
+    {
+        // Hits must take the fresh path (LRU touch), not the expired or revalidation one
+        Cache check(1);
+        check.put("www.example.com/check", new Response(prototype), log);
+        CacheStatus status = CacheStatus::NOT_IN_CACHE;
+        check.get("www.example.com/check", status);
+        if(status != CacheStatus::VALID){
+            cerr << "cache benchmarks: the sample response is not served as VALID" << endl;
+            exit(1);
+        }
+    }
+
+    const size_t capacity = 512;
+    const int keys = capacity * 2;
+    vector<string> urls;
+    for(int i = 0; i < keys; i++){
+        urls.push_back("www.example.com/object/" + to_string(i));
+    }
+
+    for(int threads : {1, 2, 4, 8}){
+        string name = "cache.get_put";
+        if(selected(name, opts)){
+            Cache cache(capacity);
+            for(int i = 0; i < keys; i += 2){
+                cache.put(urls[i], new Response(prototype), log);
+            }
+            report(runBench(name, threads, opts, [&](int t, long long i){
+                const string& url = urls[(i * 7 + t * 131) % keys];
+                if(i % 10 == 0){
+                    cache.put(url, new Response(prototype), log);
+                } else{
+                    CacheStatus status;
+                    sink += cache.get(url, status) != NULL;
+                }
+            }), opts);
+        }
+
+        name = "cache.get_hit";
+        if(selected(name, opts)){
+            Cache cache(capacity);
+            for(size_t i = 0; i < capacity; i++){
+                cache.put(urls[i], new Response(prototype), log);
+            }
+            report(runBench(name, threads, opts, [&](int t, long long i){
+                CacheStatus status;
+                sink += cache.get(urls[(i + t * 61) % capacity], status) != NULL;
+            }), opts);
+        }
+    }
+}
+
+/**
+ * Logger benchmarks; the log file defaults to /dev/null so only formatting and locking are timed.
+ */
+void benchLogger(const BenchOptions& opts, unique_ptr<Logger>& log){
+    for(int threads : {1, 4}){
+        if(selected("log.note", opts)){
+            report(runBench("log.note", threads, opts, [&](int, long long i){
+                log->log_note((int)i, "Detected chunked encoding");
+            }), opts);
+        }
+        if(selected("log.cache_request", opts)){
+            report(runBench("log.cache_request", threads, opts, [&](int, long long i){
+                log->log_cache_request((int)i, CacheStatus::EXPIRED, "Tue, 04 Mar 2025 01:11:09 GMT");
+            }), opts);
+        }
+    }
+}
+
+int main(int argc, char* argv[]){
+    BenchOptions opts;
+    for(int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if(i + 1 >= argc){
+            cerr << "Missing value for " << arg << endl;
+            return 1;
+        }
+        if(arg == "--filter"){
+            opts.filter = argv[++i];
+        } else if(arg == "--min-time"){
+            opts.min_time_ms = stoll(argv[++i]);
+        } else if(arg == "--format"){
+            opts.format = argv[++i];
+        } else if(arg == "--log"){
+            opts.log_file = argv[++i];
+        } else{
+            cerr << "usage: ./bench [--filter <substring>] [--min-time <ms>] [--format json|csv] [--log <file>]" << endl;
+            return 1;
+        }
+    }
+
+    if(opts.format == "csv"){
+        cout << "name,threads,iterations,ns_per_op,ops_per_sec" << endl;
+    }
+
+    unique_ptr<Logger> log = make_unique<Logger>(opts.log_file);
+    benchParsing(opts);
+    benchCache(opts, log);
+    benchLogger(opts, log);
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include "bypass.hpp"
+
+/**
+ * @return The entry for `key`, created if needed. Call with `bypass_mutex` held.
+ */
+BypassLearner::Stats& BypassLearner::find(map<string, Stats>& stats, const string& key){
+    auto it = stats.find(key);
+    if(it != stats.end()){
+        return it->second;
+    }
+    if(stats.size() >= BYPASS_MAX_ENTRIES){
+        stats.erase(stats.begin());
+    }
+    return stats[key];
+}
+
+/**
+ * Counts one response and starts or ends the bypass. Call with `bypass_mutex` held.
+ * @param threshold Uncacheable responses in a row that start the bypass.
+ * @return Whether the bypass started or ended.
+ */
+bool BypassLearner::update(Stats& stats, bool cacheable, size_t threshold, double probe_interval){
+    if(cacheable){
+        stats.cacheable++;
+        stats.streak = 0;
+        if(stats.bypassed){
+            stats.bypassed = false;
+            unlearned++;
+            return true;
+        }
+        return false;
+    }
+    stats.uncacheable++;
+    stats.streak++;
+    if(stats.bypassed || stats.streak < threshold){
+        return false;
+    }
+    stats.bypassed = true;
+    stats.next_probe = chrono::steady_clock::now() +
+        chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(probe_interval));
+    learned++;
+    return true;
+}
+
+/**
+ * @param origin The origin's `host:port`.
+ * @param url The request target, in origin or absolute form.
+ * @return `origin` followed by the first segment of the path, e.g. `example.com:80/api/`;
+ *         files at the top level share the prefix `/`.
+ */
+string BypassLearner::prefixOf(const string& origin, const string& url){
+    size_t start = 0;
+    size_t scheme = url.find("://");
+    if(scheme != string::npos && url.compare(0, 4, "http") == 0){
+        start = url.find('/', scheme + 3);
+        if(start == string::npos){
+            return origin + "/";
+        }
+    }
+    size_t end = url.find_first_of("?#", start);
+    size_t slash = url.find('/', start + 1);
+    if(slash == string::npos || (end != string::npos && slash > end)){
+        return origin + "/";
+    }
+    return origin + url.substr(start, slash + 1 - start);
+}
+
+/**
+ * Decides whether a GET skips the cache.
+ *
+ * @param probe Set if the prefix is bypassed but this request is its periodic probe.
+ * @return `true` to stream the response straight from the origin.
+ */
+bool BypassLearner::bypass(const string& origin, const string& prefix, double probe_interval, bool& probe){
+    probe = false;
+    lock_guard<mutex> lock(bypass_mutex);
+    Stats* stats = nullptr;
+    auto it = prefixes.find(prefix);
+    if(it != prefixes.end()){
+        stats = &it->second;
+    } else{
+        auto origin_it = origins.find(origin);
+        if(origin_it != origins.end()){
+            stats = &origin_it->second;
+        }
+    }
+    if(stats == nullptr || !stats->bypassed){
+        return false;
+    }
+    auto now = chrono::steady_clock::now();
+    if(now >= stats->next_probe){
+        stats->next_probe = now + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(probe_interval));
+        probe = true;
+        probes++;
+        return false;
+    }
+    streamed++;
+    return true;
+}
+
+/**
+ * Counts a 200 response of the origin and prefix.
+ * @param threshold Uncacheable responses in a row that start a bypass.
+ * @return Whether the prefix's bypass started or ended.
+ */
+bool BypassLearner::record(const string& origin, const string& prefix, bool cacheable, size_t threshold,
+                           double probe_interval){
+    lock_guard<mutex> lock(bypass_mutex);
+    bool changed = update(find(prefixes, prefix), cacheable, threshold, probe_interval);
+    update(find(origins, origin), cacheable, threshold, probe_interval);
+    return changed;
+}
+
+/**
+ * @return Prefixes and origins currently bypassed.
+ */
+size_t BypassLearner::bypassedCount() const {
+    lock_guard<mutex> lock(bypass_mutex);
+    size_t count = 0;
+    for(const auto& entry : prefixes){
+        count += entry.second.bypassed;
+    }
+    for(const auto& entry : origins){
+        count += entry.second.bypassed;
+    }
+    return count;
+}
@@ -0,0 +1,57 @@
+#ifndef _BYPASS_HPP_
+#define _BYPASS_HPP_
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+
+#define BYPASS_MAX_ENTRIES 4096         // origins and path prefixes tracked, each
+
+/**
+ * Learns which origins (`host:port`) and path prefixes (`host:port/first-segment/`) never
+ * send a cacheable response, so their GETs can skip the cache.
+ *
+ * Every 200 response from the origin counts as cacheable or not (`no-store`, `private`).
+ * After `threshold` uncacheable ones in a row a prefix, or a whole origin, is bypassed:
+ * its requests are streamed from the origin to the client without a cache lookup, a
+ * parse of the response or buffering of the body. Once every `probe_interval` seconds
+ * one request of a bypassed prefix takes the normal path again; a cacheable answer ends
+ * the bypass.
+ *
+ * A prefix that has answered on its own decides for itself; one that has not follows
+ * its origin.
+ */
+class BypassLearner {
+private:
+    struct Stats {
+        size_t cacheable{0};
+        size_t uncacheable{0};
+        size_t streak{0};                   // uncacheable responses in a row
+        bool bypassed{false};
+        chrono::steady_clock::time_point next_probe;
+    };
+
+    mutable mutex bypass_mutex;
+    map<string, Stats> origins;
+    map<string, Stats> prefixes;
+
+    Stats& find(map<string, Stats>& stats, const string& key);
+    bool update(Stats& stats, bool cacheable, size_t threshold, double probe_interval);
+
+public:
+    atomic<size_t> streamed{0};             // requests that skipped the cache
+    atomic<size_t> probes{0};               // requests of a bypassed prefix sent the normal way
+    atomic<size_t> learned{0};              // prefixes and origins that became bypassed
+    atomic<size_t> unlearned{0};            // ... and that answered cacheably again
+
+    static string prefixOf(const string& origin, const string& url);
+    bool bypass(const string& origin, const string& prefix, double probe_interval, bool& probe);
+    bool record(const string& origin, const string& prefix, bool cacheable, size_t threshold, double probe_interval);
+    size_t bypassedCount() const;
+};
+
+#endif
@@ -8,6 +8,9 @@
  * @param url The URL whose position in the LRU list needs to be updated.
  */
 void Cache::updateLRU(const string& url){
+    if(!touch_on_hit && !lru_list.empty() && find(lru_list.begin(), lru_list.end(), url) != lru_list.end()){
+        return; // FIFO: only insertions change the eviction order
+    }
     lru_list.remove(url);
     lru_list.push_front(url);
 }
@@ -25,14 +28,35 @@ bool Cache::isExpired(const Response* response) const{
         return true;
     }
 
+    auto expireTime_chrono = parseExpireTime(response->getExpireTime());
+    auto now = chrono::system_clock::now();
+    return now > expireTime_chrono;
+}
+
+/**
+ * Builds the key a response is cached under.
+ * @note Shared with the offline tools so that they key objects exactly like the proxy does.
+ *
+ * @param host The `Host` of the request.
+ * @param url The request target as received from the client.
+ * @return The cache key.
+ */
+string Cache::makeKey(const string& host, const string& url){
+    return host + url;
+}
+
+/**
+ * Converts an expire time stored on a `Response` back to a time point.
+ * @param expire_time An HTTP date such as "Wed, 21 Oct 2015 07:28:00 GMT".
+ * @return The corresponding `chrono::system_clock::time_point`.
+ */
+chrono::system_clock::time_point Cache::parseExpireTime(const string& expire_time){
     tm tm = {};
-    istringstream ss(response->getExpireTime());
+    istringstream ss(expire_time);
     ss >> get_time(&tm, "%a, %d %b %Y %H:%M:%S GMT");
 
     auto time_t = mktime(&tm);
-    auto expireTime_chrono = chrono::system_clock::from_time_t(time_t);
-    auto now = chrono::system_clock::now();
-    return now > expireTime_chrono;
+    return chrono::system_clock::from_time_t(time_t);
 }
 
 /**
@@ -43,7 +67,17 @@ bool Cache::isExpired(const Response* response) const{
  * @param log A `Logger` instance to record eviction events.
  */
 void Cache::cacheUpdate(unique_ptr<Logger>& log){
-    while (cache_map.size() >= max_entries && !lru_list.empty()){
+    evict(max_entries > 0 ? max_entries - 1 : 0, log);
+}
+
+/**
+ * Evicts least recently used entries until at most `keep` remain and the byte budget is met.
+ *
+ * @param keep The number of entries to keep.
+ * @param log A `Logger` instance to record eviction events.
+ */
+void Cache::evict(size_t keep, unique_ptr<Logger>& log){
+    while ((cache_map.size() > keep || (max_bytes > 0 && total_bytes > max_bytes)) && !lru_list.empty()){
         string urlRemove = lru_list.back();
         auto it = cache_map.find(urlRemove);
         // When cache is full, delete the tail
@@ -51,6 +85,7 @@ void Cache::cacheUpdate(unique_ptr<Logger>& log){
             string msg = "evicted" + it->second.response->toString() + " from cache";
             log->log_note(-1, msg);
 
+            total_bytes -= it->second.bytes;
             delete it->second.response;
             cache_map.erase(it);
         }
@@ -58,6 +93,230 @@ void Cache::cacheUpdate(unique_ptr<Logger>& log){
     }
 }
 
+/**
+ * Applies new cache settings while the proxy is running.
+ * @note Takes the write lock, so lookups see either the old or the new settings.
+ *       Shrinking the cache evicts the least recently used entries right away.
+ *
+ * @param size The maximum number of entries.
+ * @param clean_sec Seconds between sweeps of expired entries.
+ * @param policy `"lru"`, or `"fifo"` to stop hits from refreshing an entry's position.
+ * @param log A `Logger` instance to record eviction events.
+ */
+void Cache::configure(size_t size, int clean_sec, const string& policy, unique_ptr<Logger>& log){
+    unique_lock<shared_mutex> write_lock(cache_mutex);
+    max_entries = size;
+    cleanup_interval = chrono::seconds(clean_sec);
+    touch_on_hit = (policy != "fifo");
+    evict(max_entries, log);
+    configureShards(log);
+}
+
+/**
+ * Applies the entry limit, byte budget and policy to the shared shards. Caller holds the write lock.
+ * @note The byte budget is turned into a number of slots, at least one.
+ */
+void Cache::configureShards(unique_ptr<Logger>& log){
+    for(auto& shard : shared_shards){
+        size_t slots = max_bytes > 0 ? max(max_bytes / shard->slotSize(), (size_t)1) : max_entries;
+        vector<string> evicted;
+        shard->configure(min(slots, max_entries), touch_on_hit, evicted);
+        for(const string& url : evicted){
+            log->log_note(-1, "evicted " + url + " from shared cache");
+        }
+    }
+}
+
+/**
+ * Compiles the `refresh_pattern` rules and swaps them in for responses cached from now on.
+ * @note The rules were validated when the configuration was loaded. If the combined
+ *       automaton still fails to compile, the previous rules are kept.
+ *
+ * @param patterns The `refresh_pattern` lines, in order.
+ * @param log A `Logger` instance to record a compile failure.
+ */
+void Cache::configureRefresh(const vector<string>& patterns, unique_ptr<Logger>& log){
+    unique_lock<shared_mutex> write_lock(cache_mutex);
+    try{
+        atomic_store(&refresh_patterns, shared_ptr<const RefreshPatterns>(make_shared<const RefreshPatterns>(patterns, refresh_counters)));
+    } catch(const exception& e){
+        log->log_error(-1, string("Failed to compile refresh_pattern rules, keeping the old ones: ") + e.what());
+    }
+}
+
+/**
+ * Sets the lifetime of negative responses (404, 410, 301) without one of their own.
+ * @param seconds The lifetime, 0 to keep them stale (so they are not served from the cache).
+ */
+void Cache::setNegativeTtl(double seconds){
+    negative_ttl = seconds;
+}
+
+/**
+ * Gives `response` the freshness of the first refresh rule matching the URL of `url`,
+ * or `negative_ttl` if it is a negative response.
+ *
+ * @param url The cache key.
+ * @param count Whether to count the response as one the rule applied to; not done for
+ *        copies parsed again from the shared cache or a snapshot.
+ * @param rule Set to the rule's line when one applied.
+ * @param stored_rule The line of the rule chosen when the response was stored, for a copy
+ *        parsed again from the shared cache: that rule applies without matching the URL.
+ * @return `true` if a rule changed the response's expire time.
+ */
+bool Cache::applyRefresh(const string& url, Response* response, bool count, string* rule, const string* stored_rule){
+    if(response->isNegative()){
+        return response->applyNegativeTtl(negative_ttl);
+    }
+    if(stored_rule && stored_rule->empty()){
+        return false;
+    }
+    shared_ptr<const RefreshPatterns> patterns = atomic_load(&refresh_patterns);
+    if(!patterns){
+        return false;
+    }
+    const RefreshRule* matched = stored_rule ? patterns->find(*stored_rule) : patterns->match(RefreshPatterns::urlOf(url));
+    if(!matched || !response->applyRefresh(matched->min_age, matched->percent, matched->max_age, matched->override_expire)){
+        return false;
+    }
+    response->setRefreshRule(matched->line, &matched->counters->hits);
+    if(count){
+        matched->counters->applied++;
+    }
+    if(rule){
+        *rule = matched->line;
+    }
+    return true;
+}
+
+/**
+ * Applies the refresh rules to a response about to be cached with `put()`.
+ * @return The line of the rule that set the response's expire time, or "".
+ */
+string Cache::refresh(const string& url, Response* response){
+    string rule;
+    applyRefresh(url, response, true, &rule);
+    return rule;
+}
+
+/**
+ * Counts a fresh hit on the refresh rule it is owed to, if any.
+ * @return `response`.
+ */
+Response* Cache::countRefreshHit(Response* response){
+    atomic<size_t>* hits = response->refreshHit();
+    if(hits){
+        (*hits)++;
+    }
+    return response;
+}
+
+/**
+ * @return The current refresh rules, with their counters.
+ */
+vector<RefreshRule> Cache::refreshRules() const {
+    shared_ptr<const RefreshPatterns> patterns = atomic_load(&refresh_patterns);
+    return patterns ? patterns->all() : vector<RefreshRule>();
+}
+
+/**
+ * Moves the cache into a shared-memory segment for the prefork workers.
+ * @note Must be called before the workers are forked; the segment has one slot per
+ *       `max_entries`, so a later reload can shrink the shared cache but not grow it.
+ *
+ * @param slot_size The largest response, in bytes, that can be shared.
+ * @param nodes NUMA nodes to create one shard on each, or empty for a single unplaced segment.
+ *              Each shard holds up to `max_entries` objects; workers use the shard of their node.
+ * @throws `std::runtime_error` if a segment cannot be created.
+ */
+void Cache::enableShared(size_t slot_size, const vector<int>& nodes){
+    unique_lock<shared_mutex> write_lock(cache_mutex);
+    shared_shards.clear();
+    if(nodes.empty()){
+        shared_shards.push_back(make_unique<ShmCache>(max_entries, slot_size));
+    }
+    for(int node : nodes){
+        shared_shards.push_back(make_unique<ShmCache>(max_entries, slot_size, node));
+    }
+    for(auto& shard : shared_shards){
+        vector<string> evicted;
+        shard->configure(max_entries, touch_on_hit, evicted);
+    }
+    shared = shared_shards.front().get();
+}
+
+/**
+ * Selects the shared shard this process reads and writes (a worker's NUMA node).
+ * @param index The shard, in the order of the `nodes` given to `enableShared()`.
+ */
+void Cache::useShard(size_t index){
+    unique_lock<shared_mutex> write_lock(cache_mutex);
+    if(!shared_shards.empty()){
+        shared = shared_shards[index % shared_shards.size()].get();
+    }
+}
+
+/**
+ * Splits off the status line and headers of a response, as stored in snapshots and the shared cache.
+ */
+string Cache::responseHead(const Response* response){
+    string whole = response->toString();
+    return whole.substr(0, whole.size() - response->getBody().size());
+}
+
+/**
+ * Looks a response up in the shared cache.
+ * @note The response is parsed into a per-thread object, which stays valid until the
+ *       thread's next lookup; callers never delete what `get()` returns.
+ */
+Response* Cache::getShared(const string& url, CacheStatus& cache_res){
+    thread_local Response response;
+    string head, body, rule;
+    if(!shared->get(url, head, body, rule)){
+        cache_res = CacheStatus::NOT_IN_CACHE;
+        return NULL;
+    }
+
+    response = Response();
+    try{
+        response.parseResponse(head);
+        if(response.getIsChunked()){
+            response.addChunkedData(vector<char>(body.begin(), body.end()));
+        } else{
+            response.addResponseBody(body);
+        }
+    } catch(const exception& e){
+        cache_res = CacheStatus::NOT_IN_CACHE;
+        return NULL;
+    }
+    applyRefresh(url, &response, false, nullptr, &rule);
+
+    if(isExpired(&response)){
+        cache_res = CacheStatus::EXPIRED;
+    } else if(response.getCacheMode() == CACHE_MUST_REVALIDATE){
+        cache_res = CacheStatus::REQUIRES_VALIDATION;
+    } else{
+        cache_res = CacheStatus::VALID;
+        countRefreshHit(&response);
+    }
+    return &response;
+}
+
+/**
+ * Copies a response into the shared cache and frees it.
+ * Responses larger than a shared slot are not cached.
+ */
+void Cache::putShared(const string& url, Response* response, unique_ptr<Logger>& log){
+    vector<string> evicted;
+    if(!shared->put(url, responseHead(response), response->getBody(), response->refreshRule(), evicted)){
+        log->log_note(-1, "Not caching " + url + ": larger than shared_cache_object_size");
+    }
+    for(const string& key : evicted){
+        log->log_note(-1, "evicted " + key + " from shared cache");
+    }
+    delete response;
+}
+
 /**
  * Retrieves a response from the cache.
  * @note This function first attempts a read lock for fast access. If the entry is expired,
@@ -68,6 +327,9 @@ void Cache::cacheUpdate(unique_ptr<Logger>& log){
  * @return A pointer to the cached `Response`, or `NULL` if the entry is not found or expired.
  */
 Response* Cache::get(const string&url, CacheStatus& cache_res){
+    if(shared){
+        return getShared(url, cache_res);
+    }
     shared_lock<shared_mutex> lock(cache_mutex);
 
     auto it = cache_map.find(url);
@@ -105,7 +367,7 @@ Response* Cache::get(const string&url, CacheStatus& cache_res){
 
         updateLRU(url);
         cache_res = CacheStatus::VALID;
-        return it->second.response;
+        return countRefreshHit(it->second.response);
     }
 
     if(cac_res->getCacheMode() == CACHE_MUST_REVALIDATE){
@@ -124,7 +386,7 @@ Response* Cache::get(const string&url, CacheStatus& cache_res){
 
     updateLRU(url);
     cache_res = CacheStatus::VALID;
-    return it->second.response;
+    return countRefreshHit(it->second.response);
 }
 
 /**
@@ -142,6 +404,7 @@ void Cache::cleanExpiredResponse(unique_ptr<Logger>& log){
         if (isExpired(it->second.response)) {
             string url = it->first;
             log->log_note(-1, "Removing expired entry: " + url);
+            total_bytes -= it->second.bytes;
             delete it->second.response;
             lru_list.remove(url);
             it = cache_map.erase(it);
@@ -164,6 +427,10 @@ void Cache::put(const string& url, Response* response, unique_ptr<Logger>& log){
     if (!response || response->getCacheMode() == CACHE_NO_STORE){
         return;
     }
+    if(shared){
+        putShared(url, response, log);
+        return;
+    }
 
     unique_lock<shared_mutex> write_lock(cache_mutex);
 
@@ -173,11 +440,15 @@ void Cache::put(const string& url, Response* response, unique_ptr<Logger>& log){
         cleanExpiredResponse(log);
     }
 
+    size_t bytes = url.size() + response->toString().size();
     auto it = cache_map.find(url);
     if (it != cache_map.end()){
+        total_bytes += bytes - it->second.bytes;
         delete it->second.response;
         it->second.response = response;
+        it->second.bytes = bytes;
         updateLRU(url);
+        evict(max_entries, log);
         return;
     }
 
@@ -185,11 +456,50 @@ void Cache::put(const string& url, Response* response, unique_ptr<Logger>& log){
 
     CacheEntry new_entry{
         response,
-        url
+        url,
+        chrono::system_clock::time_point(),
+        bytes
     };
 
     cache_map[url] = new_entry;
+    total_bytes += bytes;
     updateLRU(url);
+    evict(max_entries, log); // an entry over the byte budget is evicted last, once the older ones are gone
+}
+
+/**
+ * Limits the memory held by cached responses, evicting least recently used entries right away.
+ * @note Used by the memory-pressure controller; with a shared cache the budget is turned into
+ *       a number of shared slots.
+ *
+ * @param bytes The budget in bytes, 0 for no limit.
+ * @param log A `Logger` instance to record eviction events.
+ */
+void Cache::setByteBudget(size_t bytes, unique_ptr<Logger>& log){
+    unique_lock<shared_mutex> write_lock(cache_mutex);
+    max_bytes = bytes;
+    evict(max_entries, log);
+    configureShards(log);
+}
+
+/**
+ * Retrieves the byte budget set by `setByteBudget()`; 0 means unlimited.
+ */
+size_t Cache::byteBudget() const {
+    shared_lock<shared_mutex> lock(cache_mutex);
+    return max_bytes;
+}
+
+/**
+ * Retrieves the memory held by cached responses, in bytes.
+ * @note A shared cache reports its slots in use times the slot size.
+ */
+size_t Cache::bytes() const {
+    shared_lock<shared_mutex> lock(cache_mutex);
+    if(shared){
+        return shared->size() * shared->slotSize();
+    }
+    return total_bytes;
 }
 
 /**
@@ -198,6 +508,99 @@ void Cache::put(const string& url, Response* response, unique_ptr<Logger>& log){
  * @return The number of cached responses.
  */
 size_t Cache::size() const {
+    if(shared){
+        return shared->size();
+    }
     unique_lock<shared_mutex> write_lock(cache_mutex);
     return cache_map.size();
+}
+
+/**
+ * Writes every cached response to a snapshot file, so another process can start with a warm cache.
+ * @note Entries are written from least to most recently used, so `load()` restores the LRU order.
+ *       Holds the read lock; lookups continue while the snapshot is written.
+ *
+ * @param filename The snapshot file to (over)write.
+ * @return The number of entries written.
+ * @throws `std::runtime_error` if the file cannot be written.
+ */
+size_t Cache::save(const string& filename) const{
+    ofstream file(filename, ios::binary | ios::trunc | ios::out);
+    if(!file.is_open()){
+        throw runtime_error("Failed to open cache snapshot " + filename);
+    }
+
+    auto writeField = [&file](const string& field){
+        uint32_t length = field.size();
+        file.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        file.write(field.data(), field.size());
+    };
+
+    shared_lock<shared_mutex> lock(cache_mutex);
+    file << CACHE_SNAPSHOT_MAGIC;
+    size_t count = 0;
+    for(auto it = lru_list.rbegin(); it != lru_list.rend(); it++){
+        auto entry = cache_map.find(*it);
+        if(entry == cache_map.end()){continue;}
+
+        const Response* response = entry->second.response;
+        writeField(entry->first);
+        writeField(responseHead(response));
+        writeField(response->getBody());
+        count++;
+    }
+
+    if(!file){
+        throw runtime_error("Failed to write cache snapshot " + filename);
+    }
+    return count;
+}
+
+/**
+ * Fills the cache from a snapshot written by `save()`.
+ * @note Responses are parsed again, so their cache mode and expire time are recomputed from their headers
+ *       and the refresh rules. Entries that fail to parse are skipped.
+ *
+ * @param filename The snapshot file.
+ * @param log A `Logger` instance to record skipped entries.
+ * @return The number of entries loaded.
+ * @throws `std::runtime_error` if the file cannot be opened or is not a snapshot.
+ */
+size_t Cache::load(const string& filename, unique_ptr<Logger>& log){
+    ifstream file(filename, ios::binary);
+    string magic(strlen(CACHE_SNAPSHOT_MAGIC), '\0');
+    if(!file.is_open() || !file.read(&magic[0], magic.size()) || magic != CACHE_SNAPSHOT_MAGIC){
+        throw runtime_error("Invalid cache snapshot " + filename);
+    }
+
+    auto readField = [&file](string& field){
+        uint32_t length = 0;
+        if(!file.read(reinterpret_cast<char*>(&length), sizeof(length))){
+            return false;
+        }
+        field.resize(length);
+        return (bool)file.read(&field[0], length);
+    };
+
+    size_t count = 0;
+    string url, head, body;
+    while(readField(url) && readField(head) && readField(body)){
+        Response* response = new Response();
+        try{
+            response->parseResponse(head);
+            if(response->getIsChunked()){
+                response->addChunkedData(vector<char>(body.begin(), body.end()));
+            } else{
+                response->addResponseBody(body);
+            }
+        } catch(const exception& e){
+            log->log_error(-1, "Skipping cache snapshot entry " + url);
+            delete response;
+            continue;
+        }
+        applyRefresh(url, response, false);
+        put(url, response, log);
+        count++;
+    }
+    return count;
 }
\ No newline at end of file
@@ -9,8 +9,14 @@
 #include <chrono>
 #include <shared_mutex>
 #include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
 #include "response.hpp"
 #include "log.hpp"
+#include "shmcache.hpp"
+#include "refresh.hpp"
 #include "util.hpp"
 
 using namespace std;
@@ -21,26 +27,59 @@ private:
         Response* response;
         string url;
         chrono::system_clock::time_point last_checked;
+        size_t bytes;
     };
 
     unordered_map<string, CacheEntry> cache_map;
     list<string> lru_list;
 
-    const size_t max_entries;
+    size_t max_entries;
+    size_t max_bytes{0};                    // 0 = no byte budget
+    size_t total_bytes{0};
+    bool touch_on_hit{true};
     chrono::seconds cleanup_interval;
     chrono::system_clock::time_point last_cleanup;
     mutable shared_mutex cache_mutex;
+    vector<unique_ptr<ShmCache>> shared_shards;
+    ShmCache* shared{nullptr};
+    shared_ptr<const RefreshPatterns> refresh_patterns;
+    map<string, RefreshCounters> refresh_counters;      // by rule, never erased: responses point into it
+    atomic<double> negative_ttl{0};
 
     void updateLRU(const string& url);
     void cacheUpdate(unique_ptr<Logger>& log);
+    void evict(size_t keep, unique_ptr<Logger>& log);
     bool isExpired(const Response* response) const;
     void cleanExpiredResponse(unique_ptr<Logger>& log);
+    Response* getShared(const string& url, CacheStatus& cache_res);
+    void putShared(const string& url, Response* response, unique_ptr<Logger>& log);
+    static string responseHead(const Response* response);
+    void configureShards(unique_ptr<Logger>& log);
+    bool applyRefresh(const string& url, Response* response, bool count, string* rule = nullptr,
+                      const string* stored_rule = nullptr);
+    static Response* countRefreshHit(Response* response);
 
 public:
     explicit Cache(size_t size, int clean_sec = 300) : max_entries(size), cleanup_interval(clean_sec), last_cleanup(chrono::system_clock::now()) {}
+    static string makeKey(const string& host, const string& url);
+    static chrono::system_clock::time_point parseExpireTime(const string& expire_time);
+
+    void configure(size_t size, int clean_sec, const string& policy, unique_ptr<Logger>& log);
+    void configureRefresh(const vector<string>& patterns, unique_ptr<Logger>& log);
+    void setNegativeTtl(double seconds);
+    void enableShared(size_t slot_size, const vector<int>& nodes = {});
+    void useShard(size_t index);
     Response* get(const string&url, CacheStatus &cache_res);
     void put(const string& url, Response* response, unique_ptr<Logger>& log);
+    string refresh(const string& url, Response* response);
+    vector<RefreshRule> refreshRules() const;
     size_t size() const;
+    void setByteBudget(size_t bytes, unique_ptr<Logger>& log);
+    size_t byteBudget() const;
+    size_t bytes() const;
+
+    size_t save(const string& filename) const;
+    size_t load(const string& filename, unique_ptr<Logger>& log);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,562 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include "cache.hpp"
+
+using namespace std;
+
+/**
+ * Offline cache-policy simulator.
+ *
+ * usage:  `./cachesim [options] <trace>`
+ *
+ * Replays a request trace through several eviction policies and cache sizes and prints,
+ * for every (policy, size) pair, the hit ratio, byte hit ratio and the load left for the origin.
+ *
+ * Supported traces (detected per line):
+ * - `proxy.log` written by this proxy: requests are keyed with `Cache::makeKey()`, and
+ *   "cached, expires at" / "not cacheable" lines give each object its lifetime.
+ * - Squid native access.log: `time elapsed client code/status bytes method URL ...`
+ * - Simple access log: `<unix time> <url> <bytes> [<ttl seconds>]`
+ *
+ * Options:
+ * - `--policies lru,fifo,sieve,lfu,gdsf`   policies to compare (default: all)
+ * - `--sizes <bytes>,<bytes>,...`          cache sizes (default: 16 sizes, 1MB doubling)
+ * - `--default-size <bytes>`               object size when the trace has none (default 1)
+ * - `--default-ttl <seconds>`              lifetime for access-log objects without one (default 3600, -1 = never expires)
+ */
+
+const int64_t TTL_NEVER = -1;
+
+struct TraceRecord {
+    uint32_t key;
+    uint32_t size;
+    int64_t time;
+    int64_t ttl;       // seconds of freshness after `time`, TTL_NEVER for no expiry
+    bool cacheable;
+};
+
+struct Trace {
+    vector<TraceRecord> records;
+    vector<string> keys;
+    unordered_map<string, uint32_t> key_ids;
+
+    uint32_t intern(const string& key){
+        auto it = key_ids.find(key);
+        if(it != key_ids.end()){
+            return it->second;
+        }
+        uint32_t id = keys.size();
+        keys.push_back(key);
+        key_ids.emplace(key, id);
+        return id;
+    }
+};
+
+struct SimOptions {
+    vector<string> policies{"lru", "fifo", "sieve", "lfu", "gdsf"};
+    vector<uint64_t> sizes;
+    uint32_t default_size{1};
+    int64_t default_ttl{3600};
+};
+
+/**
+ * Splits an absolute-form URL into the `Host` and the request target used by the proxy.
+ */
+string hostOfUrl(const string& url){
+    size_t start = url.find("://");
+    start = (start == string::npos) ? 0 : start + 3;
+    size_t end = url.find_first_of(":/", start);
+    return url.substr(start, end == string::npos ? string::npos : end - start);
+}
+
+/**
+ * Parses the asctime() timestamp written by `Logger` ("Tue Mar  4 01:11:09 2025", UTC).
+ */
+int64_t parseLogTime(const string& time_str){
+    tm tm = {};
+    istringstream ss(time_str);
+    ss >> get_time(&tm, "%a %b %d %H:%M:%S %Y");
+    if(ss.fail()){
+        return 0;
+    }
+    return timegm(&tm);
+}
+
+/**
+ * Reads a proxy.log line of the form `ID: "A" from B @ TIME`, where one of A and B is the request line.
+ * @return `true` when the line is a new request, filling `id`, `request_line` and `time`.
+ */
+bool parseNewRequest(const string& line, long& id, string& request_line, int64_t& time){
+    size_t colon = line.find(": \"");
+    if(colon == string::npos){
+        return false;
+    }
+    size_t close_quote = line.find("\" from ", colon + 3);
+    size_t at = line.rfind(" @ ");
+    if(close_quote == string::npos || at == string::npos || at < close_quote){
+        return false;
+    }
+    try{
+        id = stol(line.substr(0, colon));
+    } catch(...){
+        return false;
+    }
+
+    string first = line.substr(colon + 3, close_quote - colon - 3);
+    string second = line.substr(close_quote + 7, at - close_quote - 7);
+    request_line = (first.find(' ') != string::npos) ? first : second;
+    time = parseLogTime(line.substr(at + 3));
+    return true;
+}
+
+/**
+ * Loads a trace into memory, interning cache keys so the replay loop only touches integers.
+ */
+void loadTrace(istream& in, Trace& trace, const SimOptions& opts){
+    unordered_map<long, size_t> log_ids;   // proxy.log request ID -> record index
+    vector<bool> ttl_known;
+    string line;
+
+    while(getline(in, line)){
+        if(!line.empty() && line.back() == '\r'){
+            line.pop_back();
+        }
+        if(line.empty()){continue;}
+
+        // proxy.log format
+        long id;
+        string request_line;
+        int64_t time;
+        if(parseNewRequest(line, id, request_line, time)){
+            istringstream rs(request_line);
+            string method, url;
+            rs >> method >> url;
+            if(method != "GET"){continue;}
+
+            TraceRecord rec{trace.intern(Cache::makeKey(hostOfUrl(url), url)), opts.default_size, time, 0, true};
+            log_ids[id] = trace.records.size();
+            trace.records.push_back(rec);
+            ttl_known.push_back(false);
+            continue;
+        }
+
+        size_t colon = line.find(": ");
+        if(colon != string::npos && colon > 0 && (isdigit(line[0]) || line[0] == '-')){
+            long log_id;
+            try{
+                log_id = stol(line.substr(0, colon));
+            } catch(...){
+                continue;
+            }
+            auto it = log_ids.find(log_id);
+            if(it == log_ids.end()){continue;}
+            TraceRecord& rec = trace.records[it->second];
+
+            string rest = line.substr(colon + 2);
+            if(rest.find("cached, expires at ") == 0){
+                auto expire = Cache::parseExpireTime(rest.substr(19));
+                rec.ttl = max<int64_t>(0, chrono::system_clock::to_time_t(expire) - rec.time);
+                ttl_known[it->second] = true;
+            } else if(rest.find("not cacheable because") == 0){
+                rec.cacheable = false;
+                ttl_known[it->second] = true;
+            }
+            continue;
+        }
+
+        // Access log formats
+        istringstream ls(line);
+        vector<string> fields;
+        string field;
+        while(ls >> field){
+            fields.push_back(field);
+        }
+
+        TraceRecord rec{0, opts.default_size, 0, opts.default_ttl, true};
+        try{
+            if(fields.size() >= 7 && fields[3].find('/') != string::npos){
+                // Squid: time elapsed client code/status bytes method URL
+                if(fields[5] != "GET"){continue;}
+                rec.time = (int64_t)stod(fields[0]);
+                rec.size = (uint32_t)stoul(fields[4]);
+                rec.key = trace.intern(Cache::makeKey(hostOfUrl(fields[6]), fields[6]));
+                rec.cacheable = fields[3].find("/200") != string::npos;
+            } else if(fields.size() >= 3){
+                rec.time = (int64_t)stod(fields[0]);
+                rec.size = (uint32_t)stoul(fields[2]);
+                rec.key = trace.intern(Cache::makeKey(hostOfUrl(fields[1]), fields[1]));
+                if(fields.size() >= 4){
+                    rec.ttl = (fields[3] == "-") ? opts.default_ttl : stoll(fields[3]);
+                }
+            } else{
+                continue;
+            }
+        } catch(...){
+            continue;
+        }
+        trace.records.push_back(rec);
+        ttl_known.push_back(true);
+    }
+
+    // proxy.log only records lifetimes on misses: carry the last known lifetime of an object forward
+    unordered_map<uint32_t, int64_t> last_ttl;
+    for(size_t i = 0; i < trace.records.size(); i++){
+        TraceRecord& rec = trace.records[i];
+        if(ttl_known[i]){
+            last_ttl[rec.key] = rec.ttl;
+        } else{
+            auto it = last_ttl.find(rec.key);
+            rec.ttl = (it != last_ttl.end()) ? it->second : 0;
+        }
+    }
+}
+
+/**
+ * Eviction policy interface. Policies track membership and bytes; freshness is handled by the driver.
+ */
+class Policy {
+protected:
+    uint64_t capacity;
+    uint64_t used{0};
+    vector<uint32_t> sizes;
+    vector<bool> present;
+
+public:
+    Policy(uint64_t capacity, size_t keys) : capacity(capacity), sizes(keys, 0), present(keys, false) {}
+    virtual ~Policy() {}
+
+    bool contains(uint32_t key) const { return present[key]; }
+    virtual void touch(uint32_t key) = 0;
+    virtual void insert(uint32_t key, uint32_t size) = 0;
+    virtual void erase(uint32_t key) = 0;
+};
+
+/**
+ * Intrusive doubly linked list over key ids, shared by the list based policies.
+ */
+class KeyList {
+private:
+    static const uint32_t NIL = UINT32_MAX;
+    vector<uint32_t> prev, next;
+    uint32_t head{NIL}, tail{NIL};
+
+public:
+    explicit KeyList(size_t keys) : prev(keys, NIL), next(keys, NIL) {}
+
+    void pushFront(uint32_t key){
+        prev[key] = NIL;
+        next[key] = head;
+        if(head != NIL){prev[head] = key;}
+        head = key;
+        if(tail == NIL){tail = key;}
+    }
+
+    void remove(uint32_t key){
+        if(prev[key] != NIL){next[prev[key]] = next[key];} else{head = next[key];}
+        if(next[key] != NIL){prev[next[key]] = prev[key];} else{tail = prev[key];}
+        prev[key] = next[key] = NIL;
+    }
+
+    uint32_t back() const { return tail; }
+    uint32_t before(uint32_t key) const { return prev[key]; }
+    bool empty() const { return head == NIL; }
+    static bool isNil(uint32_t key) { return key == NIL; }
+};
+
+/* Least recently used: the policy implemented by `Cache` */
+class LRUPolicy : public Policy {
+protected:
+    KeyList list;
+
+public:
+    LRUPolicy(uint64_t capacity, size_t keys) : Policy(capacity, keys), list(keys) {}
+
+    void touch(uint32_t key) override {
+        list.remove(key);
+        list.pushFront(key);
+    }
+
+    void insert(uint32_t key, uint32_t size) override {
+        if(size > capacity){return;}
+        while(used + size > capacity && !list.empty()){
+            erase(list.back());
+        }
+        list.pushFront(key);
+        present[key] = true;
+        sizes[key] = size;
+        used += size;
+    }
+
+    void erase(uint32_t key) override {
+        if(!present[key]){return;}
+        list.remove(key);
+        present[key] = false;
+        used -= sizes[key];
+    }
+};
+
+/* First in, first out: hits do not change the eviction order */
+class FIFOPolicy : public LRUPolicy {
+public:
+    using LRUPolicy::LRUPolicy;
+    void touch(uint32_t) override {}
+};
+
+/* SIEVE: FIFO order with a visited bit and a hand that skips recently used objects */
+class SievePolicy : public Policy {
+private:
+    KeyList list;
+    vector<bool> visited;
+    uint32_t hand;
+
+public:
+    SievePolicy(uint64_t capacity, size_t keys) : Policy(capacity, keys), list(keys), visited(keys, false), hand(UINT32_MAX) {}
+
+    void touch(uint32_t key) override { visited[key] = true; }
+
+    void insert(uint32_t key, uint32_t size) override {
+        if(size > capacity){return;}
+        while(used + size > capacity && !list.empty()){
+            uint32_t victim = KeyList::isNil(hand) ? list.back() : hand;
+            while(visited[victim]){
+                visited[victim] = false;
+                victim = list.before(victim);
+                if(KeyList::isNil(victim)){victim = list.back();}
+            }
+            hand = list.before(victim);
+            erase(victim);
+        }
+        list.pushFront(key);
+        present[key] = true;
+        visited[key] = false;
+        sizes[key] = size;
+        used += size;
+    }
+
+    void erase(uint32_t key) override {
+        if(!present[key]){return;}
+        if(hand == key){hand = list.before(key);}
+        list.remove(key);
+        present[key] = false;
+        used -= sizes[key];
+    }
+};
+
+/**
+ * Priority based eviction with a lazily invalidated min-heap.
+ * LFU uses the hit count; GDSF uses inflation + frequency / size.
+ */
+class PriorityPolicy : public Policy {
+private:
+    struct HeapEntry {
+        double priority;
+        uint64_t version;
+        uint32_t key;
+        bool operator>(const HeapEntry& other) const { return priority > other.priority; }
+    };
+
+    bool size_aware;
+    double inflation{0};
+    uint64_t clock{0};
+    vector<uint32_t> freq;
+    vector<uint64_t> version;
+    priority_queue<HeapEntry, vector<HeapEntry>, greater<HeapEntry>> heap;
+
+    void push(uint32_t key){
+        double priority = size_aware ? inflation + (double)freq[key] / max<uint32_t>(sizes[key], 1)
+                                     : (double)freq[key];
+        version[key] = ++clock;
+        heap.push(HeapEntry{priority, version[key], key});
+    }
+
+public:
+    PriorityPolicy(uint64_t capacity, size_t keys, bool size_aware)
+        : Policy(capacity, keys), size_aware(size_aware), freq(keys, 0), version(keys, 0) {}
+
+    void touch(uint32_t key) override {
+        freq[key]++;
+        push(key);
+    }
+
+    void insert(uint32_t key, uint32_t size) override {
+        if(size > capacity){return;}
+        while(used + size > capacity && !heap.empty()){
+            HeapEntry top = heap.top();
+            heap.pop();
+            if(!present[top.key] || version[top.key] != top.version){continue;}
+            inflation = top.priority;
+            erase(top.key);
+        }
+        present[key] = true;
+        sizes[key] = size;
+        freq[key] = 1;
+        used += size;
+        push(key);
+    }
+
+    void erase(uint32_t key) override {
+        if(!present[key]){return;}
+        present[key] = false;
+        used -= sizes[key];
+        version[key] = ++clock;
+
+        // Drop stale heap entries once they dominate the heap
+        if(heap.size() > 4 * sizes.size() + 1024){
+            priority_queue<HeapEntry, vector<HeapEntry>, greater<HeapEntry>> live;
+            while(!heap.empty()){
+                if(present[heap.top().key] && version[heap.top().key] == heap.top().version){
+                    live.push(heap.top());
+                }
+                heap.pop();
+            }
+            heap.swap(live);
+        }
+    }
+};
+
+unique_ptr<Policy> makePolicy(const string& name, uint64_t capacity, size_t keys){
+    if(name == "lru"){return make_unique<LRUPolicy>(capacity, keys);}
+    if(name == "fifo"){return make_unique<FIFOPolicy>(capacity, keys);}
+    if(name == "sieve"){return make_unique<SievePolicy>(capacity, keys);}
+    if(name == "lfu"){return make_unique<PriorityPolicy>(capacity, keys, false);}
+    if(name == "gdsf"){return make_unique<PriorityPolicy>(capacity, keys, true);}
+    return nullptr;
+}
+
+struct SimResult {
+    uint64_t requests{0}, bytes{0};
+    uint64_t hits{0}, hit_bytes{0};
+    uint64_t origin_requests{0}, origin_bytes{0};
+};
+
+/**
+ * Replays the trace through one policy. A cached object is a hit only while it is fresh,
+ * using the same rule as `Cache::isExpired()` (expired once now > expire time).
+ */
+SimResult simulate(const Trace& trace, Policy& policy){
+    SimResult res;
+    vector<int64_t> expire_at(trace.keys.size(), 0);
+
+    for(const TraceRecord& rec : trace.records){
+        res.requests++;
+        res.bytes += rec.size;
+
+        if(!rec.cacheable){
+            policy.erase(rec.key);
+            res.origin_requests++;
+            res.origin_bytes += rec.size;
+            continue;
+        }
+
+        if(policy.contains(rec.key) && (expire_at[rec.key] == TTL_NEVER || rec.time <= expire_at[rec.key])){
+            policy.touch(rec.key);
+            res.hits++;
+            res.hit_bytes += rec.size;
+            continue;
+        }
+
+        res.origin_requests++;
+        res.origin_bytes += rec.size;
+        policy.erase(rec.key);
+        policy.insert(rec.key, rec.size);
+        expire_at[rec.key] = (rec.ttl == TTL_NEVER) ? TTL_NEVER : rec.time + rec.ttl;
+    }
+    return res;
+}
+
+vector<string> splitList(const string& list){
+    vector<string> items;
+    stringstream ss(list);
+    string item;
+    while(getline(ss, item, ',')){
+        if(!item.empty()){items.push_back(item);}
+    }
+    return items;
+}
+
+int main(int argc, char* argv[]){
+    SimOptions opts;
+    string trace_path;
+
+    try{
+        for(int i = 1; i < argc; i++){
+            string arg = argv[i];
+            if(arg == "--policies" && i + 1 < argc){
+                opts.policies = splitList(argv[++i]);
+            } else if(arg == "--sizes" && i + 1 < argc){
+                for(const string& size : splitList(argv[++i])){
+                    opts.sizes.push_back(stoull(size));
+                }
+            } else if(arg == "--default-size" && i + 1 < argc){
+                opts.default_size = stoul(argv[++i]);
+            } else if(arg == "--default-ttl" && i + 1 < argc){
+                opts.default_ttl = stoll(argv[++i]);
+            } else if(trace_path.empty() && arg[0] != '-'){
+                trace_path = arg;
+            } else{
+                throw invalid_argument(arg);
+            }
+        }
+    } catch(const exception& e){
+        cerr << "Invalid argument: " << e.what() << endl;
+        return 1;
+    }
+
+    if(trace_path.empty()){
+        cerr << "usage: ./cachesim [--policies lru,fifo,sieve,lfu,gdsf] [--sizes b1,b2,...] "
+                "[--default-size bytes] [--default-ttl seconds] <trace>" << endl;
+        return 1;
+    }
+
+    ifstream in(trace_path);
+    if(!in.is_open()){
+        cerr << "Error opening trace file: " << trace_path << endl;
+        return 1;
+    }
+
+    Trace trace;
+    auto load_start = chrono::steady_clock::now();
+    loadTrace(in, trace, opts);
+    double load_sec = chrono::duration<double>(chrono::steady_clock::now() - load_start).count();
+    cerr << "Loaded " << trace.records.size() << " requests for " << trace.keys.size()
+         << " objects in " << load_sec << "s" << endl;
+
+    if(opts.sizes.empty()){
+        for(int i = 0; i < 16; i++){
+            opts.sizes.push_back((1ULL << 20) << i);
+        }
+    }
+
+    cout << "policy,cache_bytes,requests,hit_ratio,byte_hit_ratio,origin_requests,origin_bytes" << endl;
+    for(const string& name : opts.policies){
+        for(uint64_t size : opts.sizes){
+            unique_ptr<Policy> policy = makePolicy(name, size, trace.keys.size());
+            if(!policy){
+                cerr << "Unknown policy: " << name << endl;
+                return 1;
+            }
+
+            auto start = chrono::steady_clock::now();
+            SimResult res = simulate(trace, *policy);
+            double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            cout << name << "," << size << "," << res.requests << ","
+                 << fixed << setprecision(6)
+                 << (res.requests ? (double)res.hits / res.requests : 0) << ","
+                 << (res.bytes ? (double)res.hit_bytes / res.bytes : 0) << ","
+                 << res.origin_requests << "," << res.origin_bytes << endl;
+            cerr << name << " @ " << size << ": " << (uint64_t)(sec > 0 ? res.requests / sec : 0)
+                 << " requests/s" << endl;
+        }
+    }
+    return 0;
+}
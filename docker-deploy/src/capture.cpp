@@ -0,0 +1,78 @@
+#include "capture.hpp"
+#include <stdexcept>
+#include <cstring>
+
+/**
+ * Opens the capture file and writes the file header.
+ * @param filename Path of the capture file; an existing file is overwritten.
+ * @throws `std::runtime_error` if the file cannot be opened.
+ */
+Capture::Capture(const string& filename){
+    capture_file.open(filename, ios::binary | ios::trunc | ios::out);
+    if(!capture_file.is_open()){
+        throw runtime_error("Failed to open capture file " + filename);
+    }
+    capture_file << CAPTURE_MAGIC;
+    capture_file.flush();
+}
+
+/**
+ * Appends one record to the capture file.
+ * - Uses `capture_mutex` so records from different threads never interleave.
+ */
+void Capture::write(uint8_t type, int request_id, const string& data){
+    uint64_t timestamp_us = chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    int32_t id = request_id;
+    uint32_t length = data.size();
+
+    lock_guard<mutex> lock(capture_mutex);
+    capture_file.write(reinterpret_cast<const char*>(&type), sizeof(type));
+    capture_file.write(reinterpret_cast<const char*>(&id), sizeof(id));
+    capture_file.write(reinterpret_cast<const char*>(&timestamp_us), sizeof(timestamp_us));
+    capture_file.write(reinterpret_cast<const char*>(&length), sizeof(length));
+    capture_file.write(data.data(), data.size());
+    capture_file.flush();
+}
+
+/**
+ * Records a request exactly as received from the client.
+ */
+void Capture::recordRequest(int request_id, const string& raw_request){
+    write(CAPTURE_CLIENT_REQUEST, request_id, raw_request);
+}
+
+/**
+ * Records a response exactly as received from the origin server.
+ */
+void Capture::recordResponse(int request_id, const string& raw_response){
+    write(CAPTURE_ORIGIN_RESPONSE, request_id, raw_response);
+}
+
+/**
+ * Checks the magic line at the start of a capture file.
+ * @return `true` if `in` holds a capture file.
+ */
+bool Capture::readHeader(istream& in){
+    string magic(strlen(CAPTURE_MAGIC), '\0');
+    in.read(&magic[0], magic.size());
+    return in && magic == CAPTURE_MAGIC;
+}
+
+/**
+ * Reads the next record of a capture file.
+ * @return `false` at the end of the file or on a truncated record.
+ */
+bool Capture::readRecord(istream& in, CaptureRecord& record){
+    uint32_t length = 0;
+    in.read(reinterpret_cast<char*>(&record.type), sizeof(record.type));
+    in.read(reinterpret_cast<char*>(&record.request_id), sizeof(record.request_id));
+    in.read(reinterpret_cast<char*>(&record.timestamp_us), sizeof(record.timestamp_us));
+    in.read(reinterpret_cast<char*>(&length), sizeof(length));
+    if(!in){
+        return false;
+    }
+    record.data.resize(length);
+    in.read(&record.data[0], length);
+    return (bool)in;
+}
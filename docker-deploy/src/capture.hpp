@@ -0,0 +1,51 @@
+#ifndef _CAPTURE_HPP_
+#define _CAPTURE_HPP_
+
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+using namespace std;
+
+#define CAPTURE_CLIENT_REQUEST 1
+#define CAPTURE_ORIGIN_RESPONSE 2
+
+const char * const CAPTURE_MAGIC = "PXCAP1\n";
+
+/**
+ * One captured message. `timestamp_us` is the wall clock time in microseconds.
+ */
+struct CaptureRecord {
+    uint8_t type;
+    int32_t request_id;
+    uint64_t timestamp_us;
+    string data;
+};
+
+/**
+ * Writes client requests and origin responses to a compact binary capture file,
+ * which the `replay` tool feeds back through the proxy.
+ *
+ * File layout: the magic line, then records of
+ * `type (1 byte) | request id (4) | timestamp us (8) | length (4) | data`, little endian.
+ */
+class Capture {
+private:
+    ofstream capture_file;
+    mutex capture_mutex;
+
+    void write(uint8_t type, int request_id, const string& data);
+
+public:
+    explicit Capture(const string& filename);
+
+    void recordRequest(int request_id, const string& raw_request);
+    void recordResponse(int request_id, const string& raw_response);
+
+    static bool readHeader(istream& in);
+    static bool readRecord(istream& in, CaptureRecord& record);
+};
+
+#endif
@@ -0,0 +1,357 @@
+#include "config.hpp"
+#include "access.hpp"
+#include "numa.hpp"
+#include "parent.hpp"
+#include "refresh.hpp"
+
+/**
+ * Reads a configuration file.
+ * - Each non-empty line is `key = value`; a `#` at the start of a line or after whitespace starts a
+ *   comment, so values such as regexes and paths may contain `#`.
+ * - Keys that are not in the file keep their default value.
+ *
+ * @param filename The path of the configuration file.
+ * @return The parsed configuration.
+ * @throws `std::runtime_error` if the file cannot be opened or a line is invalid,
+ *         with the line number in the message.
+ */
+Config Config::load(const string& filename){
+    ifstream file(filename);
+    if(!file.is_open()){
+        throw runtime_error("Failed to open config file " + filename);
+    }
+
+    Config config;
+    string line;
+    int line_no = 0;
+    while(getline(file, line)){
+        line_no++;
+        size_t comment = line.find('#');
+        while(comment != string::npos && comment > 0 && line[comment - 1] != ' ' && line[comment - 1] != '\t'){
+            comment = line.find('#', comment + 1);
+        }
+        line = line.substr(0, comment);
+        line.erase(0, line.find_first_not_of(" \t\r"));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if(line.empty()){continue;}
+
+        size_t equal = line.find('=');
+        if(equal == string::npos){
+            throw runtime_error(filename + ":" + to_string(line_no) + ": expected key = value");
+        }
+        string key = line.substr(0, equal);
+        string value = line.substr(equal + 1);
+        key.erase(key.find_last_not_of(" \t") + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+
+        try{
+            config.set(key, value);
+        } catch(const exception& e){
+            throw runtime_error(filename + ":" + to_string(line_no) + ": invalid " + key + ": " + e.what());
+        }
+    }
+    return config;
+}
+
+/**
+ * Sets one setting from its textual value.
+ * @throws `std::invalid_argument` for unknown keys, malformed values and values out of range.
+ */
+void Config::set(const string& key, const string& value){
+    if(key == "port"){port = parseInt(value, 1, 65535);}
+    else if(key == "listen_address"){listen_address = value;}
+    else if(key == "backlog"){backlog = parseInt(value, 1, INT_MAX);}
+    else if(key == "admin_port"){admin_port = parseInt(value, 0, 65535);}
+    else if(key == "admin_address"){admin_address = value;}
+    else if(key == "cache_entries"){cache_entries = parseSize(value, 1);}
+    else if(key == "cache_cleanup_interval"){cache_cleanup_interval = parseInt(value, 1, INT_MAX);}
+    else if(key == "cache_policy"){
+        if(value != "lru" && value != "fifo"){throw invalid_argument("expected lru or fifo");}
+        cache_policy = value;
+    }
+    else if(key == "refresh_pattern"){
+        RefreshPatterns::parseRule(value);
+        refresh_patterns.push_back(value);
+    }
+    else if(key == "negative_ttl"){negative_ttl = parseNumber(value);}
+    else if(key == "failure_ttl"){failure_ttl = parseNumber(value);}
+    else if(key == "bypass_after"){bypass_after = parseSize(value);}
+    else if(key == "bypass_probe_interval"){bypass_probe_interval = parsePositive(value);}
+    else if(key == "prefetch"){prefetch = parseBool(value);}
+    else if(key == "prefetch_per_origin"){prefetch_per_origin = parseSize(value);}
+    else if(key == "prefetch_links"){prefetch_links = parseSize(value);}
+    else if(key == "cache_max_bytes"){cache_max_bytes = parseSize(value);}
+    else if(key == "cache_memory_fraction"){
+        cache_memory_fraction = parseNumber(value);
+        if(cache_memory_fraction <= 0 || cache_memory_fraction > 1){throw invalid_argument("expected a fraction in (0, 1]");}
+    }
+    else if(key == "memory_pressure_threshold"){memory_pressure_threshold = parseNumber(value, 0, 100);}
+    else if(key == "memory_check_interval"){memory_check_interval = parseNumber(value);}
+    else if(key == "client_timeout"){client_timeout = parsePositive(value);}
+    else if(key == "request_timeout"){request_timeout = parsePositive(value);}
+    else if(key == "origin_timeout"){origin_timeout = parsePositive(value);}
+    else if(key == "origin_header_timeout"){origin_header_timeout = parsePositive(value);}
+    else if(key == "tunnel_timeout"){tunnel_timeout = parsePositive(value);}
+    else if(key == "websocket_timeout"){websocket_timeout = parsePositive(value);}
+    else if(key == "buffer_size"){buffer_size = parseSize(value, 1024);}
+    else if(key == "max_connections"){max_connections = parseSize(value);}
+    else if(key == "hit_lane_connections"){hit_lane_connections = parseSize(value);}
+    else if(key == "rate_limit"){rate_limit = parseBool(value);}
+    else if(key == "rate_limit_requests"){rate_limit_requests = parseNumber(value);}
+    else if(key == "rate_limit_burst"){rate_limit_burst = parseNumber(value, 1);}
+    else if(key == "rate_limit_bytes"){rate_limit_bytes = parseSize(value);}
+    else if(key == "rate_limit_subnet_prefix"){rate_limit_subnet_prefix = parseInt(value, 0, 32);}
+    else if(key == "rate_limit_subnet_requests"){rate_limit_subnet_requests = parseNumber(value);}
+    else if(key == "rate_limit_subnet_bytes"){rate_limit_subnet_bytes = parseSize(value);}
+    else if(key == "rate_limit_max_delay"){rate_limit_max_delay = parseNumber(value);}
+    else if(key == "acl"){
+        AccessList::compile({value}, 0);
+        acl_rules.push_back(value);
+    }
+    else if(key == "acl_file"){
+        if(!value.empty()){
+            AccessList::compile(AccessList::readFile(value), 0);
+        }
+        acl_file = value;
+    }
+    else if(key == "acl_default"){
+        AccessList::parseActions(value);
+        acl_default = value;
+    }
+    else if(key == "circuit_breaker"){circuit_breaker = parseBool(value);}
+    else if(key == "breaker_error_rate"){
+        breaker_error_rate = parseNumber(value);
+        if(breaker_error_rate <= 0 || breaker_error_rate > 1){throw invalid_argument("expected a fraction in (0, 1]");}
+    }
+    else if(key == "breaker_min_requests"){breaker_min_requests = parseSize(value, 1);}
+    else if(key == "breaker_open_time"){breaker_open_time = parsePositive(value);}
+    else if(key == "adaptive_timeouts"){adaptive_timeouts = parseBool(value);}
+    else if(key == "upstream_balance"){
+        if(value != "first" && value != "p2c" && value != "least"){throw invalid_argument("expected first, p2c or least");}
+        upstream_balance = value;
+    }
+    else if(key == "upstream_eject_failures"){upstream_eject_failures = parseSize(value);}
+    else if(key == "upstream_eject_time"){upstream_eject_time = parsePositive(value);}
+    else if(key == "upstream_health_interval"){upstream_health_interval = parseNumber(value);}
+    else if(key == "parent_routes"){
+        ParentRoutes::parse(value);
+        parent_routes = value;
+    }
+    else if(key == "parent_idle_connections"){parent_idle_connections = parseSize(value);}
+    else if(key == "parent_retry"){parent_retry = parseNumber(value);}
+    else if(key == "parent_direct_fallback"){parent_direct_fallback = parseBool(value);}
+    else if(key == "retry_attempts"){retry_attempts = parseSize(value);}
+    else if(key == "retry_backoff"){retry_backoff = parseNumber(value);}
+    else if(key == "retry_deadline"){retry_deadline = parseNumber(value);}
+    else if(key == "hedge"){hedge = parseBool(value);}
+    else if(key == "hedge_delay"){hedge_delay = parseNumber(value);}
+    else if(key == "hedge_budget"){hedge_budget = parseNumber(value, 0, 1);}
+    else if(key == "h2c"){h2c = parseBool(value);}
+    else if(key == "h2_max_concurrent_streams"){h2_max_concurrent_streams = parseSize(value, 1);}
+    else if(key == "h2_upstream"){h2_upstream = parseBool(value);}
+    else if(key == "h2_upstream_connections"){h2_upstream_connections = parseSize(value, 1);}
+    else if(key == "h2_upstream_retry"){h2_upstream_retry = parseNumber(value);}
+    else if(key == "tls_origins"){tls_origins = parseBool(value);}
+    else if(key == "tls_verify"){tls_verify = parseBool(value);}
+    else if(key == "tls_ca_file"){tls_ca_file = value;}
+    else if(key == "tls_idle_connections"){tls_idle_connections = parseSize(value);}
+    else if(key == "log_file"){log_file = value;}
+    else if(key == "log_level"){
+        if(value == "none"){log_level = LOG_LEVEL_NONE;}
+        else if(value == "error"){log_level = LOG_LEVEL_ERROR;}
+        else if(value == "note"){log_level = LOG_LEVEL_NOTE;}
+        else{throw invalid_argument("expected none, error or note");}
+    }
+    else if(key == "capture_file"){capture_file = value;}
+    else if(key == "workers"){workers = parseInt(value, 0, 1024);}
+    else if(key == "shared_cache_object_size"){shared_cache_object_size = parseSize(value, 1);}
+    else if(key == "cpu_affinity"){
+        if(value != "off" && value != "node" && value != "core" && Numa::parseCpuList(value).empty()){
+            throw invalid_argument("expected off, node, core or a CPU list");
+        }
+        cpu_affinity = value;
+    }
+    else if(key == "numa_cache_shards"){numa_cache_shards = parseBool(value);}
+    else if(key == "upgrade_socket"){upgrade_socket = value;}
+    else if(key == "cache_snapshot_file"){cache_snapshot_file = value;}
+    else if(key == "upgrade_drain_timeout"){upgrade_drain_timeout = parseNumber(value);}
+    else{throw invalid_argument("unknown setting");}
+}
+
+/**
+ * Dumps the effective configuration in the same `key = value` format as the file.
+ */
+string Config::toString() const {
+    const char* levels[] = {"none", "error", "note"};
+    stringstream ss;
+    ss << "port = " << port << "\n"
+       << "listen_address = " << listen_address << "\n"
+       << "backlog = " << backlog << "\n"
+       << "admin_port = " << admin_port << "\n"
+       << "admin_address = " << admin_address << "\n"
+       << "cache_entries = " << cache_entries << "\n"
+       << "cache_cleanup_interval = " << cache_cleanup_interval << "\n"
+       << "cache_policy = " << cache_policy << "\n";
+    for(const string& pattern : refresh_patterns){
+        ss << "refresh_pattern = " << pattern << "\n";
+    }
+    ss << "negative_ttl = " << negative_ttl << "\n"
+       << "failure_ttl = " << failure_ttl << "\n"
+       << "bypass_after = " << bypass_after << "\n"
+       << "bypass_probe_interval = " << bypass_probe_interval << "\n"
+       << "prefetch = " << (prefetch ? "on" : "off") << "\n"
+       << "prefetch_per_origin = " << prefetch_per_origin << "\n"
+       << "prefetch_links = " << prefetch_links << "\n"
+       << "cache_max_bytes = " << cache_max_bytes << "\n"
+       << "cache_memory_fraction = " << cache_memory_fraction << "\n"
+       << "memory_pressure_threshold = " << memory_pressure_threshold << "\n"
+       << "memory_check_interval = " << memory_check_interval << "\n"
+       << "client_timeout = " << client_timeout << "\n"
+       << "request_timeout = " << request_timeout << "\n"
+       << "origin_timeout = " << origin_timeout << "\n"
+       << "origin_header_timeout = " << origin_header_timeout << "\n"
+       << "tunnel_timeout = " << tunnel_timeout << "\n"
+       << "websocket_timeout = " << websocket_timeout << "\n"
+       << "buffer_size = " << buffer_size << "\n"
+       << "max_connections = " << max_connections << "\n"
+       << "hit_lane_connections = " << hit_lane_connections << "\n"
+       << "rate_limit = " << (rate_limit ? "on" : "off") << "\n"
+       << "rate_limit_requests = " << rate_limit_requests << "\n"
+       << "rate_limit_burst = " << rate_limit_burst << "\n"
+       << "rate_limit_bytes = " << rate_limit_bytes << "\n"
+       << "rate_limit_subnet_prefix = " << rate_limit_subnet_prefix << "\n"
+       << "rate_limit_subnet_requests = " << rate_limit_subnet_requests << "\n"
+       << "rate_limit_subnet_bytes = " << rate_limit_subnet_bytes << "\n"
+       << "rate_limit_max_delay = " << rate_limit_max_delay << "\n";
+    for(const string& rule : acl_rules){
+        ss << "acl = " << rule << "\n";
+    }
+    ss << "acl_file = " << acl_file << "\n"
+       << "acl_default = " << acl_default << "\n"
+       << "circuit_breaker = " << (circuit_breaker ? "on" : "off") << "\n"
+       << "breaker_error_rate = " << breaker_error_rate << "\n"
+       << "breaker_min_requests = " << breaker_min_requests << "\n"
+       << "breaker_open_time = " << breaker_open_time << "\n"
+       << "adaptive_timeouts = " << (adaptive_timeouts ? "on" : "off") << "\n"
+       << "upstream_balance = " << upstream_balance << "\n"
+       << "upstream_eject_failures = " << upstream_eject_failures << "\n"
+       << "upstream_eject_time = " << upstream_eject_time << "\n"
+       << "upstream_health_interval = " << upstream_health_interval << "\n"
+       << "parent_routes = " << parent_routes << "\n"
+       << "parent_idle_connections = " << parent_idle_connections << "\n"
+       << "parent_retry = " << parent_retry << "\n"
+       << "parent_direct_fallback = " << (parent_direct_fallback ? "on" : "off") << "\n"
+       << "retry_attempts = " << retry_attempts << "\n"
+       << "retry_backoff = " << retry_backoff << "\n"
+       << "retry_deadline = " << retry_deadline << "\n"
+       << "hedge = " << (hedge ? "on" : "off") << "\n"
+       << "hedge_delay = " << hedge_delay << "\n"
+       << "hedge_budget = " << hedge_budget << "\n"
+       << "h2c = " << (h2c ? "on" : "off") << "\n"
+       << "h2_max_concurrent_streams = " << h2_max_concurrent_streams << "\n"
+       << "h2_upstream = " << (h2_upstream ? "on" : "off") << "\n"
+       << "h2_upstream_connections = " << h2_upstream_connections << "\n"
+       << "h2_upstream_retry = " << h2_upstream_retry << "\n"
+       << "tls_origins = " << (tls_origins ? "on" : "off") << "\n"
+       << "tls_verify = " << (tls_verify ? "on" : "off") << "\n"
+       << "tls_ca_file = " << tls_ca_file << "\n"
+       << "tls_idle_connections = " << tls_idle_connections << "\n"
+       << "log_file = " << log_file << "\n"
+       << "log_level = " << levels[log_level] << "\n"
+       << "capture_file = " << capture_file << "\n"
+       << "workers = " << workers << "\n"
+       << "shared_cache_object_size = " << shared_cache_object_size << "\n"
+       << "cpu_affinity = " << cpu_affinity << "\n"
+       << "numa_cache_shards = " << (numa_cache_shards ? "on" : "off") << "\n"
+       << "upgrade_socket = " << upgrade_socket << "\n"
+       << "cache_snapshot_file = " << cache_snapshot_file << "\n"
+       << "upgrade_drain_timeout = " << upgrade_drain_timeout << "\n";
+    return ss.str();
+}
+
+/**
+ * Parses `on/off`, `yes/no`, `true/false` or `1/0`.
+ * @throws `std::invalid_argument` for anything else.
+ */
+bool Config::parseBool(const string& value){
+    if(value == "on" || value == "yes" || value == "true" || value == "1"){return true;}
+    if(value == "off" || value == "no" || value == "false" || value == "0"){return false;}
+    throw invalid_argument("expected on or off");
+}
+
+/**
+ * Parses a count or byte size with an optional `K`, `M` or `G` suffix (powers of 1024).
+ * @param min The smallest value accepted.
+ * @throws `std::invalid_argument` if the value is not a non-negative number, is too large
+ *         or is below `min`.
+ */
+size_t Config::parseSize(const string& value, size_t min){
+    if(value.empty() || !isdigit((unsigned char)value[0])){
+        throw invalid_argument("expected a non-negative number");
+    }
+    size_t pos = 0;
+    unsigned long long number = stoull(value, &pos);
+    string suffix = value.substr(pos);
+    int shift = 0;
+    if(suffix == "K" || suffix == "k"){shift = 10;}
+    else if(suffix == "M" || suffix == "m"){shift = 20;}
+    else if(suffix == "G" || suffix == "g"){shift = 30;}
+    else if(!suffix.empty()){throw invalid_argument("unknown size suffix " + suffix);}
+    if(number > (SIZE_MAX >> shift)){
+        throw invalid_argument("value too large");
+    }
+    size_t size = (size_t)number << shift;
+    if(size < min){
+        throw invalid_argument("expected at least " + to_string(min));
+    }
+    return size;
+}
+
+/**
+ * Parses an integer in `[min, max]`.
+ * @throws `std::invalid_argument` if the value is not an integer or is out of range.
+ */
+int Config::parseInt(const string& value, int min, int max){
+    size_t pos = 0;
+    long number = stol(value, &pos);
+    if(pos != value.size()){
+        throw invalid_argument("expected an integer");
+    }
+    if(number < min || number > max){
+        throw invalid_argument("expected an integer from " + to_string(min) + " to " + to_string(max));
+    }
+    return (int)number;
+}
+
+/**
+ * Parses a number in `[min, max]`; durations and rates where 0 means "never" or "unlimited" use the
+ * default range.
+ * @throws `std::invalid_argument` if the value is not a number or is out of range.
+ */
+double Config::parseNumber(const string& value, double min, double max){
+    size_t pos = 0;
+    double number = stod(value, &pos);
+    if(pos != value.size() || !isfinite(number)){
+        throw invalid_argument("expected a number");
+    }
+    if(number < min || number > max){
+        stringstream range;
+        range << "expected a number from " << min;
+        if(max != DBL_MAX){range << " to " << max;}
+        throw invalid_argument(range.str());
+    }
+    return number;
+}
+
+/**
+ * Parses a number greater than 0, e.g. a timeout that must not be disabled.
+ * @throws `std::invalid_argument` if the value is not a positive number.
+ */
+double Config::parsePositive(const string& value){
+    size_t pos = 0;
+    double number = stod(value, &pos);
+    if(pos != value.size() || !isfinite(number) || number <= 0){
+        throw invalid_argument("expected a positive number");
+    }
+    return number;
+}
@@ -0,0 +1,154 @@
+#ifndef _CONFIG_HPP_
+#define _CONFIG_HPP_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cctype>
+#include <climits>
+#include <cfloat>
+#include <cmath>
+#include "util.hpp"
+
+using namespace std;
+
+/**
+ * Proxy settings, read from a `key = value` file (`#` at the start of a line or after whitespace
+ * starts a comment).
+ * The defaults are the values the proxy used before it had a config file.
+ *
+ * Settings marked "live" take effect on reload (SIGHUP or the admin `/reload` call);
+ * the others need a restart.
+ */
+class Config {
+public:
+    // Listeners (restart)
+    int port{12345};
+    string listen_address{"::"};            // "::" is dual-stack (IPv4 clients arrive IPv4-mapped)
+    int backlog{100};
+    int admin_port{0};                      // 0 disables the admin listener
+    string admin_address{"127.0.0.1"};
+
+    // Cache (live)
+    size_t cache_entries{50};
+    int cache_cleanup_interval{300};        // seconds between expired-entry sweeps
+    string cache_policy{"lru"};             // "lru" or "fifo"
+    vector<string> refresh_patterns;        // "refresh_pattern" lines, in order; the key may repeat
+    double negative_ttl{0};                 // seconds 404, 410 and 301 responses without a lifetime are fresh, 0 = never
+    double failure_ttl{0};                  // seconds DNS and connect failures of an origin are remembered, 0 = never
+    size_t bypass_after{0};                 // uncacheable responses in a row that make a path prefix skip the cache, 0 = never
+    double bypass_probe_interval{300};      // seconds between normal requests to a bypassed prefix
+    bool prefetch{false};                   // warm the cache with the subresources of cacheable HTML pages
+    size_t prefetch_per_origin{2};          // prefetches in flight to one origin
+    size_t prefetch_links{16};              // subresources prefetched per page
+
+    // Memory pressure (live)
+    size_t cache_max_bytes{0};              // byte budget of the cache, 0 = cache_memory_fraction of the memory limit
+    double cache_memory_fraction{0.5};      // share of the cgroup (or machine) memory the cache may use
+    double memory_pressure_threshold{10};   // PSI "some avg10" percentage that halves the budget
+    double memory_check_interval{2};        // seconds between checks, 0 disables the controller
+
+    // Timeouts in seconds (live)
+    double client_timeout{30};              // receive timeout on client sockets
+    double request_timeout{10};             // waiting for the client's request
+    double origin_timeout{10};              // receive timeout on origin sockets
+    double origin_header_timeout{5};        // waiting for the first bytes of an origin response
+    double tunnel_timeout{10.5};            // idle CONNECT tunnels are closed after this
+    double websocket_timeout{300};          // idle upgraded (WebSocket) connections are closed after this
+
+    // Limits (live)
+    size_t buffer_size{65536};              // socket read buffer, also the "large response" threshold
+    size_t max_connections{0};              // concurrent client connections, 0 = unlimited
+    size_t hit_lane_connections{64};        // connections beyond max_connections served only from cache
+
+    // Rate limiting (live)
+    bool rate_limit{false};                 // per-client and per-subnet token buckets, fair connection share
+    double rate_limit_requests{50};         // requests per second per client IP, 0 = unlimited
+    double rate_limit_burst{100};           // requests a client may send at once
+    size_t rate_limit_bytes{0};             // origin bytes per second per client IP, 0 = unlimited
+    int rate_limit_subnet_prefix{24};       // IPv4 subnet size (prefix length; IPv6 uses /48), 0 disables subnet buckets
+    double rate_limit_subnet_requests{200}; // requests per second per subnet, 0 = unlimited
+    size_t rate_limit_subnet_bytes{0};      // origin bytes per second per subnet, 0 = unlimited
+    double rate_limit_max_delay{2};         // seconds a request over the rate may wait before 429
+
+    // Client access control (live)
+    vector<string> acl_rules;               // "acl" lines, "<address>[/<length>] <action>[,...]"; the key may repeat
+    string acl_file;                        // more rules, one per line, empty = none
+    string acl_default{"allow"};            // actions of clients that match no rule
+
+    // Origin circuit breaker and timeouts (live)
+    bool circuit_breaker{false};            // fail fast (or serve stale) while an origin keeps failing
+    double breaker_error_rate{0.5};         // share of an origin's last 20 requests that trips the breaker
+    size_t breaker_min_requests{10};        // requests needed before the error rate counts
+    double breaker_open_time{30};           // seconds before a probe request is let through
+    bool adaptive_timeouts{false};          // connect and header timeouts from observed p99, capped by the fixed ones
+
+    // Load balancing over an origin's resolved addresses (live)
+    string upstream_balance{"first"};       // "first" (resolver order), "p2c" or "least" (fewest outstanding requests)
+    size_t upstream_eject_failures{3};      // failed connects in a row that eject an address, 0 = never
+    double upstream_eject_time{30};         // seconds an ejected address is skipped
+    double upstream_health_interval{5};     // seconds between connect probes of ejected addresses, 0 = none
+
+    // Parent proxies for misses, chosen by domain suffix (live)
+    string parent_routes;                   // "suffix=parent:port[|parent:port...]" or "suffix=direct", space separated
+    size_t parent_idle_connections{4};      // idle keep-alive connections kept per parent
+    double parent_retry{30};                // seconds a parent that refused a connection is skipped
+    bool parent_direct_fallback{false};     // go direct when no parent of the route can be reached
+
+    // Retries of GET misses whose origin connection fails before a response (live)
+    size_t retry_attempts{2};               // retries per request, 0 = none
+    double retry_backoff{0.1};              // seconds; the n-th retry waits up to backoff x 2^n (jittered)
+    double retry_deadline{15};              // seconds after the first attempt when no retry starts
+
+    // Request hedging (live)
+    bool hedge{false};                      // hedge GET misses on an origin's next resolved address
+    double hedge_delay{0.2};                // seconds before hedging until the origin's p95 is known
+    double hedge_budget{0.05};              // share of GET misses that may be hedged
+
+    // HTTP/2 (live)
+    bool h2c{false};                        // accept HTTP/2 with prior knowledge on the client port
+    size_t h2_max_concurrent_streams{100};  // streams per HTTP/2 connection
+    bool h2_upstream{false};                // try HTTP/2 (prior knowledge) to origins for misses
+    size_t h2_upstream_connections{2};      // multiplexed connections per origin
+    double h2_upstream_retry{300};          // seconds an HTTP/1.1-only origin is not retried
+
+    // TLS origins for absolute-form https:// requests
+    bool tls_origins{true};                 // live: fetch (and cache) https:// URLs over TLS
+    bool tls_verify{true};                  // live: verify origin certificates and host names
+    string tls_ca_file;                     // restart: trusted CAs (PEM), empty = system store
+    size_t tls_idle_connections{4};         // live: idle TLS connections kept per origin
+
+    // Logging
+    string log_file{"/var/log/erss/proxy.log"};   // restart
+    int log_level{LOG_LEVEL_NOTE};                // live: "none", "error" or "note"
+
+    // Traffic capture (restart)
+    string capture_file;
+
+    // Prefork mode (restart)
+    int workers{0};                         // worker processes sharing the listener, 0 = threads only
+    size_t shared_cache_object_size{1 << 20};   // largest response kept in the shared cache
+
+    // CPU and NUMA placement (restart)
+    string cpu_affinity{"off"};             // "off", "node", "core" or a CPU list such as "0-3,8"
+    bool numa_cache_shards{false};          // one shared cache segment per NUMA node (workers only)
+
+    // Zero-downtime upgrade (SIGUSR2), read when the upgrade starts
+    string upgrade_socket{"/tmp/proxy-upgrade.sock"};
+    string cache_snapshot_file{"/tmp/proxy-cache.snapshot"};
+    double upgrade_drain_timeout{60};       // seconds the old process waits for its connections
+
+    static Config load(const string& filename);
+    void set(const string& key, const string& value);
+    string toString() const;
+
+    static bool parseBool(const string& value);
+    static size_t parseSize(const string& value, size_t min = 0);
+    static int parseInt(const string& value, int min, int max);
+    static double parseNumber(const string& value, double min = 0, double max = DBL_MAX);
+    static double parsePositive(const string& value);
+};
+
+#endif
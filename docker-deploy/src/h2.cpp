@@ -0,0 +1,1031 @@
+#include "h2.hpp"
+
+#define H2_POLL_INTERVAL 1000           // ms between checks of idle connections and reset streams
+#define H2_READ_SIZE 16384
+
+uint32_t H2::read32(const string& data, size_t pos){
+    return ((uint32_t)(uint8_t)data[pos] << 24) | ((uint32_t)(uint8_t)data[pos + 1] << 16) |
+           ((uint32_t)(uint8_t)data[pos + 2] << 8) | (uint32_t)(uint8_t)data[pos + 3];
+}
+
+static void append32(string& out, uint32_t value){
+    out += (char)(value >> 24);
+    out += (char)(value >> 16);
+    out += (char)(value >> 8);
+    out += (char)value;
+}
+
+/**
+ * Writes the whole buffer to a socket.
+ * @return `false` if the peer went away.
+ */
+bool H2::sendAll(int fd, const char* data, size_t length){
+    while(length > 0){
+        ssize_t sent = ::send(fd, data, length, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR){continue;}
+        if(sent <= 0){return false;}
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+/**
+ * Converts an HTTP/2 field name to the capitalisation the HTTP/1.1 request and response
+ * parsers expect, e.g. `user-agent` to `User-Agent` and `etag` to `ETag`.
+ */
+string H2::titleCase(const string& name){
+    if(name == "etag"){
+        return HEADER_ETAG;
+    }
+    string result = name;
+    bool upper = true;
+    for(char& c : result){
+        if(upper){c = toupper((unsigned char)c);}
+        upper = (c == '-');
+    }
+    return result;
+}
+
+/**
+ * Checks for the HTTP/1.1 connection-specific fields that HTTP/2 does not carry.
+ */
+bool H2::isConnectionHeader(const string& name){
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+           name == "transfer-encoding" || name == "upgrade";
+}
+
+/**
+ * Reads exactly `length` bytes.
+ * @param timeout Seconds to wait for each part of the data.
+ * @return `false` on timeout, error or end of stream.
+ */
+bool H2::readExact(int fd, char* buffer, size_t length, double timeout){
+    size_t done = 0;
+    while(done < length){
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int rv = poll(&pfd, 1, (int)(timeout * 1000));
+        if(rv < 0 && errno == EINTR){continue;}
+        if(rv <= 0){return false;}
+        ssize_t received = recv(fd, buffer + done, length - done, 0);
+        if(received <= 0){return false;}
+        done += received;
+    }
+    return true;
+}
+
+/**
+ * Reads one frame.
+ * @param max_frame_size The largest payload accepted (our SETTINGS_MAX_FRAME_SIZE).
+ * @param too_large Set when the frame is larger than `max_frame_size`.
+ * @return `false` if no complete frame could be read.
+ */
+bool H2::readFrame(int fd, H2Frame& frame, size_t max_frame_size, double timeout, bool& too_large){
+    char header[H2_FRAME_HEADER_LEN];
+    too_large = false;
+    if(!readExact(fd, header, H2_FRAME_HEADER_LEN, timeout)){
+        return false;
+    }
+    size_t length = ((size_t)(uint8_t)header[0] << 16) | ((size_t)(uint8_t)header[1] << 8) | (uint8_t)header[2];
+    frame.type = header[3];
+    frame.flags = header[4];
+    frame.stream_id = H2::read32(string(header + 5, 4), 0) & H2_MAX_WINDOW;
+    if(length > max_frame_size){
+        too_large = true;
+        return false;
+    }
+    frame.payload.resize(length);
+    return length == 0 || readExact(fd, &frame.payload[0], length, timeout);
+}
+
+string H2::frame(uint8_t type, uint8_t flags, uint32_t stream_id, const string& payload){
+    string out;
+    out.reserve(H2_FRAME_HEADER_LEN + payload.size());
+    out += (char)(payload.size() >> 16);
+    out += (char)(payload.size() >> 8);
+    out += (char)payload.size();
+    out += (char)type;
+    out += (char)flags;
+    append32(out, stream_id & H2_MAX_WINDOW);
+    out += payload;
+    return out;
+}
+
+string H2::settingsFrame(const vector<pair<uint16_t, uint32_t>>& settings){
+    string payload;
+    for(const auto& setting : settings){
+        payload += (char)(setting.first >> 8);
+        payload += (char)setting.first;
+        append32(payload, setting.second);
+    }
+    return frame(H2_SETTINGS, 0, 0, payload);
+}
+
+string H2::windowUpdate(uint32_t stream_id, uint32_t increment){
+    string payload;
+    append32(payload, increment & H2_MAX_WINDOW);
+    return frame(H2_WINDOW_UPDATE, 0, stream_id, payload);
+}
+
+/**
+ * Removes the padding of a DATA or HEADERS frame with the PADDED flag.
+ * @return `false` if the padding is longer than the frame.
+ */
+bool H2::stripPadding(H2Frame& frame){
+    if(!(frame.flags & H2_FLAG_PADDED)){
+        return true;
+    }
+    if(frame.payload.empty()){
+        return false;
+    }
+    size_t padding = (uint8_t)frame.payload[0];
+    if(padding >= frame.payload.size()){
+        return false;
+    }
+    frame.payload = frame.payload.substr(1, frame.payload.size() - 1 - padding);
+    return true;
+}
+
+string H2::toLower(const string& s){
+    string result = s;
+    for(char& c : result){
+        c = tolower((unsigned char)c);
+    }
+    return result;
+}
+
+H2Connection::H2Connection(int fd, function<void(int)> handler, unique_ptr<Logger>& logger,
+                           uint32_t max_streams, double idle_timeout)
+    : fd(fd), handler(handler), logger(logger), max_streams(max_streams), idle_timeout(idle_timeout) {}
+
+/**
+ * Checks, without consuming anything, whether a client opened the connection with the
+ * HTTP/2 connection preface. HTTP/1.1 requests never start with `PRI `, so a mismatch is
+ * detected on the first bytes.
+ *
+ * @param timeout Seconds to wait for the client's first bytes.
+ */
+bool H2Connection::hasPreface(int fd, double timeout){
+    auto deadline = chrono::steady_clock::now() + chrono::duration<double>(timeout);
+    char buffer[H2_PREFACE_LEN];
+    while(true){
+        int remaining = (int)chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        if(remaining <= 0){
+            return false;
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if(poll(&pfd, 1, remaining) <= 0){
+            return false;
+        }
+        ssize_t peeked = recv(fd, buffer, H2_PREFACE_LEN, MSG_PEEK);
+        if(peeked <= 0 || memcmp(buffer, H2_PREFACE, peeked) != 0){
+            return false;
+        }
+        if(peeked == H2_PREFACE_LEN){
+            return true;
+        }
+        this_thread::sleep_for(chrono::milliseconds(5)); // the rest of the preface is on its way
+    }
+}
+
+/**
+ * Sends frames; concurrent callers are serialised so frames never interleave.
+ * @return `false` if the client went away.
+ */
+bool H2Connection::send(const string& data){
+    lock_guard<mutex> lock(write_mutex);
+    return H2::sendAll(fd, data.data(), data.size());
+}
+
+void H2Connection::goAway(uint32_t error_code){
+    string payload;
+    append32(payload, last_stream_id);
+    append32(payload, error_code);
+    send(H2::frame(H2_GOAWAY, 0, 0, payload));
+    if(error_code != H2_NO_ERROR){
+        logger->log_error(-1, "HTTP/2 connection error " + to_string(error_code));
+    }
+}
+
+void H2Connection::resetStream(uint32_t stream_id, uint32_t error_code){
+    string payload;
+    append32(payload, error_code);
+    send(H2::frame(H2_RST_STREAM, 0, stream_id, payload));
+}
+
+shared_ptr<H2Connection::Stream> H2Connection::findStream(uint32_t stream_id){
+    lock_guard<mutex> lock(state_mutex);
+    auto it = streams.find(stream_id);
+    return it == streams.end() ? nullptr : it->second;
+}
+
+/**
+ * Serves the connection until the client closes it, it is idle for `idle_timeout` seconds
+ * without open streams, or a connection error occurs. Returns once every stream is finished.
+ *
+ * @return The number of streams served.
+ */
+size_t H2Connection::serve(){
+    char preface[H2_PREFACE_LEN];
+    if(!H2::readExact(fd, preface, H2_PREFACE_LEN, idle_timeout) || memcmp(preface, H2_PREFACE, H2_PREFACE_LEN) != 0){
+        return 0;
+    }
+    send(H2::settingsFrame({{H2_SETTINGS_MAX_CONCURRENT_STREAMS, max_streams}, {H2_SETTINGS_ENABLE_PUSH, 0}}) +
+         H2::windowUpdate(0, H2_CONNECTION_WINDOW - H2_DEFAULT_WINDOW));
+
+    auto last_activity = chrono::steady_clock::now();
+    string header_block;
+    uint32_t header_stream = 0;     // stream whose header block continues in CONTINUATION frames
+    bool header_end_stream = false;
+
+    while(true){
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int rv = poll(&pfd, 1, H2_POLL_INTERVAL);
+        if(rv < 0 && errno != EINTR){
+            break;
+        }
+        if(rv <= 0){
+            lock_guard<mutex> lock(state_mutex);
+            double idle = chrono::duration<double>(chrono::steady_clock::now() - last_activity).count();
+            if(streams.empty() && idle > idle_timeout){
+                break;
+            }
+            continue;
+        }
+
+        H2Frame frame;
+        bool too_large = false;
+        if(!H2::readFrame(fd, frame, H2_DEFAULT_FRAME_SIZE, idle_timeout, too_large)){
+            if(too_large){
+                goAway(H2_FRAME_SIZE_ERROR);
+            }
+            break;
+        }
+        last_activity = chrono::steady_clock::now();
+
+        if(header_stream != 0 && (frame.type != H2_CONTINUATION || frame.stream_id != header_stream)){
+            goAway(H2_PROTOCOL_ERROR);
+            break;
+        }
+
+        uint32_t error = H2_NO_ERROR;
+        switch(frame.type){
+        case H2_HEADERS:
+            if(frame.stream_id == 0 || !H2::stripPadding(frame)){
+                error = H2_PROTOCOL_ERROR;
+                break;
+            }
+            if(frame.flags & H2_FLAG_PRIORITY){
+                if(frame.payload.size() < 5){
+                    error = H2_FRAME_SIZE_ERROR;
+                    break;
+                }
+                frame.payload.erase(0, 5);  // stream dependency and weight are not used
+            }
+            header_block = frame.payload;
+            header_end_stream = frame.flags & H2_FLAG_END_STREAM;
+            if(frame.flags & H2_FLAG_END_HEADERS){
+                error = openStream(frame.stream_id, header_block, header_end_stream);
+            } else{
+                header_stream = frame.stream_id;
+            }
+            break;
+        case H2_CONTINUATION:
+            if(header_stream == 0){
+                error = H2_PROTOCOL_ERROR;
+                break;
+            }
+            header_block += frame.payload;
+            if(frame.flags & H2_FLAG_END_HEADERS){
+                error = openStream(header_stream, header_block, header_end_stream);
+                header_stream = 0;
+            }
+            break;
+        case H2_DATA:
+            error = handleData(frame);
+            break;
+        case H2_SETTINGS:
+            error = handleSettings(frame);
+            break;
+        case H2_PING:
+            if(frame.stream_id != 0 || frame.payload.size() != 8){
+                error = H2_PROTOCOL_ERROR;
+            } else if(!(frame.flags & H2_FLAG_ACK)){
+                send(H2::frame(H2_PING, H2_FLAG_ACK, 0, frame.payload));
+            }
+            break;
+        case H2_WINDOW_UPDATE:
+            error = handleWindowUpdate(frame);
+            break;
+        case H2_RST_STREAM:
+            handleReset(frame);
+            break;
+        case H2_PUSH_PROMISE:
+            error = H2_PROTOCOL_ERROR;  // clients never push
+            break;
+        default:
+            break;  // PRIORITY, GOAWAY and unknown frame types need no action
+        }
+        if(error != H2_NO_ERROR){
+            goAway(error);
+            break;
+        }
+    }
+
+    // Stop the remaining streams and wait for their pump threads
+    unique_lock<mutex> lock(state_mutex);
+    closed = true;
+    for(auto& entry : streams){
+        entry.second->reset = true;
+        lock_guard<mutex> io_lock(entry.second->io_mutex);
+        if(entry.second->pair_fd >= 0){
+            shutdown(entry.second->pair_fd, SHUT_RDWR);
+        }
+    }
+    state_cv.notify_all();
+    state_cv.wait(lock, [this]{return active_pumps == 0;});
+    return streams_served;
+}
+
+/**
+ * Applies the client's SETTINGS and acknowledges them. A new INITIAL_WINDOW_SIZE adjusts the
+ * send window of every open stream by the difference (RFC 9113 6.9.2).
+ * @return An error code for the connection, or `H2_NO_ERROR`.
+ */
+uint32_t H2Connection::handleSettings(const H2Frame& frame){
+    if(frame.stream_id != 0){
+        return H2_PROTOCOL_ERROR;
+    }
+    if(frame.flags & H2_FLAG_ACK){
+        return frame.payload.empty() ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+    }
+    if(frame.payload.size() % 6 != 0){
+        return H2_FRAME_SIZE_ERROR;
+    }
+    for(size_t pos = 0; pos < frame.payload.size(); pos += 6){
+        uint16_t id = ((uint8_t)frame.payload[pos] << 8) | (uint8_t)frame.payload[pos + 1];
+        uint32_t value = H2::read32(frame.payload, pos + 2);
+        lock_guard<mutex> lock(state_mutex);
+        if(id == H2_SETTINGS_INITIAL_WINDOW_SIZE){
+            if(value > H2_MAX_WINDOW){
+                return H2_FLOW_CONTROL_ERROR;
+            }
+            int64_t delta = (int64_t)value - peer_initial_window;
+            for(auto& entry : streams){
+                entry.second->send_window += delta;
+            }
+            peer_initial_window = value;
+            state_cv.notify_all();
+        } else if(id == H2_SETTINGS_MAX_FRAME_SIZE){
+            if(value < H2_DEFAULT_FRAME_SIZE || value > 0xffffff){
+                return H2_PROTOCOL_ERROR;
+            }
+            peer_max_frame = value;
+        } else if(id == H2_SETTINGS_ENABLE_PUSH && value > 1){
+            return H2_PROTOCOL_ERROR;
+        }
+        // HEADER_TABLE_SIZE needs nothing: the encoder does not use the dynamic table
+    }
+    send(H2::frame(H2_SETTINGS, H2_FLAG_ACK, 0, ""));
+    return H2_NO_ERROR;
+}
+
+/**
+ * Opens the send window of the connection or of one stream.
+ * @return An error code for the connection, or `H2_NO_ERROR`.
+ */
+uint32_t H2Connection::handleWindowUpdate(const H2Frame& frame){
+    if(frame.payload.size() != 4){
+        return H2_FRAME_SIZE_ERROR;
+    }
+    uint32_t increment = H2::read32(frame.payload, 0) & H2_MAX_WINDOW;
+    if(frame.stream_id == 0){
+        if(increment == 0){
+            return H2_PROTOCOL_ERROR;
+        }
+        lock_guard<mutex> lock(state_mutex);
+        if(connection_window + increment > H2_MAX_WINDOW){
+            return H2_FLOW_CONTROL_ERROR;
+        }
+        connection_window += increment;
+        state_cv.notify_all();
+        return H2_NO_ERROR;
+    }
+
+    uint32_t stream_error = increment == 0 ? H2_PROTOCOL_ERROR : H2_NO_ERROR;
+    {
+        lock_guard<mutex> lock(state_mutex);
+        auto it = streams.find(frame.stream_id);
+        if(it != streams.end() && stream_error == H2_NO_ERROR){
+            if(it->second->send_window + increment > H2_MAX_WINDOW){
+                stream_error = H2_FLOW_CONTROL_ERROR;
+            } else{
+                it->second->send_window += increment;
+                state_cv.notify_all();
+            }
+        }
+    }
+    if(stream_error != H2_NO_ERROR){
+        resetStream(frame.stream_id, stream_error);
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Handles a DATA frame, which must fit the receive windows the client was given.
+ * - A request body is buffered until END_STREAM, at most `H2_MAX_REQUEST_BODY` bytes; a
+ *   larger one resets the stream with REFUSED_STREAM.
+ * - Tunnel bytes are queued on the stream and written to the handler without blocking (see
+ *   `flushTunnel()`); what the handler does not take yet waits for its relay thread.
+ * Windows are credited back only for bytes that are consumed: buffered as a body, written
+ * to a tunnel or dropped. A stalled tunnel therefore holds at most its own stream window.
+ *
+ * @return An error code for the connection, or `H2_NO_ERROR`.
+ */
+uint32_t H2Connection::handleData(H2Frame& frame){
+    size_t flow_length = frame.payload.size();
+    if(frame.stream_id == 0 || !H2::stripPadding(frame)){
+        return H2_PROTOCOL_ERROR;
+    }
+    bool end_stream = frame.flags & H2_FLAG_END_STREAM;
+    shared_ptr<Stream> stream = findStream(frame.stream_id);
+    bool stream_overflow = false;
+    bool was_reset = false;
+    {
+        lock_guard<mutex> lock(state_mutex);
+        if((int64_t)flow_length > recv_window){
+            return H2_FLOW_CONTROL_ERROR;
+        }
+        recv_window -= flow_length;
+        was_reset = stream && stream->reset;
+        if(stream && !stream->end_received && !was_reset){
+            stream_overflow = (int64_t)flow_length > stream->recv_window;
+            stream->recv_window -= flow_length;
+            stream->end_received = end_stream;
+        }
+    }
+
+    if(was_reset){
+        credit(nullptr, flow_length, 0);    // frames the client sent before it saw our reset
+        return H2_NO_ERROR;
+    }
+    if(!stream || (stream->started && !stream->tunnel)){
+        credit(nullptr, flow_length, 0);
+        resetStream(frame.stream_id, H2_STREAM_CLOSED);
+        return H2_NO_ERROR;
+    }
+    if(stream_overflow){
+        credit(nullptr, flow_length, 0);
+        refuseStream(stream, H2_FLOW_CONTROL_ERROR);
+        return H2_NO_ERROR;
+    }
+
+    size_t padding = flow_length - frame.payload.size();
+    if(stream->tunnel){
+        {
+            lock_guard<mutex> io_lock(stream->io_mutex);
+            stream->inbound += frame.payload;
+            stream->inbound_end = end_stream;
+        }
+        credit(stream, padding, padding);
+        flushTunnel(stream);
+        return H2_NO_ERROR;
+    }
+
+    if(stream->body.size() + frame.payload.size() > H2_MAX_REQUEST_BODY){
+        logger->log_note(-1, "HTTP/2 stream " + to_string(stream->id) + " refused, request body over " +
+                             to_string(H2_MAX_REQUEST_BODY) + " bytes");
+        credit(nullptr, flow_length, 0);
+        refuseStream(stream, H2_REFUSED_STREAM);
+        return H2_NO_ERROR;
+    }
+    stream->body += frame.payload;
+    credit(stream, flow_length, flow_length);
+    if(end_stream){
+        startStream(stream);
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Gives consumed bytes back to the client's receive windows: `connection_bytes` to the
+ * connection's and, while the client may still send on it, `stream_bytes` to the stream's.
+ */
+void H2Connection::credit(shared_ptr<Stream> stream, size_t connection_bytes, size_t stream_bytes){
+    string updates;
+    {
+        lock_guard<mutex> lock(state_mutex);
+        if(connection_bytes > 0){
+            recv_window += connection_bytes;
+            updates += H2::windowUpdate(0, connection_bytes);
+        }
+        if(stream && stream_bytes > 0 && !stream->end_received && !stream->reset){
+            stream->recv_window += stream_bytes;
+            updates += H2::windowUpdate(stream->id, stream_bytes);
+        }
+    }
+    if(!updates.empty()){
+        send(updates);
+    }
+}
+
+/**
+ * Resets a stream from our side: its pump stops and its handler is cut off. A stream that
+ * has not started yet is forgotten at once.
+ */
+void H2Connection::refuseStream(shared_ptr<Stream> stream, uint32_t error_code){
+    resetStream(stream->id, error_code);
+    {
+        lock_guard<mutex> lock(state_mutex);
+        stream->reset = true;
+        if(!stream->started){
+            streams.erase(stream->id);
+        }
+        state_cv.notify_all();
+    }
+    lock_guard<mutex> io_lock(stream->io_mutex);
+    stream->inbound.clear();
+    if(stream->pair_fd >= 0){
+        shutdown(stream->pair_fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * Writes the queued client bytes of a tunnel to its handler as far as the socket takes them
+ * without blocking, and credits what was written. Bytes for a handler that is gone are
+ * dropped. If some are left, the stream's relay thread is woken to write them once the
+ * handler reads. Called by the reader for new DATA and by `relayTunnel()`.
+ */
+void H2Connection::flushTunnel(shared_ptr<Stream> stream){
+    size_t consumed = 0;
+    {
+        lock_guard<mutex> io_lock(stream->io_mutex);
+        size_t written = 0;
+        while(stream->pair_fd >= 0 && written < stream->inbound.size()){
+            ssize_t sent = ::send(stream->pair_fd, stream->inbound.data() + written, stream->inbound.size() - written,
+                                  MSG_NOSIGNAL | MSG_DONTWAIT);
+            if(sent < 0 && errno == EINTR){continue;}
+            if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){break;}
+            if(sent <= 0){
+                written = stream->inbound.size();
+                break;
+            }
+            written += sent;
+        }
+        if(stream->pair_fd < 0){
+            written = stream->inbound.size();
+        }
+        stream->inbound.erase(0, written);
+        consumed = written;
+        if(stream->inbound.empty()){
+            if(stream->inbound_end && stream->pair_fd >= 0){
+                shutdown(stream->pair_fd, SHUT_WR);
+            }
+            stream->inbound_end = false;
+        } else if(stream->wake_fd >= 0){
+            uint64_t one = 1;
+            ssize_t ignored = write(stream->wake_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+    credit(stream, consumed, consumed);
+}
+
+/**
+ * Handles RST_STREAM: the stream's pump stops sending and its handler is cut off.
+ */
+void H2Connection::handleReset(const H2Frame& frame){
+    shared_ptr<Stream> stream = findStream(frame.stream_id);
+    if(!stream){
+        return;
+    }
+    {
+        lock_guard<mutex> lock(state_mutex);
+        stream->reset = true;
+        state_cv.notify_all();
+    }
+    lock_guard<mutex> io_lock(stream->io_mutex);
+    if(stream->pair_fd >= 0){
+        shutdown(stream->pair_fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * Opens a stream from a complete header block, or takes a trailer block for a stream whose
+ * request body is still arriving (trailer fields are dropped).
+ * Streams beyond `max_streams` are refused with REFUSED_STREAM, which clients retry.
+ *
+ * @return An error code for the connection, or `H2_NO_ERROR`.
+ */
+uint32_t H2Connection::openStream(uint32_t stream_id, const string& block, bool end_stream){
+    HeaderList headers;
+    if(!decoder.decode(block, headers)){
+        return H2_COMPRESSION_ERROR;
+    }
+
+    shared_ptr<Stream> existing = findStream(stream_id);
+    if(existing){
+        if(existing->started || !end_stream){
+            return H2_PROTOCOL_ERROR;
+        }
+        startStream(existing);
+        return H2_NO_ERROR;
+    }
+    if(stream_id % 2 == 0 || stream_id <= last_stream_id){
+        return H2_PROTOCOL_ERROR;
+    }
+    last_stream_id = stream_id;
+
+    string method, path, authority;
+    for(const auto& field : headers){
+        if(field.first == ":method"){method = field.second;}
+        else if(field.first == ":path"){path = field.second;}
+        else if(field.first == ":authority" || field.first == "host"){
+            if(authority.empty()){authority = field.second;}
+        }
+    }
+    if(method.empty() || authority.empty() || (method != "CONNECT" && path.empty())){
+        resetStream(stream_id, H2_PROTOCOL_ERROR);
+        return H2_NO_ERROR;
+    }
+
+    shared_ptr<Stream> stream = make_shared<Stream>();
+    stream->id = stream_id;
+    stream->headers = headers;
+    stream->tunnel = (method == "CONNECT");
+    {
+        lock_guard<mutex> lock(state_mutex);
+        if(streams.size() >= max_streams){
+            stream.reset();
+        } else{
+            stream->send_window = peer_initial_window;
+            streams[stream_id] = stream;
+            streams_served++;
+        }
+    }
+    if(!stream){
+        logger->log_note(-1, "HTTP/2 stream " + to_string(stream_id) + " refused, " +
+                             to_string(max_streams) + " streams open");
+        resetStream(stream_id, H2_REFUSED_STREAM);
+        return H2_NO_ERROR;
+    }
+
+    if(stream->tunnel || end_stream){
+        startStream(stream);
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Connects a stream to the request handler through a socketpair and starts its pump thread.
+ * A CONNECT request is written here, before any DATA frame can be relayed after it.
+ */
+void H2Connection::startStream(shared_ptr<Stream> stream){
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0){
+        logger->log_error(-1, "Failed to create socketpair for HTTP/2 stream");
+        resetStream(stream->id, H2_INTERNAL_ERROR);
+        lock_guard<mutex> lock(state_mutex);
+        streams.erase(stream->id);
+        return;
+    }
+    stream->pair_fd = pair[0];
+    stream->started = true;
+    if(stream->tunnel){
+        stream->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        string request = buildRequest(stream->headers, "");
+        H2::sendAll(pair[0], request.data(), request.size());
+    }
+    {
+        lock_guard<mutex> lock(state_mutex);
+        active_pumps++;
+    }
+    thread(&H2Connection::pump, this, stream, pair[1]).detach();
+}
+
+/**
+ * Runs one stream: the handler serves the HTTP/1.1 request on `handler_fd` in its own
+ * thread while the pump converts the response into HEADERS and DATA frames.
+ * - A chunked response is de-chunked; HTTP/2 frames the body itself. Otherwise the body ends
+ *   at `Content-Length`, which HTTP/2 clients check strictly, or at the end of the stream.
+ * - A successful CONNECT turns the stream into a tunnel (see `relayTunnel()`).
+ * - A handler that answers nothing becomes `502`.
+ */
+void H2Connection::pump(shared_ptr<Stream> stream, int handler_fd){
+    thread handler_thread([this, handler_fd](){
+        handler(handler_fd);
+        close(handler_fd);
+    });
+    int pair_fd = stream->pair_fd;
+
+    if(!stream->tunnel){
+        string request = buildRequest(stream->headers, stream->body);
+        stream->body.clear();
+        H2::sendAll(pair_fd, request.data(), request.size());
+    }
+
+    // Read the response head
+    string data;
+    size_t head_end = string::npos;
+    char buffer[H2_READ_SIZE];
+    while(head_end == string::npos){
+        ssize_t received = recv(pair_fd, buffer, sizeof(buffer), 0);
+        if(received <= 0){break;}
+        data.append(buffer, received);
+        head_end = data.find("\r\n\r\n");
+    }
+
+    HeaderList headers;
+    bool chunked = false;
+    size_t remaining = string::npos;
+    if(head_end == string::npos || !parseResponseHead(data.substr(0, head_end + 2), headers, chunked, remaining)){
+        sendHeaders(stream->id, {{":status", "502"}}, true);
+    } else if(stream->tunnel && headers[0].second[0] == '2'){
+        data.erase(0, head_end + 4);
+        if(sendHeaders(stream->id, headers, false) && (data.empty() || sendData(stream, data.data(), data.size(), false))){
+            relayTunnel(stream);
+        }
+    } else{
+        data.erase(0, head_end + 4);
+        bool ok = sendHeaders(stream->id, headers, false);
+        bool done = false;
+        string body;
+        while(ok){
+            if(chunked){
+                body.clear();
+                if(!dechunk(data, body, done)){
+                    logger->log_error(-1, "Malformed chunked response on HTTP/2 stream " + to_string(stream->id));
+                    resetStream(stream->id, H2_INTERNAL_ERROR);
+                    ok = false;
+                    break;
+                }
+            } else{
+                body.swap(data);
+                data.clear();
+                if(remaining != string::npos){
+                    body.resize(min(body.size(), remaining));   // nothing past Content-Length is body
+                    remaining -= body.size();
+                    done = (remaining == 0);
+                }
+            }
+            if(!body.empty()){
+                ok = sendData(stream, body.data(), body.size(), false);
+            }
+            if(done){break;}
+            ssize_t received = recv(pair_fd, buffer, sizeof(buffer), 0);
+            if(received <= 0){break;}
+            data.append(buffer, received);
+        }
+        if(ok){
+            sendData(stream, NULL, 0, true);
+        }
+    }
+
+    shutdown(pair_fd, SHUT_RDWR);  // unblocks a handler still writing to a reset stream
+    handler_thread.join();
+    {
+        lock_guard<mutex> io_lock(stream->io_mutex);
+        close(pair_fd);
+        stream->pair_fd = -1;
+        if(stream->wake_fd >= 0){
+            close(stream->wake_fd);
+            stream->wake_fd = -1;
+        }
+    }
+    finishStream(stream);
+}
+
+/**
+ * Relays tunnel bytes from the handler to the client as DATA frames until either side
+ * closes, and writes the client bytes `handleData()` could not write without blocking
+ * once the handler reads them.
+ */
+void H2Connection::relayTunnel(shared_ptr<Stream> stream){
+    char buffer[H2_READ_SIZE];
+    flushTunnel(stream);    // bytes that arrived before the CONNECT was answered
+    while(true){
+        {
+            lock_guard<mutex> lock(state_mutex);
+            if(closed || stream->reset){return;}
+        }
+        bool queued;
+        {
+            lock_guard<mutex> io_lock(stream->io_mutex);
+            queued = !stream->inbound.empty();
+        }
+        struct pollfd pfds[2] = {{stream->pair_fd, (short)(POLLIN | (queued ? POLLOUT : 0)), 0},
+                                 {stream->wake_fd, POLLIN, 0}};
+        int rv = poll(pfds, stream->wake_fd >= 0 ? 2 : 1, H2_POLL_INTERVAL);
+        if(rv < 0 && errno != EINTR){break;}
+        if(rv <= 0){continue;}
+        if(pfds[1].revents & POLLIN){
+            uint64_t count;
+            ssize_t ignored = read(stream->wake_fd, &count, sizeof(count));
+            (void)ignored;
+        }
+        if((pfds[0].revents & POLLOUT) || (pfds[1].revents & POLLIN)){
+            flushTunnel(stream);
+        }
+        if(!(pfds[0].revents & (POLLIN | POLLHUP | POLLERR))){continue;}
+        ssize_t received = recv(stream->pair_fd, buffer, sizeof(buffer), 0);
+        if(received <= 0){break;}
+        if(!sendData(stream, buffer, received, false)){return;}
+    }
+    sendData(stream, NULL, 0, true);
+}
+
+void H2Connection::finishStream(shared_ptr<Stream> stream){
+    lock_guard<mutex> lock(state_mutex);
+    streams.erase(stream->id);
+    active_pumps--;
+    state_cv.notify_all();
+}
+
+/**
+ * Sends a header block as HEADERS plus CONTINUATION frames, split at the client's maximum
+ * frame size. The frames go out in one write so no other frame lands between them.
+ */
+bool H2Connection::sendHeaders(uint32_t stream_id, const HeaderList& headers, bool end_stream){
+    string block = Hpack::encode(headers);
+    size_t max_frame;
+    {
+        lock_guard<mutex> lock(state_mutex);
+        max_frame = peer_max_frame;
+    }
+    string frames;
+    size_t offset = 0;
+    do{
+        size_t length = min(max_frame, block.size() - offset);
+        bool last = (offset + length == block.size());
+        uint8_t flags = (last ? H2_FLAG_END_HEADERS : 0) | (offset == 0 && end_stream ? H2_FLAG_END_STREAM : 0);
+        frames += H2::frame(offset == 0 ? H2_HEADERS : H2_CONTINUATION, flags, stream_id, block.substr(offset, length));
+        offset += length;
+    } while(offset < block.size());
+    return send(frames);
+}
+
+/**
+ * Sends body bytes as DATA frames, waiting while the connection or stream send window is
+ * exhausted. `length` 0 with `end_stream` sends an empty END_STREAM frame.
+ *
+ * @return `false` if the stream was reset or the connection closed.
+ */
+bool H2Connection::sendData(shared_ptr<Stream> stream, const char* data, size_t length, bool end_stream){
+    if(length == 0 && !end_stream){
+        return true;
+    }
+    size_t offset = 0;
+    do{
+        size_t chunk = 0;
+        {
+            unique_lock<mutex> lock(state_mutex);
+            if(length > 0){
+                state_cv.wait(lock, [&]{
+                    return closed || stream->reset || (connection_window > 0 && stream->send_window > 0);
+                });
+            }
+            if(closed || stream->reset){
+                return false;
+            }
+            if(length > 0){
+                int64_t window = min(connection_window, stream->send_window);
+                chunk = min((size_t)window, min(length - offset, (size_t)peer_max_frame));
+                connection_window -= chunk;
+                stream->send_window -= chunk;
+            }
+        }
+        bool last = end_stream && (offset + chunk == length);
+        if(!send(H2::frame(H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->id, string(data ? data + offset : "", chunk)))){
+            return false;
+        }
+        offset += chunk;
+    } while(offset < length);
+    return true;
+}
+
+/**
+ * Builds the HTTP/1.1 request for a stream.
+ * - The target is in absolute form (`GET http://host/path`), as a client configured to use
+ *   a proxy would send it; CONNECT keeps `host:port`.
+ * - Field names are title-cased, split `cookie` fields are joined again and
+ *   connection-specific fields are dropped.
+ * - A buffered body gets a `Content-Length`; the handler sees `Connection: close`, so the
+ *   end of the response is the end of the socketpair stream.
+ */
+string H2Connection::buildRequest(const HeaderList& headers, const string& body){
+    string method, scheme = "http", authority, path;
+    string fields;
+    string cookies;
+    for(const auto& field : headers){
+        const string& name = field.first;
+        if(name == ":method"){method = field.second;}
+        else if(name == ":scheme"){scheme = field.second;}
+        else if(name == ":path"){path = field.second;}
+        else if(name == ":authority" || name == "host"){
+            if(authority.empty()){authority = field.second;}
+        }
+        else if(name[0] == ':' || name == "content-length" || name == "te" || H2::isConnectionHeader(name)){continue;}
+        else if(name == "cookie"){
+            cookies += (cookies.empty() ? "" : "; ") + field.second;
+        } else{
+            fields += H2::titleCase(name) + ": " + field.second + "\r\n";
+        }
+    }
+
+    string request;
+    if(method == "CONNECT"){
+        request = "CONNECT " + authority + " HTTP/1.1\r\n";
+    } else{
+        request = method + " " + scheme + "://" + authority + path + " HTTP/1.1\r\n";
+    }
+    request += "Host: " + authority + "\r\n" + fields;
+    if(!cookies.empty()){
+        request += "Cookie: " + cookies + "\r\n";
+    }
+    if(method != "CONNECT" && (!body.empty() || method == "POST")){
+        request += "Content-Length: " + to_string(body.size()) + "\r\n";
+    }
+    request += "Connection: close\r\n\r\n";
+    return request + body;
+}
+
+/**
+ * Converts an HTTP/1.1 response head into HTTP/2 fields: `:status` first, names in lower
+ * case and connection-specific fields dropped.
+ *
+ * @param chunked Set when the body uses chunked transfer coding.
+ * @param content_length Set to the `Content-Length`, or `string::npos` if there is none.
+ * @return `false` if the status line is malformed.
+ */
+bool H2Connection::parseResponseHead(const string& head, HeaderList& headers, bool& chunked, size_t& content_length){
+    istringstream ss(head);
+    string line;
+    getline(ss, line);
+    size_t space = line.find(' ');
+    if(line.compare(0, 5, "HTTP/") != 0 || space == string::npos || line.size() < space + 4){
+        return false;
+    }
+    string status = line.substr(space + 1, 3);
+    for(char c : status){
+        if(!isdigit((unsigned char)c)){return false;}
+    }
+    headers.push_back({":status", status});
+
+    chunked = false;
+    content_length = string::npos;
+    while(getline(ss, line)){
+        if(!line.empty() && line.back() == '\r'){line.pop_back();}
+        size_t colon = line.find(':');
+        if(line.empty() || colon == string::npos){continue;}
+        string name = H2::toLower(line.substr(0, colon));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        if(name == "transfer-encoding" && H2::toLower(value).find("chunked") != string::npos){
+            chunked = true;
+        } else if(name == "content-length"){
+            try{
+                content_length = stoul(value);
+            } catch(...){
+                return false;
+            }
+        }
+        if(!H2::isConnectionHeader(name)){
+            headers.push_back({name, value});
+        }
+    }
+    return true;
+}
+
+/**
+ * Decodes the complete chunks at the front of `pending` into `out` and removes them.
+ * Trailers after the last chunk are discarded.
+ *
+ * @param done Set once the last (zero-size) chunk was seen.
+ * @return `false` if a chunk size line is malformed.
+ */
+bool H2Connection::dechunk(string& pending, string& out, bool& done){
+    while(!done){
+        size_t line_end = pending.find("\r\n");
+        if(line_end == string::npos){
+            return true;
+        }
+        size_t size;
+        try{
+            size = stoul(pending.substr(0, line_end), nullptr, 16);
+        } catch(...){
+            return false;
+        }
+        if(size == 0){
+            done = true;
+            pending.clear();
+            return true;
+        }
+        if(pending.size() < line_end + 2 + size + 2){
+            return true;
+        }
+        out.append(pending, line_end + 2, size);
+        pending.erase(0, line_end + 2 + size + 2);
+    }
+    return true;
+}
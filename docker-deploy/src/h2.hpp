@@ -0,0 +1,182 @@
+#ifndef _H2_HPP_
+#define _H2_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
+#include <sstream>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "hpack.hpp"
+#include "log.hpp"
+
+using namespace std;
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER_LEN 9
+#define H2_DEFAULT_WINDOW 65535
+#define H2_DEFAULT_FRAME_SIZE 16384
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_CONNECTION_WINDOW (1 << 24)  // receive window granted for a whole connection
+#define H2_MAX_REQUEST_BODY (1 << 23)   // bytes of a request body buffered before the stream is refused
+
+// Frame types
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+// Frame flags
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+// Settings
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+// Error codes
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_CANCEL 0x8
+#define H2_COMPRESSION_ERROR 0x9
+
+/**
+ * One HTTP/2 frame.
+ */
+struct H2Frame {
+    uint8_t type{0};
+    uint8_t flags{0};
+    uint32_t stream_id{0};
+    string payload;
+};
+
+/**
+ * Frame-level helpers shared by the client-side (`H2Connection`) and origin-side HTTP/2 code.
+ */
+class H2 {
+public:
+    static bool readExact(int fd, char* buffer, size_t length, double timeout);
+    static bool readFrame(int fd, H2Frame& frame, size_t max_frame_size, double timeout, bool& too_large);
+    static string frame(uint8_t type, uint8_t flags, uint32_t stream_id, const string& payload);
+    static string settingsFrame(const vector<pair<uint16_t, uint32_t>>& settings);
+    static string windowUpdate(uint32_t stream_id, uint32_t increment);
+    static bool stripPadding(H2Frame& frame);
+    static string toLower(const string& s);
+    static string titleCase(const string& name);
+    static bool isConnectionHeader(const string& name);
+    static bool sendAll(int fd, const char* data, size_t length);
+    static uint32_t read32(const string& data, size_t pos);
+};
+
+/**
+ * Serves one h2c (HTTP/2 with prior knowledge) client connection.
+ *
+ * Each stream is turned back into an HTTP/1.1 request and given to the existing handler on
+ * one end of a socketpair, so GET/POST/CONNECT handling and the cache are shared with the
+ * HTTP/1.1 path. A pump thread per stream translates the HTTP/1.1 response into HEADERS and
+ * DATA frames. Streams progress independently: a slow response only holds its own stream,
+ * and DATA is sent within the connection and stream flow-control windows.
+ *
+ * Received DATA is credited back to the client's windows only once it is consumed, and the
+ * reader thread never blocks on a stream: tunnel bytes are queued and written to the
+ * handler without blocking, so a slow tunnel target only stops its own stream.
+ */
+class H2Connection {
+private:
+    struct Stream {
+        uint32_t id{0};
+        HeaderList headers;
+        bool tunnel{false};             // CONNECT: DATA frames are relayed as they arrive
+        string body;                    // request body, handed over once END_STREAM arrives
+        bool started{false};
+        int64_t send_window{0};
+        int64_t recv_window{H2_DEFAULT_WINDOW};    // bytes the client may still send
+        bool end_received{false};       // the client sent END_STREAM
+        bool reset{false};
+        int pair_fd{-1};                // our end of the socketpair to the handler
+        int wake_fd{-1};                // tunnels: eventfd that wakes relayTunnel() for `inbound`
+        string inbound;                 // tunnels: client bytes not yet written to pair_fd
+        bool inbound_end{false};        // ... to be followed by a write shutdown
+        mutex io_mutex;                 // guards pair_fd, wake_fd and inbound
+    };
+
+    int fd;
+    function<void(int)> handler;
+    unique_ptr<Logger>& logger;
+    uint32_t max_streams;
+    double idle_timeout;
+
+    mutex write_mutex;
+    mutex state_mutex;
+    condition_variable state_cv;
+    map<uint32_t, shared_ptr<Stream>> streams;
+    int64_t connection_window{H2_DEFAULT_WINDOW};
+    int64_t recv_window{H2_CONNECTION_WINDOW};  // bytes the client may still send on the connection
+    uint32_t peer_initial_window{H2_DEFAULT_WINDOW};
+    uint32_t peer_max_frame{H2_DEFAULT_FRAME_SIZE};
+    uint32_t last_stream_id{0};
+    int active_pumps{0};
+    size_t streams_served{0};
+    bool closed{false};
+    Hpack decoder;
+
+    bool send(const string& data);
+    void goAway(uint32_t error_code);
+    void resetStream(uint32_t stream_id, uint32_t error_code);
+    uint32_t handleSettings(const H2Frame& frame);
+    uint32_t handleWindowUpdate(const H2Frame& frame);
+    uint32_t handleData(H2Frame& frame);
+    void handleReset(const H2Frame& frame);
+    void credit(shared_ptr<Stream> stream, size_t connection_bytes, size_t stream_bytes);
+    void refuseStream(shared_ptr<Stream> stream, uint32_t error_code);
+    void flushTunnel(shared_ptr<Stream> stream);
+    uint32_t openStream(uint32_t stream_id, const string& block, bool end_stream);
+    shared_ptr<Stream> findStream(uint32_t stream_id);
+    void startStream(shared_ptr<Stream> stream);
+    void pump(shared_ptr<Stream> stream, int handler_fd);
+    bool sendHeaders(uint32_t stream_id, const HeaderList& headers, bool end_stream);
+    bool sendData(shared_ptr<Stream> stream, const char* data, size_t length, bool end_stream);
+    void relayTunnel(shared_ptr<Stream> stream);
+    void finishStream(shared_ptr<Stream> stream);
+
+    static string buildRequest(const HeaderList& headers, const string& body);
+    static bool parseResponseHead(const string& head, HeaderList& headers, bool& chunked, size_t& content_length);
+    static bool dechunk(string& pending, string& out, bool& done);
+
+public:
+    H2Connection(int fd, function<void(int)> handler, unique_ptr<Logger>& logger,
+                 uint32_t max_streams, double idle_timeout);
+    size_t serve();
+
+    static bool hasPreface(int fd, double timeout);
+};
+
+#endif
@@ -0,0 +1,719 @@
+#include "h2pool.hpp"
+
+#define H2_UPSTREAM_WINDOW (1 << 20)    // per-stream receive window announced to origins
+#define H2_UPSTREAM_IDLE 60             // seconds before an unused connection is closed
+#define H2_UPSTREAM_POLL 1000           // ms between checks for shutdown in the reader
+#define H2_UPSTREAM_READ 16384
+
+/**
+ * Reason phrases for the status line of converted responses (HTTP/2 has none).
+ */
+static string reasonPhrase(int status){
+    switch(status){
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "Unknown";
+    }
+}
+
+H2Upstream::H2Upstream(int fd) : fd(fd), last_used(chrono::steady_clock::now()) {}
+
+H2Upstream::~H2Upstream(){
+    stopping = true;
+    shutdown(fd, SHUT_RDWR);
+    if(reader.joinable()){
+        reader.join();
+    }
+    close(fd);
+}
+
+bool H2Upstream::send(const string& data){
+    lock_guard<mutex> lock(write_mutex);
+    return H2::sendAll(fd, data.data(), data.size());
+}
+
+/**
+ * Sends the connection preface and our SETTINGS, then waits for the origin's SETTINGS.
+ * An HTTP/1.1-only origin answers with an error status line instead, which does not parse
+ * as a SETTINGS frame.
+ *
+ * @param timeout Seconds to wait for the origin's SETTINGS.
+ * @return `true` if the origin speaks HTTP/2; the reader thread is then running.
+ */
+bool H2Upstream::handshake(double timeout){
+    string greeting = string(H2_PREFACE, H2_PREFACE_LEN) +
+        H2::settingsFrame({{H2_SETTINGS_ENABLE_PUSH, 0}, {H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_UPSTREAM_WINDOW}}) +
+        H2::windowUpdate(0, H2_CONNECTION_WINDOW - H2_DEFAULT_WINDOW);
+    if(!send(greeting)){
+        return false;
+    }
+    H2Frame frame;
+    bool too_large = false;
+    if(!H2::readFrame(fd, frame, H2_DEFAULT_FRAME_SIZE, timeout, too_large) || frame.type != H2_SETTINGS ||
+       frame.stream_id != 0 || (frame.flags & H2_FLAG_ACK) || !applySettings(frame)){
+        return false;
+    }
+    reader = thread(&H2Upstream::readLoop, this);
+    return true;
+}
+
+/**
+ * Applies the origin's SETTINGS and acknowledges them.
+ * @return `false` if a setting is invalid.
+ */
+bool H2Upstream::applySettings(const H2Frame& frame){
+    if(frame.payload.size() % 6 != 0){
+        return false;
+    }
+    {
+        lock_guard<mutex> lock(state_mutex);
+        for(size_t pos = 0; pos < frame.payload.size(); pos += 6){
+            uint16_t id = ((uint8_t)frame.payload[pos] << 8) | (uint8_t)frame.payload[pos + 1];
+            uint32_t value = H2::read32(frame.payload, pos + 2);
+            if(id == H2_SETTINGS_MAX_CONCURRENT_STREAMS){
+                peer_max_streams = value;
+            } else if(id == H2_SETTINGS_INITIAL_WINDOW_SIZE){
+                if(value > H2_MAX_WINDOW){return false;}
+                int64_t delta = (int64_t)value - peer_initial_window;
+                for(auto& entry : streams){
+                    entry.second->send_window += delta;
+                }
+                peer_initial_window = value;
+            } else if(id == H2_SETTINGS_MAX_FRAME_SIZE){
+                if(value < H2_DEFAULT_FRAME_SIZE || value > 0xffffff){return false;}
+                peer_max_frame = value;
+            }
+        }
+        state_cv.notify_all();
+    }
+    return send(H2::frame(H2_SETTINGS, H2_FLAG_ACK, 0, ""));
+}
+
+/**
+ * Whether new streams can be opened: the connection is alive and got no GOAWAY.
+ */
+bool H2Upstream::usable(){
+    lock_guard<mutex> lock(state_mutex);
+    return !dead && !going_away && next_stream_id < H2_MAX_WINDOW;
+}
+
+uint32_t H2Upstream::maxStreams(){
+    lock_guard<mutex> lock(state_mutex);
+    return peer_max_streams;
+}
+
+/**
+ * Marks the unfinished streams above `after_id` as failed.
+ * @param retry Whether the origin is known not to have processed them.
+ */
+void H2Upstream::failStreams(uint32_t after_id, bool retry){
+    lock_guard<mutex> lock(state_mutex);
+    for(auto& entry : streams){
+        if(entry.first > after_id && !entry.second->ended){
+            entry.second->failed = true;
+            entry.second->retry = retry;
+        }
+    }
+    state_cv.notify_all();
+}
+
+/**
+ * Takes a complete response header block. Informational (1xx) responses are skipped and a
+ * block after the final response is a trailer, whose fields are dropped.
+ * @return `false` on an HPACK error, which breaks the whole connection.
+ */
+bool H2Upstream::handleHeaders(uint32_t stream_id, const string& block, bool end_stream){
+    HeaderList headers;
+    if(!decoder.decode(block, headers)){    // decoded even for unknown streams: HPACK state is shared
+        return false;
+    }
+    lock_guard<mutex> lock(state_mutex);
+    auto it = streams.find(stream_id);
+    if(it == streams.end() || it->second->failed){
+        return true;
+    }
+    shared_ptr<Stream> stream = it->second;
+    if(!stream->headers_done){
+        if(headers.empty() || headers[0].first != ":status" || headers[0].second.empty()){
+            stream->failed = true;
+        } else if(headers[0].second[0] == '1'){
+            return true;
+        } else{
+            stream->headers = headers;
+            stream->headers_done = true;
+        }
+    }
+    if(end_stream){
+        stream->ended = true;
+    }
+    state_cv.notify_all();
+    return true;
+}
+
+/**
+ * Reader thread: dispatches the origin's frames until the connection closes or breaks,
+ * then fails the streams still open.
+ */
+void H2Upstream::readLoop(){
+    string block;
+    uint32_t block_stream = 0;      // stream whose header block continues in CONTINUATION frames
+    bool block_end_stream = false;
+    bool ok = true;
+
+    while(ok && !stopping){
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int rv = poll(&pfd, 1, H2_UPSTREAM_POLL);
+        if(rv < 0 && errno != EINTR){break;}
+        if(rv <= 0){continue;}
+
+        H2Frame frame;
+        bool too_large = false;
+        if(!H2::readFrame(fd, frame, H2_DEFAULT_FRAME_SIZE, H2_UPSTREAM_POLL / 1000.0, too_large)){
+            break;
+        }
+        if(block_stream != 0 && (frame.type != H2_CONTINUATION || frame.stream_id != block_stream)){
+            break;
+        }
+
+        switch(frame.type){
+        case H2_HEADERS:
+            if(!H2::stripPadding(frame)){ok = false; break;}
+            if(frame.flags & H2_FLAG_PRIORITY){
+                if(frame.payload.size() < 5){ok = false; break;}
+                frame.payload.erase(0, 5);
+            }
+            block = frame.payload;
+            block_end_stream = frame.flags & H2_FLAG_END_STREAM;
+            if(frame.flags & H2_FLAG_END_HEADERS){
+                ok = handleHeaders(frame.stream_id, block, block_end_stream);
+            } else{
+                block_stream = frame.stream_id;
+            }
+            break;
+        case H2_CONTINUATION:
+            if(block_stream == 0){ok = false; break;}
+            block += frame.payload;
+            if(frame.flags & H2_FLAG_END_HEADERS){
+                ok = handleHeaders(block_stream, block, block_end_stream);
+                block_stream = 0;
+            }
+            break;
+        case H2_DATA: {
+            size_t flow_length = frame.payload.size();
+            if(!H2::stripPadding(frame)){ok = false; break;}
+            bool buffered = false;
+            {
+                lock_guard<mutex> lock(state_mutex);
+                auto it = streams.find(frame.stream_id);
+                if(it != streams.end() && !it->second->failed){
+                    it->second->data += frame.payload;
+                    if(frame.flags & H2_FLAG_END_STREAM){
+                        it->second->ended = true;
+                    }
+                    buffered = true;
+                    state_cv.notify_all();
+                }
+            }
+            // Buffered bytes are credited when consumed; padding and dropped data right away
+            size_t credit = buffered ? flow_length - frame.payload.size() : flow_length;
+            if(credit > 0){
+                send(H2::windowUpdate(0, credit));
+            }
+            break;
+        }
+        case H2_SETTINGS:
+            if(!(frame.flags & H2_FLAG_ACK)){
+                ok = (frame.stream_id == 0) && applySettings(frame);
+            }
+            break;
+        case H2_PING:
+            if(frame.payload.size() == 8 && !(frame.flags & H2_FLAG_ACK)){
+                send(H2::frame(H2_PING, H2_FLAG_ACK, 0, frame.payload));
+            }
+            break;
+        case H2_WINDOW_UPDATE: {
+            if(frame.payload.size() != 4){ok = false; break;}
+            uint32_t increment = H2::read32(frame.payload, 0) & H2_MAX_WINDOW;
+            lock_guard<mutex> lock(state_mutex);
+            if(frame.stream_id == 0){
+                connection_window += increment;
+            } else{
+                auto it = streams.find(frame.stream_id);
+                if(it != streams.end()){
+                    it->second->send_window += increment;
+                }
+            }
+            state_cv.notify_all();
+            break;
+        }
+        case H2_RST_STREAM: {
+            if(frame.payload.size() != 4){ok = false; break;}
+            uint32_t error_code = H2::read32(frame.payload, 0);
+            lock_guard<mutex> lock(state_mutex);
+            auto it = streams.find(frame.stream_id);
+            if(it != streams.end()){
+                it->second->failed = true;
+                it->second->retry = (error_code == H2_REFUSED_STREAM);
+            }
+            state_cv.notify_all();
+            break;
+        }
+        case H2_GOAWAY: {
+            if(frame.payload.size() < 8){ok = false; break;}
+            {
+                lock_guard<mutex> lock(state_mutex);
+                going_away = true;
+            }
+            failStreams(H2::read32(frame.payload, 0) & H2_MAX_WINDOW, true);
+            break;
+        }
+        case H2_PUSH_PROMISE:
+            ok = false;     // push is disabled in our SETTINGS
+            break;
+        default:
+            break;
+        }
+    }
+
+    if(!ok){
+        string payload(8, '\0');
+        payload[7] = H2_PROTOCOL_ERROR;
+        send(H2::frame(H2_GOAWAY, 0, 0, payload));
+    }
+    {
+        lock_guard<mutex> lock(state_mutex);
+        dead = true;
+    }
+    failStreams(0, false);
+}
+
+/**
+ * Opens a stream and sends the request. HEADERS frames go out in stream-ID order because
+ * the ID is allocated while holding the write lock.
+ *
+ * @param timeout Seconds to wait for send window for the body.
+ * @return The stream, or `nullptr` if the connection can take no new streams.
+ */
+shared_ptr<H2Upstream::Stream> H2Upstream::open(const HeaderList& headers, const string& body, double timeout){
+    shared_ptr<Stream> stream = make_shared<Stream>();
+    string block = Hpack::encode(headers);
+    {
+        lock_guard<mutex> write_lock(write_mutex);
+        size_t max_frame;
+        {
+            lock_guard<mutex> lock(state_mutex);
+            if(dead || going_away){
+                return nullptr;
+            }
+            stream->id = next_stream_id;
+            next_stream_id += 2;
+            stream->send_window = peer_initial_window;
+            streams[stream->id] = stream;
+            max_frame = peer_max_frame;
+        }
+        string frames;
+        size_t offset = 0;
+        do{
+            size_t length = min(max_frame, block.size() - offset);
+            uint8_t flags = (offset + length == block.size() ? H2_FLAG_END_HEADERS : 0) |
+                            (offset == 0 && body.empty() ? H2_FLAG_END_STREAM : 0);
+            frames += H2::frame(offset == 0 ? H2_HEADERS : H2_CONTINUATION, flags, stream->id, block.substr(offset, length));
+            offset += length;
+        } while(offset < block.size());
+        if(!H2::sendAll(fd, frames.data(), frames.size())){
+            lock_guard<mutex> lock(state_mutex);
+            stream->failed = true;
+            return stream;
+        }
+    }
+
+    size_t offset = 0;
+    while(offset < body.size()){
+        size_t chunk;
+        {
+            unique_lock<mutex> lock(state_mutex);
+            bool ready = state_cv.wait_for(lock, chrono::duration<double>(timeout), [&]{
+                return dead || stream->failed || (connection_window > 0 && stream->send_window > 0);
+            });
+            if(!ready || dead || stream->failed){
+                stream->failed = true;
+                return stream;
+            }
+            int64_t window = min(connection_window, stream->send_window);
+            chunk = min((size_t)window, min(body.size() - offset, (size_t)peer_max_frame));
+            connection_window -= chunk;
+            stream->send_window -= chunk;
+        }
+        bool last = (offset + chunk == body.size());
+        send(H2::frame(H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->id, body.substr(offset, chunk)));
+        offset += chunk;
+    }
+    return stream;
+}
+
+/**
+ * Waits for the final response headers.
+ * @return `false` if the stream failed or `timeout` seconds passed.
+ */
+bool H2Upstream::readHeaders(shared_ptr<Stream> stream, double timeout){
+    unique_lock<mutex> lock(state_mutex);
+    state_cv.wait_for(lock, chrono::duration<double>(timeout), [&]{
+        return stream->headers_done || stream->failed;
+    });
+    return stream->headers_done && !stream->failed;
+}
+
+/**
+ * Takes the body bytes received so far, waiting up to `timeout` seconds for more, and
+ * credits them back to the origin's windows.
+ * @return `true` with data, `true` with empty `data` at the end of the body, or `false`
+ *         if the stream failed or timed out.
+ */
+bool H2Upstream::readData(shared_ptr<Stream> stream, string& data, double timeout){
+    data.clear();
+    bool ended;
+    {
+        unique_lock<mutex> lock(state_mutex);
+        bool ready = state_cv.wait_for(lock, chrono::duration<double>(timeout), [&]{
+            return !stream->data.empty() || stream->ended || stream->failed;
+        });
+        if(!ready || (stream->failed && stream->data.empty())){
+            return false;
+        }
+        data.swap(stream->data);
+        ended = stream->ended;
+    }
+    if(!data.empty()){
+        string credit = H2::windowUpdate(0, data.size());
+        if(!ended){
+            credit += H2::windowUpdate(stream->id, data.size());
+        }
+        send(credit);
+    }
+    return true;
+}
+
+/**
+ * Closes a stream, resetting it with CANCEL if the response is not complete.
+ * @return `true` if the stream may be retried elsewhere: the origin did not process it.
+ */
+bool H2Upstream::finish(shared_ptr<Stream> stream){
+    bool reset;
+    bool retry;
+    {
+        lock_guard<mutex> lock(state_mutex);
+        reset = !stream->ended && !stream->failed && !dead;
+        retry = stream->retry && !stream->headers_done;
+        streams.erase(stream->id);
+    }
+    if(reset){
+        string payload(4, '\0');
+        payload[3] = H2_CANCEL;
+        send(H2::frame(H2_RST_STREAM, 0, stream->id, payload));
+    }
+    return retry;
+}
+
+H2Pool::H2Pool(function<int(const string&, int)> connector, unique_ptr<Logger>& logger)
+    : connector(connector), logger(logger) {}
+
+/**
+ * Takes a stream slot on a connection to the origin, opening a connection when every
+ * existing one is at the origin's stream limit and fewer than `max_connections` exist.
+ * Dead and idle connections of all origins are dropped on the way.
+ *
+ * @param timeout Seconds to wait for the handshake or for a free slot.
+ * @param retry_after Seconds an origin without HTTP/2 support is not asked again.
+ * @return The connection, or `nullptr` to use HTTP/1.1.
+ */
+shared_ptr<H2Upstream> H2Pool::acquire(const string& host, int port, size_t max_connections,
+                                       double timeout, double retry_after){
+    string key = host + ":" + to_string(port);
+    auto deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(timeout));
+    vector<shared_ptr<H2Upstream>> closing;     // destroyed after the lock is released
+    unique_lock<mutex> lock(pool_mutex);
+
+    while(true){
+        auto now = chrono::steady_clock::now();
+        for(auto& entry : origins){
+            auto& connections = entry.second.connections;
+            for(auto it = connections.begin(); it != connections.end();){
+                bool idle = (now - (*it)->last_used) > chrono::seconds(H2_UPSTREAM_IDLE);
+                if((*it)->reserved == 0 && (idle || !(*it)->usable())){
+                    closing.push_back(*it);
+                    it = connections.erase(it);
+                } else{
+                    ++it;
+                }
+            }
+        }
+
+        Origin& origin = origins[key];
+        if(now < origin.h1_until){
+            return nullptr;
+        }
+        size_t usable = 0;
+        for(auto& connection : origin.connections){
+            if(!connection->usable()){continue;}
+            usable++;
+            if(connection->reserved < connection->maxStreams()){
+                connection->reserved++;
+                connection->last_used = now;
+                return connection;
+            }
+        }
+
+        if(usable + origin.connecting < max(max_connections, (size_t)1)){
+            origin.connecting++;
+            lock.unlock();
+            shared_ptr<H2Upstream> connection;
+            bool supported = false;
+            int fd = connector(host, port);
+            if(fd >= 0){
+                connection = make_shared<H2Upstream>(fd);
+                supported = connection->handshake(timeout);
+            }
+            lock.lock();
+            origin.connecting--;
+            pool_cv.notify_all();
+            if(fd < 0){
+                return nullptr;
+            }
+            if(!supported){
+                origin.h1_until = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(retry_after));
+                logger->log_note(-1, key + " does not speak HTTP/2, using HTTP/1.1 for " + to_string((int)retry_after) + " seconds");
+                closing.push_back(connection);
+                return nullptr;
+            }
+            connections_opened++;
+            logger->log_note(-1, "Opened HTTP/2 connection to " + key + ", " + to_string(connection->maxStreams()) + " streams allowed");
+            connection->reserved = 1;
+            connection->last_used = chrono::steady_clock::now();
+            origin.connections.push_back(connection);
+            return connection;
+        }
+
+        if(pool_cv.wait_until(lock, deadline) == cv_status::timeout){
+            return nullptr;
+        }
+    }
+}
+
+void H2Pool::release(shared_ptr<H2Upstream> connection){
+    lock_guard<mutex> lock(pool_mutex);
+    connection->reserved--;
+    connection->last_used = chrono::steady_clock::now();
+    pool_cv.notify_all();
+}
+
+/**
+ * Returns a socket to send one request to `host:port` over a pooled HTTP/2 connection.
+ * The proxy uses it like a connection from `connectServer()`; the receive timeout is set the
+ * same way.
+ *
+ * @param max_connections Connections per origin.
+ * @param timeout Seconds to wait for a stream slot and for each part of the response.
+ * @param retry_after Seconds an origin without HTTP/2 support is not asked again.
+ * @return The socket, or -1 if the request should go over HTTP/1.1.
+ */
+int H2Pool::open(const string& host, int port, size_t max_connections, double timeout, double retry_after){
+    shared_ptr<H2Upstream> connection = acquire(host, port, max_connections, timeout, retry_after);
+    if(!connection){
+        fallbacks++;
+        return -1;
+    }
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0){
+        release(connection);
+        return -1;
+    }
+    struct timeval tv;
+    tv.tv_sec = (time_t)timeout;
+    tv.tv_usec = (suseconds_t)((timeout - tv.tv_sec) * 1000000);
+    setsockopt(pair[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    streams_opened++;
+    thread(&H2Pool::carry, this, connection, pair[1], host, port, max_connections, timeout, retry_after).detach();
+    return pair[0];
+}
+
+/**
+ * Carries one request: reads it from the socketpair, sends it as a stream and writes the
+ * response back as HTTP/1.1. A response without `Content-Length` is sent chunked, since
+ * the proxy frames bodies by one or the other. A stream the origin refused or dropped with
+ * GOAWAY before processing is retried once on another connection.
+ */
+void H2Pool::carry(shared_ptr<H2Upstream> connection, int fd, string host, int port,
+                   size_t max_connections, double timeout, double retry_after){
+    string head, body;
+    if(!readRequest(fd, timeout, head, body)){
+        release(connection);
+        close(fd);
+        return;
+    }
+    HeaderList request = toH2Request(head);
+    const string& method = request[0].second;
+
+    for(int attempt = 0; attempt < 2 && connection; attempt++){
+        shared_ptr<H2Upstream::Stream> stream = connection->open(request, body, timeout);
+        if(stream && connection->readHeaders(stream, timeout)){
+            const string& status = stream->headers[0].second;
+            bool has_body = method != "HEAD" && status != "204" && status != "304";
+            bool chunked = false;
+            string out = toH1Head(stream->headers, has_body, chunked);
+            bool ok = H2::sendAll(fd, out.data(), out.size());
+            string data;
+            while(ok && connection->readData(stream, data, timeout)){
+                if(data.empty()){
+                    if(chunked){
+                        ok = H2::sendAll(fd, "0\r\n\r\n", 5);
+                    }
+                    break;
+                }
+                if(chunked){
+                    stringstream size;
+                    size << hex << data.size() << "\r\n";
+                    data = size.str() + data + "\r\n";
+                }
+                ok = H2::sendAll(fd, data.data(), data.size());
+            }
+            connection->finish(stream);
+            break;
+        }
+        bool retry = stream && connection->finish(stream);
+        release(connection);
+        connection = nullptr;
+        if(retry){
+            logger->log_note(-1, "HTTP/2 stream to " + host + " refused, retrying on another connection");
+            connection = acquire(host, port, max_connections, timeout, retry_after);
+        }
+    }
+    if(connection){
+        release(connection);
+    }
+    close(fd);  // EOF ends the response, as with an origin that closes the connection
+}
+
+/**
+ * Reads the HTTP/1.1 request the proxy wrote to a socketpair: the head, then a `Content-Length` body.
+ * Also used by `TlsPool`.
+ */
+bool H2Pool::readRequest(int fd, double timeout, string& head, string& body){
+    string data;
+    char buffer[H2_UPSTREAM_READ];
+    size_t head_end;
+    while((head_end = data.find("\r\n\r\n")) == string::npos){
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if(poll(&pfd, 1, (int)(timeout * 1000)) <= 0){return false;}
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if(received <= 0){return false;}
+        data.append(buffer, received);
+    }
+    head = data.substr(0, head_end + 2);
+    body = data.substr(head_end + 4);
+
+    string lower = H2::toLower(head);
+    size_t pos = lower.find("\ncontent-length:");
+    if(pos == string::npos){
+        return true;
+    }
+    size_t length = strtoul(lower.c_str() + pos + 16, NULL, 10);
+    while(body.size() < length){
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if(poll(&pfd, 1, (int)(timeout * 1000)) <= 0){return false;}
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if(received <= 0){return false;}
+        body.append(buffer, received);
+    }
+    body.resize(length);
+    return true;
+}
+
+/**
+ * Converts an HTTP/1.1 request head into HTTP/2 fields. An absolute-form target
+ * (`http://host/path`) is split into `:authority` and `:path`.
+ */
+HeaderList H2Pool::toH2Request(const string& head){
+    istringstream ss(head);
+    string line, method, target, version;
+    getline(ss, line);
+    istringstream(line) >> method >> target >> version;
+
+    string authority;
+    HeaderList fields;
+    while(getline(ss, line)){
+        if(!line.empty() && line.back() == '\r'){line.pop_back();}
+        size_t colon = line.find(':');
+        if(colon == string::npos){continue;}
+        string name = H2::toLower(line.substr(0, colon));
+        string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        if(name == "host"){
+            authority = value;
+        } else if(!H2::isConnectionHeader(name) && name != "te" && name != "content-length"){
+            fields.push_back({name, value});
+        }
+    }
+
+    string path = target;
+    if(target.compare(0, 7, "http://") == 0){
+        size_t slash = target.find('/', 7);
+        if(authority.empty()){
+            authority = target.substr(7, slash == string::npos ? string::npos : slash - 7);
+        }
+        path = slash == string::npos ? "/" : target.substr(slash);
+    }
+
+    HeaderList headers = {{":method", method}, {":scheme", "http"}, {":authority", authority}, {":path", path}};
+    headers.insert(headers.end(), fields.begin(), fields.end());
+    return headers;
+}
+
+/**
+ * Converts HTTP/2 response fields into an HTTP/1.1 head.
+ * @param has_body Whether the response carries a body (not HEAD, 204 or 304).
+ * @param chunked Set when the body has to be sent chunked for lack of `Content-Length`.
+ */
+string H2Pool::toH1Head(const HeaderList& headers, bool has_body, bool& chunked){
+    int status = atoi(headers[0].second.c_str());
+    string out = "HTTP/1.1 " + headers[0].second + " " + reasonPhrase(status) + "\r\n";
+    bool has_length = false;
+    for(const auto& field : headers){
+        if(field.first.empty() || field.first[0] == ':'){continue;}
+        if(field.first == "content-length"){has_length = true;}
+        out += H2::titleCase(field.first) + ": " + field.second + "\r\n";
+    }
+    chunked = has_body && !has_length;
+    if(chunked){
+        out += "Transfer-Encoding: chunked\r\n";
+    }
+    return out + "\r\n";
+}
+
+/**
+ * Counts the HTTP/2 connections currently open to origins.
+ */
+size_t H2Pool::openConnections(){
+    lock_guard<mutex> lock(pool_mutex);
+    size_t count = 0;
+    for(auto& entry : origins){
+        count += entry.second.connections.size();
+    }
+    return count;
+}
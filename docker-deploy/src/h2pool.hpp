@@ -0,0 +1,126 @@
+#ifndef _H2POOL_HPP_
+#define _H2POOL_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "h2.hpp"
+
+using namespace std;
+
+/**
+ * One HTTP/2 connection (h2c, prior knowledge) to an origin, shared by concurrent requests.
+ * A reader thread dispatches the origin's frames to the open streams; requesters send
+ * their own HEADERS/DATA and consume the response with `readHeaders()` / `readData()`.
+ * Received body bytes are credited back to the origin only once consumed.
+ */
+class H2Upstream {
+public:
+    struct Stream {
+        uint32_t id{0};
+        HeaderList headers;             // final response fields, once `headers_done`
+        bool headers_done{false};
+        string data;                    // body bytes not yet consumed
+        bool ended{false};
+        bool failed{false};
+        bool retry{false};              // refused or beyond GOAWAY: the origin did not process it
+        int64_t send_window{0};
+    };
+
+private:
+    int fd;
+    mutex write_mutex;
+    mutex state_mutex;
+    condition_variable state_cv;
+    map<uint32_t, shared_ptr<Stream>> streams;
+    uint32_t next_stream_id{1};
+    int64_t connection_window{H2_DEFAULT_WINDOW};
+    uint32_t peer_initial_window{H2_DEFAULT_WINDOW};
+    uint32_t peer_max_frame{H2_DEFAULT_FRAME_SIZE};
+    uint32_t peer_max_streams{100};
+    bool dead{false};
+    bool going_away{false};
+    atomic<bool> stopping{false};
+    Hpack decoder;
+    thread reader;
+
+    bool send(const string& data);
+    bool applySettings(const H2Frame& frame);
+    void readLoop();
+    bool handleHeaders(uint32_t stream_id, const string& block, bool end_stream);
+    void failStreams(uint32_t after_id, bool retry);
+
+public:
+    size_t reserved{0};                 // stream slots handed out by the pool (pool lock)
+    chrono::steady_clock::time_point last_used;
+
+    explicit H2Upstream(int fd);
+    ~H2Upstream();
+
+    bool handshake(double timeout);
+    bool usable();
+    uint32_t maxStreams();
+
+    shared_ptr<Stream> open(const HeaderList& headers, const string& body, double timeout);
+    bool readHeaders(shared_ptr<Stream> stream, double timeout);
+    bool readData(shared_ptr<Stream> stream, string& data, double timeout);
+    bool finish(shared_ptr<Stream> stream);
+};
+
+/**
+ * Pool of multiplexed HTTP/2 connections per origin (`host:port`).
+ *
+ * `open()` hands out one end of a socketpair that behaves like a connection from
+ * `connectServer()`: the proxy writes an HTTP/1.1 request and reads an HTTP/1.1 response
+ * until EOF. A thread per request carries it as one stream over a pooled connection.
+ * A stream slot is taken on a connection below the origin's SETTINGS_MAX_CONCURRENT_STREAMS;
+ * when all are full, a new connection is opened up to the per-origin limit, otherwise the
+ * request waits for a slot. Origins that do not answer the HTTP/2 preface with SETTINGS are
+ * remembered and get HTTP/1.1 for a while.
+ */
+class H2Pool {
+private:
+    struct Origin {
+        vector<shared_ptr<H2Upstream>> connections;
+        size_t connecting{0};
+        chrono::steady_clock::time_point h1_until;  // HTTP/1.1 only until then
+    };
+
+    function<int(const string&, int)> connector;
+    unique_ptr<Logger>& logger;
+    mutex pool_mutex;
+    condition_variable pool_cv;
+    map<string, Origin> origins;
+
+    shared_ptr<H2Upstream> acquire(const string& host, int port, size_t max_connections,
+                                   double timeout, double retry_after);
+    void release(shared_ptr<H2Upstream> connection);
+    void carry(shared_ptr<H2Upstream> connection, int fd, string host, int port,
+               size_t max_connections, double timeout, double retry_after);
+
+    static HeaderList toH2Request(const string& head);
+    static string toH1Head(const HeaderList& headers, bool has_body, bool& chunked);
+
+public:
+    atomic<size_t> connections_opened{0};
+    atomic<size_t> streams_opened{0};
+    atomic<size_t> fallbacks{0};
+
+    H2Pool(function<int(const string&, int)> connector, unique_ptr<Logger>& logger);
+
+    int open(const string& host, int port, size_t max_connections, double timeout, double retry_after);
+    size_t openConnections();
+
+    static bool readRequest(int fd, double timeout, string& head, string& body);
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include "handoff.hpp"
+
+#define HANDOFF_MAX_FDS 8
+#define HANDOFF_MAX_PAYLOAD 4096
+
+/**
+ * Creates the listening end of the upgrade channel, replacing a stale socket file.
+ * @param path The filesystem path of the Unix socket.
+ * @return The listening socket.
+ * @throws `std::runtime_error` if the socket cannot be created.
+ */
+int Handoff::listenChannel(const string& path){
+    struct sockaddr_un addr;
+    if(path.size() >= sizeof(addr.sun_path)){
+        throw runtime_error("Upgrade socket path too long: " + path);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0){
+        throw runtime_error("Failed to create upgrade socket");
+    }
+    unlink(path.c_str());
+    if(::bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0){
+        close(fd);
+        throw runtime_error("Failed to listen on upgrade socket " + path);
+    }
+    return fd;
+}
+
+/**
+ * Connects to the upgrade channel of the old proxy.
+ * @throws `std::runtime_error` if the connection fails.
+ */
+int Handoff::connectChannel(const string& path){
+    struct sockaddr_un addr;
+    if(path.size() >= sizeof(addr.sun_path)){
+        throw runtime_error("Upgrade socket path too long: " + path);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+        if(fd >= 0){close(fd);}
+        throw runtime_error("Failed to connect to upgrade socket " + path);
+    }
+    return fd;
+}
+
+/**
+ * Waits for the new proxy to connect.
+ * @return The channel socket, or -1 on timeout.
+ */
+int Handoff::acceptChannel(int listen_fd, int timeout_ms){
+    struct pollfd pfd;
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, timeout_ms) <= 0){
+        return -1;
+    }
+    return accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+}
+
+/**
+ * Sends file descriptors and a payload in one message using SCM_RIGHTS.
+ * @throws `std::runtime_error` if the message cannot be sent.
+ */
+void Handoff::sendFds(int channel, const vector<int>& fds, const string& payload){
+    if(fds.size() > HANDOFF_MAX_FDS || payload.size() > HANDOFF_MAX_PAYLOAD){
+        throw runtime_error("Handoff message too large");
+    }
+
+    string data = payload.empty() ? string(1, '\0') : payload;
+    struct iovec iov;
+    iov.iov_base = &data[0];
+    iov.iov_len = data.size();
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    if(sendmsg(channel, &msg, 0) < 0){
+        throw runtime_error("Failed to send listening sockets");
+    }
+}
+
+/**
+ * Receives the message written by `sendFds()`.
+ * @throws `std::runtime_error` if no valid message arrives.
+ */
+void Handoff::receiveFds(int channel, vector<int>& fds, string& payload){
+    char data[HANDOFF_MAX_PAYLOAD];
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t len = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    if(len <= 0){
+        throw runtime_error("Failed to receive listening sockets");
+    }
+
+    fds.clear();
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            fds.resize(count);
+            memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * count);
+        }
+    }
+    payload.assign(data, len);
+    if(payload == string(1, '\0')){
+        payload.clear();
+    }
+}
+
+/**
+ * Tells the old proxy that the new one is ready to accept connections.
+ */
+void Handoff::sendReady(int channel){
+    send(channel, HANDOFF_READY, strlen(HANDOFF_READY), MSG_NOSIGNAL);
+}
+
+/**
+ * Waits for `READY` from the new proxy.
+ * @return `true` if the new proxy reported ready within `timeout_ms`.
+ */
+bool Handoff::waitReady(int channel, int timeout_ms){
+    struct pollfd pfd;
+    pfd.fd = channel;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, timeout_ms) <= 0){
+        return false;
+    }
+    char buffer[16];
+    ssize_t len = recv(channel, buffer, sizeof(buffer), 0);
+    return len == (ssize_t)strlen(HANDOFF_READY) && memcmp(buffer, HANDOFF_READY, len) == 0;
+}
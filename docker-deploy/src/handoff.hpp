@@ -0,0 +1,39 @@
+#ifndef _HANDOFF_HPP_
+#define _HANDOFF_HPP_
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+const char * const HANDOFF_ENV = "PROXY_UPGRADE_SOCKET";
+const char * const HANDOFF_READY = "READY";
+
+/**
+ * Unix-socket channel used for zero-downtime upgrades.
+ *
+ * The running (old) proxy listens on the channel and starts the new binary with
+ * `PROXY_UPGRADE_SOCKET` set. The new proxy connects and receives the listening sockets
+ * (SCM_RIGHTS) together with the path of the cache snapshot. It answers `READY` once it
+ * can accept connections, and the old proxy then stops accepting and drains.
+ */
+class Handoff {
+public:
+    static int listenChannel(const string& path);
+    static int connectChannel(const string& path);
+    static int acceptChannel(int listen_fd, int timeout_ms);
+
+    static void sendFds(int channel, const vector<int>& fds, const string& payload);
+    static void receiveFds(int channel, vector<int>& fds, string& payload);
+
+    static void sendReady(int channel);
+    static bool waitReady(int channel, int timeout_ms);
+};
+
+#endif
@@ -0,0 +1,225 @@
+#include "health.hpp"
+
+/**
+ * @return The origin's entry, created if needed. Call with `health_mutex` held.
+ */
+OriginHealth::Origin& OriginHealth::find(const string& key){
+    auto it = origins.find(key);
+    if(it != origins.end()){
+        return it->second;
+    }
+    if(origins.size() >= HEALTH_MAX_ORIGINS){
+        // Forget a healthy origin to make room; open breakers are kept
+        for(auto candidate = origins.begin(); candidate != origins.end(); candidate++){
+            if(candidate->second.state == BreakerState::CLOSED){
+                origins.erase(candidate);
+                break;
+            }
+        }
+    }
+    return origins[key];
+}
+
+void OriginHealth::open(Origin& origin){
+    origin.state = BreakerState::OPEN;
+    origin.opened_at = chrono::steady_clock::now();
+    origin.probing = false;
+    origin.outcomes.clear();
+    origin.next_outcome = 0;
+}
+
+void OriginHealth::addSample(vector<double>& samples, size_t& next, double value){
+    if(samples.size() < HEALTH_SAMPLES){
+        samples.push_back(value);
+    } else{
+        samples[next] = value;
+    }
+    next = (next + 1) % HEALTH_SAMPLES;
+}
+
+/**
+ * @return `HEALTH_TIMEOUT_FACTOR` times the p99 of `samples`, between `minimum` and
+ *         `configured`; `configured` until there are enough samples.
+ */
+double OriginHealth::adapt(const vector<double>& samples, double configured, double minimum){
+    if(samples.size() < HEALTH_MIN_SAMPLES){
+        return configured;
+    }
+    vector<double> sorted = samples;
+    size_t index = (sorted.size() * 99 + 99) / 100 - 1;
+    nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return min(configured, max(minimum, sorted[index] * HEALTH_TIMEOUT_FACTOR));
+}
+
+/**
+ * Decides whether a request may go to the origin.
+ * @param open_time Seconds an open breaker waits before letting a probe through.
+ * @param probe Set to the probe's token when the request is the half-open probe, 0 otherwise;
+ *        pass it to `record()`.
+ * @return `false` while the breaker is open, or half-open with its probe still running.
+ */
+bool OriginHealth::allow(const string& key, double open_time, uint64_t& probe){
+    lock_guard<mutex> lock(health_mutex);
+    probe = 0;
+    Origin& origin = find(key);
+    auto now = chrono::steady_clock::now();
+    if(origin.state == BreakerState::OPEN && now - origin.opened_at >= chrono::duration<double>(open_time)){
+        origin.state = BreakerState::HALF_OPEN;
+    }
+    if(origin.state == BreakerState::HALF_OPEN){
+        // A probe that never reported (e.g. its thread is stuck) is replaced after open_time
+        if(!origin.probing || now - origin.probe_started >= chrono::duration<double>(open_time)){
+            origin.probing = true;
+            origin.probe_started = now;
+            origin.probe = ++last_probe;
+            probe = origin.probe;
+            return true;
+        }
+    }
+    if(origin.state == BreakerState::CLOSED){
+        return true;
+    }
+    fast_failures++;
+    return false;
+}
+
+/**
+ * Records the outcome of a request to the origin and opens or closes its breaker.
+ * While half-open only the current probe (`probe` matching the token from `allow()`) counts;
+ * other requests, and a probe replaced after it stalled, are ignored.
+ */
+void OriginHealth::record(const string& key, bool success, const Config& config, uint64_t probe){
+    lock_guard<mutex> lock(health_mutex);
+    Origin& origin = find(key);
+    if(probe != 0 && (origin.state != BreakerState::HALF_OPEN || probe != origin.probe)){
+        return; // a probe that was replaced
+    }
+    if(origin.state == BreakerState::HALF_OPEN){
+        if(probe == 0){
+            return; // a request sent before the breaker opened
+        }
+        if(success){
+            origin.state = BreakerState::CLOSED;
+            origin.probing = false;
+        } else{
+            open(origin);
+            trips++;
+        }
+        return;
+    }
+    if(origin.state == BreakerState::OPEN){
+        return; // a request sent before the breaker opened
+    }
+
+    if(origin.outcomes.size() < HEALTH_WINDOW){
+        origin.outcomes.push_back(success);
+    } else{
+        origin.outcomes[origin.next_outcome] = success;
+    }
+    origin.next_outcome = (origin.next_outcome + 1) % HEALTH_WINDOW;
+
+    size_t failures = count(origin.outcomes.begin(), origin.outcomes.end(), false);
+    size_t requests = origin.outcomes.size();
+    if(requests >= max<size_t>(1, config.breaker_min_requests) &&
+       failures >= config.breaker_error_rate * requests){
+        open(origin);
+        trips++;
+    }
+}
+
+void OriginHealth::recordConnect(const string& key, double seconds){
+    lock_guard<mutex> lock(health_mutex);
+    Origin& origin = find(key);
+    addSample(origin.connect_times, origin.next_connect, seconds);
+}
+
+void OriginHealth::recordHeaders(const string& key, double seconds){
+    lock_guard<mutex> lock(health_mutex);
+    Origin& origin = find(key);
+    addSample(origin.header_times, origin.next_header, seconds);
+}
+
+double OriginHealth::connectTimeout(const string& key, double configured){
+    lock_guard<mutex> lock(health_mutex);
+    return adapt(find(key).connect_times, configured, HEALTH_MIN_CONNECT_TIMEOUT);
+}
+
+double OriginHealth::headerTimeout(const string& key, double configured){
+    lock_guard<mutex> lock(health_mutex);
+    return adapt(find(key).header_times, configured, HEALTH_MIN_HEADER_TIMEOUT);
+}
+
+size_t OriginHealth::openCircuits() const {
+    lock_guard<mutex> lock(health_mutex);
+    size_t count = 0;
+    for(const auto& entry : origins){
+        if(entry.second.state != BreakerState::CLOSED){
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Remembers a failure for `ttl` seconds; does nothing if `ttl` is not positive.
+ * When the cache is full, expired entries are dropped first, then an arbitrary one.
+ */
+void FailureCache::record(const string& key, int status, const string& reason, double ttl){
+    if(ttl <= 0){
+        return;
+    }
+    lock_guard<mutex> lock(failure_mutex);
+    auto now = chrono::steady_clock::now();
+    if(failures.size() >= FAILURE_CACHE_MAX && failures.find(key) == failures.end()){
+        for(auto it = failures.begin(); it != failures.end();){
+            it = it->second.expires <= now ? failures.erase(it) : next(it);
+        }
+        if(failures.size() >= FAILURE_CACHE_MAX){
+            failures.erase(failures.begin());
+        }
+    }
+    failures[key] = {status, reason, now + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(ttl))};
+}
+
+/**
+ * Looks up a remembered failure.
+ * @param status Set to the status to answer with.
+ * @param reason Set to what failed.
+ * @return `false` if the origin has no failure that is still remembered.
+ */
+bool FailureCache::find(const string& key, int& status, string& reason){
+    lock_guard<mutex> lock(failure_mutex);
+    auto it = failures.find(key);
+    if(it == failures.end()){
+        return false;
+    }
+    if(it->second.expires <= chrono::steady_clock::now()){
+        failures.erase(it);
+        return false;
+    }
+    status = it->second.status;
+    reason = it->second.reason;
+    hits++;
+    return true;
+}
+
+size_t FailureCache::size() const {
+    lock_guard<mutex> lock(failure_mutex);
+    return failures.size();
+}
+
+OriginCall::OriginCall(OriginHealth* health, const string& key, const Config& config, uint64_t probe)
+    : health(health), key(key), config(config), probe(probe) {}
+
+OriginCall::~OriginCall(){
+    if(health && !recorded){
+        health->record(key, false, config, probe);
+    }
+}
+
+void OriginCall::succeeded(){
+    if(health && !recorded){
+        health->record(key, true, config, probe);
+    }
+    recorded = true;
+}
@@ -0,0 +1,123 @@
+#ifndef _HEALTH_HPP_
+#define _HEALTH_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "config.hpp"
+
+using namespace std;
+
+#define HEALTH_WINDOW 20                // outcomes kept per origin for the error rate
+#define HEALTH_SAMPLES 64               // connect and header times kept per origin
+#define HEALTH_MIN_SAMPLES 20           // samples needed before a timeout adapts
+#define HEALTH_TIMEOUT_FACTOR 3         // adaptive timeout = factor x p99
+#define HEALTH_MIN_CONNECT_TIMEOUT 0.2  // seconds
+#define HEALTH_MIN_HEADER_TIMEOUT 0.5   // seconds
+#define HEALTH_MAX_ORIGINS 1024
+#define FAILURE_CACHE_MAX 4096          // origins remembered by FailureCache
+
+enum class BreakerState { CLOSED, OPEN, HALF_OPEN };
+
+/**
+ * Per-origin (`host:port`) error and latency statistics, a circuit breaker and adaptive
+ * timeouts.
+ *
+ * The breaker opens when at least `breaker_error_rate` of the origin's last requests
+ * (and at least `breaker_min_requests` of them) failed. While open, requests fail fast or
+ * are served stale. After `breaker_open_time` seconds one probe request is let through
+ * (half-open): success closes the breaker, failure opens it again. Only the probe decides;
+ * requests sent before the breaker opened that finish meanwhile are ignored.
+ *
+ * Timeouts adapt to `HEALTH_TIMEOUT_FACTOR` times the origin's p99 connect and response
+ * header times, never above the configured ones.
+ */
+class OriginHealth {
+private:
+    struct Origin {
+        vector<bool> outcomes;              // ring of HEALTH_WINDOW, true = success
+        size_t next_outcome{0};
+        vector<double> connect_times;       // rings of HEALTH_SAMPLES, seconds
+        size_t next_connect{0};
+        vector<double> header_times;
+        size_t next_header{0};
+        BreakerState state{BreakerState::CLOSED};
+        chrono::steady_clock::time_point opened_at;
+        chrono::steady_clock::time_point probe_started;
+        bool probing{false};
+        uint64_t probe{0};                  // token of the running probe
+    };
+
+    mutable mutex health_mutex;
+    map<string, Origin> origins;
+    uint64_t last_probe{0};
+
+    Origin& find(const string& key);
+    void open(Origin& origin);
+    static void addSample(vector<double>& samples, size_t& next, double value);
+    static double adapt(const vector<double>& samples, double configured, double minimum);
+
+public:
+    atomic<size_t> trips{0};                // times a breaker opened
+    atomic<size_t> fast_failures{0};        // requests not sent because a breaker was open
+    atomic<size_t> stale_served{0};         // stale responses served while a breaker was open
+
+    bool allow(const string& key, double open_time, uint64_t& probe);
+    void record(const string& key, bool success, const Config& config, uint64_t probe = 0);
+    void recordConnect(const string& key, double seconds);
+    void recordHeaders(const string& key, double seconds);
+    double connectTimeout(const string& key, double configured);
+    double headerTimeout(const string& key, double configured);
+    size_t openCircuits() const;
+};
+
+/**
+ * Origins (`host:port`) whose name did not resolve, or that refused or timed out every
+ * connection, remembered for `failure_ttl` seconds so requests to them are answered at
+ * once with the same 502 or 504 instead of going to the resolver or origin again.
+ */
+class FailureCache {
+private:
+    struct Failure {
+        int status;                         // 502 or 504
+        string reason;
+        chrono::steady_clock::time_point expires;
+    };
+
+    mutable mutex failure_mutex;
+    map<string, Failure> failures;
+
+public:
+    atomic<size_t> hits{0};                 // requests answered from the cache
+
+    void record(const string& key, int status, const string& reason, double ttl);
+    bool find(const string& key, int& status, string& reason);
+    size_t size() const;
+};
+
+/**
+ * One request to an origin. Its outcome is recorded once: as a success by `succeeded()`,
+ * otherwise as a failure when the call goes out of scope, so every early return of a
+ * request handler counts. Does nothing when `health` is `nullptr` (breaker off).
+ * `probe` is the token `OriginHealth::allow()` gave a half-open probe, 0 otherwise.
+ */
+class OriginCall {
+private:
+    OriginHealth* health;
+    string key;
+    const Config& config;
+    uint64_t probe;
+    bool recorded{false};
+
+public:
+    OriginCall(OriginHealth* health, const string& key, const Config& config, uint64_t probe = 0);
+    ~OriginCall();
+
+    void succeeded();
+};
+
+#endif
@@ -0,0 +1,173 @@
+#include "hedge.hpp"
+
+Hedger::Hedger(function<int(const string&, int, size_t, size_t&)> connector, unique_ptr<Logger>& logger) :
+    connector(connector), logger(logger) {}
+
+/**
+ * @return The origin's p95 time to first byte, or `fallback` until enough samples exist.
+ */
+double Hedger::hedgeDelay(const string& key, double fallback){
+    lock_guard<mutex> lock(stats_mutex);
+    auto it = origins.find(key);
+    if(it == origins.end() || it->second.ttfb.size() < HEDGE_MIN_SAMPLES){
+        return fallback;
+    }
+    vector<double> sorted = it->second.ttfb;
+    size_t index = (sorted.size() * 95 + 99) / 100 - 1;
+    nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return sorted[index];
+}
+
+void Hedger::record(const string& key, double ttfb){
+    lock_guard<mutex> lock(stats_mutex);
+    if(origins.size() >= HEDGE_MAX_ORIGINS && origins.find(key) == origins.end()){
+        origins.erase(origins.begin());
+    }
+    Samples& samples = origins[key];
+    if(samples.ttfb.size() < HEDGE_SAMPLES){
+        samples.ttfb.push_back(ttfb);
+    } else{
+        samples.ttfb[samples.next] = ttfb;
+    }
+    samples.next = (samples.next + 1) % HEDGE_SAMPLES;
+}
+
+/**
+ * Spends a hedge from the budget, which `open()` credits with `budget` of a hedge per call.
+ * @return `false` if the budget has no whole hedge left.
+ */
+bool Hedger::takeToken(){
+    lock_guard<mutex> lock(stats_mutex);
+    if(tokens < 1){
+        return false;
+    }
+    tokens -= 1;
+    return true;
+}
+
+/**
+ * Connects to `host:port`, starting on address `first_address`, and sends `request`.
+ * @param addresses Set to the number of addresses the host resolved to.
+ * @return `false` if no address accepted the connection or the request could not be sent.
+ */
+bool Hedger::startAttempt(const string& host, int port, size_t first_address, const string& request,
+                          vector<Attempt>& attempts, bool hedge, size_t& addresses){
+    Attempt attempt;
+    attempt.start = chrono::steady_clock::now();
+    attempt.hedge = hedge;
+    attempt.fd = connector(host, port, first_address, addresses);
+    if(attempt.fd < 0){
+        return false;
+    }
+    size_t offset = 0;
+    while(offset < request.size()){
+        ssize_t sent = send(attempt.fd, request.data() + offset, request.size() - offset, MSG_NOSIGNAL);
+        if(sent <= 0){
+            close(attempt.fd);
+            return false;
+        }
+        offset += sent;
+    }
+    attempts.push_back(attempt);
+    return true;
+}
+
+/**
+ * Sends `request` to `host:port`, hedging it on a second connection when the first is slow.
+ *
+ * @param request The complete HTTP/1.1 request to send.
+ * @param fallback_delay Seconds to wait before hedging while the origin has too few samples.
+ * @param budget Share of calls that may be hedged.
+ * @param header_timeout Seconds to wait for a first response byte from any attempt.
+ * @param first_address Index of the resolved address to try first, so a retry starts on a
+ *        different address; the hedge starts on the one after it.
+ * @param request_id The request being served, for logging.
+ * @return A socket with a response byte waiting, or `-1` if no attempt answered.
+ */
+int Hedger::open(const string& host, int port, const string& request, double fallback_delay, double budget,
+                 double header_timeout, size_t first_address, int request_id){
+    string key = host + ":" + to_string(port);
+    {
+        lock_guard<mutex> lock(stats_mutex);
+        tokens = min<double>(HEDGE_BURST, tokens + budget);
+    }
+    auto start = chrono::steady_clock::now();
+    auto hedge_at = start + chrono::duration<double>(hedgeDelay(key, fallback_delay));
+    auto deadline = start + chrono::duration<double>(header_timeout);
+    vector<Attempt> attempts;
+    size_t addresses = 0;
+    if(!startAttempt(host, port, first_address, request, attempts, false, addresses)){
+        return -1;
+    }
+    // A hedge to the same single address would only double the load on it
+    bool hedge_decided = addresses < 2;
+    int winner = -1;
+
+    while(winner < 0 && !attempts.empty()){
+        auto now = chrono::steady_clock::now();
+        if(now >= deadline){
+            break;
+        }
+        if(!hedge_decided && now >= hedge_at){
+            hedge_decided = true;
+            size_t ignored;
+            if(!takeToken()){
+                budget_exhausted++;
+            } else if(startAttempt(host, port, first_address + 1, request, attempts, true, ignored)){
+                hedges++;
+                logger->log_note(request_id, "No response from " + key + " yet, hedging on another address");
+            }
+        }
+
+        auto until = deadline;
+        if(!hedge_decided){
+            until = min(until, hedge_at);
+        }
+        int wait_ms = (int)max<long long>(1, chrono::duration_cast<chrono::milliseconds>(until - now).count());
+        vector<struct pollfd> fds(attempts.size());
+        for(size_t i = 0; i < attempts.size(); i++){
+            fds[i].fd = attempts[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if(poll(fds.data(), fds.size(), wait_ms) < 0 && errno != EINTR){
+            break;
+        }
+
+        // An attempt closed or reset before answering is dropped; the caller's retry covers
+        // the case where none is left
+        vector<Attempt> alive;
+        for(size_t i = 0; i < attempts.size(); i++){
+            Attempt& attempt = attempts[i];
+            bool ok = true;
+            if(fds[i].revents && winner < 0){
+                char byte;
+                ok = recv(attempt.fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+                if(ok){
+                    winner = attempt.fd;
+                    record(key, chrono::duration<double>(chrono::steady_clock::now() - attempt.start).count());
+                    if(attempt.hedge){
+                        wins++;
+                        logger->log_note(request_id, "Hedged request to " + key + " answered first");
+                    }
+                    continue;
+                }
+            }
+            if(ok && winner < 0){
+                alive.push_back(attempt);
+            } else{
+                close(attempt.fd);
+            }
+        }
+        attempts.swap(alive);
+    }
+
+    if(winner < 0){
+        logger->log_error(request_id, attempts.empty() ? "Connection to " + key + " closed before a response" :
+                          "No response from " + key + " within " + to_string(header_timeout) + " seconds");
+    }
+    for(Attempt& attempt : attempts){
+        close(attempt.fd);
+    }
+    return winner;
+}
@@ -0,0 +1,74 @@
+#ifndef _HEDGE_HPP_
+#define _HEDGE_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "log.hpp"
+
+using namespace std;
+
+#define HEDGE_SAMPLES 64            // time-to-first-byte samples kept per origin
+#define HEDGE_MIN_SAMPLES 10        // samples needed before the p95 replaces hedge_delay
+#define HEDGE_MAX_ORIGINS 1024
+#define HEDGE_BURST 10              // hedges the budget can save up
+
+/**
+ * Hedged connections for idempotent GET misses.
+ *
+ * `open()` connects through the proxy's connector (`Proxy::connectServer()`, which ranks the
+ * addresses, fails over between them and feeds the balancer, origin health and failure
+ * cache) and sends the request. If no response byte has arrived after the origin's p95 time
+ * to first byte (or `hedge_delay` until enough samples exist), the same request is sent over
+ * a second connection that starts on the next address, and the first connection with a
+ * response byte wins; the other is closed. Hedges are paid from a budget that earns
+ * `hedge_budget` of a hedge per call, so they add at most that share of origin requests.
+ */
+class Hedger {
+private:
+    struct Samples {
+        vector<double> ttfb;                // seconds, a ring of HEDGE_SAMPLES
+        size_t next{0};
+    };
+    struct Attempt {
+        int fd;
+        chrono::steady_clock::time_point start;
+        bool hedge{false};
+    };
+
+    // Connects to host:port starting on the given resolved address, and reports how many
+    // addresses the host resolved to
+    function<int(const string&, int, size_t, size_t&)> connector;
+    unique_ptr<Logger>& logger;
+    mutex stats_mutex;
+    map<string, Samples> origins;           // by host:port
+    double tokens{0};                       // hedges the budget allows now
+
+    double hedgeDelay(const string& key, double fallback);
+    void record(const string& key, double ttfb);
+    bool takeToken();
+    bool startAttempt(const string& host, int port, size_t first_address, const string& request,
+                      vector<Attempt>& attempts, bool hedge, size_t& addresses);
+
+public:
+    atomic<size_t> hedges{0};               // second attempts started
+    atomic<size_t> wins{0};                 // second attempts that answered first
+    atomic<size_t> budget_exhausted{0};     // hedges skipped for lack of budget
+
+    Hedger(function<int(const string&, int, size_t, size_t&)> connector, unique_ptr<Logger>& logger);
+
+    int open(const string& host, int port, const string& request, double fallback_delay, double budget,
+             double header_timeout, size_t first_address, int request_id);
+};
+
+#endif
@@ -0,0 +1,347 @@
+#include "hpack.hpp"
+
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_EOS 256
+
+static const char* const STATIC_TABLE[HPACK_STATIC_ENTRIES][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// Code lengths of the RFC 7541 Appendix B Huffman code, symbols 0-255 and EOS (256).
+// The code is canonical, so the codes themselves follow from the lengths.
+static const uint8_t HUFFMAN_LENGTHS[HPACK_EOS + 1] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/**
+ * The canonical Huffman code, built once from `HUFFMAN_LENGTHS`.
+ * Codes of one length are consecutive, so decoding only needs the first code of each length.
+ */
+struct HuffmanCode {
+    uint32_t codes[HPACK_EOS + 1];
+    uint16_t sorted[HPACK_EOS + 1];     // symbols ordered by (length, symbol)
+    uint32_t first_code[32];
+    uint16_t first_index[32];
+    uint16_t count[32];
+
+    HuffmanCode(){
+        uint16_t n = 0;
+        for(int length = 1; length < 32; length++){
+            first_index[length] = n;
+            count[length] = 0;
+            for(int symbol = 0; symbol <= HPACK_EOS; symbol++){
+                if(HUFFMAN_LENGTHS[symbol] == length){
+                    sorted[n++] = symbol;
+                    count[length]++;
+                }
+            }
+        }
+        uint32_t code = 0;
+        for(int length = 1; length < 32; length++){
+            first_code[length] = code;
+            for(int i = 0; i < count[length]; i++){
+                codes[sorted[first_index[length] + i]] = code++;
+            }
+            code <<= 1;
+        }
+    }
+};
+
+static const HuffmanCode& huffman(){
+    static const HuffmanCode code;
+    return code;
+}
+
+/**
+ * Appends an HPACK integer with an N-bit prefix (RFC 7541 section 5.1).
+ * @param first_byte The flag bits that share the first byte with the prefix.
+ */
+void Hpack::encodeInteger(string& out, uint64_t value, int prefix_bits, uint8_t first_byte){
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if(value < max_prefix){
+        out.push_back((char)(first_byte | value));
+        return;
+    }
+    out.push_back((char)(first_byte | max_prefix));
+    value -= max_prefix;
+    while(value >= 128){
+        out.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+/**
+ * Reads an HPACK integer with an N-bit prefix.
+ * @return `false` if the input ends early or the value overflows.
+ */
+bool Hpack::decodeInteger(const string& in, size_t& pos, int prefix_bits, uint64_t& value){
+    if(pos >= in.size()){
+        return false;
+    }
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    value = (uint8_t)in[pos++] & max_prefix;
+    if(value < max_prefix){
+        return true;
+    }
+    for(int shift = 0; shift <= 56; shift += 7){
+        if(pos >= in.size()){
+            return false;
+        }
+        uint8_t byte = in[pos++];
+        value += (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)){
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Huffman-codes a string, padding the last byte with the most significant bits of EOS.
+ */
+string Hpack::huffmanEncode(const string& in){
+    const HuffmanCode& code = huffman();
+    string out;
+    uint64_t bits = 0;
+    int bit_count = 0;
+    for(unsigned char c : in){
+        bits = (bits << HUFFMAN_LENGTHS[c]) | code.codes[c];
+        bit_count += HUFFMAN_LENGTHS[c];
+        while(bit_count >= 8){
+            bit_count -= 8;
+            out.push_back((char)(bits >> bit_count));
+        }
+    }
+    if(bit_count > 0){
+        out.push_back((char)((bits << (8 - bit_count)) | (0xff >> bit_count)));
+    }
+    return out;
+}
+
+/**
+ * Decodes a Huffman-coded string.
+ * @return `false` on EOS in the data, or padding longer than 7 bits or not all ones.
+ */
+bool Hpack::huffmanDecode(const string& in, string& out){
+    const HuffmanCode& code = huffman();
+    out.clear();
+    uint32_t current = 0;
+    int length = 0;
+    bool all_ones = true;
+    for(unsigned char byte : in){
+        for(int bit = 7; bit >= 0; bit--){
+            int b = (byte >> bit) & 1;
+            current = (current << 1) | b;
+            all_ones = all_ones && b;
+            length++;
+            if(length >= 32){
+                return false;
+            }
+            if(code.count[length] > 0 && current - code.first_code[length] < code.count[length] &&
+               current >= code.first_code[length]){
+                uint16_t symbol = code.sorted[code.first_index[length] + current - code.first_code[length]];
+                if(symbol == HPACK_EOS){
+                    return false;
+                }
+                out.push_back((char)symbol);
+                current = 0;
+                length = 0;
+                all_ones = true;
+            }
+        }
+    }
+    return length <= 7 && all_ones;
+}
+
+/**
+ * Appends a string literal, Huffman-coded when that is shorter.
+ */
+void Hpack::encodeString(string& out, const string& value){
+    string coded = huffmanEncode(value);
+    if(coded.size() < value.size()){
+        encodeInteger(out, coded.size(), 7, 0x80);
+        out += coded;
+    } else{
+        encodeInteger(out, value.size(), 7, 0x00);
+        out += value;
+    }
+}
+
+/**
+ * Reads a string literal.
+ * @return `false` if the input is truncated or the Huffman data is invalid.
+ */
+bool Hpack::decodeString(const string& in, size_t& pos, string& value){
+    if(pos >= in.size()){
+        return false;
+    }
+    bool huffman_coded = (uint8_t)in[pos] & 0x80;
+    uint64_t length;
+    if(!decodeInteger(in, pos, 7, length) || length > in.size() - pos){
+        return false;
+    }
+    string raw = in.substr(pos, length);
+    pos += length;
+    if(huffman_coded){
+        return huffmanDecode(raw, value);
+    }
+    value = raw;
+    return true;
+}
+
+/**
+ * Encodes a header list. Header names must already be lowercase.
+ * - A field matching a static entry exactly is sent as an index.
+ * - Otherwise it is a literal without indexing, reusing a static name when there is one.
+ */
+string Hpack::encode(const HeaderList& headers){
+    string out;
+    for(const auto& header : headers){
+        int name_index = 0;
+        int full_index = 0;
+        for(int i = 0; i < HPACK_STATIC_ENTRIES && !full_index; i++){
+            if(header.first == STATIC_TABLE[i][0]){
+                if(!name_index){name_index = i + 1;}
+                if(header.second == STATIC_TABLE[i][1]){full_index = i + 1;}
+            }
+        }
+        if(full_index){
+            encodeInteger(out, full_index, 7, 0x80);
+            continue;
+        }
+        encodeInteger(out, name_index, 4, 0x00);
+        if(!name_index){
+            encodeString(out, header.first);
+        }
+        encodeString(out, header.second);
+    }
+    return out;
+}
+
+/**
+ * Evicts the oldest dynamic table entries until `room` more bytes fit within the table size.
+ */
+void Hpack::shrinkTable(size_t room){
+    while(!dynamic_table.empty() && table_size + room > max_table_size){
+        table_size -= dynamic_table.back().first.size() + dynamic_table.back().second.size() + HPACK_ENTRY_OVERHEAD;
+        dynamic_table.pop_back();
+    }
+}
+
+/**
+ * Adds a field to the front of the dynamic table, evicting the oldest entries to make room.
+ * A field larger than the whole table empties it and is not added.
+ */
+void Hpack::addEntry(const string& name, const string& value){
+    size_t size = name.size() + value.size() + HPACK_ENTRY_OVERHEAD;
+    shrinkTable(size);
+    if(size <= max_table_size){
+        dynamic_table.push_front({name, value});
+        table_size += size;
+    }
+}
+
+/**
+ * Resolves an index into the static table (1-61) or the dynamic table (62 and up).
+ */
+bool Hpack::lookup(uint64_t index, pair<string, string>& field) const{
+    if(index == 0){
+        return false;
+    }
+    if(index <= HPACK_STATIC_ENTRIES){
+        field = {STATIC_TABLE[index - 1][0], STATIC_TABLE[index - 1][1]};
+        return true;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if(index >= dynamic_table.size()){
+        return false;
+    }
+    field = dynamic_table[index];
+    return true;
+}
+
+/**
+ * Decodes one complete header block, updating the dynamic table.
+ *
+ * @param block The concatenated HEADERS and CONTINUATION fragments.
+ * @param headers Receives the fields in order.
+ * @return `false` on a compression error; the connection must then be closed.
+ */
+bool Hpack::decode(const string& block, HeaderList& headers){
+    headers.clear();
+    size_t pos = 0;
+    while(pos < block.size()){
+        uint8_t byte = block[pos];
+        uint64_t index;
+        pair<string, string> field;
+
+        if(byte & 0x80){
+            // Indexed header field
+            if(!decodeInteger(block, pos, 7, index) || !lookup(index, field)){
+                return false;
+            }
+            headers.push_back(field);
+        } else if((byte & 0xe0) == 0x20){
+            // Dynamic table size update
+            if(!decodeInteger(block, pos, 5, index) || index > settings_max_table_size){
+                return false;
+            }
+            max_table_size = index;
+            shrinkTable(0);
+        } else{
+            // Literal with incremental indexing (01), without indexing (0000) or never indexed (0001)
+            bool indexing = (byte & 0xc0) == 0x40;
+            if(!decodeInteger(block, pos, indexing ? 6 : 4, index)){
+                return false;
+            }
+            if(index > 0){
+                if(!lookup(index, field)){
+                    return false;
+                }
+            } else if(!decodeString(block, pos, field.first)){
+                return false;
+            }
+            if(!decodeString(block, pos, field.second)){
+                return false;
+            }
+            if(indexing){
+                addEntry(field.first, field.second);
+            }
+            headers.push_back(field);
+        }
+    }
+    return true;
+}
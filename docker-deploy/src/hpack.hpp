@@ -0,0 +1,45 @@
+#ifndef _HPACK_HPP_
+#define _HPACK_HPP_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstdint>
+#include <stdexcept>
+
+using namespace std;
+
+typedef vector<pair<string, string>> HeaderList;
+
+/**
+ * HPACK (RFC 7541) header compression for the HTTP/2 connections.
+ *
+ * The encoder never adds entries to the dynamic table: every field is sent as an indexed
+ * field or a literal without indexing, Huffman-coded when that is shorter. This keeps the
+ * encoder stateless, so frames from many streams can be encoded without ordering concerns.
+ * The decoder implements the full specification, including the dynamic table.
+ */
+class Hpack {
+private:
+    deque<pair<string, string>> dynamic_table;
+    size_t table_size{0};
+    size_t max_table_size{4096};
+    size_t settings_max_table_size{4096};
+
+    void addEntry(const string& name, const string& value);
+    void shrinkTable(size_t room);
+    bool lookup(uint64_t index, pair<string, string>& field) const;
+
+public:
+    static void encodeInteger(string& out, uint64_t value, int prefix_bits, uint8_t first_byte);
+    static bool decodeInteger(const string& in, size_t& pos, int prefix_bits, uint64_t& value);
+    static void encodeString(string& out, const string& value);
+    static bool decodeString(const string& in, size_t& pos, string& value);
+    static string huffmanEncode(const string& in);
+    static bool huffmanDecode(const string& in, string& out);
+
+    static string encode(const HeaderList& headers);
+    bool decode(const string& block, HeaderList& headers);
+};
+
+#endif
@@ -14,14 +14,20 @@ std::string Logger::get_current_time() {
 
 /**
  * Constructs a `Logger` object and opens a log file for writing.
- * The log file is overwritten each time the logger is initialized due to `std::ios::trunc`.
+ * The log file is overwritten each time the logger is initialized due to `std::ios::trunc`,
+ * unless `append` is set (an upgraded process shares the file with the old one).
+ * Writes always go to the end of the file, so both processes can log during an upgrade.
  * @param filename The name of the log file to open.
+ * @param append Append to the file instead of overwriting it.
  *
  * Error Handling: 
  * If fail to open the log_gile, then report error and exit
  */
-Logger::Logger(const std::string &filename) {
-    log_file.open(filename, std::ios::trunc | std::ios::out);
+Logger::Logger(const std::string &filename, bool append) {
+    if (!append) {
+        std::ofstream(filename, std::ios::trunc | std::ios::out);
+    }
+    log_file.open(filename, std::ios::app | std::ios::out);
 
     if (!log_file.is_open()) {
         std::cerr << "Error opening log file: " << filename << std::endl;
@@ -39,6 +45,25 @@ Logger::~Logger() {
     }
 }
 
+/**
+ * Changes which `ERROR`/`NOTE` lines are written; the required request log lines are always written.
+ * Safe to call while other threads are logging.
+ *
+ * @param new_level One of `LOG_LEVEL_NONE`, `LOG_LEVEL_ERROR` or `LOG_LEVEL_NOTE`.
+ */
+void Logger::setLevel(int new_level) {
+    level = new_level;
+}
+
+/**
+ * Writes out buffered `ERROR`/`NOTE` lines.
+ * Called before `fork()`, so a child does not inherit and repeat them.
+ */
+void Logger::flush() {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    log_file.flush();
+}
+
 /**
  * Logs a message to the log file with a timestamp.
  * - Uses `std::lock_guard<std::mutex>` to ensure thread safety.
@@ -214,6 +239,7 @@ void Logger::log_tunnel_closed(int request_id) {
  * @param error_message The error message to log.
  */
 void Logger::log_error(int request_id, const std::string &error_message) {
+    if (level < LOG_LEVEL_ERROR) return;
     std::lock_guard<std::mutex> lock(log_mutex);
     if (!log_file.is_open()) return;
 
@@ -229,6 +255,7 @@ void Logger::log_error(int request_id, const std::string &error_message) {
  * @param error_message The note message to log.
  */
 void Logger::log_note(int request_id, const std::string &error_message) {
+    if (level < LOG_LEVEL_NOTE) return;
     std::lock_guard<std::mutex> lock(log_mutex);
     if (!log_file.is_open()) return;
 
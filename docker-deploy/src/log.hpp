@@ -6,6 +6,7 @@
 #include <string>
 #include <ctime>
 #include <mutex>
+#include <atomic>
 #include <sys/stat.h>
 #include "util.hpp"
 
@@ -13,14 +14,18 @@ class Logger {
 private:
     std::ofstream log_file;  
     std::mutex log_mutex;   
+    std::atomic<int> level{LOG_LEVEL_NOTE};
 
     std::string get_current_time();
 
 public:
-    explicit Logger(const std::string &filename);
+    explicit Logger(const std::string &filename, bool append = false);
 
     ~Logger();
 
+    void setLevel(int new_level);
+    void flush();
+
     void log(const std::string &message);
 
     /*
@@ -16,37 +16,110 @@ void signalHandler(int sig) {
     global_proxy->stop();
 }
 
+/**
+ * Handle SIGHUP: ask the proxy to reload its configuration file.
+ */
+void reloadHandler(int sig) {
+    global_proxy->requestReload();
+}
+
+/**
+ * Handle SIGUSR2: ask the proxy to hand over to a new copy of the binary.
+ */
+void upgradeHandler(int sig) {
+    global_proxy->requestUpgrade();
+}
+
 /**
  * Entry point for the HTTP proxy server.
  *
- * usage:  `./proxy <port>`
+ * usage:  `./proxy [<port>] [--config <file>] [--capture <file>]`
  *
  * The function:
- * - Reads the port number from command-line arguments.
+ * - Reads the configuration file given with `--config` (defaults are used without one).
+ * - Reads the port number from command-line arguments; it overrides the `port` setting.
+ * - With `--capture`, records client requests and origin responses to `file` for the `replay` tool.
  * - Initializes and starts the `Proxy` server.
- * - Handles termination signals (`SIGINT`) for a clean shutdown.
+ * - Handles termination signals (`SIGINT`) for a clean shutdown, `SIGHUP` to reload the configuration
+ *   and `SIGUSR2` to upgrade to the binary on disk without dropping connections.
+ * - When started by an upgrade (`PROXY_UPGRADE_SOCKET` set), takes the listening sockets and
+ *   the cache from the old process instead of binding.
  * - Catches and reports exceptions related to server initialization or runtime errors.
  */
 int main(int argc, char* argv[]) {
-    if(argc != 2){
-        std::cerr << "Port number should be included in arguments" << endl;
-        return 1;
+    string config_file;
+    string port_arg;
+    string capture_file;
+    for(int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if(arg == "--config" && i + 1 < argc){
+            config_file = argv[++i];
+        } else if(arg == "--capture" && i + 1 < argc){
+            capture_file = argv[++i];
+        } else if(port_arg.empty() && arg[0] != '-'){
+            port_arg = arg;
+        } else{
+            std::cerr << "usage: ./main [<port>] [--config <file>] [--capture <file>]" << endl;
+            return 1;
+        }
     }
-    
-    int port = stoi(argv[1]);
 
     try {
-        Proxy proxy(port);
+        Config config = config_file.empty() ? Config() : Config::load(config_file);
+        if(!port_arg.empty()){
+            config.port = stoi(port_arg);
+        } else if(config_file.empty()){
+            std::cerr << "Port number or config file should be included in arguments" << endl;
+            return 1;
+        }
+        if(!capture_file.empty()){
+            config.capture_file = capture_file;
+        }
+        if(config.workers > 0 && !config.capture_file.empty()){
+            std::cerr << "Traffic capture is not supported with workers" << endl;
+            return 1;
+        }
+
+        // Started by an upgrade: receive the listeners and the cache snapshot path
+        int channel_fd = -1;
+        vector<int> fds;
+        string snapshot;
+        const char* upgrade_socket = getenv(HANDOFF_ENV);
+        if(upgrade_socket != NULL){
+            channel_fd = Handoff::connectChannel(upgrade_socket);
+            Handoff::receiveFds(channel_fd, fds, snapshot);
+            unsetenv(HANDOFF_ENV);
+            if(fds.empty()){
+                throw runtime_error("No listening socket received from the old process");
+            }
+        }
+
+        Proxy proxy(config, config_file, fds.empty() ? -1 : fds[0], fds.size() > 1 ? fds[1] : -1);
+        if(!config.capture_file.empty()){
+            proxy.enableCapture(config.capture_file);
+        }
+        proxy.setCommandLine(vector<string>(argv, argv + argc));
         global_proxy = &proxy;
         signal(SIGINT, signalHandler);
-        
+        signal(SIGHUP, reloadHandler);
+        signal(SIGUSR2, upgradeHandler);
+        signal(SIGPIPE, SIG_IGN);   // a client or origin that went away is reported by send()
+
+        if(channel_fd >= 0){
+            if(!snapshot.empty()){
+                proxy.loadCacheSnapshot(snapshot);
+            }
+            Handoff::sendReady(channel_fd);
+            close(channel_fd);
+        }
+
         std::cout << "Proxy started. Press Ctrl+C to stop." << std::endl;
         proxy.run();
-        
-    } catch (const std::exception& e) { // If exception received, send error and stop the whole program using return 
+
+    } catch (const std::exception& e) { // If exception received, send error and stop the whole program using return
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
     }
-    
+
     return 0;
-}
\ No newline at end of file
+}
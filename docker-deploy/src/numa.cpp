@@ -0,0 +1,120 @@
+#include "numa.hpp"
+
+#define NUMA_SYSFS "/sys/devices/system/node"
+#define NUMA_MAX_NODES 64
+
+/**
+ * Parses a kernel CPU list such as `"0-3,8,10-11"`.
+ * @throws `std::invalid_argument` if the list is malformed.
+ */
+vector<int> Numa::parseCpuList(const string& list){
+    vector<int> cpus;
+    stringstream ss(list);
+    string range;
+    while(getline(ss, range, ',')){
+        range.erase(0, range.find_first_not_of(" \t\n"));
+        range.erase(range.find_last_not_of(" \t\n") + 1);
+        if(range.empty()){continue;}
+
+        size_t dash = range.find('-');
+        int first = stoi(range.substr(0, dash));
+        int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+        if(first < 0 || last < first){
+            throw invalid_argument("invalid CPU range " + range);
+        }
+        for(int cpu = first; cpu <= last; cpu++){
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * Lists the NUMA nodes and their CPUs, restricted to the CPUs this process may run on.
+ * @return One entry per node with allowed CPUs; at least one entry.
+ */
+vector<NumaNode> Numa::nodes(){
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    vector<NumaNode> nodes;
+    for(int node = 0; node < NUMA_MAX_NODES; node++){
+        ifstream file(string(NUMA_SYSFS) + "/node" + to_string(node) + "/cpulist");
+        if(!file.is_open()){continue;}
+        string list;
+        getline(file, list);
+
+        vector<int> cpus;
+        for(int cpu : parseCpuList(list)){
+            if(cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)){
+                cpus.push_back(cpu);
+            }
+        }
+        if(!cpus.empty()){
+            nodes.push_back({node, cpus});
+        }
+    }
+
+    if(nodes.empty()){
+        vector<int> cpus;
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+            if(CPU_ISSET(cpu, &allowed)){
+                cpus.push_back(cpu);
+            }
+        }
+        nodes.push_back({0, cpus});
+    }
+    return nodes;
+}
+
+/**
+ * Restricts the calling thread to `cpus`. Threads it creates afterwards inherit the mask.
+ * @return `true` on success.
+ */
+bool Numa::pinThread(const vector<int>& cpus){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int cpu : cpus){
+        if(cpu >= 0 && cpu < CPU_SETSIZE){
+            CPU_SET(cpu, &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/**
+ * Places a memory range on one NUMA node, moving pages that are already allocated.
+ * @return `true` on success; `false` on kernels without NUMA support.
+ */
+bool Numa::bindMemory(void* addr, size_t length, int node){
+    if(node < 0 || node >= NUMA_MAX_NODES){
+        return false;
+    }
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_mbind, addr, length, MPOL_BIND, &mask, NUMA_MAX_NODES + 1, MPOL_MF_MOVE) == 0;
+}
+
+/**
+ * Reads the per-node allocation counters from `numastat`.
+ * `numa_miss`/`other_node` count allocations served by a remote node, the closest thing to
+ * remote-access counters the kernel exposes without perf.
+ *
+ * @return One line per node: `node<N> numa_hit=... numa_miss=... ...`.
+ */
+string Numa::stats(){
+    stringstream out;
+    for(int node = 0; node < NUMA_MAX_NODES; node++){
+        ifstream file(string(NUMA_SYSFS) + "/node" + to_string(node) + "/numastat");
+        if(!file.is_open()){continue;}
+        out << "node" << node;
+        string name;
+        unsigned long long value;
+        while(file >> name >> value){
+            out << " " << name << "=" << value;
+        }
+        out << "\n";
+    }
+    string result = out.str();
+    return result.empty() ? "NUMA statistics not available\n" : result;
+}
@@ -0,0 +1,37 @@
+#ifndef _NUMA_HPP_
+#define _NUMA_HPP_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+using namespace std;
+
+struct NumaNode {
+    int id;
+    vector<int> cpus;
+};
+
+/**
+ * NUMA topology, CPU pinning and node-local memory, read from sysfs and set with raw
+ * system calls so the proxy does not need libnuma.
+ * A machine without NUMA support is reported as one node holding every allowed CPU.
+ */
+class Numa {
+public:
+    static vector<NumaNode> nodes();
+    static vector<int> parseCpuList(const string& list);
+
+    static bool pinThread(const vector<int>& cpus);
+    static bool bindMemory(void* addr, size_t length, int node);
+    static string stats();
+};
+
+#endif
@@ -0,0 +1,381 @@
+#include "parent.hpp"
+
+#define PARENT_IDLE_TIMEOUT 30      // seconds an idle pooled connection is kept
+
+string ParentProxy::key() const {
+    return (host.find(':') != string::npos ? "[" + host + "]" : host) + ":" + to_string(port);
+}
+
+ParentRoutes::ParentRoutes() : nodes(1) {}
+
+/**
+ * Parses `host`, `host:port` or `[ipv6]:port`.
+ * @throws `std::invalid_argument` for an empty host or a bad port.
+ */
+ParentProxy ParentRoutes::parseParent(const string& text){
+    ParentProxy parent;
+    string port;
+    if(!text.empty() && text[0] == '['){
+        size_t close = text.find(']');
+        if(close == string::npos){
+            throw invalid_argument("unterminated [ in parent " + text);
+        }
+        parent.host = text.substr(1, close - 1);
+        if(close + 1 < text.size()){
+            if(text[close + 1] != ':'){
+                throw invalid_argument("expected [address]:port, got " + text);
+            }
+            port = text.substr(close + 2);
+        }
+    } else{
+        size_t colon = text.rfind(':');
+        parent.host = text.substr(0, colon);
+        if(colon != string::npos){
+            port = text.substr(colon + 1);
+        }
+    }
+    if(parent.host.empty()){
+        throw invalid_argument("empty parent host in " + text);
+    }
+    if(!port.empty()){
+        parent.port = stoi(port);
+        if(parent.port <= 0 || parent.port > 65535){
+            throw invalid_argument("bad parent port in " + text);
+        }
+    }
+    return parent;
+}
+
+/**
+ * Compiles the `parent_routes` setting.
+ * @throws `std::invalid_argument` for a malformed or duplicate rule.
+ */
+ParentRoutes ParentRoutes::parse(const string& rules){
+    ParentRoutes compiled;
+    string text = rules;
+    replace(text.begin(), text.end(), ',', ' ');
+    istringstream ss(text);
+    string rule;
+    while(ss >> rule){
+        size_t equal = rule.find('=');
+        if(equal == string::npos || equal == 0 || equal + 1 == rule.size()){
+            throw invalid_argument("expected suffix=parent[|parent...] or suffix=direct, got " + rule);
+        }
+        string suffix = H2::toLower(rule.substr(0, equal));
+        string target = rule.substr(equal + 1);
+
+        vector<ParentProxy> parents;
+        if(target != "direct"){
+            size_t start = 0;
+            while(true){
+                size_t bar = target.find('|', start);
+                parents.push_back(parseParent(target.substr(start, bar == string::npos ? string::npos : bar - start)));
+                if(bar == string::npos){
+                    break;
+                }
+                start = bar + 1;
+            }
+        }
+
+        size_t node = 0;
+        if(suffix != "*"){
+            if(suffix.compare(0, 2, "*.") == 0){
+                suffix.erase(0, 2);
+            } else if(suffix[0] == '.'){
+                suffix.erase(0, 1);
+            }
+            if(!suffix.empty() && suffix.back() == '.'){
+                suffix.pop_back();
+            }
+            vector<string> labels;
+            istringstream split(suffix);
+            string label;
+            while(getline(split, label, '.')){
+                labels.push_back(label);
+            }
+            if(labels.empty() || suffix.back() == '.'){
+                throw invalid_argument("bad domain in " + rule);
+            }
+            for(auto it = labels.rbegin(); it != labels.rend(); it++){
+                if(it->empty()){
+                    throw invalid_argument("bad domain in " + rule);
+                }
+                auto child = compiled.nodes[node].children.find(*it);
+                if(child != compiled.nodes[node].children.end()){
+                    node = child->second;
+                    continue;
+                }
+                compiled.nodes.push_back(Node());
+                compiled.nodes[node].children[*it] = compiled.nodes.size() - 1;
+                node = compiled.nodes.size() - 1;
+            }
+        }
+        if(compiled.nodes[node].route >= 0){
+            throw invalid_argument("duplicate rule for " + suffix);
+        }
+        compiled.nodes[node].route = compiled.routes.size();
+        compiled.routes.push_back(parents);
+    }
+    return compiled;
+}
+
+/**
+ * @return The parents of the longest rule matching `host`, in failover order; empty if
+ *         the host goes direct.
+ */
+vector<ParentProxy> ParentRoutes::match(const string& host) const {
+    string name = H2::toLower(host);
+    if(!name.empty() && name.back() == '.'){
+        name.pop_back();
+    }
+    size_t node = 0;
+    int route = nodes[0].route;
+    size_t end = name.size();
+    while(end > 0){
+        size_t dot = name.rfind('.', end - 1);
+        size_t start = dot == string::npos ? 0 : dot + 1;
+        auto it = nodes[node].children.find(name.substr(start, end - start));
+        if(it == nodes[node].children.end()){
+            break;
+        }
+        node = it->second;
+        if(nodes[node].route >= 0){
+            route = nodes[node].route;
+        }
+        if(dot == string::npos){
+            break;
+        }
+        end = dot;
+    }
+    return route < 0 ? vector<ParentProxy>() : routes[route];
+}
+
+bool ParentRoutes::empty() const {
+    return routes.empty();
+}
+
+/**
+ * @param connector Opens the TCP connection to a parent (the proxy's `connectServer()`).
+ */
+ParentPool::ParentPool(function<int(const string&, int)> connector, unique_ptr<Logger>& logger)
+    : connector(connector), logger(logger), routes(make_shared<const ParentRoutes>()) {}
+
+ParentPool::~ParentPool(){
+    lock_guard<mutex> lock(pool_mutex);
+    for(auto& entry : idle){
+        for(Idle& connection : entry.second){
+            close(connection.fd);
+        }
+    }
+    idle.clear();
+}
+
+/**
+ * Compiles `rules` (the `parent_routes` setting) and swaps them in for new requests.
+ * Invalid rules are logged and leave no routes, so every request goes direct; the config
+ * loader rejects them before they get here.
+ */
+void ParentPool::configure(const string& rules){
+    shared_ptr<const ParentRoutes> compiled;
+    try{
+        compiled = make_shared<const ParentRoutes>(ParentRoutes::parse(rules));
+    } catch(const exception& e){
+        logger->log_error(-1, string("Invalid parent_routes, going direct: ") + e.what());
+        compiled = make_shared<const ParentRoutes>();
+    }
+    atomic_store(&routes, compiled);
+}
+
+/**
+ * @return The parents `host` is routed through, in failover order; empty if it goes direct.
+ */
+vector<ParentProxy> ParentPool::route(const string& host) const {
+    shared_ptr<const ParentRoutes> current = atomic_load(&routes);
+    if(current->empty()){
+        return vector<ParentProxy>();
+    }
+    return current->match(host);
+}
+
+bool ParentPool::isDown(const string& key){
+    lock_guard<mutex> lock(pool_mutex);
+    auto it = down_until.find(key);
+    if(it == down_until.end()){
+        return false;
+    }
+    if(chrono::steady_clock::now() >= it->second){
+        down_until.erase(it);
+        return false;
+    }
+    return true;
+}
+
+void ParentPool::markDown(const string& key, double retry_time){
+    lock_guard<mutex> lock(pool_mutex);
+    down_until[key] = chrono::steady_clock::now() +
+        chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(retry_time));
+}
+
+/**
+ * Returns a connection to `parent`: the most recently used idle one that is still open
+ * if `pooled`, otherwise a new one.
+ * @param reused Set if the connection came from the pool.
+ * @return The socket, or -1 if the parent cannot be reached.
+ */
+int ParentPool::acquire(const ParentProxy& parent, bool pooled, bool& reused){
+    reused = false;
+    if(pooled){
+        lock_guard<mutex> lock(pool_mutex);
+        auto& connections = idle[parent.key()];
+        auto now = chrono::steady_clock::now();
+        while(!connections.empty()){
+            Idle connection = connections.back();
+            connections.pop_back();
+            // An idle connection has nothing to read unless the parent closed it
+            struct pollfd pfd = {connection.fd, POLLIN, 0};
+            if(now - connection.last_used < chrono::seconds(PARENT_IDLE_TIMEOUT) && poll(&pfd, 1, 0) == 0){
+                reused = true;
+                reuses++;
+                return connection.fd;
+            }
+            close(connection.fd);
+        }
+    }
+    return connector(parent.host, parent.port);
+}
+
+/**
+ * Puts a connection whose last response was read completely back in the idle pool,
+ * closing the oldest idle connections beyond `max_idle` for the parent.
+ */
+void ParentPool::release(const string& key, int fd, size_t max_idle){
+    lock_guard<mutex> lock(pool_mutex);
+    auto& connections = idle[key];
+    connections.push_back({fd, chrono::steady_clock::now()});
+    while(connections.size() > max_idle){
+        close(connections.front().fd);
+        connections.erase(connections.begin());
+    }
+}
+
+/**
+ * Returns a socket to send one request for `host:port` through the first reachable
+ * parent in `parents`. The connection to the parent is made (or taken from the pool)
+ * before returning, so failover happens here.
+ *
+ * @param max_idle Idle connections kept per parent.
+ * @param timeout Seconds to wait for the request from the proxy.
+ * @param retry_time Seconds a parent that could not be reached is skipped.
+ * @return The socket, or -1 if no parent could be reached.
+ */
+int ParentPool::open(const vector<ParentProxy>& parents, const string& host, int port, size_t max_idle,
+                     double timeout, double retry_time){
+    // Parents marked down go last, so they are only tried when all the others fail
+    vector<const ParentProxy*> order, down;
+    for(const ParentProxy& parent : parents){
+        (isDown(parent.key()) ? down : order).push_back(&parent);
+    }
+    order.insert(order.end(), down.begin(), down.end());
+
+    for(const ParentProxy* parent : order){
+        bool reused;
+        int parent_fd = acquire(*parent, true, reused);
+        if(parent_fd < 0){
+            logger->log_error(-1, "Parent proxy " + parent->key() + " unreachable, skipping it for " +
+                              to_string((int)retry_time) + " seconds");
+            markDown(parent->key(), retry_time);
+            continue;
+        }
+        if(parent != &parents[0]){
+            failovers++;
+        }
+        int pair[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0){
+            close(parent_fd);
+            return -1;
+        }
+        struct timeval tv;
+        tv.tv_sec = (time_t)timeout;
+        tv.tv_usec = (suseconds_t)((timeout - tv.tv_sec) * 1000000);
+        setsockopt(pair[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        requests++;
+        thread(&ParentPool::carry, this, *parent, parent_fd, reused, pair[1], host, port, max_idle, timeout).detach();
+        return pair[0];
+    }
+    return -1;
+}
+
+/**
+ * Carries one request to the parent and writes the response back.
+ * A pooled connection the parent closed before answering is replaced by a new one once;
+ * the request had not been processed, so this is safe for POST as well.
+ */
+void ParentPool::carry(ParentProxy parent, int parent_fd, bool reused, int fd, string host, int port,
+                       size_t max_idle, double timeout){
+    string head, body;
+    if(!H2Pool::readRequest(fd, timeout, head, body)){
+        release(parent.key(), parent_fd, max_idle);
+        close(fd);
+        return;
+    }
+    string method;
+    string request = toAbsoluteForm(head, host, port, method) + body;
+
+    while(parent_fd >= 0){
+        bool reusable = false;
+        bool started = false;
+        bool complete = exchange(parent_fd, request, method, fd, reusable, started);
+        if(complete && reusable){
+            release(parent.key(), parent_fd, max_idle);
+        } else{
+            close(parent_fd);
+        }
+        parent_fd = -1;
+        if(complete || started || !reused){
+            break;
+        }
+        logger->log_note(-1, "Pooled connection to parent " + parent.key() + " was closed, reconnecting");
+        parent_fd = acquire(parent, false, reused);
+    }
+    close(fd);  // EOF ends the response, as with an origin that closes the connection
+}
+
+/**
+ * Sends the request to the parent and relays the response to `fd`; see `TlsPool::relayResponse()`.
+ */
+bool ParentPool::exchange(int parent_fd, const string& request, const string& method, int fd,
+                          bool& reusable, bool& started){
+    if(!H2::sendAll(parent_fd, request.data(), request.size())){
+        return false;
+    }
+    return TlsPool::relayResponse([parent_fd](char* buffer, size_t size){
+        return recv(parent_fd, buffer, size, 0);
+    }, method, fd, reusable, started);
+}
+
+/**
+ * Rewrites the proxy's request head for a parent: an origin-form target becomes absolute
+ * form (`http://host:port/path`) and the connection is asked to stay open.
+ * @param method Set to the request method.
+ */
+string ParentPool::toAbsoluteForm(const string& head, const string& host, int port, string& method){
+    return TlsPool::keepAliveHead(head, method, [&host, port](const string& target){
+        if(target.find("://") != string::npos){
+            return target;
+        }
+        return "http://" + host + (port != 80 ? ":" + to_string(port) : "") + target;
+    });
+}
+
+/**
+ * Counts the idle parent connections kept for reuse.
+ */
+size_t ParentPool::idleConnections(){
+    lock_guard<mutex> lock(pool_mutex);
+    size_t count = 0;
+    for(auto& entry : idle){
+        count += entry.second.size();
+    }
+    return count;
+}
@@ -0,0 +1,120 @@
+#ifndef _PARENT_HPP_
+#define _PARENT_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "h2pool.hpp"
+#include "tls.hpp"
+#include "log.hpp"
+
+using namespace std;
+
+#define PARENT_DEFAULT_PORT 3128
+
+/**
+ * One parent proxy (`host:port`).
+ */
+struct ParentProxy {
+    string host;
+    int port{PARENT_DEFAULT_PORT};
+
+    string key() const;
+};
+
+/**
+ * The `parent_routes` rules compiled into a trie of domain labels, read from the right
+ * (`www.example.com` is looked up as `com`, `example`, `www`), so a lookup costs one step
+ * per label of the host whatever the number of rules.
+ *
+ * A rule is `suffix=parent[|parent...]` or `suffix=direct`; rules are separated by
+ * spaces or commas. A suffix matches the domain itself and all its subdomains, the
+ * longest matching suffix wins, and `*` matches every host. Parents are listed in
+ * failover order.
+ */
+class ParentRoutes {
+private:
+    struct Node {
+        unordered_map<string, size_t> children;
+        int route{-1};                      // index into `routes`, -1 = no rule ends here
+    };
+
+    vector<Node> nodes;                     // nodes[0] is the root
+    vector<vector<ParentProxy>> routes;     // empty = direct
+
+    static ParentProxy parseParent(const string& text);
+
+public:
+    ParentRoutes();
+
+    static ParentRoutes parse(const string& rules);
+    vector<ParentProxy> match(const string& host) const;
+    bool empty() const;
+};
+
+/**
+ * Sends requests for the domains in `parent_routes` through parent proxies.
+ *
+ * `open()` hands out one end of a socketpair that behaves like a connection from
+ * `connectServer()`, as `TlsPool::open()` does: the proxy writes an HTTP/1.1 request and
+ * reads the response until EOF. A thread per request forwards it to the parent in
+ * absolute form over a keep-alive connection, which goes back to a per-parent idle pool
+ * once the response is complete.
+ *
+ * The parents of a route are tried in order. One that refuses the connection is skipped
+ * for `retry_time` seconds, unless all of them are down.
+ */
+class ParentPool {
+private:
+    struct Idle {
+        int fd;
+        chrono::steady_clock::time_point last_used;
+    };
+
+    function<int(const string&, int)> connector;
+    unique_ptr<Logger>& logger;
+    shared_ptr<const ParentRoutes> routes;
+    mutex pool_mutex;
+    map<string, vector<Idle>> idle;
+    map<string, chrono::steady_clock::time_point> down_until;
+
+    int acquire(const ParentProxy& parent, bool pooled, bool& reused);
+    void release(const string& key, int fd, size_t max_idle);
+    bool isDown(const string& key);
+    void markDown(const string& key, double retry_time);
+    void carry(ParentProxy parent, int parent_fd, bool reused, int fd, string host, int port,
+               size_t max_idle, double timeout);
+    bool exchange(int parent_fd, const string& request, const string& method, int fd,
+                  bool& reusable, bool& started);
+
+    static string toAbsoluteForm(const string& head, const string& host, int port, string& method);
+
+public:
+    atomic<size_t> requests{0};             // requests sent to a parent
+    atomic<size_t> reuses{0};               // requests sent on a pooled connection
+    atomic<size_t> failovers{0};            // connections that went to a later parent
+
+    ParentPool(function<int(const string&, int)> connector, unique_ptr<Logger>& logger);
+    ~ParentPool();
+
+    void configure(const string& rules);
+    vector<ParentProxy> route(const string& host) const;
+    int open(const vector<ParentProxy>& parents, const string& host, int port, size_t max_idle,
+             double timeout, double retry_time);
+    size_t idleConnections();
+};
+
+#endif
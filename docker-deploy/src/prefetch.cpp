@@ -0,0 +1,255 @@
+#include "prefetch.hpp"
+
+Prefetcher::Prefetcher(function<void(const string&)> fetcher) : fetcher(fetcher) {}
+
+Prefetcher::~Prefetcher(){
+    {
+        lock_guard<mutex> lock(prefetch_mutex);
+        stopping = true;
+        queue.clear();
+    }
+    wake.notify_all();
+    for(thread& worker : workers){
+        worker.join();
+    }
+}
+
+/**
+ * @return `scheme://authority` of an absolute URL, or an empty string.
+ */
+string Prefetcher::originOf(const string& url){
+    size_t scheme = url.find("://");
+    if(scheme == string::npos){
+        return "";
+    }
+    size_t end = url.find_first_of("/?#", scheme + 3);
+    return url.substr(0, end);
+}
+
+/**
+ * Resolves a link of a page to an absolute URL without its fragment.
+ * @return An empty string for links that are not fetched (`data:`, `javascript:`, ...).
+ */
+string Prefetcher::resolve(const string& page_url, const string& link){
+    string target = link.substr(0, link.find('#'));
+    if(target.empty()){
+        return "";
+    }
+    if(target.compare(0, 7, "http://") == 0 || target.compare(0, 8, "https://") == 0){
+        return target;
+    }
+    if(target.compare(0, 2, "//") == 0){
+        return page_url.substr(0, page_url.find("://") + 1) + target;
+    }
+    size_t colon = target.find(':');
+    if(colon != string::npos && colon < target.find_first_of("/?")){
+        return "";                          // another scheme
+    }
+    string origin = originOf(page_url);
+    if(target[0] == '/'){
+        return origin + target;
+    }
+    string path = page_url.substr(origin.size());
+    path = path.substr(0, path.find_first_of("?#"));
+    size_t slash = path.rfind('/');
+    return origin + (slash == string::npos ? "/" : path.substr(0, slash + 1)) + target;
+}
+
+/**
+ * @param tag A start tag, from `<` to `>`.
+ * @param name A lowercase attribute name.
+ * @return The attribute's value with `&amp;` decoded, or an empty string.
+ */
+string Prefetcher::attribute(const string& tag, const string& name){
+    string lower = tag;
+    transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    for(size_t at = lower.find(name); at != string::npos; at = lower.find(name, at + 1)){
+        size_t equals = at + name.size();
+        while(equals < lower.size() && isspace((unsigned char)lower[equals])){
+            equals++;
+        }
+        if(!isspace((unsigned char)lower[at - 1]) || equals >= lower.size() || lower[equals] != '='){
+            continue;
+        }
+        size_t start = equals + 1;
+        while(start < tag.size() && isspace((unsigned char)tag[start])){
+            start++;
+        }
+        if(start >= tag.size()){
+            return "";
+        }
+        string value;
+        if(tag[start] == '"' || tag[start] == '\''){
+            size_t end = tag.find(tag[start], start + 1);
+            value = end == string::npos ? "" : tag.substr(start + 1, end - start - 1);
+        } else{
+            size_t end = tag.find_first_of(" \t\r\n>", start);
+            value = tag.substr(start, end == string::npos ? string::npos : end - start);
+        }
+        for(size_t amp = value.find("&amp;"); amp != string::npos; amp = value.find("&amp;", amp + 1)){
+            value.erase(amp + 1, 4);
+        }
+        return value;
+    }
+    return "";
+}
+
+/**
+ * Finds the subresources of a page on its own origin.
+ *
+ * @param page_url The page's absolute URL.
+ * @param html The page's body; only the first `PREFETCH_SCAN_BYTES` are searched.
+ * @param link_header The page's `Link` header, possibly empty.
+ * @param limit The most URLs returned.
+ * @return Absolute URLs, in document order, without duplicates.
+ */
+vector<string> Prefetcher::extract(const string& page_url, const string& html, const string& link_header, size_t limit){
+    vector<string> links;
+
+    // Link: </app.css>; rel=preload; as=style, </app.js>; rel=preload
+    for(size_t open = link_header.find('<'); open != string::npos; open = link_header.find('<', open + 1)){
+        size_t close = link_header.find('>', open);
+        if(close == string::npos){
+            break;
+        }
+        size_t next = link_header.find('<', close);
+        string params = link_header.substr(close, next == string::npos ? string::npos : next - close);
+        transform(params.begin(), params.end(), params.begin(), ::tolower);
+        if(params.find("preload") != string::npos){
+            links.push_back(link_header.substr(open + 1, close - open - 1));
+        }
+    }
+
+    string lower = html.substr(0, PREFETCH_SCAN_BYTES);
+    transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    for(size_t open = lower.find('<'); open != string::npos; open = lower.find('<', open + 1)){
+        size_t close = lower.find('>', open);
+        if(close == string::npos){
+            break;
+        }
+        string tag = html.substr(open, close - open + 1);
+        if(lower.compare(open, 5, "<link") == 0 && isspace((unsigned char)lower[open + 5])){
+            string rel = attribute(tag, "rel");
+            transform(rel.begin(), rel.end(), rel.begin(), ::tolower);
+            if(rel.find("stylesheet") != string::npos || rel.find("preload") != string::npos){
+                links.push_back(attribute(tag, "href"));
+            }
+        } else if((lower.compare(open, 7, "<script") == 0 && isspace((unsigned char)lower[open + 7])) ||
+                  (lower.compare(open, 4, "<img") == 0 && isspace((unsigned char)lower[open + 4]))){
+            links.push_back(attribute(tag, "src"));
+        }
+    }
+
+    string origin = originOf(page_url);
+    vector<string> urls;
+    set<string> seen;
+    for(const string& link : links){
+        string url = resolve(page_url, link);
+        if(url.empty() || originOf(url) != origin || url == page_url || !seen.insert(url).second){
+            continue;
+        }
+        urls.push_back(url);
+        if(urls.size() >= limit){
+            break;
+        }
+    }
+    return urls;
+}
+
+/**
+ * Queues `urls` for prefetching, skipping those already queued.
+ * @param per_origin The most prefetches in flight to one origin.
+ */
+void Prefetcher::enqueue(const vector<string>& urls, size_t per_origin){
+    lock_guard<mutex> lock(prefetch_mutex);
+    if(stopping){
+        return;
+    }
+    this->per_origin = max<size_t>(per_origin, 1);
+    for(const string& url : urls){
+        if(pending.count(url)){
+            continue;
+        }
+        if(queue.size() >= PREFETCH_QUEUE_MAX){
+            dropped++;
+            continue;
+        }
+        queue.push_back({originOf(url), url});
+        pending.insert(url);
+        queued++;
+    }
+    while(workers.size() < PREFETCH_THREADS && !queue.empty()){
+        workers.emplace_back(&Prefetcher::work, this);
+    }
+    wake.notify_all();
+}
+
+/**
+ * A prefetch thread: fetches the first queued URL whose origin is under its budget.
+ */
+void Prefetcher::work(){
+    unique_lock<mutex> lock(prefetch_mutex);
+    while(true){
+        auto job = queue.end();
+        wake.wait(lock, [&]{
+            job = find_if(queue.begin(), queue.end(), [&](const Job& candidate){
+                auto busy = in_flight.find(candidate.origin);
+                return busy == in_flight.end() || busy->second < per_origin;
+            });
+            return stopping || job != queue.end();
+        });
+        if(stopping){
+            return;
+        }
+        Job current = *job;
+        queue.erase(job);
+        in_flight[current.origin]++;
+        lock.unlock();
+        try{
+            fetcher(current.url);
+        } catch(const exception&){
+            // a failed prefetch costs nothing but the attempt
+        }
+        fetched++;
+        lock.lock();
+        if(--in_flight[current.origin] == 0){
+            in_flight.erase(current.origin);
+        }
+        pending.erase(current.url);
+        wake.notify_all();
+    }
+}
+
+/**
+ * Records that a prefetch put the response for `key` in the cache.
+ */
+void Prefetcher::stored(const string& key){
+    lock_guard<mutex> lock(prefetch_mutex);
+    stored_count++;
+    if(!prefetched.insert(key).second){
+        return;
+    }
+    prefetched_order.push_back(key);
+    if(prefetched_order.size() > PREFETCH_REMEMBERED){
+        prefetched.erase(prefetched_order.front());
+        prefetched_order.pop_front();
+    }
+}
+
+/**
+ * Counts a client's cache hit on `key` if a prefetch stored it and it was not hit before.
+ * @return Whether the hit was on a prefetched entry.
+ */
+bool Prefetcher::hit(const string& key){
+    lock_guard<mutex> lock(prefetch_mutex);
+    if(prefetched.erase(key) == 0){
+        return false;
+    }
+    useful++;
+    return true;
+}
+
+size_t Prefetcher::queueLength(){
+    lock_guard<mutex> lock(prefetch_mutex);
+    return queue.size();
+}
@@ -0,0 +1,77 @@
+#ifndef _PREFETCH_HPP_
+#define _PREFETCH_HPP_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+
+#define PREFETCH_THREADS 4              // fetches in flight over all origins
+#define PREFETCH_QUEUE_MAX 256          // URLs waiting; more are dropped
+#define PREFETCH_SCAN_BYTES 262144      // bytes of a page searched for links
+#define PREFETCH_REMEMBERED 4096        // prefetched cache keys kept to count hits
+
+/**
+ * Warms the cache with the stylesheets, scripts and images of the HTML pages that pass
+ * through it, before the browser asks for them.
+ *
+ * `extract()` finds the same-site subresources of a page (`<link rel=stylesheet|preload>`,
+ * `<script src>`, `<img src>` and `Link: <...>; rel=preload` headers), and `enqueue()`
+ * queues them for a pool of `PREFETCH_THREADS` threads, started on first use, that fetch
+ * each through `fetcher`. No more than `per_origin` fetches go to one origin at a time.
+ *
+ * A prefetch is useful if its cache entry is later hit by a client: `stored()` records
+ * the entries the prefetches put in the cache and `hit()` counts the first hit on each.
+ */
+class Prefetcher {
+private:
+    struct Job {
+        string origin;                      // scheme://host[:port]
+        string url;
+    };
+
+    function<void(const string&)> fetcher;
+    mutex prefetch_mutex;
+    condition_variable wake;
+    deque<Job> queue;
+    set<string> pending;                    // URLs queued or being fetched
+    map<string, size_t> in_flight;          // fetches per origin
+    size_t per_origin{2};
+    set<string> prefetched;                 // cache keys stored by a prefetch, not hit yet
+    deque<string> prefetched_order;
+    vector<thread> workers;
+    bool stopping{false};
+
+    void work();
+    static string originOf(const string& url);
+    static string resolve(const string& page_url, const string& link);
+    static string attribute(const string& tag, const string& name);
+
+public:
+    atomic<size_t> queued{0};               // URLs queued for prefetching
+    atomic<size_t> dropped{0};              // URLs not queued because the queue was full
+    atomic<size_t> fetched{0};              // prefetches that completed
+    atomic<size_t> stored_count{0};         // ... and put a response in the cache
+    atomic<size_t> useful{0};               // prefetched entries later hit by a client
+
+    explicit Prefetcher(function<void(const string&)> fetcher);
+    ~Prefetcher();
+
+    static vector<string> extract(const string& page_url, const string& html, const string& link_header, size_t limit);
+    void enqueue(const vector<string>& urls, size_t per_origin);
+    void stored(const string& key);
+    bool hit(const string& key);
+    size_t queueLength();
+};
+
+#endif
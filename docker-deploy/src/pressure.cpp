@@ -0,0 +1,87 @@
+#include "pressure.hpp"
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+/**
+ * Finds the cgroup v2 directory of this process from the `0::<path>` line of `/proc/self/cgroup`.
+ * Containers usually see their own cgroup as the root, so `/sys/fs/cgroup` is tried as well.
+ */
+MemoryPressure::MemoryPressure(){
+    ifstream file("/proc/self/cgroup");
+    string line;
+    while(getline(file, line)){
+        if(line.compare(0, 3, "0::") == 0){
+            string dir = CGROUP_ROOT + line.substr(3);
+            if(access((dir + "/memory.max").c_str(), R_OK) == 0){
+                cgroup_dir = dir;
+            }
+        }
+    }
+    if(cgroup_dir.empty() && access(CGROUP_ROOT "/memory.max", R_OK) == 0){
+        cgroup_dir = CGROUP_ROOT;
+    }
+}
+
+/**
+ * Reads a file holding a single number.
+ * @return `false` if the file is missing or holds something else (such as `max`).
+ */
+bool MemoryPressure::readNumber(const string& path, size_t& value){
+    ifstream file(path);
+    unsigned long long number;
+    if(!(file >> number)){
+        return false;
+    }
+    value = number;
+    return true;
+}
+
+/**
+ * Retrieves the memory limit in bytes: `memory.max`, or the machine's memory when the
+ * cgroup is unlimited or unknown.
+ */
+size_t MemoryPressure::limit() const{
+    size_t value = 0;
+    if(!cgroup_dir.empty() && readNumber(cgroup_dir + "/memory.max", value)){
+        return value;
+    }
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    return pages > 0 && page_size > 0 ? (size_t)pages * page_size : 0;
+}
+
+/**
+ * Retrieves the cgroup's memory usage (`memory.current`) in bytes, or 0 if unknown.
+ */
+size_t MemoryPressure::current() const{
+    size_t value = 0;
+    if(!cgroup_dir.empty()){
+        readNumber(cgroup_dir + "/memory.current", value);
+    }
+    return value;
+}
+
+/**
+ * Retrieves the share of the last 10 seconds in which some task stalled on memory
+ * (PSI `some avg10`), as a percentage.
+ * @return The percentage, or -1 if PSI is not available.
+ */
+double MemoryPressure::pressure() const{
+    ifstream file(cgroup_dir.empty() ? "/proc/pressure/memory" : cgroup_dir + "/memory.pressure");
+    if(!file.is_open()){
+        file.open("/proc/pressure/memory");
+    }
+    string line;
+    while(getline(file, line)){
+        if(line.compare(0, 5, "some ") != 0){continue;}
+        size_t pos = line.find("avg10=");
+        if(pos != string::npos){
+            return stod(line.substr(pos + 6));
+        }
+    }
+    return -1;
+}
+
+const string& MemoryPressure::cgroupDir() const{
+    return cgroup_dir;
+}
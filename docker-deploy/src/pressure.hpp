@@ -0,0 +1,32 @@
+#ifndef _PRESSURE_HPP_
+#define _PRESSURE_HPP_
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <unistd.h>
+
+using namespace std;
+
+/**
+ * Reads the memory limit, usage and PSI memory pressure of the proxy's cgroup (v2).
+ * Outside a cgroup v2 hierarchy the limit is the machine's memory and the pressure is
+ * taken from `/proc/pressure/memory`; values that cannot be read are reported as 0 / -1.
+ */
+class MemoryPressure {
+private:
+    string cgroup_dir;
+
+    static bool readNumber(const string& path, size_t& value);
+
+public:
+    MemoryPressure();
+
+    size_t limit() const;
+    size_t current() const;
+    double pressure() const;
+    const string& cgroupDir() const;
+};
+
+#endif
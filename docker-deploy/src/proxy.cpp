@@ -1,5 +1,22 @@
 #include "proxy.hpp"
 
+#define WORKER_REQUEST_ID_STRIDE 100000000
+#define CACHE_MIN_BUDGET (1 << 20)
+
+// Bytes read from origins by the current connection thread, charged to the client's byte bucket
+thread_local size_t origin_bytes = 0;
+// Origin addresses the request being served on this thread holds (see Balancer::connected())
+thread_local vector<string> balancer_leases;
+thread_local bool serving_request = false;
+// Why the last connectServer() on this thread failed, for the failure cache: 502 (name not
+// resolved, connections refused) or 504 (connections timed out); 0 after a success
+thread_local int connect_failure = 0;
+thread_local string connect_failure_reason;
+// Whether this thread is running a prefetch rather than a client's request
+thread_local bool prefetching = false;
+// ACL_* actions of the client whose request this thread is serving
+thread_local int client_access = 0;
+
 /**
  * Generates a unique request ID for tracking and logging each HTTP request processed by the proxy.
  * Increment every time new request is made
@@ -9,6 +26,14 @@ int Proxy::generateRequestID(){
     return request_count++;
 }
 
+/**
+ * Returns the configuration currently in effect.
+ * A reload swaps the whole snapshot, so a caller always sees one consistent configuration.
+ */
+shared_ptr<const Config> Proxy::currentConfig() const {
+    return atomic_load(&config);
+}
+
 /**
  * Receives data from a socket (both cliend and server) with a specified timeout.
  *
@@ -26,16 +51,16 @@ int Proxy::generateRequestID(){
  *
  * @throws `std::runtime_error` if `poll()` fails.
  */
-string Proxy::receiveFromSocket(int socket_fd, int timeout){
+string Proxy::receiveFromSocket(int socket_fd, double timeout){
     string received_data;
-    char buffer[65536];
+    vector<char> buffer(currentConfig()->buffer_size);
 
     struct pollfd fd;
     fd.fd = socket_fd;
     fd.events = POLLIN;
 
     while(true){
-        int rv = poll(&fd, 1, timeout * 1000); // wait for socket to receive data
+        int rv = poll(&fd, 1, (int)(timeout * 1000)); // wait for socket to receive data
 
         if(rv == -1){
             throw runtime_error("Error in poll");
@@ -43,7 +68,7 @@ string Proxy::receiveFromSocket(int socket_fd, int timeout){
             break;
         }
 
-        int bytes_received = recv(socket_fd, buffer, sizeof(buffer) - 1, 0);
+        int bytes_received = recv(socket_fd, buffer.data(), buffer.size() - 1, 0);
     
     if (bytes_received < 0) {
         perror("recv");  // Print exact error
@@ -54,11 +79,11 @@ string Proxy::receiveFromSocket(int socket_fd, int timeout){
         break;
     }
 
-        buffer[bytes_received] = '\0';
         // When new contents are received, append to the total received data
-        received_data.append(buffer, bytes_received);
+        received_data.append(buffer.data(), bytes_received);
+        origin_bytes += bytes_received;
 
-        if(bytes_received < (int)sizeof(buffer) - 1){
+        if(bytes_received < (int)buffer.size() - 1){
             break;
         }
     }
@@ -80,19 +105,19 @@ string Proxy::receiveFromSocket(int socket_fd, int timeout){
  */
 vector<char> Proxy::handleChunkResponse(int server_fd, int client_fd){
     vector<char> response; // vector to store binary reponse characters
-    char buffer[65536];
+    vector<char> buffer(currentConfig()->buffer_size);
     int byte_received;
 
     while(true){
-        memset(buffer, 0, sizeof(buffer));
-        byte_received = recv(server_fd, buffer, sizeof(buffer), 0); // receive from server
+        byte_received = recv(server_fd, buffer.data(), buffer.size(), 0); // receive from server
 
         if(byte_received <= 0){
             break;
         }
 
-        response.insert(response.end(), buffer, buffer + byte_received);
-        send(client_fd, buffer, byte_received, 0); // send to client immediately after received
+        response.insert(response.end(), buffer.begin(), buffer.begin() + byte_received);
+        origin_bytes += byte_received;
+        send(client_fd, buffer.data(), byte_received, 0); // send to client immediately after received
 
         // Test if end of the chunked response is received, if so, then break receiving loop
         if(response.size() >= 5){
@@ -119,33 +144,67 @@ vector<char> Proxy::handleChunkResponse(int server_fd, int client_fd){
  */
 vector<char> Proxy::handleLongResponse(int server_fd){
     vector<char> response;
-    char buffer[65536];
+    vector<char> buffer(currentConfig()->buffer_size);
     int byte_received;
 
     while(true){
-        memset(buffer, 0, sizeof(buffer));
-        byte_received = recv(server_fd, buffer, sizeof(buffer), 0);
+        byte_received = recv(server_fd, buffer.data(), buffer.size(), 0);
 
         if(byte_received <= 0){break;}
-        response.insert(response.end(), buffer, buffer + byte_received);
+        response.insert(response.end(), buffer.begin(), buffer.begin() + byte_received);
+        origin_bytes += byte_received;
     }
 
     return response;
 }
 
+/**
+ * Connects `fd` to `address`, giving up after `timeout` seconds.
+ * @param timed_out Set if the connection did not complete within `timeout`.
+ * @return `false` if the connection failed or timed out.
+ */
+static bool connectWithin(int fd, const struct sockaddr* address, socklen_t length, double timeout, bool& timed_out){
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    bool connected = connect(fd, address, length) == 0;
+    timed_out = false;
+    if(!connected && errno == EINPROGRESS){
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        int ready = poll(&pfd, 1, (int)(timeout * 1000));
+        if(ready == 1){
+            int error = 0;
+            socklen_t error_length = sizeof(error);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+            connected = error == 0;
+        }
+        timed_out = ready == 0;
+    }
+    fcntl(fd, F_SETFL, flags);
+    return connected;
+}
+
 /**
  * Establishes a connection to the origin server (as a client).
  * - Uses `getaddrinfo()` to resolve the server's address information.
  * - Iterates through the resolved addresses, attempting to create and connect a socket.
+ * - Gives up on an address after `origin_timeout` seconds, or with `adaptive_timeouts` on,
+ *   after a few times the origin's p99 connect time.
+ * - With `upstream_balance` set, tries the addresses in the order `Balancer::order()` ranks them.
  * - If a connection attempt fails, it tries the next available address.
- * - Sets a **10-second receive timeout** on the socket using `setsockopt()`.
+ * - Records why it failed in `connect_failure`, for the failure cache.
+ * - Sets the `origin_timeout` receive timeout (10 seconds by default) on the socket using `setsockopt()`.
  * - Returns `server_fd` on success, otherwise logs an error and returns `-1`.
  *
  * @param host The hostname or IP address of the server to connect to.
  * @param port The port number to connect to on the server.
+ * @param first_address Index of the resolved address to try first (wrapping around), so a
+ *        retry starts on a different address.
+ * @param address_count If set, receives the number of addresses the host resolved to.
  * @return The socket file descriptor (`server_fd`) for the connected server, or `-1` if the connection fails.
  */
-int Proxy::connectServer(const string& host, int port){
+int Proxy::connectServer(const string& host, int port, size_t first_address, size_t* address_count){
     struct addrinfo server_info, *server_info_list, *p;
     int server_fd;
 
@@ -154,27 +213,74 @@ int Proxy::connectServer(const string& host, int port){
     server_info.ai_socktype = SOCK_STREAM;
 
     string port_str = to_string(port);
+    shared_ptr<const Config> cfg = currentConfig();
+    double timeout = cfg->origin_timeout;
+    string origin = host + ":" + port_str;
+    double connect_timeout = cfg->adaptive_timeouts ? origin_health.connectTimeout(origin, timeout) : timeout;
 
+    connect_failure = 0;
     int status = getaddrinfo(host.c_str(), port_str.c_str(), &server_info, &server_info_list); // server_info a link list of server addr
     if (status != 0) {
         logger->log_error(-1, "Failed to get address info: " + std::string(gai_strerror(status))); 
+        connect_failure = 502;
+        connect_failure_reason = "Could not resolve " + host + ": " + gai_strerror(status);
         return -1;
     }
 
+    vector<struct addrinfo*> addresses;
     for(p = server_info_list; p != NULL; p = p->ai_next){
+        addresses.push_back(p);
+    }
+    if(address_count != NULL){
+        *address_count = addresses.size();
+    }
+    bool balanced = cfg->upstream_balance != "first" && addresses.size() > 1;
+    if(balanced){
+        vector<struct addrinfo*> ranked;
+        for(size_t index : balancer.order(addresses, cfg->upstream_balance)){
+            ranked.push_back(addresses[index]);
+        }
+        addresses.swap(ranked);
+    }
+
+    p = NULL;
+    bool attempted = false, timed_out = false;
+    for(size_t i = 0; i < addresses.size(); i++){
+        p = addresses[(first_address + i) % addresses.size()];
         server_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if(server_fd == -1){continue;}
+        if(server_fd == -1){
+            p = NULL;
+            continue;
+        }
 
         struct timeval tv;
-        tv.tv_sec = 10;
-        tv.tv_usec = 0; // no additional microseconds
+        tv.tv_sec = (time_t)timeout;
+        tv.tv_usec = (suseconds_t)((timeout - tv.tv_sec) * 1000000);
         setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
         // When the client fail to connect to the server, close the file descriptor and 
-        if(connect(server_fd, p->ai_addr, p->ai_addrlen) == -1){
+        auto started = chrono::steady_clock::now();
+        bool timeout_hit;
+        attempted = true;
+        if(!connectWithin(server_fd, p->ai_addr, p->ai_addrlen, connect_timeout, timeout_hit)){
+            timed_out = timed_out || timeout_hit;
             close(server_fd);
+            if(balanced){
+                balancer.failed(Balancer::key(p), *cfg);
+            }
+            p = NULL;
             continue;
         }
+        double connect_time = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        origin_health.recordConnect(origin, connect_time);
+        if(balanced){
+            // Connections opened for a client request count as outstanding until it is done;
+            // pooled ones (HTTP/2, TLS carriers) are only counted as requests
+            balancer.connected(Balancer::key(p), connect_time, serving_request);
+            if(serving_request){
+                balancer_leases.push_back(Balancer::key(p));
+            }
+        }
 
         // When connection successful close the loop
         break;
@@ -183,17 +289,136 @@ int Proxy::connectServer(const string& host, int port){
     freeaddrinfo(server_info_list);
     if(p == NULL){
         logger->log_error(-1, "Failed to connect to " + host + ":" + port_str);
+        if(attempted){
+            connect_failure = timed_out ? 504 : 502;
+            connect_failure_reason = (timed_out ? "Connecting to " : "Connection refused by ") + host + ":" + port_str +
+                                     (timed_out ? " timed out" : "");
+        }
         return -1;
     }
     return server_fd;
 }
 
+/**
+ * Opens a connection for one request to an origin: a pooled TLS connection for `https://`
+ * origins, a pooled connection to a parent proxy when `parent_routes` routes the host to
+ * one, a stream over a pooled HTTP/2 connection when `h2_upstream` is on and the origin
+ * speaks HTTP/2, otherwise a new HTTP/1.1 connection.
+ * Either way the caller writes an HTTP/1.1 request and reads the plaintext response until EOF.
+ *
+ * @param host The hostname or IP address of the origin.
+ * @param port The port number of the origin.
+ * @param tls Whether the origin is an `https://` one.
+ * @param attempt How many times this request was tried before; see `connectServer()`.
+ * @return The socket file descriptor, or `-1` if the connection fails.
+ */
+int Proxy::connectOrigin(const string& host, int port, bool tls, size_t attempt){
+    shared_ptr<const Config> current = currentConfig();
+    if(tls){
+        if(!current->tls_origins){
+            logger->log_error(-1, "https:// requests to " + host + " refused, tls_origins is off");
+            return -1;
+        }
+        return tls_pool.open(host, port, current->tls_verify, current->tls_idle_connections, current->origin_timeout);
+    }
+    vector<ParentProxy> parents = parent_pool.route(host);
+    if(!parents.empty()){
+        int fd = parent_pool.open(parents, host, port, current->parent_idle_connections, current->origin_timeout,
+                                  current->parent_retry);
+        if(fd >= 0 || !current->parent_direct_fallback){
+            return fd;
+        }
+        parent_direct_fallbacks++;
+        logger->log_note(-1, "No parent proxy for " + host + " reachable, going direct");
+    }
+    if(current->h2_upstream){
+        int fd = h2_pool.open(host, port, current->h2_upstream_connections, current->origin_timeout, current->h2_upstream_retry);
+        if(fd >= 0){
+            return fd;
+        }
+    }
+    return connectServer(host, port, attempt);
+}
+
+/**
+ * Sends a GET miss to the origin and reads the first bytes of the response.
+ * A connection that fails, or closes or resets before any response byte, is tried again
+ * (GET is idempotent) up to `retry_attempts` times, starting on the next resolved address,
+ * after an exponential backoff with full jitter. No retry starts once `retry_deadline`
+ * seconds have passed since the first attempt. An origin that is merely slow to answer is
+ * not retried.
+ *
+ * @param request The parsed `Request` object.
+ * @param origin_request The request to send to the origin.
+ * @param header_timeout Seconds to wait for the first response bytes on each attempt.
+ * @param request_id The unique request identifier for logging.
+ * @param initial Set to the first bytes of the response.
+ * @return The origin socket, or `-1` if no attempt got a response.
+ */
+int Proxy::fetchOrigin(Request& request, int port, const string& origin_request, double header_timeout,
+                       int request_id, string& initial){
+    thread_local mt19937 jitter(random_device{}());
+    shared_ptr<const Config> cfg = currentConfig();
+    auto deadline = chrono::steady_clock::now() + chrono::duration<double>(cfg->retry_deadline);
+
+    for(size_t attempt = 0; ; attempt++){
+        auto started = chrono::steady_clock::now();
+        bool retryable;
+        int server_fd;
+        if(cfg->hedge && !request.isHttps() && !cfg->h2_upstream && parent_pool.route(request.host).empty()){
+            // Sends the request itself, possibly to two addresses, and returns the first to answer
+            server_fd = hedger.open(request.host, port, origin_request, cfg->hedge_delay, cfg->hedge_budget,
+                                    header_timeout, attempt, request_id);
+            retryable = chrono::steady_clock::now() - started < chrono::duration<double>(header_timeout);
+        } else{
+            server_fd = connectOrigin(request.host, port, request.isHttps(), attempt);
+            retryable = true;
+            if(server_fd >= 0){
+                send(server_fd, origin_request.c_str(), origin_request.length(), 0); // Send request to server
+            }
+        }
+
+        if(server_fd >= 0){
+            initial.clear();
+            try{
+                initial = receiveFromSocket(server_fd, header_timeout);
+            } catch(const exception& e){
+                logger->log_error(request_id, string("Failed to receive response: ") + e.what());
+            }
+            if(!initial.empty()){
+                return server_fd;
+            }
+            // Closed or reset by the origin, rather than still waiting for it
+            char byte;
+            ssize_t peeked = recv(server_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+            retryable = peeked == 0 || (peeked < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+            close(server_fd);
+        }
+
+        if(!retryable || attempt >= cfg->retry_attempts){
+            return -1;
+        }
+        double ceiling = cfg->retry_backoff * (1 << min<size_t>(attempt, 10));
+        auto delay = chrono::duration<double>(uniform_real_distribution<double>(0, ceiling)(jitter));
+        if(chrono::steady_clock::now() + delay >= deadline){
+            logger->log_note(request_id, "No retry, retry_deadline reached");
+            return -1;
+        }
+        origin_retries++;
+        logger->log_note(request_id, "Connection to " + request.host + " failed before a response, retrying in " +
+                         to_string((int)(delay.count() * 1000)) + " ms");
+        this_thread::sleep_for(delay);
+    }
+}
+
 
 /**
  * Log cache status response according to cached response content
  * - Checks whether the response is **cacheable**.
- * - If not cacheable, logs the reason (`no-store`, `status code not 200`, etc.), and delete the response to prevent memory leaks.
+ * - If not cacheable, logs the reason (`no-store`, a status other than 200, 301, 404 or 410, etc.), and delete the response to prevent memory leaks.
  * - If the response has an expiration time (`Expires`, `Cache-Control: max-age`), logs it.
+ * - Applies the first matching `refresh_pattern` rule's heuristic freshness, see `Response::applyRefresh()`,
+ *   or `negative_ttl` to a negative response (404, 410, 301), which is not cached without a lifetime.
  * - If `must-revalidate` or `no-cache` is present, logs that revalidation is required.
  * - If cacheable, stores the response in the cache using `cache.put(url, response, logger)`.
  *
@@ -202,10 +427,12 @@ int Proxy::connectServer(const string& host, int port){
  * @param request_id The unique request identifier for logging.
  */
 void Proxy::handleCaching(Response* response, const string& url, int request_id){
-    if(!response->isCacheable()){
+    if(!response->isCacheable(false, currentConfig()->negative_ttl > 0)){
         string reason;
-        if(response->getStatusCode() != 200){
-            reason = "status code is not 200 OK";
+        if(response->getStatusCode() != 200 && !response->isNegative()){
+            reason = "status code is not 200, 301, 404 or 410";
+        } else if(response->isNegative() && response->getCacheMode() != CACHE_NO_STORE){
+            reason = "negative response without max-age or Expires, negative_ttl is 0";
         } else if(response->getNoStore()){
             reason = "no-store directive";
         } else if(response->getCacheMode() == CACHE_NO_STORE){
@@ -219,6 +446,18 @@ void Proxy::handleCaching(Response* response, const string& url, int request_id)
         return;
     }
 
+    string rule = cache.refresh(url, response);
+    if(!rule.empty()){
+        logger->log_note(request_id, "Freshness from refresh_pattern " + rule);
+    }
+    if(response->isNegative()){
+        if(response->getExpireTime().empty()){
+            logger->log_cache_response(request_id, CacheStatus::NOT_CACHEABLE, "negative response without a lifetime");
+            delete response;
+            return;
+        }
+        negative_cached++;
+    }
     if (!response->getExpireTime().empty()) {
         logger->log_cache_response(request_id, CacheStatus::WILL_EXPIRE, response->getExpireTime());
     } else if (response->getNoCache() || response->getMustRevalidate()) {
@@ -226,6 +465,9 @@ void Proxy::handleCaching(Response* response, const string& url, int request_id)
     }
 
     // Put this response into the cache
+    if(prefetching){
+        prefetcher.stored(url);
+    }
     cache.put(url, response, logger);
 }
 
@@ -259,6 +501,43 @@ void Proxy::sendErrorResponse(int client_fd, int status_code, const string& reas
     logger->log_responding(-1, status_line);
 }
 
+/**
+ * Answers a request to an origin in the failure cache with the error it failed with.
+ *
+ * @param origin The origin's `host:port`.
+ * @return `true` if the request was answered.
+ */
+bool Proxy::answerFromFailureCache(int client_fd, const string& origin, int request_id){
+    int status;
+    string reason;
+    if(currentConfig()->failure_ttl <= 0 || !failure_cache.find(origin, status, reason)){
+        return false;
+    }
+    logger->log_note(request_id, "Failure cached for " + origin + ": " + reason);
+    sendErrorResponse(client_fd, status, status == 504 ? "Gateway Timeout" : "Bad Gateway");
+    return true;
+}
+
+/**
+ * Puts the origin in the failure cache if the last connection attempt on this thread failed
+ * to resolve or connect (`connect_failure`).
+ *
+ * @param origin The origin's `host:port`.
+ * @return The status to answer with: 504 if the connections timed out, otherwise 502.
+ */
+int Proxy::rememberFailure(const string& origin, int request_id){
+    int status = connect_failure == 504 ? 504 : 502;
+    if(connect_failure != 0){
+        double ttl = currentConfig()->failure_ttl;
+        if(ttl > 0){
+            failure_cache.record(origin, connect_failure, connect_failure_reason, ttl);
+            logger->log_note(request_id, "Remembering failure of " + origin + " for " + to_string((int)ttl) + " seconds");
+        }
+        connect_failure = 0;
+    }
+    return status;
+}
+
 /**
  * Handles an HTTP request received from a client.
  * - Receives the HTTP request from the client.
@@ -269,20 +548,28 @@ void Proxy::sendErrorResponse(int client_fd, int status_code, const string& reas
  * - Catches and logs any exceptions that occur during request processing.
  *
  * If an error occurs while parsing the request, a `400 Bad Request` error is sent to the client.
+ * The caller closes `client_fd`, which may also be one end of a socketpair serving an HTTP/2 stream.
  * 
  * @param client_fd The client socket file descriptor.
- * @param client_addr The `sockaddr_in` structure containing the client's address.
+ * @param client_addr The client's address; IPv4 clients are IPv4-mapped.
+ * @param hit_only Serve the request only if it is a fresh cache hit (see `processHitLane()`).
  */
-void Proxy::receiveClient(int client_fd, struct sockaddr_in client_addr){
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+void Proxy::receiveClient(int client_fd, struct sockaddr_in6 client_addr, bool hit_only, int access){
+    char client_ip[INET6_ADDRSTRLEN];
+    if(IN6_IS_ADDR_V4MAPPED(&client_addr.sin6_addr)){
+        inet_ntop(AF_INET, client_addr.sin6_addr.s6_addr + 12, client_ip, INET6_ADDRSTRLEN);
+    } else{
+        inet_ntop(AF_INET6, &client_addr.sin6_addr, client_ip, INET6_ADDRSTRLEN);
+    }
+    serving_request = true;
+    connect_failure = 0;
+    client_access = access;
 
     try{
-        string http_request = receiveFromSocket(client_fd); // Receive request from client
+        string http_request = receiveFromSocket(client_fd, currentConfig()->request_timeout); // Receive request from client
 
         if(http_request.empty()){
             logger->log_error(-1, "Empty request received"); 
-            close(client_fd);
             return;
         }
 
@@ -293,17 +580,29 @@ void Proxy::receiveClient(int client_fd, struct sockaddr_in client_addr){
         } catch(const exception& e){
             // When exception happens, it first log the error into the log
             // Reply to client with the error code 400 to indicate the request is bad
-            // Finally close the client file descriptor
             logger->log_error(-1, string("Fail to parse request"));
             sendErrorResponse(client_fd, 400, "Bad Request");
-            close(client_fd);
             return;
         }
 
         int request_id = generateRequestID();
         logger->log_new_request(request_id, client_ip, request.requestHeader); // log a new request
+        if(capture){
+            capture->recordRequest(request_id, http_request);
+        }
+        bool rate_limited = !(access & ACL_UNLIMITED);
+        if(rate_limited && !rate_limiter.admit(client_addr.sin6_addr, *currentConfig())){
+            logger->log_error(request_id, string("Rate limit exceeded for ") + client_ip);
+            sendErrorResponse(client_fd, 429, "Too Many Requests");
+            return;
+        }
+        origin_bytes = 0;
 
-        if(request.method == "GET"){
+        if(hit_only){
+            processHitLane(client_fd, request, request_id);
+        } else if(request.method == "GET" && !request.upgrade.empty()){
+            processUpgrade(client_fd, request, request_id);
+        } else if(request.method == "GET"){
             processGet(client_fd, request, request_id);
         } else if(request.method == "POST"){
             processPost(client_fd, request, request_id);
@@ -313,14 +612,64 @@ void Proxy::receiveClient(int client_fd, struct sockaddr_in client_addr){
             // When the method is not found from the three required method
             logger->log_error(request_id,  "Method " + request.method + " not found"); 
             sendErrorResponse(client_fd, 501, "Not implement method request");
-            close(client_fd);
+        }
+        if(rate_limited){
+            rate_limiter.charge(client_addr.sin6_addr, origin_bytes, *currentConfig());
         }
     } catch(const exception& e){ // Catch exception for the whole client request handling process
         // Log the error and print it out
-        // close the client file descriptor
         logger->log_error(-1, std::string("Unhandled exception: ") + e.what());
-        close(client_fd);
     }
+    for(const string& address : balancer_leases){
+        balancer.release(address);
+    }
+    balancer_leases.clear();
+    serving_request = false;
+}
+
+/**
+ * Sends a cached response to the client and logs it.
+ *
+ * @param client_fd The client socket file descriptor.
+ * @param cached_resp The response returned by `Cache::get()`.
+ * @param request_id The unique request identifier for logging.
+ */
+void Proxy::sendCached(int client_fd, Response* cached_resp, int request_id){
+    string response_str = cached_resp->toString();
+    send(client_fd, response_str.c_str(), response_str.length(), 0);
+
+    std::string status_line = "HTTP/1.1 " + std::to_string(cached_resp->getStatusCode()) + " " + cached_resp->getStatusMessage();
+    if (!status_line.empty()) {
+        status_line.erase(status_line.find_last_not_of("\r\n ") + 1); // Delete the last change line char from status message
+    }
+    logger->log_responding(request_id, status_line); // Log response from the cache
+}
+
+/**
+ * Serves a request that arrived on the hit lane (beyond `max_connections`).
+ * Only a GET with a fresh cached response is answered; a miss, a response that needs
+ * revalidation or any other method gets `503 Service Unavailable`, so the lane never
+ * waits on an origin.
+ *
+ * @param client_fd The client socket file descriptor.
+ * @param request The parsed `Request` object.
+ * @param request_id The unique request identifier for logging.
+ */
+void Proxy::processHitLane(int client_fd, Request& request, int request_id){
+    CacheStatus cache_result = CacheStatus::NOT_IN_CACHE;
+    Response* cached_resp = NULL;
+    if(request.method == "GET" && request.upgrade.empty()){
+        cached_resp = cache.get(Cache::makeKey(request.host, request.url), cache_result);
+    }
+    if(cached_resp != NULL && cache_result == CacheStatus::VALID){
+        logger->log_cache_request(request_id, cache_result, cached_resp->getExpireTime());
+        sendCached(client_fd, cached_resp, request_id);
+        hit_lane_served++;
+        return;
+    }
+    logger->log_error(request_id, "Connection limit reached, rejecting request that is not a cache hit");
+    sendErrorResponse(client_fd, 503, "Service Unavailable");
+    hit_lane_rejected++;
 }
 
 /**
@@ -336,6 +685,7 @@ void Proxy::receiveClient(int client_fd, struct sockaddr_in client_addr){
  * - If the response is `200 OK`, stores it in the cache.
  * - Catches exceptions related to server communication and logs errors.
  * If the requested content is unchanged (`304 Not Modified`), the cached response is used instead.
+ * A path prefix that has proven uncacheable (`bypass_after`) skips all of this, see `streamGet()`.
  *
  * @param client_fd The client socket file descriptor.
  * @param request The parsed `Request` object.
@@ -345,7 +695,37 @@ void Proxy::processGet(int client_fd, Request& request, int request_id){
     // Get the request info from the parsed Request object
     string host = request.host;
     string url = request.url;
-    string full_url = host + url;
+    string full_url = Cache::makeKey(host, url);
+    shared_ptr<const Config> cfg = currentConfig();
+
+    int port = request.isHttps() ? 443 : 80; // default port
+    if(request.port != ""){
+        try{
+            port = stoi(request.port);
+        } catch (...){ // try to catch if there is any exception from conver the string port to int
+            port = request.isHttps() ? 443 : 80;
+        }
+    }
+    string origin = host + ":" + to_string(port);
+    string prefix = BypassLearner::prefixOf(origin, url);
+
+    if(client_access & ACL_NOCACHE){
+        logger->log_note(request_id, "Bypassing the cache for this client (acl nocache)");
+        acl_nocache++;
+        streamGet(client_fd, request, port, origin, request_id);
+        return;
+    }
+
+    // Stream prefixes that never answer cacheably past the cache, except for the periodic probe
+    bool probe = false;
+    if(cfg->bypass_after > 0 && !capture && bypass_learner.bypass(origin, prefix, cfg->bypass_probe_interval, probe)){
+        logger->log_note(request_id, "Bypassing the cache for " + prefix);
+        streamGet(client_fd, request, port, origin, request_id);
+        return;
+    }
+    if(probe){
+        logger->log_note(request_id, "Probing whether " + prefix + " is cacheable again");
+    }
 
     CacheStatus cache_result;
     // Get response from cache first
@@ -360,31 +740,38 @@ void Proxy::processGet(int client_fd, Request& request, int request_id){
     
     // When valid cache response is get
     if(cache_result == CacheStatus::VALID){
-        string response_str = cached_resp->toString();
-        send(client_fd, response_str.c_str(), response_str.length(), 0);
-
-        std::string status_line = "HTTP/1.1 " + std::to_string(cached_resp->getStatusCode()) + " " + cached_resp->getStatusMessage();
-        if (!status_line.empty()) {
-            status_line.erase(status_line.find_last_not_of("\r\n ") + 1); // Delete the last change line char from status message
+        if(cfg->prefetch && !prefetching && prefetcher.hit(full_url)){
+            logger->log_note(request_id, "Hit on a prefetched response");
         }
-        logger->log_responding(request_id, status_line); // Log response from the cache
+        sendCached(client_fd, cached_resp, request_id);
         return;
-    } 
-    // When a revalidation for the cache is required
-    else if(cache_result == CacheStatus::REQUIRES_VALIDATION){ 
-        int port = 80; // default port
-        if(request.port != ""){
-            try{
-                port = stoi(request.port);
-            } catch (...){ // try to catch if there is any exception from conver the string port to int
-                port = 80;
-            }
+    }
+
+    // Fail fast, or serve the stale copy, while the origin's circuit breaker is open
+    if(answerFromFailureCache(client_fd, origin, request_id)){
+        return;
+    }
+    uint64_t breaker_probe = 0;
+    if(cfg->circuit_breaker && !origin_health.allow(origin, cfg->breaker_open_time, breaker_probe)){
+        if(cached_resp != NULL){
+            logger->log_note(request_id, "Circuit open for " + origin + ", serving stale copy");
+            origin_health.stale_served++;
+            sendCached(client_fd, cached_resp, request_id);
+            return;
         }
+        logger->log_error(request_id, "Circuit open for " + origin + ", failing fast");
+        sendErrorResponse(client_fd, 503, "Service Unavailable");
+        return;
+    }
+    OriginCall call(cfg->circuit_breaker ? &origin_health : nullptr, origin, *cfg, breaker_probe);
 
-        int server_fd = connectServer(host, port); // Create a new connection for revalidation
+    // When a revalidation for the cache is required
+    if(cache_result == CacheStatus::REQUIRES_VALIDATION){ 
+        int server_fd = connectOrigin(host, port, request.isHttps()); // Create a new connection for revalidation
         if(server_fd < 0){
             logger->log_error(request_id, "Failed to connect to server for validation");
-            sendErrorResponse(client_fd, 502, "Bad Gateway");
+            int status = rememberFailure(origin, request_id);
+            sendErrorResponse(client_fd, status, status == 504 ? "Gateway Timeout" : "Bad Gateway");
             return;
         }
 
@@ -410,12 +797,15 @@ void Proxy::processGet(int client_fd, Request& request, int request_id){
 
             string validation_resp_str;
             try{
-                validation_resp_str = receiveFromSocket(server_fd); // get a new response from server
+                validation_resp_str = receiveFromSocket(server_fd, cfg->origin_timeout); // get a new response from server
 
                 if(validation_resp_str.empty()){
                     logger->log_error(request_id, "Empty validation response from server");
                     close(server_fd);
                 } else{
+                    if(capture){
+                        capture->recordResponse(request_id, validation_resp_str);
+                    }
                     Response* validation_resp = new Response();
                     try{
                         validation_resp->parseResponse(validation_resp_str);
@@ -438,6 +828,7 @@ void Proxy::processGet(int client_fd, Request& request, int request_id){
                             logger->log_responding(request_id, status_line);
                             delete validation_resp;
                             close(server_fd);
+                            call.succeeded();
                             return;
                         } else{
                             // Content modifed, get response from original server
@@ -456,40 +847,29 @@ void Proxy::processGet(int client_fd, Request& request, int request_id){
     }
 
     // need to fetch response from origin server
-    int port = 80;
-    if(request.port != ""){ // get client port
-        try{
-            port = stoi(request.port);
-        } catch(...){
-            port = 80;
-        }
-    }   
-
     logger->log_requesting(request_id, request.requestHeader, host);
 
-    int server_fd = connectServer(host, port);
+    double header_timeout = cfg->adaptive_timeouts ? origin_health.headerTimeout(origin, cfg->origin_header_timeout)
+                                                   : cfg->origin_header_timeout;
+    auto sent_at = chrono::steady_clock::now();
+    std::string transformed_request = request.Request_line();
+    // only get initial header to check if response is chunked or too long
+    string inital_resp;
+    int server_fd = fetchOrigin(request, port, transformed_request, header_timeout, request_id, inital_resp);
     if (server_fd < 0) {
-        sendErrorResponse(client_fd, 502, "Bad Gateway");
+        logger->log_error(request_id, "Empty response from server");
+        int status = rememberFailure(origin, request_id);
+        sendErrorResponse(client_fd, status, status == 504 ? "Gateway Timeout" : "Bad Gateway");
         return;
     }
 
-    // Send request to server
-    std::string transformed_request = request.Request_line();
-    send(server_fd, transformed_request.c_str(), transformed_request.length(), 0);
-
     Response* server_response = new Response();
     try{
-        // only get initial header to check if response is chunked or too long
-        string inital_resp = receiveFromSocket(server_fd, 5); 
-
-        if(inital_resp.empty()){
-            logger->log_error(request_id, "Empty response from server");
-            close(server_fd);
-            delete server_response;
-            sendErrorResponse(client_fd, 502, "Bad Gateway");
-            return;
-        }
+        origin_health.recordHeaders(origin, chrono::duration<double>(chrono::steady_clock::now() - sent_at).count());
         server_response->parseResponse(inital_resp);
+        if(server_response->getStatusCode() < 500){
+            call.succeeded();
+        }
         if(server_response->getIsChunked()){
             logger->log_note(request_id, "Detected chunked encoding");
                 
@@ -497,20 +877,30 @@ void Proxy::processGet(int client_fd, Request& request, int request_id){
             send(client_fd, inital_resp.c_str(), inital_resp.length(), 0);
             vector<char> chunked_data = handleChunkResponse(server_fd, client_fd);
             server_response->addChunkedData(chunked_data);
-        } else if(server_response->getContentLength() > 65536){
+            if(capture){
+                capture->recordResponse(request_id, inital_resp + string(chunked_data.begin(), chunked_data.end()));
+            }
+        } else if(server_response->getContentLength() > (int)cfg->buffer_size){
             logger->log_note(request_id, "Detected large content: " + 
             std::to_string(server_response->getContentLength()) + " bytes");
 
             vector<char> long_data = handleLongResponse(server_fd);
             server_response->addResponseBody(string(long_data.begin(), long_data.end()));
+            if(capture){
+                capture->recordResponse(request_id, inital_resp + string(long_data.begin(), long_data.end()));
+            }
 
             string resp_str = server_response->toString();
             send(client_fd, resp_str.c_str(), resp_str.length(), 0);
         } else{ // Regular response
+            std::string rest_of_response;
             if (server_response->getContentLength() > 0) {
-                std::string rest_of_response = receiveFromSocket(server_fd);
+                rest_of_response = receiveFromSocket(server_fd, cfg->origin_timeout);
                 server_response->addResponseBody(rest_of_response);
             }
+            if(capture){
+                capture->recordResponse(request_id, inital_resp + rest_of_response);
+            }
 
             string resp_str = server_response->toString();
             send(client_fd, resp_str.c_str(), resp_str.length(), 0);
@@ -531,8 +921,22 @@ void Proxy::processGet(int client_fd, Request& request, int request_id){
             logger->log_note(request_id, "Cache-Control: " + server_response->getCacheControl());
         }
 
+        if(cfg->bypass_after > 0 && server_response->getStatusCode() == 200){
+            bool cacheable = server_response->isCacheable();
+            if(bypass_learner.record(origin, prefix, cacheable, cfg->bypass_after, cfg->bypass_probe_interval)){
+                logger->log_note(request_id, cacheable ? prefix + " is cacheable again, ending its cache bypass"
+                                                       : prefix + " is never cacheable, bypassing the cache for it");
+            }
+        }
+        if(cfg->prefetch && !prefetching && !capture && server_response->getStatusCode() == 200 &&
+           server_response->isCacheable()){
+            prefetchLinks(server_response, full_url, request_id);
+        }
         if(server_response->getStatusCode() == 200){
             handleCaching(server_response, full_url, request_id); // If 200 ok is received, cache response 
+        } else if(server_response->isNegative()){
+            logger->log_responding(request_id, status_line);
+            handleCaching(server_response, full_url, request_id); // 404, 410 and 301 for negative_ttl
         } else{
             logger->log_responding(request_id, status_line);
             delete server_response;
@@ -548,6 +952,202 @@ void Proxy::processGet(int client_fd, Request& request, int request_id){
     return;
 }
 
+/**
+ * @param name A lowercase header name.
+ * @return The value of the response's header, matched in any case, or an empty string.
+ */
+static string headerValue(const Response* response, const string& name){
+    for(const auto& entry : response->getHeaders()){
+        string key = entry.first;
+        transform(key.begin(), key.end(), key.begin(), ::tolower);
+        if(key == name){
+            return entry.second;
+        }
+    }
+    return "";
+}
+
+/**
+ * Queues the same-site subresources of an HTML page for prefetching, see `Prefetcher`.
+ *
+ * @param response The page, a cacheable `200 OK`.
+ * @param full_url The page's cache key.
+ */
+void Proxy::prefetchLinks(const Response* response, const string& full_url, int request_id){
+    string type = headerValue(response, "content-type");
+    transform(type.begin(), type.end(), type.begin(), ::tolower);
+    if(type.find("text/html") == string::npos){
+        return;
+    }
+    shared_ptr<const Config> cfg = currentConfig();
+    vector<string> urls = Prefetcher::extract(RefreshPatterns::urlOf(full_url), response->getBody(),
+                                              headerValue(response, "link"), cfg->prefetch_links);
+    if(!urls.empty()){
+        logger->log_note(request_id, "Prefetching " + to_string(urls.size()) + " subresources");
+        prefetcher.enqueue(urls, cfg->prefetch_per_origin);
+    }
+}
+
+/**
+ * Fetches `url` into the cache as a client's GET would, on a prefetch thread. The response
+ * is written to a socket whose peer is already closed.
+ *
+ * @param url An absolute `http://` or `https://` URL.
+ */
+void Proxy::prefetch(const string& url){
+    size_t authority = url.find("://") + 3;
+    string host = url.substr(authority, url.find_first_of("/?#", authority) - authority);
+    Request request("GET " + url + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n");
+    try{
+        request.parseRequest();
+    } catch(...){
+        return;
+    }
+    int sockets[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0){
+        return;
+    }
+    close(sockets[1]);
+
+    int request_id = generateRequestID();
+    logger->log_note(request_id, "Prefetch of " + url);
+    prefetching = true;
+    serving_request = true;
+    connect_failure = 0;
+    origin_bytes = 0;
+    processGet(sockets[0], request, request_id);
+    for(const string& address : balancer_leases){
+        balancer.release(address);
+    }
+    balancer_leases.clear();
+    serving_request = false;
+    prefetching = false;
+    close(sockets[0]);
+}
+
+/**
+ * Reads the framing of a response from its header.
+ *
+ * @param head The start of the response, including the whole header.
+ * @param content_length Set to the `Content-Length`, or `-1` without one.
+ * @param chunked Set if the body is `Transfer-Encoding: chunked`.
+ * @return The status code, or `0` if the status line is malformed.
+ */
+static int responseFraming(const string& head, long& content_length, bool& chunked){
+    content_length = -1;
+    chunked = false;
+    int status = 0;
+    if(head.compare(0, 5, "HTTP/") != 0 || sscanf(head.c_str(), "HTTP/%*s %d", &status) != 1){
+        return 0;
+    }
+    istringstream lines(head);
+    string line;
+    getline(lines, line);
+    while(getline(lines, line) && line != "\r" && !line.empty()){
+        size_t colon = line.find(':');
+        if(colon == string::npos){
+            continue;
+        }
+        string name = line.substr(0, colon);
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        string value = line.substr(colon + 1);
+        if(name == "content-length"){
+            content_length = atol(value.c_str());
+        } else if(name == "transfer-encoding"){
+            transform(value.begin(), value.end(), value.begin(), ::tolower);
+            chunked = value.find("chunked") != string::npos;
+        }
+    }
+    return status;
+}
+
+/**
+ * Serves a GET whose path prefix bypasses the cache: sends the response to the client as
+ * it arrives from the origin, without a cache lookup, a `Response` or buffering of the body.
+ * - Applies the failure cache and the circuit breaker as `processGet()` does.
+ * - Reads the body by its `Content-Length` or chunked framing, or until the origin closes.
+ *
+ * @param port The origin's port.
+ * @param origin The origin's `host:port`.
+ */
+void Proxy::streamGet(int client_fd, Request& request, int port, const string& origin, int request_id){
+    shared_ptr<const Config> cfg = currentConfig();
+    if(answerFromFailureCache(client_fd, origin, request_id)){
+        return;
+    }
+    uint64_t breaker_probe = 0;
+    if(cfg->circuit_breaker && !origin_health.allow(origin, cfg->breaker_open_time, breaker_probe)){
+        logger->log_error(request_id, "Circuit open for " + origin + ", failing fast");
+        sendErrorResponse(client_fd, 503, "Service Unavailable");
+        return;
+    }
+    OriginCall call(cfg->circuit_breaker ? &origin_health : nullptr, origin, *cfg, breaker_probe);
+
+    logger->log_requesting(request_id, request.requestHeader, request.host);
+    double header_timeout = cfg->adaptive_timeouts ? origin_health.headerTimeout(origin, cfg->origin_header_timeout)
+                                                   : cfg->origin_header_timeout;
+    auto sent_at = chrono::steady_clock::now();
+    string initial;
+    int server_fd = fetchOrigin(request, port, request.Request_line(), header_timeout, request_id, initial);
+    if(server_fd < 0){
+        logger->log_error(request_id, "Empty response from server");
+        int status = rememberFailure(origin, request_id);
+        sendErrorResponse(client_fd, status, status == 504 ? "Gateway Timeout" : "Bad Gateway");
+        return;
+    }
+    origin_health.recordHeaders(origin, chrono::duration<double>(chrono::steady_clock::now() - sent_at).count());
+
+    size_t header_end = initial.find("\r\n\r\n");
+    long content_length = -1;
+    bool chunked = false;
+    int status = responseFraming(initial.substr(0, header_end), content_length, chunked);
+    if(status == 0){
+        close(server_fd);
+        logger->log_error(request_id, "Malformed response from server");
+        sendErrorResponse(client_fd, 502, "Bad Gateway");
+        return;
+    }
+    if(status < 500){
+        call.succeeded();
+    }
+    send(client_fd, initial.c_str(), initial.length(), 0);
+
+    // Relay the rest of the body; without a header end or any framing, until the origin closes
+    bool bodiless = status == 204 || status == 304 || (status >= 100 && status < 200);
+    long remaining = -1;
+    if(header_end != string::npos && !chunked && content_length >= 0){
+        remaining = content_length - (long)(initial.size() - header_end - 4);
+    } else if(header_end != string::npos && bodiless){
+        remaining = 0;
+    }
+    string tail = initial.size() >= 5 ? initial.substr(initial.size() - 5) : initial;
+    bool complete = remaining == 0 || (chunked && tail == "0\r\n\r\n");
+    vector<char> buffer(cfg->buffer_size);
+    while(!complete){
+        ssize_t received = recv(server_fd, buffer.data(), remaining > 0 ? min<long>(buffer.size(), remaining) : buffer.size(), 0);
+        if(received <= 0){
+            break;
+        }
+        origin_bytes += received;
+        if(send(client_fd, buffer.data(), received, MSG_NOSIGNAL) < 0){
+            break;
+        }
+        if(remaining > 0){
+            remaining -= received;
+            complete = remaining == 0;
+        } else if(chunked){
+            tail += string(buffer.data(), received);
+            tail = tail.substr(tail.size() - min<size_t>(tail.size(), 5));
+            complete = tail == "0\r\n\r\n";
+        }
+    }
+    close(server_fd);
+
+    string status_line = initial.substr(0, initial.find("\r\n"));
+    logger->log_received(request_id, status_line, request.host);
+    logger->log_responding(request_id, status_line);
+}
+
 /**
  * Processes an HTTP POST request from the client.
  * - Determines the host and port from the request.
@@ -566,20 +1166,37 @@ void Proxy::processGet(int client_fd, Request& request, int request_id){
  */
 void Proxy::processPost(int client_fd, Request& request, int request_id) {
     string host = request.host;
-    int port = 80;
+    int port = request.isHttps() ? 443 : 80;
     if(request.port != "") {
         try {
             port = stoi(request.port);
         } catch(...) {
-            port = 80;
+            port = request.isHttps() ? 443 : 80;
         }
     }
 
+    shared_ptr<const Config> cfg = currentConfig();
+    string origin = host + ":" + to_string(port);
+    if(answerFromFailureCache(client_fd, origin, request_id)){
+        return;
+    }
+    uint64_t breaker_probe = 0;
+    if(cfg->circuit_breaker && !origin_health.allow(origin, cfg->breaker_open_time, breaker_probe)){
+        logger->log_error(request_id, "Circuit open for " + origin + ", failing fast");
+        sendErrorResponse(client_fd, 503, "Service Unavailable");
+        return;
+    }
+    OriginCall call(cfg->circuit_breaker ? &origin_health : nullptr, origin, *cfg, breaker_probe);
+
     logger->log_requesting(request_id, request.requestHeader, host);
 
-    int server_fd = connectServer(host, port);
+    double header_timeout = cfg->adaptive_timeouts ? origin_health.headerTimeout(origin, cfg->origin_header_timeout)
+                                                   : cfg->origin_header_timeout;
+    auto sent_at = chrono::steady_clock::now();
+    int server_fd = connectOrigin(host, port, request.isHttps());
     if(server_fd < 0) {
-        sendErrorResponse(client_fd, 502, "Unable connect to server");
+        int status = rememberFailure(origin, request_id);
+        sendErrorResponse(client_fd, status, status == 504 ? "Gateway Timeout" : "Unable connect to server");
         return;
     }
 
@@ -589,7 +1206,7 @@ void Proxy::processPost(int client_fd, Request& request, int request_id) {
     Response* server_resp = new Response();
     try {
         // Get initial response headers
-        string initial_resp = receiveFromSocket(server_fd, 5);
+        string initial_resp = receiveFromSocket(server_fd, header_timeout);
         
         if(initial_resp.empty()) {
             logger->log_error(request_id, "Empty response from server");
@@ -598,8 +1215,12 @@ void Proxy::processPost(int client_fd, Request& request, int request_id) {
             sendErrorResponse(client_fd, 502, "Bad Response: from POST server");
             return;
         }
+        origin_health.recordHeaders(origin, chrono::duration<double>(chrono::steady_clock::now() - sent_at).count());
 
         server_resp->parseResponse(initial_resp);
+        if(server_resp->getStatusCode() < 500){
+            call.succeeded();
+        }
         
         if(server_resp->getIsChunked()) {
             logger->log_note(request_id, "Detected chunked encoding");
@@ -608,6 +1229,9 @@ void Proxy::processPost(int client_fd, Request& request, int request_id) {
             send(client_fd, initial_resp.c_str(), initial_resp.length(), 0);
             vector<char> chunked_data = handleChunkResponse(server_fd, client_fd);
             server_resp->addChunkedData(chunked_data);
+            if(capture){
+                capture->recordResponse(request_id, initial_resp + string(chunked_data.begin(), chunked_data.end()));
+            }
         } else if(server_resp->getContentLength() > 0) {
             // For regular responses with a body
             if (server_resp->getBody().length() < static_cast<size_t>(server_resp->getContentLength())) {
@@ -615,6 +1239,10 @@ void Proxy::processPost(int client_fd, Request& request, int request_id) {
                 logger->log_note(request_id, "Getting remaining body data");
                 vector<char> additional_data = handleLongResponse(server_fd);
                 server_resp->addResponseBody(string(additional_data.begin(), additional_data.end()));
+                initial_resp.append(additional_data.begin(), additional_data.end());
+            }
+            if(capture){
+                capture->recordResponse(request_id, initial_resp);
             }
             
             // Send the complete response to the client
@@ -622,6 +1250,9 @@ void Proxy::processPost(int client_fd, Request& request, int request_id) {
             send(client_fd, resp_str.c_str(), resp_str.length(), 0);
         } else {
             // No body or already complete
+            if(capture){
+                capture->recordResponse(request_id, initial_resp);
+            }
             string resp_str = server_resp->toString();
             send(client_fd, resp_str.c_str(), resp_str.length(), 0);
         }
@@ -649,9 +1280,10 @@ void Proxy::processPost(int client_fd, Request& request, int request_id) {
  * Handles an HTTP CONNECT request for establishing an HTTPS tunnel.
  * - Establishes a TCP connection to the target server.
  * - Sends `HTTP/1.1 200 Connection established` to the client.
- * - Uses `select()` for bidirectional communication between client and server.
- * - Transfers data until one side closes the connection or an error occurs.
- * - Logs tunnel creation, data transfer issues, and tunnel closure.
+ * - Hands the client/server pair to the relay, which moves the bytes in both directions
+ *   on its event loop, so the tunnel does not hold this thread.
+ * - The relay closes the tunnel after `tunnel_timeout` seconds of inactivity, or when one
+ *   side closes the connection or an error occurs, and logs the closure.
  *
  * @param client_fd The socket file descriptor for the client.
  * @param request The parsed `Request` object containing the CONNECT request details.
@@ -668,10 +1300,15 @@ void Proxy::processConnect(int client_fd, Request& request, int request_id){
         }
     }
 
+    string origin = host + ":" + to_string(port);
+    if(answerFromFailureCache(client_fd, origin, request_id)){
+        return;
+    }
     int server_fd = connectServer(host, port);
     if(server_fd < 0){
         logger->log_error(request_id, "Failed to connect to server for connect");
-        sendErrorResponse(client_fd, 502, "Bad Gateway");
+        int status = rememberFailure(origin, request_id);
+        sendErrorResponse(client_fd, status, status == 504 ? "Gateway Timeout" : "Bad Gateway");
         return;
     }
 
@@ -680,110 +1317,903 @@ void Proxy::processConnect(int client_fd, Request& request, int request_id){
 
     logger->log_responding(request_id, "HTTP/1.1 200 Connection established");
 
-    int max_fd = max(client_fd, server_fd) + 1;
-    fd_set readfds;
-    struct timeval tv;
-    int fd[2] = {server_fd, client_fd}; // Keep listening to both client and server
-    char buffer[65536];
-    bool tunnel_active = true;
-
-    while(running && tunnel_active){
-        FD_ZERO(&readfds);
-        FD_SET(server_fd, &readfds);
-        FD_SET(client_fd, &readfds);
-
-        tv.tv_sec = 10;
-        tv.tv_usec = 500000;
-
-        int rv = select(max_fd, &readfds, NULL, NULL, &tv);
-        if(rv == 0){
-            logger->log_note(request_id, "Tunnel timeout after 10.5 seconds of inactivity");
-            tunnel_active = false;
-            break;
-        }
-
-        if(rv == -1){
-            logger->log_error(request_id, "Select error in tunnel");
-            tunnel_active = false;
-            break;
-        }
-
-        for(int i = 0; i < 2; i++){
-            if(FD_ISSET(fd[i], &readfds)){
-                memset(buffer, 0, sizeof(buffer));
-                int byte_received = recv(fd[i], buffer, sizeof(buffer), MSG_NOSIGNAL);
-                
-                string receive_from = (i == 0) ? "server" : "client";
-                if(byte_received <= 0){
-                    logger->log_note(request_id, "Connection closed by " + receive_from);
-                    tunnel_active = false;
-                    break;
-                }
-
-                string sendTo = (i == 0) ? "client" : "server";
-                int byte_sent = send(fd[1-i], buffer, byte_received, MSG_NOSIGNAL); // send the received contents to the other direction
-                if(byte_sent <= 0){
-                    logger->log_error(request_id, "Failed to forward data to " + sendTo);
-                    tunnel_active = false;
-                    break;
-                }
-            }
-        }
-    }
-
-    logger->log_tunnel_closed(request_id);
-    close(server_fd);
+    // The relay owns a duplicate of client_fd; the caller still closes its own
+    active_connections++;
+    relay.add(dup(client_fd), server_fd, request_id, currentConfig()->tunnel_timeout, [this](){ active_connections--; });
 }
 
 /**
- * Constructs the Proxy server.
- * Initialze all varibales: Specify log address; Specify cache max size to be 50
- * Finilize initial listening and binding operations for the sockets
+ * Handles a GET request asking to switch protocols (`Upgrade:`, e.g. a WebSocket handshake).
+ * - Forwards the request to the origin exactly as received, since the handshake depends on
+ *   headers (`Sec-WebSocket-Key`, `Connection: Upgrade`, ...) that are not rebuilt otherwise.
+ * - Relays the origin's answer to the client without caching it. A refusal (any status but
+ *   101) is relayed whole, up to its `Content-Length`, last chunk or the origin closing.
+ * - On `101 Switching Protocols`, hands the client/server pair to the relay like a CONNECT
+ *   tunnel; upgraded connections are closed after `websocket_timeout` idle seconds.
  *
- * @param port The port number on which the proxy listens for client connections.
- * @throws `std::runtime_error` if socket creation, binding, or listening fails.
- */
-Proxy::Proxy(int port) : logger(make_unique<Logger>("/var/log/erss/proxy.log")), cache(50), request_count(0), running(false) {
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+ * @param client_fd The socket file descriptor for the client.
+ * @param request The parsed `Request` object containing the upgrade request.
+ * @param request_id The unique identifier for this request.
+ */
+void Proxy::processUpgrade(int client_fd, Request& request, int request_id){
+    shared_ptr<const Config> cfg = currentConfig();
+    if(request.isHttps()){
+        logger->log_error(request_id, "Upgrade to an https:// origin is not supported, use CONNECT");
+        sendErrorResponse(client_fd, 501, "Not implement method request");
+        return;
+    }
+    string host = request.host;
+    int port = 80;
+    if(request.port != ""){
+        try{
+            port = stoi(request.port);
+        } catch(...){
+            port = 80;
+        }
+    }
+
+    logger->log_requesting(request_id, request.requestHeader, host);
+    int server_fd = connectServer(host, port);
     if(server_fd < 0){
+        sendErrorResponse(client_fd, 502, "Bad Gateway");
+        return;
+    }
+    send(server_fd, request.httpRequest.c_str(), request.httpRequest.length(), MSG_NOSIGNAL);
+
+    string response = receiveFromSocket(server_fd, cfg->origin_header_timeout);
+    size_t line_end = response.find("\r\n");
+    if(response.compare(0, 5, "HTTP/") != 0 || line_end == string::npos){
+        logger->log_error(request_id, "Invalid response to upgrade request");
+        close(server_fd);
+        sendErrorResponse(client_fd, 502, "Bad Gateway");
+        return;
+    }
+    string status_line = response.substr(0, line_end);
+    logger->log_received(request_id, status_line, host);
+    logger->log_responding(request_id, status_line);
+
+    if(atoi(response.c_str() + response.find(' ')) != 101){
+        // The origin declined: relay its whole response, framed by Content-Length, chunked
+        // encoding or the origin closing, starting with the bytes already received
+        size_t offset = 0;
+        bool reusable = false, started = false;
+        TlsPool::relayResponse([&](char* buffer, size_t size){
+            if(offset < response.size()){
+                size = min(size, response.size() - offset);
+                memcpy(buffer, response.data() + offset, size);
+                offset += size;
+                return (ssize_t)size;
+            }
+            ssize_t received = recv(server_fd, buffer, size, 0);
+            if(received > 0){
+                origin_bytes += received;
+            }
+            return received;
+        }, "GET", client_fd, reusable, started);
+        close(server_fd);
+        return;
+    }
+    // Anything after the 101 head is already the new protocol and goes to the client as is
+    send(client_fd, response.c_str(), response.length(), MSG_NOSIGNAL);
+    logger->log_note(request_id, "Switching to " + request.upgrade + ", relaying the connection");
+    active_connections++;
+    relay.add(dup(client_fd), server_fd, request_id, cfg->websocket_timeout, [this](){ active_connections--; });
+}
+
+/**
+ * Creates a listening TCP socket.
+ * An IPv6 address gets a dual-stack socket, so `"::"` also accepts IPv4 clients (as
+ * IPv4-mapped addresses); on a host without IPv6 it falls back to `"0.0.0.0"`.
+ *
+ * @param address The IPv4 or IPv6 address to bind, e.g. `"::"` or `"0.0.0.0"`.
+ * @param port The port to listen on.
+ * @param backlog The `listen()` backlog.
+ * @return The listening socket.
+ * @throws `std::runtime_error` if socket creation, binding, or listening fails.
+ */
+int Proxy::openListener(const string& address, int port, int backlog){
+    bool ipv6 = address.find(':') != string::npos;
+    int listen_fd = socket(ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+    if(listen_fd < 0 && ipv6 && errno == EAFNOSUPPORT && address == "::"){
+        logger->log_note(-1, "IPv6 is not available, listening on 0.0.0.0");
+        return openListener("0.0.0.0", port, backlog);
+    }
+    if(listen_fd < 0){
         throw std::runtime_error("Failed to create socket");
     }
 
     int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        close(server_fd);
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        close(listen_fd);
         throw std::runtime_error("Failed to set socket options");
     }
 
-    struct sockaddr_in server_addr;
+    struct sockaddr_storage server_addr;
+    socklen_t server_len;
     memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+    int parsed;
+    if(ipv6){
+        int v6only = 0;
+        setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+        struct sockaddr_in6* addr6 = (struct sockaddr_in6*)&server_addr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(port);
+        parsed = inet_pton(AF_INET6, address.c_str(), &addr6->sin6_addr);
+        server_len = sizeof(struct sockaddr_in6);
+    } else{
+        struct sockaddr_in* addr4 = (struct sockaddr_in*)&server_addr;
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(port);
+        parsed = inet_pton(AF_INET, address.c_str(), &addr4->sin_addr);
+        server_len = sizeof(struct sockaddr_in);
+    }
+    if(parsed != 1){
+        close(listen_fd);
+        throw std::runtime_error("Invalid listen address " + address);
+    }
 
-    if(::bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0){
-        close(server_fd);
+    if(::bind(listen_fd, (struct sockaddr*)&server_addr, server_len) < 0){
+        close(listen_fd);
         throw std::runtime_error("Failed to bind to port " + std::to_string(port)); // Throw an exception
     }
 
-    if(listen(server_fd, 100) < 0){
-        close(server_fd);
+    if(listen(listen_fd, backlog) < 0){
+        close(listen_fd);
         throw std::runtime_error("Failed to listen on socket"); // Throw listen exception
     }
+    return listen_fd;
+}
 
-    logger->log_note(-1, "Proxy started on port " + std::to_string(port));
+/**
+ * Constructs the Proxy server.
+ * Initialze all varibales from the configuration: log file, cache size and policy, timeouts and limits
+ * Finilize initial listening and binding operations for the sockets (and the admin socket if enabled)
+ * During an upgrade the listening sockets are inherited from the old process instead.
+ *
+ * @param initial_config The settings to start with.
+ * @param config_file The file `reloadConfig()` re-reads; empty if the proxy runs on defaults.
+ * @param inherited_fd The proxy listener received from the old process, or -1 to open one.
+ * @param inherited_admin_fd The admin listener received from the old process, or -1.
+ * @throws `std::runtime_error` if socket creation, binding, or listening fails.
+ */
+Proxy::Proxy(const Config& initial_config, const string& config_file, int inherited_fd, int inherited_admin_fd) :
+    config(make_shared<const Config>(initial_config)), config_path(config_file),
+    logger(make_unique<Logger>(initial_config.log_file, inherited_fd >= 0)),
+    balancer(logger),
+    h2_pool([this](const string& host, int port){ return connectServer(host, port); }, logger),
+    tls_pool(initial_config.tls_ca_file, [this](const string& host, int port){ return connectServer(host, port); }, logger),
+    parent_pool([this](const string& host, int port){ return connectServer(host, port); }, logger),
+    relay(logger),
+    hedger([this](const string& host, int port, size_t first_address, size_t& addresses){
+        return connectServer(host, port, first_address, &addresses);
+    }, logger),
+    cache(initial_config.cache_entries, initial_config.cache_cleanup_interval),
+    prefetcher([this](const string& url){ prefetch(url); }), request_count(0), running(false) {
+    logger->setLevel(initial_config.log_level);
+    cache.configure(initial_config.cache_entries, initial_config.cache_cleanup_interval, initial_config.cache_policy, logger);
+    cache.configureRefresh(initial_config.refresh_patterns, logger);
+    cache.setNegativeTtl(initial_config.negative_ttl);
+    configureAccess(initial_config);
+    parent_pool.configure(initial_config.parent_routes);
+    numa_nodes = Numa::nodes();
+    if(initial_config.workers > 0){
+        vector<int> shard_nodes;
+        if(initial_config.numa_cache_shards){
+            for(const NumaNode& node : numa_nodes){
+                shard_nodes.push_back(node.id);
+            }
+        }
+        cache.enableShared(initial_config.shared_cache_object_size, shard_nodes);
+    }
+
+    if(inherited_fd >= 0){
+        server_fd = inherited_fd;
+        admin_fd = inherited_admin_fd;
+        logger->log_note(-1, "Inherited listening sockets from the previous process");
+    } else{
+        server_fd = openListener(initial_config.listen_address, initial_config.port, initial_config.backlog);
+    }
+    if(inherited_fd < 0 && initial_config.admin_port > 0){
+        try{
+            admin_fd = openListener(initial_config.admin_address, initial_config.admin_port, 16);
+        } catch(const exception& e){
+            close(server_fd);
+            throw;
+        }
+    }
+
+    logger->log_note(-1, "Proxy started on port " + std::to_string(initial_config.port));
+}
+
+/**
+ * Compiles the `acl` rules, the rules of `acl_file` and `acl_default` into the trie that
+ * `run()` checks every accepted connection against, and swaps it in. If they cannot be
+ * compiled (the file changed since the config was loaded), the running ACL stays.
+ */
+void Proxy::configureAccess(const Config& new_config){
+    try{
+        vector<string> rules = new_config.acl_rules;
+        if(!new_config.acl_file.empty()){
+            vector<string> file_rules = AccessList::readFile(new_config.acl_file);
+            rules.insert(rules.end(), file_rules.begin(), file_rules.end());
+        }
+        shared_ptr<const AccessList> compiled = make_shared<const AccessList>(
+            AccessList::compile(rules, AccessList::parseActions(new_config.acl_default)));
+        atomic_store(&access_list, compiled);
+        if(!rules.empty()){
+            logger->log_note(-1, "Loaded " + to_string(compiled->size()) + " ACL rules");
+        }
+    } catch(const exception& e){
+        logger->log_error(-1, string("Invalid ACL, keeping the running one: ") + e.what());
+    }
+}
+
+/**
+ * Re-reads the configuration file and applies the settings that can change live:
+ * cache size, cleanup interval and policy, timeouts, limits and the log level.
+ * - The new configuration replaces the old one in a single atomic swap; connections in flight are kept.
+ * - Listener, log file, capture and TLS trust store settings only take effect after a restart; changes to them are logged.
+ * - If the file cannot be read or is invalid, the running configuration is kept.
+ *
+ * @param message Set to a human readable result.
+ * @return `true` if the new configuration was applied.
+ */
+bool Proxy::reloadConfig(string& message){
+    lock_guard<mutex> lock(reload_mutex);
+    if(config_path.empty()){
+        message = "No config file to reload";
+        return false;
+    }
+
+    Config new_config;
+    try{
+        new_config = Config::load(config_path);
+    } catch(const exception& e){
+        message = string("Reload failed, keeping the running configuration: ") + e.what();
+        logger->log_error(-1, message);
+        return false;
+    }
+
+    shared_ptr<const Config> old_config = currentConfig();
+    if(new_config.port != old_config->port || new_config.listen_address != old_config->listen_address ||
+       new_config.backlog != old_config->backlog || new_config.admin_port != old_config->admin_port ||
+       new_config.admin_address != old_config->admin_address || new_config.log_file != old_config->log_file ||
+       new_config.capture_file != old_config->capture_file || new_config.workers != old_config->workers ||
+       new_config.shared_cache_object_size != old_config->shared_cache_object_size ||
+       new_config.tls_ca_file != old_config->tls_ca_file){
+        logger->log_note(-1, "Listener, log file, capture, worker and TLS trust store changes need a restart");
+    }
+
+    cache.configure(new_config.cache_entries, new_config.cache_cleanup_interval, new_config.cache_policy, logger);
+    cache.configureRefresh(new_config.refresh_patterns, logger);
+    cache.setNegativeTtl(new_config.negative_ttl);
+    configureAccess(new_config);
+    parent_pool.configure(new_config.parent_routes);
+    logger->setLevel(new_config.log_level);
+    atomic_store(&config, shared_ptr<const Config>(make_shared<const Config>(new_config)));
+
+    message = "Configuration reloaded from " + config_path;
+    logger->log_note(-1, message);
+    for(pid_t pid : worker_pids){
+        if(pid > 0){
+            kill(pid, SIGHUP); // workers re-read the file themselves
+        }
+    }
+    return true;
+}
+
+/**
+ * Asks the accept loop to reload the configuration.
+ * Only sets a flag, so it is safe to call from a signal handler (SIGHUP).
+ */
+void Proxy::requestReload(){
+    reload_requested = true;
+}
+
+/**
+ * Serves the admin listener until the proxy stops.
+ * One connection is handled at a time; admin calls are rare and short.
+ */
+void Proxy::adminLoop(){
+    while(running && accepting){
+        struct pollfd pfd;
+        pfd.fd = admin_fd;
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, 1000) <= 0){
+            continue;
+        }
+
+        int fd = accept(admin_fd, NULL, NULL);
+        if(fd < 0){
+            continue;
+        }
+        handleAdminRequest(fd);
+        close(fd);
+    }
+}
+
+/**
+ * Handles one admin HTTP request.
+ * - `/reload` re-reads the configuration file (see `reloadConfig()`).
+ * - `/config` returns the configuration in effect.
+ * - `/numa` returns the per-node allocation counters (see `Numa::stats()`).
+ * - `/metrics` returns cache and memory metrics in the Prometheus text format.
+ * Anything else gets `404 Not Found`.
+ *
+ * @param fd The admin client socket.
+ */
+void Proxy::handleAdminRequest(int fd){
+    string request = receiveFromSocket(fd, 5);
+    istringstream ss(request);
+    string method, path;
+    ss >> method >> path;
+
+    int status = 200;
+    string body;
+    if(path == "/reload"){
+        string message;
+        status = reloadConfig(message) ? 200 : 500;
+        body = message + "\n";
+    } else if(path == "/config"){
+        body = currentConfig()->toString();
+    } else if(path == "/numa"){
+        body = Numa::stats();
+    } else if(path == "/metrics"){
+        body = metrics();
+    } else{
+        status = 404;
+        body = "Unknown admin command " + path + "\n";
+    }
+
+    string response = "HTTP/1.1 " + to_string(status) + (status == 200 ? " OK" : status == 404 ? " Not Found" : " Internal Server Error") +
+                      "\r\nContent-Type: text/plain\r\nConnection: close\r\nContent-Length: " + to_string(body.size()) +
+                      "\r\n\r\n" + body;
+    send(fd, response.c_str(), response.length(), MSG_NOSIGNAL);
+}
+
+/**
+ * Asks the accept loop to hand over to a new copy of the binary.
+ * Only sets a flag, so it is safe to call from a signal handler (SIGUSR2).
+ */
+void Proxy::requestUpgrade(){
+    upgrade_requested = true;
+}
+
+/**
+ * Remembers the command line the proxy was started with; `upgrade()` runs it again.
+ * The first argument must be the path of the binary.
+ */
+void Proxy::setCommandLine(const vector<string>& args){
+    command_line = args;
+}
+
+/**
+ * Loads the cache written by the previous process and removes the snapshot file.
+ *
+ * @param filename The snapshot file.
+ * @return The number of entries restored.
+ */
+size_t Proxy::loadCacheSnapshot(const string& filename){
+    size_t count = 0;
+    try{
+        count = cache.load(filename, logger);
+        logger->log_note(-1, "Restored " + to_string(count) + " cache entries from " + filename);
+    } catch(const exception& e){
+        logger->log_error(-1, string("Failed to restore cache snapshot: ") + e.what());
+    }
+    unlink(filename.c_str());
+    return count;
+}
+
+/**
+ * Starts the new binary and hands the listening sockets and the cache over to it.
+ * - Writes the cache to `cache_snapshot_file` and opens the `upgrade_socket` channel.
+ * - Runs the saved command line again with `PROXY_UPGRADE_SOCKET` set.
+ * - Sends the proxy and admin listeners over the channel and waits for `READY`.
+ * Runs on `upgrade_thread` while the accept loop keeps serving, and the listening sockets are
+ * shared, so no connection waits in the backlog while the new process starts and loads the cache.
+ * If the new process fails to start or to report ready, it is killed and the old one keeps serving.
+ * Refused while capturing traffic, since the new process would truncate the capture file.
+ *
+ * @return `true` if the new process took over the listeners.
+ */
+bool Proxy::upgrade(){
+    shared_ptr<const Config> cfg = currentConfig();
+    if(command_line.empty()){
+        logger->log_error(-1, "Upgrade failed: command line unknown");
+        return false;
+    }
+    if(capture){
+        // The new process would reopen (and truncate) the file this one is still writing
+        logger->log_error(-1, "Upgrade refused while capturing traffic to " + cfg->capture_file);
+        return false;
+    }
+    logger->log_note(-1, "Starting upgrade to " + command_line[0]);
+
+    int channel_fd;
+    try{
+        channel_fd = Handoff::listenChannel(cfg->upgrade_socket);
+    } catch(const exception& e){
+        logger->log_error(-1, string("Upgrade failed: ") + e.what());
+        return false;
+    }
+
+    string snapshot = cfg->cache_snapshot_file;
+    try{
+        size_t count = cache.save(snapshot);
+        logger->log_note(-1, "Saved " + to_string(count) + " cache entries to " + snapshot);
+    } catch(const exception& e){
+        logger->log_error(-1, string("Upgrade continues without the cache: ") + e.what());
+        snapshot.clear();
+    }
+
+    // Everything the child needs is prepared before fork(); the child only closes and execs
+    vector<char*> argv;
+    for(const string& arg : command_line){
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(NULL);
+    vector<string> env_strings;
+    for(char** env = environ; *env != NULL; env++){
+        if(strncmp(*env, HANDOFF_ENV, strlen(HANDOFF_ENV)) != 0){
+            env_strings.push_back(*env);
+        }
+    }
+    env_strings.push_back(string(HANDOFF_ENV) + "=" + cfg->upgrade_socket);
+    vector<char*> envp;
+    for(string& env : env_strings){
+        envp.push_back(&env[0]);
+    }
+    envp.push_back(NULL);
+    struct rlimit limit;
+    int max_fd = (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) ? (int)limit.rlim_cur : 1024;
+
+    pid_t pid = fork();
+    if(pid < 0){
+        logger->log_error(-1, "Upgrade failed: fork failed");
+        close(channel_fd);
+        unlink(cfg->upgrade_socket.c_str());
+        return false;
+    }
+    if(pid == 0){
+        for(int fd = 3; fd < max_fd; fd++){
+            close(fd);
+        }
+        execve(argv[0], argv.data(), envp.data());
+        _exit(127);
+    }
+
+    bool ok = false;
+    int conn_fd = Handoff::acceptChannel(channel_fd, 10000);
+    if(conn_fd < 0){
+        logger->log_error(-1, "Upgrade failed: new process did not connect");
+    } else{
+        try{
+            vector<int> fds = {server_fd};
+            if(admin_fd >= 0){
+                fds.push_back(admin_fd);
+            }
+            Handoff::sendFds(conn_fd, fds, snapshot);
+            ok = Handoff::waitReady(conn_fd, 30000);
+            if(!ok){
+                logger->log_error(-1, "Upgrade failed: new process did not report ready");
+            }
+        } catch(const exception& e){
+            logger->log_error(-1, string("Upgrade failed: ") + e.what());
+        }
+        close(conn_fd);
+    }
+    close(channel_fd);
+    unlink(cfg->upgrade_socket.c_str());
+
+    if(!ok){
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        if(!snapshot.empty()){
+            unlink(snapshot.c_str());
+        }
+        return false;
+    }
+    logger->log_note(-1, "Upgrade handed over to process " + to_string(pid));
+    return true;
+}
+
+/**
+ * Forks one prefork worker. The worker runs the usual accept loop on the inherited
+ * listener and exits when it stops; it never returns to the supervisor's code.
+ *
+ * @param index The worker's slot, which also spaces out its request IDs.
+ * @return The worker's pid, or -1 if fork failed.
+ */
+pid_t Proxy::startWorker(int index){
+    logger->flush();
+    pid_t pid = fork();
+    if(pid < 0){
+        logger->log_error(-1, "Failed to fork worker " + to_string(index));
+        return -1;
+    }
+    if(pid == 0){
+        worker_index = index;
+        worker_pids.clear();
+        if(admin_fd >= 0){
+            close(admin_fd);
+            admin_fd = -1;
+        }
+        request_count = (index + 1) * WORKER_REQUEST_ID_STRIDE;
+        applyAffinity(index);
+        run();
+        exit(0);
+    }
+    logger->log_note(-1, "Started worker " + to_string(index) + " as process " + to_string(pid));
+    return pid;
+}
+
+/**
+ * Pins the calling thread according to `cpu_affinity` and, with `numa_cache_shards`,
+ * switches to the shared cache shard of the node it now runs on.
+ * Connection threads are created by the pinned accept loop and inherit its CPUs, so a
+ * client is served, and its cache objects allocated, on the node that accepted it.
+ *
+ * @param index The worker index (0 without workers); workers are spread across nodes/CPUs by it.
+ */
+void Proxy::applyAffinity(int index){
+    shared_ptr<const Config> cfg = currentConfig();
+    if(cfg->cpu_affinity == "off"){
+        return;
+    }
+
+    size_t node_pos = index % numa_nodes.size();
+    vector<int> cpus;
+    if(cfg->cpu_affinity == "node"){
+        cpus = numa_nodes[node_pos].cpus;
+    } else{
+        // One CPU per worker: "core" interleaves the nodes, a list is used as given
+        vector<int> order;
+        if(cfg->cpu_affinity == "core"){
+            for(size_t i = 0; order.size() < (size_t)CPU_SETSIZE; i++){
+                bool any = false;
+                for(const NumaNode& node : numa_nodes){
+                    if(i < node.cpus.size()){
+                        order.push_back(node.cpus[i]);
+                        any = true;
+                    }
+                }
+                if(!any){break;}
+            }
+        } else{
+            order = Numa::parseCpuList(cfg->cpu_affinity);
+        }
+        int cpu = order[index % order.size()];
+        cpus.push_back(cpu);
+        for(size_t i = 0; i < numa_nodes.size(); i++){
+            if(find(numa_nodes[i].cpus.begin(), numa_nodes[i].cpus.end(), cpu) != numa_nodes[i].cpus.end()){
+                node_pos = i;
+            }
+        }
+    }
+
+    string cpu_list;
+    for(int cpu : cpus){
+        cpu_list += (cpu_list.empty() ? "" : ",") + to_string(cpu);
+    }
+    if(!Numa::pinThread(cpus)){
+        logger->log_error(-1, "Failed to pin to CPUs " + cpu_list);
+        return;
+    }
+    if(cfg->numa_cache_shards){
+        cache.useShard(node_pos);
+    }
+    logger->log_note(-1, "Pinned " + (worker_index >= 0 ? "worker " + to_string(index) : string("proxy")) +
+                         " to CPUs " + cpu_list + " on NUMA node " + to_string(numa_nodes[node_pos].id));
+}
+
+/**
+ * Adjusts the cache's byte budget to the memory situation (called from the accept loop).
+ * - The target is `cache_max_bytes`, or `cache_memory_fraction` of the memory limit.
+ * - Under pressure (PSI `some avg10` at `memory_pressure_threshold`, or usage above 90% of
+ *   the limit) the budget is halved, never above what the cache holds, so eviction is immediate.
+ * - Once pressure is below half the threshold and usage below 80%, the budget grows back
+ *   by a tenth of the target per check.
+ * Each change is logged; the current values are exported on `/metrics`.
+ */
+void Proxy::checkMemoryPressure(){
+    shared_ptr<const Config> cfg = currentConfig();
+    auto now = chrono::steady_clock::now();
+    if (cfg->memory_check_interval <= 0 ||
+        chrono::duration<double>(now - last_memory_check).count() < cfg->memory_check_interval) {
+        return;
+    }
+    last_memory_check = now;
+
+    size_t limit = memory_pressure.limit();
+    size_t current = memory_pressure.current();
+    double psi = memory_pressure.pressure();
+    size_t target = cfg->cache_max_bytes > 0 ? cfg->cache_max_bytes : (size_t)(limit * cfg->cache_memory_fraction);
+    size_t budget = cache_budget > 0 ? cache_budget.load() : target;
+
+    bool pressured = psi >= cfg->memory_pressure_threshold || (limit > 0 && current > limit / 10 * 9);
+    bool relaxed = psi < cfg->memory_pressure_threshold / 2 && (limit == 0 || current < limit / 10 * 8);
+    size_t next = budget;
+    if (pressured) {
+        next = max((size_t)CACHE_MIN_BUDGET, min(budget, cache.bytes()) / 2);
+    } else if (relaxed && budget < target) {
+        next = min(target, budget + max(target / 10, (size_t)CACHE_MIN_BUDGET));
+    } else if (budget > target) {
+        next = target; // cache_max_bytes was lowered
+    }
+
+    if (next != cache_budget) {
+        if (cache_budget > 0) {
+            (next < cache_budget ? budget_shrinks : budget_grows)++;
+        }
+        logger->log_note(-1, "Cache budget " + to_string(cache_budget.load()) + " -> " + to_string(next) +
+                             " bytes (PSI " + to_string(psi) + "%, memory " + to_string(current) + "/" + to_string(limit) + ")");
+        cache.setByteBudget(next, logger);
+        cache_budget = next;
+    }
+}
+
+/**
+ * Renders the proxy's metrics in the Prometheus text format (admin `/metrics`).
+ */
+string Proxy::metrics(){
+    stringstream ss;
+    // HELP and TYPE lines of a family; its samples, one per label set, follow together
+    auto family = [&ss](const string& name, const string& help, const string& type){
+        ss << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+    };
+    auto gauge = [&ss, &family](const string& name, const string& help, double value){
+        family(name, help, "gauge");
+        ss << name << " " << fixed << value << "\n";
+    };
+    auto counter = [&ss, &family](const string& name, const string& help, double value){
+        family(name, help, "counter");
+        ss << name << " " << fixed << value << "\n";
+    };
+    ss.precision(0);
+    gauge("proxy_active_connections", "Client connections being served.", active_connections);
+    gauge("proxy_hit_lane_connections", "Connections beyond max_connections served only from cache.", hit_lane_connections);
+    counter("proxy_hit_lane_served_total", "Cache hits served on the hit lane.", hit_lane_served);
+    counter("proxy_hit_lane_rejected_total", "Hit-lane requests refused because they were not fresh cache hits.", hit_lane_rejected);
+    gauge("proxy_cache_entries", "Responses in the cache.", cache.size());
+    gauge("proxy_cache_bytes", "Bytes held by cached responses.", cache.bytes());
+    gauge("proxy_cache_budget_bytes", "Cache byte budget set by the memory-pressure controller.", cache_budget);
+    counter("proxy_cache_budget_shrinks_total", "Times memory pressure shrank the cache budget.", budget_shrinks);
+    counter("proxy_cache_budget_grows_total", "Times the cache budget grew back.", budget_grows);
+    vector<RefreshRule> rules = cache.refreshRules();
+    vector<string> rule_labels;
+    for(const RefreshRule& rule : rules){
+        string pattern;
+        for(char c : rule.line){
+            if(c == '\\' || c == '"'){
+                pattern += '\\';
+            }
+            pattern += c;
+        }
+        rule_labels.push_back("{rule=\"" + pattern + "\"}");
+    }
+    family("proxy_refresh_applied_total", "Responses given heuristic freshness by each refresh_pattern rule.", "counter");
+    for(size_t i = 0; i < rules.size(); i++){
+        ss << "proxy_refresh_applied_total" << rule_labels[i] << " " << rules[i].counters->applied << "\n";
+    }
+    family("proxy_refresh_hits_total", "Cache hits fresh only by the heuristic freshness of each refresh_pattern rule.", "counter");
+    for(size_t i = 0; i < rules.size(); i++){
+        ss << "proxy_refresh_hits_total" << rule_labels[i] << " " << rules[i].counters->hits << "\n";
+    }
+    counter("proxy_prefetch_queued_total", "Subresources of HTML pages queued for prefetching.", prefetcher.queued);
+    counter("proxy_prefetch_dropped_total", "Subresources not prefetched because the queue was full.", prefetcher.dropped);
+    counter("proxy_prefetch_fetched_total", "Prefetches completed.", prefetcher.fetched);
+    counter("proxy_prefetch_stored_total", "Prefetches that put a response in the cache.", prefetcher.stored_count);
+    counter("proxy_prefetch_useful_total", "Prefetched responses later hit by a client.", prefetcher.useful);
+    gauge("proxy_prefetch_queue_length", "Subresources waiting to be prefetched.", prefetcher.queueLength());
+    counter("proxy_bypass_streamed_total", "GETs streamed past the cache for a prefix that is never cacheable.", bypass_learner.streamed);
+    counter("proxy_bypass_probes_total", "GETs of a bypassed prefix sent the normal way to see if it became cacheable.", bypass_learner.probes);
+    gauge("proxy_bypass_prefixes", "Path prefixes and origins currently bypassing the cache.", bypass_learner.bypassedCount());
+    counter("proxy_bypass_learned_total", "Path prefixes and origins that started bypassing the cache.", bypass_learner.learned);
+    counter("proxy_bypass_unlearned_total", "Bypassed path prefixes and origins that answered cacheably again.", bypass_learner.unlearned);
+    counter("proxy_negative_cached_total", "404, 410 and 301 responses cached.", negative_cached);
+    gauge("proxy_failure_cache_entries", "Origins whose DNS or connect failure is remembered.", failure_cache.size());
+    counter("proxy_failure_cache_hits_total", "Requests answered from the failure cache.", failure_cache.hits);
+    gauge("proxy_memory_limit_bytes", "cgroup memory.max, or machine memory.", memory_pressure.limit());
+    gauge("proxy_memory_current_bytes", "cgroup memory.current.", memory_pressure.current());
+    gauge("proxy_h2_upstream_connections", "HTTP/2 connections open to origins.", h2_pool.openConnections());
+    counter("proxy_h2_upstream_connections_opened_total", "HTTP/2 connections opened to origins.", h2_pool.connections_opened);
+    counter("proxy_h2_upstream_streams_total", "Requests sent to origins as HTTP/2 streams.", h2_pool.streams_opened);
+    counter("proxy_h2_upstream_fallbacks_total", "Requests sent over HTTP/1.1 with h2_upstream on.", h2_pool.fallbacks);
+    gauge("proxy_relayed_connections", "CONNECT tunnels and upgraded connections held by the relay.", relay.size());
+    gauge("proxy_tls_idle_connections", "Idle TLS connections to origins kept for reuse.", tls_pool.idleConnections());
+    counter("proxy_tls_handshakes_total", "TLS handshakes with origins.", tls_pool.handshakes);
+    counter("proxy_tls_resumptions_total", "TLS handshakes with origins that resumed a cached session.", tls_pool.resumptions);
+    counter("proxy_tls_reuses_total", "Requests sent on a pooled TLS connection.", tls_pool.reuses);
+    gauge("proxy_open_circuits", "Origins whose circuit breaker is open or half-open.", origin_health.openCircuits());
+    counter("proxy_circuit_trips_total", "Times an origin's circuit breaker opened.", origin_health.trips);
+    counter("proxy_circuit_fast_failures_total", "Requests not sent to an origin because its breaker was open.", origin_health.fast_failures);
+    counter("proxy_circuit_stale_served_total", "Stale cached responses served while an origin's breaker was open.", origin_health.stale_served);
+    vector<Balancer::Stats> upstreams = balancer.stats();
+    family("proxy_upstream_requests_total", "Connections opened to each origin address.", "counter");
+    for(const Balancer::Stats& address : upstreams){
+        ss << "proxy_upstream_requests_total{address=\"" << address.address << "\"} " << address.requests << "\n";
+    }
+    family("proxy_upstream_connect_failures_total", "Failed connections to each origin address.", "counter");
+    for(const Balancer::Stats& address : upstreams){
+        ss << "proxy_upstream_connect_failures_total{address=\"" << address.address << "\"} " << address.failures << "\n";
+    }
+    family("proxy_upstream_outstanding", "Client requests holding a connection to each origin address.", "gauge");
+    for(const Balancer::Stats& address : upstreams){
+        ss << "proxy_upstream_outstanding{address=\"" << address.address << "\"} " << address.outstanding << "\n";
+    }
+    family("proxy_upstream_ejected", "1 while an origin address is ejected after repeated connect failures.", "gauge");
+    for(const Balancer::Stats& address : upstreams){
+        ss << "proxy_upstream_ejected{address=\"" << address.address << "\"} " << (address.ejected ? 1 : 0) << "\n";
+    }
+    family("proxy_upstream_connect_seconds", "Smoothed connect time to each origin address.", "gauge");
+    for(const Balancer::Stats& address : upstreams){
+        ss << "proxy_upstream_connect_seconds{address=\"" << address.address << "\"} " << to_string(address.connect_time) << "\n";
+    }
+    gauge("proxy_parent_idle_connections", "Idle connections to parent proxies kept for reuse.", parent_pool.idleConnections());
+    counter("proxy_parent_requests_total", "Requests sent through a parent proxy.", parent_pool.requests);
+    counter("proxy_parent_reuses_total", "Requests sent on a pooled parent connection.", parent_pool.reuses);
+    counter("proxy_parent_failovers_total", "Requests sent to a later parent because the first was unreachable.", parent_pool.failovers);
+    counter("proxy_parent_direct_fallbacks_total", "Requests sent direct because no parent was reachable.", parent_direct_fallbacks);
+    counter("proxy_origin_retries_total", "GET misses sent again after the origin connection failed.", origin_retries);
+    counter("proxy_hedges_total", "GET misses sent to a second origin address after the first was slow.", hedger.hedges);
+    counter("proxy_hedge_wins_total", "Hedged requests where the second address answered first.", hedger.wins);
+    counter("proxy_hedge_budget_exhausted_total", "Hedges skipped because the hedge budget was spent.", hedger.budget_exhausted);
+    gauge("proxy_rate_limit_clients", "Clients and subnets tracked by the rate limiter.", rate_limiter.trackedClients());
+    counter("proxy_rate_limited_total", "Requests refused with 429 over the rate limit.", rate_limiter.limited);
+    counter("proxy_rate_delayed_total", "Requests delayed until their client had tokens.", rate_limiter.delayed);
+    counter("proxy_rate_share_rejections_total", "Connections refused beyond the client's fair share.", rate_limiter.share_rejections);
+    gauge("proxy_acl_rules", "Client ACL rules compiled into the trie.", atomic_load(&access_list)->size());
+    counter("proxy_acl_denied_total", "Connections closed with 403 by a deny rule.", acl_denied);
+    counter("proxy_acl_unlimited_total", "Connections exempted from rate_limit by an unlimited rule.", acl_unlimited);
+    counter("proxy_acl_nocache_total", "GETs that bypassed the cache by a nocache rule.", acl_nocache);
+    counter("proxy_rate_table_full_total", "Clients not limited because the rate table was full.", rate_limiter.table_full);
+    ss.precision(2);
+    gauge("proxy_memory_pressure_avg10", "PSI memory some avg10 percentage, -1 if unavailable.", memory_pressure.pressure());
+    return ss.str();
+}
+
+/**
+ * Runs the prefork supervisor: keeps `workers` processes accepting on the shared listener.
+ * - A worker that exits or crashes is restarted; its connections are lost, the others' are not.
+ * - Serves the admin listener itself; a reload is forwarded to the workers as SIGHUP.
+ * - On stop, sends SIGINT to the workers and waits for them.
+ * The supervisor stays single-threaded so that forking a replacement worker is safe.
+ */
+void Proxy::supervise(){
+    worker_pids.assign(currentConfig()->workers, -1);
+    while (running) {
+        for (size_t i = 0; i < worker_pids.size() && running; i++) {
+            if (worker_pids[i] < 0) {
+                worker_pids[i] = startWorker(i);
+            }
+        }
+
+        if (reload_requested.exchange(false)) {
+            string message;
+            reloadConfig(message);
+        }
+        if (upgrade_requested.exchange(false)) {
+            logger->log_error(-1, "Binary upgrade is not supported with workers");
+        }
+        checkMemoryPressure();
+
+        struct pollfd pfd;
+        pfd.fd = admin_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, admin_fd >= 0 ? 1 : 0, 1000) > 0) {
+            int fd = accept(admin_fd, NULL, NULL);
+            if (fd >= 0) {
+                handleAdminRequest(fd);
+                close(fd);
+            }
+        }
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (size_t i = 0; i < worker_pids.size(); i++) {
+                if (worker_pids[i] != pid) {
+                    continue;
+                }
+                worker_pids[i] = -1;
+                if (WIFSIGNALED(status)) {
+                    logger->log_error(-1, "Worker " + to_string(i) + " (process " + to_string(pid) +
+                                          ") killed by signal " + to_string(WTERMSIG(status)) + ", restarting");
+                } else if (running) {
+                    logger->log_note(-1, "Worker " + to_string(i) + " (process " + to_string(pid) +
+                                         ") exited with status " + to_string(WEXITSTATUS(status)) + ", restarting");
+                }
+            }
+        }
+    }
+
+    for (pid_t pid : worker_pids) {
+        if (pid > 0) {
+            kill(pid, SIGINT);
+        }
+    }
+    for (pid_t pid : worker_pids) {
+        if (pid > 0) {
+            waitpid(pid, NULL, 0);
+        }
+    }
+    worker_pids.clear();
+}
+
+/**
+ * Lets the connections of an upgraded process finish.
+ * Closes (never shuts down) the listeners, which now belong to the new process as well,
+ * then waits until no connection is active or `upgrade_drain_timeout` passes.
+ */
+void Proxy::drain(){
+    accepting = false;
+    if (admin_thread.joinable()) {
+        admin_thread.join();
+    }
+    close(server_fd);
+    server_fd = -1;
+    if (admin_fd >= 0) {
+        close(admin_fd);
+        admin_fd = -1;
+    }
+
+    double timeout = currentConfig()->upgrade_drain_timeout;
+    logger->log_note(-1, "Draining " + to_string(active_connections.load()) + " connections");
+    auto start = chrono::steady_clock::now();
+    while (running && active_connections > 0 &&
+           chrono::duration<double>(chrono::steady_clock::now() - start).count() < timeout) {
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    if (active_connections > 0) {
+        logger->log_note(-1, "Drain timeout, dropping " + to_string(active_connections.load()) + " connections");
+    }
+    running = false;
+    logger->log_note(-1, "Old process exiting after upgrade");
+}
+
+/**
+ * Starts recording client requests and origin responses to a capture file.
+ * Replay the file with the `replay` tool to reproduce the recorded workload.
+ *
+ * @param filename The capture file to write.
+ * @throws `std::runtime_error` if the capture file cannot be opened.
+ */
+void Proxy::enableCapture(const string& filename){
+    capture = make_unique<Capture>(filename);
+    logger->log_note(-1, "Capturing traffic to " + filename);
 }
 
 /**
  * Handles a client request by spawning a new thread.
  * Eexecuted in a separate thread for each client request.
+ * With `h2c` on, a connection that starts with the HTTP/2 preface is served by `H2Connection`,
+ * which runs `receiveClient()` once per stream.
  *
  * @param client_fd The socket file descriptor for the client.
- * @param client_addr The `sockaddr_in` structure containing the client's address.
+ * @param client_addr The client's address; IPv4 clients are IPv4-mapped.
+ * @param rate_counted Whether the connection was counted by the rate limiter when accepted.
+ * @param hit_only Whether the connection was accepted on the hit lane (see `processHitLane()`).
  */
-void Proxy::handleClientRequest(int client_fd, sockaddr_in client_addr) {
-    receiveClient(client_fd, client_addr);
+void Proxy::handleClientRequest(int client_fd, sockaddr_in6 client_addr, bool rate_counted, bool hit_only, int access) {
+    shared_ptr<const Config> current = currentConfig();
+    if(current->h2c && H2Connection::hasPreface(client_fd, current->request_timeout)){
+        H2Connection connection(client_fd, [this, client_addr, hit_only, access](int stream_fd){
+            receiveClient(stream_fd, client_addr, hit_only, access);
+        }, logger, current->h2_max_concurrent_streams, current->client_timeout);
+        size_t streams = connection.serve();
+        logger->log_note(-1, "HTTP/2 connection closed after " + to_string(streams) + " streams");
+    } else{
+        receiveClient(client_fd, client_addr, hit_only, access);
+    }
     close(client_fd);
+    if(rate_counted){
+        rate_limiter.closeConnection(client_addr.sin6_addr);
+    }
+    if(hit_only){
+        hit_lane_connections--;
+    }
+    active_connections--;
 }
 
 /**
@@ -791,16 +2221,65 @@ void Proxy::handleClientRequest(int client_fd, sockaddr_in client_addr) {
  * - Enters a loop to accept incoming client connections.
  * - Spawns a new thread for each accepted connection.
  * - Uses `select()` with a timeout to check for incoming connections.
+ * - Reloads the configuration when `requestReload()` was called (checked every second).
+ * - Once `max_connections` are being served, accepts up to `hit_lane_connections` more on the
+ *   hit lane, which only serves fresh cache hits; beyond that, and with `rate_limit` on for a
+ *   client holding more than its fair share, rejects clients with `503 Service Unavailable`.
+ * - Closes connections from clients the ACL denies with `403 Forbidden`, see `configureAccess()`.
  * - Logs errors for failed connections and thread creation issues.
  * - Maintains a list of active threads and removes finished ones.
+ * - Serves the admin listener on a separate thread when `admin_port` is set.
+ * - Hands over to a new binary when `requestUpgrade()` was called, accepting connections until
+ *   the new process is ready, then drains and returns.
+ * - With `workers` set, the calling process becomes the prefork supervisor (see `supervise()`)
+ *   and each worker runs this loop.
  */
 void Proxy::run() {
     if (!running) {
         running = true;
         logger->log_note(-1, "Proxy started and waiting for connections");
     }
+
+    if (currentConfig()->workers > 0 && worker_index < 0) {
+        supervise();
+        return;
+    }
+    if (worker_index < 0) {
+        applyAffinity(0);
+    }
+
+    if (admin_fd >= 0) {
+        admin_thread = thread(&Proxy::adminLoop, this);
+    }
     
     while (running) {
+        if (reload_requested.exchange(false)) {
+            string message;
+            reloadConfig(message);
+        }
+        if (upgrade_requested.exchange(false)) {
+            if (upgrading) {
+                logger->log_note(-1, "Upgrade already in progress");
+            } else {
+                if (upgrade_thread.joinable()) {
+                    upgrade_thread.join();  // an earlier upgrade that failed
+                }
+                upgrading = true;
+                upgrade_thread = thread([this]() {
+                    upgraded = upgrade();
+                    upgrading = false;
+                });
+            }
+        }
+        if (upgraded) {
+            upgrade_thread.join();
+            drain();
+            return;
+        }
+        if (worker_index < 0) {
+            checkMemoryPressure(); // the supervisor sizes the shared cache for the workers
+        }
+
         fd_set readfds;
         FD_ZERO(&readfds);
         FD_SET(server_fd, &readfds);
@@ -821,10 +2300,10 @@ void Proxy::run() {
         }
         
         int client_fd;
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
+        struct sockaddr_storage peer;
+        socklen_t client_len = sizeof(peer);
         
-        client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
+        client_fd = accept(server_fd, (struct sockaddr*)&peer, &client_len);
         
         if (client_fd < 0) {
             if (running) {
@@ -832,11 +2311,55 @@ void Proxy::run() {
             }
             continue;
         }
+
+        // One address form for both families: an IPv4-only listener's clients are mapped as well
+        struct sockaddr_in6 client_addr;
+        if (peer.ss_family == AF_INET6) {
+            client_addr = *(struct sockaddr_in6*)&peer;
+        } else {
+            const struct sockaddr_in* peer4 = (const struct sockaddr_in*)&peer;
+            memset(&client_addr, 0, sizeof(client_addr));
+            client_addr.sin6_family = AF_INET6;
+            client_addr.sin6_port = peer4->sin_port;
+            client_addr.sin6_addr.s6_addr[10] = client_addr.sin6_addr.s6_addr[11] = 0xff;
+            memcpy(client_addr.sin6_addr.s6_addr + 12, &peer4->sin_addr, 4);
+        }
         
+        // Client access control, before anything else is spent on the connection
+        int access = atomic_load(&access_list)->lookup(client_addr.sin6_addr);
+        if (access & ACL_DENY) {
+            acl_denied++;
+            sendErrorResponse(client_fd, 403, "Forbidden");
+            close(client_fd);
+            continue;
+        }
+
+        shared_ptr<const Config> cfg = currentConfig();
         struct timeval tv_client;
-        tv_client.tv_sec = 30;
-        tv_client.tv_usec = 0;
+        tv_client.tv_sec = (time_t)cfg->client_timeout;
+        tv_client.tv_usec = (suseconds_t)((cfg->client_timeout - tv_client.tv_sec) * 1000000);
         setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv_client, sizeof(tv_client));
+
+        bool hit_only = false;
+        if (cfg->max_connections > 0 && active_connections >= cfg->max_connections) {
+            if (hit_lane_connections >= cfg->hit_lane_connections) {
+                logger->log_error(-1, "Connection limit reached, rejecting client");
+                sendErrorResponse(client_fd, 503, "Service Unavailable");
+                close(client_fd);
+                continue;
+            }
+            hit_only = true; // slots are held by misses; still serve what the cache has
+        }
+        bool rate_counted = cfg->rate_limit && !(access & ACL_UNLIMITED);
+        if (cfg->rate_limit && !rate_counted) {
+            acl_unlimited++;
+        }
+        if (rate_counted && !rate_limiter.openConnection(client_addr.sin6_addr, active_connections, *cfg)) {
+            logger->log_error(-1, "Client over its share of connections, rejecting client");
+            sendErrorResponse(client_fd, 503, "Service Unavailable");
+            close(client_fd);
+            continue;
+        }
         
         try {
             std::lock_guard<std::mutex> lock(requested_mutex);
@@ -852,7 +2375,11 @@ void Proxy::run() {
             }
             
             // Create new thread for this request and call the functions to handle the request
-            threads.emplace_back(&Proxy::handleClientRequest, this, client_fd, client_addr);
+            active_connections++;
+            if (hit_only) {
+                hit_lane_connections++;
+            }
+            threads.emplace_back(&Proxy::handleClientRequest, this, client_fd, client_addr, rate_counted, hit_only, access);
             
             threads.back().detach();
             
@@ -861,9 +2388,23 @@ void Proxy::run() {
         }
         catch (const std::exception& e) { // Catch exceptions
             logger->log_error(-1, "Failed to create thread: " + std::string(e.what()));
+            active_connections--;
+            if (hit_only) {
+                hit_lane_connections--;
+            }
+            if (rate_counted) {
+                rate_limiter.closeConnection(client_addr.sin6_addr);
+            }
             close(client_fd);
         }
     }
+
+    if (upgrade_thread.joinable()) {
+        upgrade_thread.join();
+    }
+    if (admin_thread.joinable()) {
+        admin_thread.join();
+    }
 }
 
 /**
@@ -880,8 +2421,15 @@ void Proxy::stop() {
     
     running = false;
     
-    shutdown(server_fd, SHUT_RDWR);
-    close(server_fd);
+    if (server_fd >= 0) {
+        if (worker_index < 0) {
+            shutdown(server_fd, SHUT_RDWR); // a worker shares the listener with its siblings
+        }
+        close(server_fd);
+    }
+    if (admin_fd >= 0) {
+        close(admin_fd);
+    }
     
     lock_guard<mutex> lock(requested_mutex);
     
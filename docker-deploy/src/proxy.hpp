@@ -14,11 +14,33 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <csignal>
+#include <chrono>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <sstream>
+#include <random>
 #include "cache.hpp"
+#include "capture.hpp"
+#include "config.hpp"
+#include "h2.hpp"
+#include "h2pool.hpp"
+#include "tls.hpp"
+#include "handoff.hpp"
+#include "numa.hpp"
+#include "pressure.hpp"
+#include "ratelimit.hpp"
+#include "hedge.hpp"
+#include "health.hpp"
+#include "balance.hpp"
+#include "parent.hpp"
+#include "bypass.hpp"
+#include "prefetch.hpp"
+#include "access.hpp"
+#include "relay.hpp"
 #include "log.hpp"
 #include "request.hpp"
 #include "response.hpp"
@@ -29,28 +51,101 @@ using namespace std;
 class Proxy{
 private:
     int server_fd;
+    int admin_fd{-1};
+    shared_ptr<const Config> config;
+    string config_path;
+    mutex reload_mutex;
+    atomic<bool> reload_requested{false};
+    atomic<bool> upgrade_requested{false};
+    atomic<bool> upgrading{false};          // upgrade() is running on upgrade_thread
+    atomic<bool> upgraded{false};           // ... and the new process reported ready
+    thread upgrade_thread;
+    atomic<bool> accepting{true};
+    vector<string> command_line;
+    vector<pid_t> worker_pids;
+    int worker_index{-1};
+    vector<NumaNode> numa_nodes;
+    MemoryPressure memory_pressure;
+    atomic<size_t> cache_budget{0};
+    atomic<size_t> budget_shrinks{0};
+    atomic<size_t> budget_grows{0};
+    chrono::steady_clock::time_point last_memory_check;
+    atomic<size_t> active_connections{0};
+    atomic<size_t> hit_lane_connections{0};
+    atomic<size_t> hit_lane_served{0};
+    atomic<size_t> hit_lane_rejected{0};
+    atomic<size_t> origin_retries{0};
+    atomic<size_t> parent_direct_fallbacks{0};
+    atomic<size_t> negative_cached{0};
+    shared_ptr<const AccessList> access_list{make_shared<const AccessList>()};
+    atomic<size_t> acl_denied{0};
+    atomic<size_t> acl_unlimited{0};
+    atomic<size_t> acl_nocache{0};
+    thread admin_thread;
     unique_ptr<Logger> logger;
+    unique_ptr<Capture> capture;
+    OriginHealth origin_health;         // before the pools, whose threads connect through connectServer()
+    FailureCache failure_cache;
+    BypassLearner bypass_learner;
+    Balancer balancer;
+    H2Pool h2_pool;
+    TlsPool tls_pool;
+    ParentPool parent_pool;
+    Relay relay;
+    RateLimiter rate_limiter;
+    Hedger hedger;
     Cache cache;
+    Prefetcher prefetcher;              // after the cache and pools its threads fetch through
     atomic<int> request_count;
     atomic<bool> running;
     vector<thread> threads;
     mutex requested_mutex;
 
     int generateRequestID();
-    string receiveFromSocket(int socket_fd, int timeout = 10);
+    shared_ptr<const Config> currentConfig() const;
+    int openListener(const string& address, int port, int backlog);
+    void adminLoop();
+    void handleAdminRequest(int fd);
+    bool upgrade();
+    void supervise();
+    pid_t startWorker(int index);
+    void applyAffinity(int index);
+    void checkMemoryPressure();
+    string metrics();
+    void drain();
+    string receiveFromSocket(int socket_fd, double timeout);
     vector<char> handleChunkResponse(int server_fd, int client_fd);
     vector<char> handleLongResponse(int server_fd);
     void handleCaching(Response* response, const string& url, int request_id);
-    void receiveClient(int client_fd, struct sockaddr_in client_addr);
+    void receiveClient(int client_fd, struct sockaddr_in6 client_addr, bool hit_only = false, int access = 0);
     void sendErrorResponse(int client_fd, int status_code, const string& reason);
-    int connectServer(const string& host, int port);
+    bool answerFromFailureCache(int client_fd, const string& origin, int request_id);
+    void streamGet(int client_fd, Request& request, int port, const string& origin, int request_id);
+    void prefetchLinks(const Response* response, const string& full_url, int request_id);
+    void prefetch(const string& url);
+    int rememberFailure(const string& origin, int request_id);
+    int connectServer(const string& host, int port, size_t first_address = 0, size_t* address_count = NULL);
+    int connectOrigin(const string& host, int port, bool tls = false, size_t attempt = 0);
+    int fetchOrigin(Request& request, int port, const string& origin_request, double header_timeout,
+                    int request_id, string& initial);
+    void sendCached(int client_fd, Response* cached_resp, int request_id);
     void processGet(int client_fd, Request& request, int request_id);
+    void processHitLane(int client_fd, Request& request, int request_id);
     void processPost(int client_fd, Request& request, int request_id);
     void processConnect(int client_fd, Request& request, int request_id);
-    void handleClientRequest(int client_fd, sockaddr_in client_addr);
+    void processUpgrade(int client_fd, Request& request, int request_id);
+    void handleClientRequest(int client_fd, sockaddr_in6 client_addr, bool rate_counted, bool hit_only, int access);
+    void configureAccess(const Config& new_config);
 
 public:
-    Proxy(int port);
+    explicit Proxy(const Config& initial_config, const string& config_file = "",
+                   int inherited_fd = -1, int inherited_admin_fd = -1);
+    void enableCapture(const string& filename);
+    bool reloadConfig(string& message);
+    void requestReload();
+    void requestUpgrade();
+    void setCommandLine(const vector<string>& args);
+    size_t loadCacheSnapshot(const string& filename);
     void run();
     void stop();
 
@@ -0,0 +1,270 @@
+#include "ratelimit.hpp"
+
+#define RATE_FULL INT32_MAX         // token count of a new bucket; refill() caps it at the burst
+
+RateLimiter::RateLimiter()
+    : slots(new Slot[RATE_SHARDS * RATE_SHARD_SLOTS]), start(chrono::steady_clock::now()) {}
+
+uint32_t RateLimiter::nowMs() const {
+    return (uint32_t)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @return The first `bytes` bytes of an IPv6 address, hashed into the low 40 bits.
+ */
+static uint64_t hashPrefix(const in6_addr& ip, int bytes){
+    uint64_t prefix = 0;
+    for(int i = 0; i < bytes; i++){
+        prefix = (prefix << 8) | ip.s6_addr[i];
+    }
+    return (prefix * 0x9E3779B97F4A7C15ULL) >> 24;
+}
+
+/**
+ * IPv4 clients are keyed by address; IPv6 clients by their /64, the usual allocation of one host.
+ */
+uint64_t RateLimiter::clientKey(const in6_addr& ip){
+    if(IN6_IS_ADDR_V4MAPPED(&ip)){
+        uint32_t v4;
+        memcpy(&v4, ip.s6_addr + 12, 4);
+        return (1ULL << 40) | ntohl(v4);
+    }
+    return (3ULL << 40) | hashPrefix(ip, 8);
+}
+
+/**
+ * IPv4 subnets are `prefix` bits long; IPv6 clients share a bucket per /48.
+ */
+uint64_t RateLimiter::subnetKey(const in6_addr& ip, int prefix){
+    if(IN6_IS_ADDR_V4MAPPED(&ip)){
+        uint32_t v4;
+        memcpy(&v4, ip.s6_addr + 12, 4);
+        uint32_t mask = prefix <= 0 ? 0 : (prefix >= 32 ? 0xffffffffu : ~(0xffffffffu >> prefix));
+        return (2ULL << 40) | ((uint64_t)prefix << 32) | (ntohl(v4) & mask);
+    }
+    return (4ULL << 40) | hashPrefix(ip, 6);
+}
+
+uint64_t RateLimiter::pack(int64_t tokens, uint32_t ms){
+    return ((uint64_t)(uint32_t)(int32_t)tokens << 32) | ms;
+}
+
+/**
+ * Finds the slot of `key`. With `create`, claims a never-used slot or one whose client has
+ * been idle for `RATE_IDLE_EXPIRY` seconds with no connection open.
+ * @return The slot, or `nullptr` if the key has none (and, with `create`, none is free).
+ */
+RateLimiter::Slot* RateLimiter::find(uint64_t key, bool create){
+    uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+    Slot* shard = &slots[(hash >> 60) % RATE_SHARDS * RATE_SHARD_SLOTS];
+    size_t index = (hash >> 20) % RATE_SHARD_SLOTS;
+    uint32_t now_s = nowMs() / 1000;
+
+    for(int pass = 0; pass < (create ? 2 : 1); pass++){
+        for(size_t i = 0; i < RATE_PROBE; i++){
+            Slot& slot = shard[(index + i) % RATE_SHARD_SLOTS];
+            uint64_t current = slot.key.load();
+            if(current == key){
+                slot.last_seen = now_s;
+                return &slot;
+            }
+            // The first pass only looks for the key, so it is not claimed twice
+            bool expired = current != 0 && slot.connections.load() == 0 && now_s - slot.last_seen.load() > RATE_IDLE_EXPIRY;
+            if(pass == 1 && (current == 0 || expired) && slot.key.compare_exchange_strong(current, key)){
+                slot.requests = pack(RATE_FULL, nowMs());
+                slot.bytes = pack(RATE_FULL, nowMs());
+                slot.last_seen = now_s;
+                return &slot;
+            }
+        }
+    }
+    if(create){
+        table_full++;
+    }
+    return nullptr;
+}
+
+/**
+ * Refills a bucket for the time since its last refill, then takes `cost` tokens.
+ *
+ * @param cost Tokens to take; negative to give tokens back.
+ * @param rate Tokens per second.
+ * @param burst Maximum tokens held.
+ * @param allow_debt Take even if that leaves the bucket negative.
+ * @param taken Set if the tokens were taken.
+ * @return The tokens left.
+ */
+int64_t RateLimiter::refill(atomic<uint64_t>& bucket, int64_t cost, int64_t rate, int64_t burst,
+                            uint32_t now, bool allow_debt, bool& taken){
+    uint64_t old = bucket.load();
+    while(true){
+        int64_t tokens = (int32_t)(old >> 32);
+        uint32_t stamp = (uint32_t)old;
+        int64_t elapsed = max<int32_t>(0, (int32_t)(now - stamp));
+        int64_t credit = elapsed * rate / 1000;
+        if(credit > 0){
+            stamp = now;    // only whole tokens are credited; a shorter interval keeps accruing
+        }
+        tokens = min(burst, tokens + credit);
+        taken = allow_debt || tokens >= cost;
+        int64_t next = taken ? tokens - cost : tokens;
+        next = max<int64_t>(INT32_MIN + 1, min(burst, next));
+        if(bucket.compare_exchange_weak(old, pack(next, stamp))){
+            return next;
+        }
+    }
+}
+
+/**
+ * Takes a request token from a slot, provided its byte bucket is not in debt.
+ * @return 0 if the token was taken, otherwise the seconds until it could be.
+ */
+double RateLimiter::wait(Slot* slot, int64_t request_rate, int64_t request_burst, int64_t byte_rate, uint32_t now){
+    bool taken = true;
+    if(byte_rate > 0){
+        int64_t tokens = refill(slot->bytes, 0, byte_rate, byte_rate, now, false, taken);
+        if(tokens < 0){
+            return (double)-tokens / byte_rate;
+        }
+    }
+    if(request_rate > 0){
+        int64_t tokens = refill(slot->requests, 1000, request_rate, request_burst, now, false, taken);
+        if(!taken){
+            return (double)(1000 - tokens) / request_rate;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Counts a new connection from `ip` and refuses it if the client already holds more than its
+ * fair share of `max_connections`: the slots divided evenly among the clients that have
+ * connections open. The share is only enforced once half of the slots are in use, so a lone
+ * client can still open many connections on an idle proxy.
+ *
+ * @param active_connections Connections currently served by the proxy.
+ * @return `false` if the connection should be refused; it is then not counted.
+ */
+bool RateLimiter::openConnection(const in6_addr& ip, size_t active_connections, const Config& config){
+    Slot* slot = find(clientKey(ip), true);
+    if(!slot){
+        return true;
+    }
+    int32_t held = ++slot->connections;
+    if(held == 1){
+        active_clients++;
+    }
+    if(config.max_connections > 0 && active_connections >= config.max_connections / 2){
+        size_t share = max<size_t>(1, config.max_connections / max<size_t>(1, active_clients));
+        if((size_t)held > share){
+            share_rejections++;
+            closeConnection(ip);
+            return false;
+        }
+    }
+    return true;
+}
+
+void RateLimiter::closeConnection(const in6_addr& ip){
+    Slot* slot = find(clientKey(ip), false);
+    if(!slot){
+        return;
+    }
+    int32_t held = slot->connections.load();
+    while(held > 0 && !slot->connections.compare_exchange_weak(held, held - 1)){}
+    if(held == 1){
+        active_clients--;
+    }
+}
+
+/**
+ * Admits one request from `ip` against the client's and its subnet's buckets. A request
+ * over the rate waits (on its own connection thread) for tokens, up to `rate_limit_max_delay`
+ * seconds; clients within their rates are never delayed.
+ *
+ * @return `false` if the request should be refused with 429.
+ */
+bool RateLimiter::admit(const in6_addr& ip, const Config& config){
+    if(!config.rate_limit){
+        return true;
+    }
+    int64_t request_rate = (int64_t)(config.rate_limit_requests * 1000);
+    int64_t request_burst = (int64_t)(max(config.rate_limit_burst, 1.0) * 1000);
+    int64_t byte_rate = (int64_t)min<size_t>(config.rate_limit_bytes, INT32_MAX / 2);
+    int64_t subnet_rate = (int64_t)(config.rate_limit_subnet_requests * 1000);
+    int64_t subnet_burst = max(request_burst, 2 * subnet_rate);
+    int64_t subnet_byte_rate = (int64_t)min<size_t>(config.rate_limit_subnet_bytes, INT32_MAX / 2);
+
+    Slot* client = find(clientKey(ip), true);
+    bool use_subnet = config.rate_limit_subnet_prefix > 0 && config.rate_limit_subnet_prefix < 32 &&
+                      (subnet_rate > 0 || subnet_byte_rate > 0);
+    Slot* subnet = use_subnet ? find(subnetKey(ip, config.rate_limit_subnet_prefix), true) : nullptr;
+
+    auto deadline = chrono::steady_clock::now() + chrono::duration<double>(config.rate_limit_max_delay);
+    bool waited = false;
+    while(true){
+        uint32_t now = nowMs();
+        double delay = client ? wait(client, request_rate, request_burst, byte_rate, now) : 0;
+        if(delay == 0 && subnet){
+            delay = wait(subnet, subnet_rate, subnet_burst, subnet_byte_rate, now);
+            if(delay > 0 && client && request_rate > 0){
+                bool taken;
+                refill(client->requests, -1000, request_rate, request_burst, now, true, taken);   // give it back
+            }
+        }
+        if(delay == 0){
+            if(waited){
+                delayed++;
+            }
+            return true;
+        }
+        auto until = chrono::steady_clock::now() + chrono::duration<double>(max(delay, 0.001));
+        if(until > deadline){
+            limited++;
+            return false;
+        }
+        this_thread::sleep_until(until);
+        waited = true;
+    }
+}
+
+/**
+ * Charges the origin bytes a request from `ip` consumed to the client's and its subnet's
+ * byte buckets. The buckets may go into debt; later requests wait until it is paid off.
+ */
+void RateLimiter::charge(const in6_addr& ip, size_t bytes, const Config& config){
+    if(!config.rate_limit || bytes == 0){
+        return;
+    }
+    int64_t cost = (int64_t)min<size_t>(bytes, INT32_MAX / 2);
+    uint32_t now = nowMs();
+    bool taken;
+    int64_t byte_rate = (int64_t)min<size_t>(config.rate_limit_bytes, INT32_MAX / 2);
+    if(byte_rate > 0){
+        Slot* client = find(clientKey(ip), true);
+        if(client){
+            refill(client->bytes, cost, byte_rate, byte_rate, now, true, taken);
+        }
+    }
+    int64_t subnet_byte_rate = (int64_t)min<size_t>(config.rate_limit_subnet_bytes, INT32_MAX / 2);
+    if(subnet_byte_rate > 0 && config.rate_limit_subnet_prefix > 0 && config.rate_limit_subnet_prefix < 32){
+        Slot* subnet = find(subnetKey(ip, config.rate_limit_subnet_prefix), true);
+        if(subnet){
+            refill(subnet->bytes, cost, subnet_byte_rate, subnet_byte_rate, now, true, taken);
+        }
+    }
+}
+
+/**
+ * Counts the clients and subnets seen within the last `RATE_IDLE_EXPIRY` seconds.
+ */
+size_t RateLimiter::trackedClients() const {
+    uint32_t now_s = nowMs() / 1000;
+    size_t count = 0;
+    for(size_t i = 0; i < RATE_SHARDS * RATE_SHARD_SLOTS; i++){
+        if(slots[i].key.load() != 0 && now_s - slots[i].last_seen.load() <= RATE_IDLE_EXPIRY){
+            count++;
+        }
+    }
+    return count;
+}
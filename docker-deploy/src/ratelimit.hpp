@@ -0,0 +1,73 @@
+#ifndef _RATELIMIT_HPP_
+#define _RATELIMIT_HPP_
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdint>
+#include <memory>
+#include <cstring>
+#include <arpa/inet.h>
+#include "config.hpp"
+
+using namespace std;
+
+#define RATE_SHARDS 16
+#define RATE_SHARD_SLOTS 1024
+#define RATE_PROBE 8                // slots tried per lookup before the table counts as full
+#define RATE_IDLE_EXPIRY 60         // seconds after which an idle client's slot can be reused
+
+/**
+ * Per-client and per-subnet token buckets, plus a fair share of connection slots.
+ * Clients are passed as IPv6 addresses, IPv4 clients IPv4-mapped; an IPv6 client is keyed by
+ * its /64 and shares a subnet bucket with its /48.
+ *
+ * State lives in a fixed table of atomic slots, sharded by key hash and probed linearly;
+ * lookups, refills and charges are compare-and-swap loops, so the accept loop and the
+ * connection threads never take a lock here. A slot idle for `RATE_IDLE_EXPIRY` seconds
+ * with no open connection is taken over by the next new key that probes it. When no slot
+ * is free the client is not limited (fail open) and the miss is counted.
+ *
+ * Each bucket is one 64-bit word: the token count (signed, so byte charges can leave a
+ * debt) and the millisecond it was last refilled. A new bucket starts full.
+ */
+class RateLimiter {
+private:
+    struct Slot {
+        atomic<uint64_t> key{0};            // 0 = never used
+        atomic<uint64_t> requests{0};       // tokens in 1/1000 request
+        atomic<uint64_t> bytes{0};          // tokens in bytes
+        atomic<uint32_t> last_seen{0};      // seconds since start
+        atomic<int32_t> connections{0};
+    };
+
+    unique_ptr<Slot[]> slots;               // RATE_SHARDS shards of RATE_SHARD_SLOTS slots
+    chrono::steady_clock::time_point start;
+    atomic<size_t> active_clients{0};       // clients with at least one open connection
+
+    uint32_t nowMs() const;
+    Slot* find(uint64_t key, bool create);
+    double wait(Slot* slot, int64_t request_rate, int64_t request_burst, int64_t byte_rate, uint32_t now);
+    static uint64_t clientKey(const in6_addr& ip);
+    static uint64_t subnetKey(const in6_addr& ip, int prefix);
+    static uint64_t pack(int64_t tokens, uint32_t ms);
+    static int64_t refill(atomic<uint64_t>& bucket, int64_t cost, int64_t rate, int64_t burst,
+                          uint32_t now, bool allow_debt, bool& taken);
+
+public:
+    atomic<size_t> limited{0};              // requests refused with 429
+    atomic<size_t> delayed{0};              // requests that waited for tokens
+    atomic<size_t> share_rejections{0};     // connections refused beyond the fair share
+    atomic<size_t> table_full{0};           // lookups that found no slot
+
+    RateLimiter();
+
+    bool openConnection(const in6_addr& ip, size_t active_connections, const Config& config);
+    void closeConnection(const in6_addr& ip);
+    bool admit(const in6_addr& ip, const Config& config);
+    void charge(const in6_addr& ip, size_t bytes, const Config& config);
+    size_t trackedClients() const;
+};
+
+#endif
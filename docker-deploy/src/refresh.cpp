@@ -0,0 +1,146 @@
+#include "refresh.hpp"
+
+/**
+ * Turns `.js,.css` into a case-insensitive regex for URLs whose path ends with one of the
+ * extensions, e.g. `(?i)\.(?:js|css)(?:\?|$)`.
+ */
+string RefreshPatterns::extensionPattern(const string& extensions){
+    string pattern = "(?i)\\.(?:";
+    istringstream ss(extensions);
+    string extension;
+    bool first = true;
+    while(getline(ss, extension, ',')){
+        pattern += (first ? "" : "|") + extension.substr(1);
+        first = false;
+    }
+    return pattern + ")(?:\\?|$)";
+}
+
+/**
+ * @return Whether `pattern` is a list of extensions: `.js` or `.js,.css,...`.
+ */
+bool RefreshPatterns::isExtensionList(const string& pattern){
+    istringstream ss(pattern);
+    string extension;
+    size_t count = 0;
+    while(getline(ss, extension, ',')){
+        if(extension.size() < 2 || extension[0] != '.'){
+            return false;
+        }
+        for(size_t i = 1; i < extension.size(); i++){
+            if(!isalnum((unsigned char)extension[i])){
+                return false;
+            }
+        }
+        count++;
+    }
+    return count > 0 && pattern.back() != ',';
+}
+
+RE2::Options RefreshPatterns::options(){
+    RE2::Options options;
+    options.set_log_errors(false);
+    return options;
+}
+
+/**
+ * Parses one `refresh_pattern` line.
+ * @throws `std::invalid_argument` for a malformed line or regex.
+ */
+RefreshRule RefreshPatterns::parseRule(const string& line){
+    RefreshRule rule;
+    rule.line = line;
+    istringstream ss(line);
+    string pattern, min_age, percent, max_age, option;
+    if(!(ss >> pattern >> min_age >> percent >> max_age)){
+        throw invalid_argument("expected <regex or .ext,...> <min> <percent>% <max> [override-expire]");
+    }
+    while(ss >> option){
+        if(option != "override-expire"){
+            throw invalid_argument("unknown option " + option);
+        }
+        rule.override_expire = true;
+    }
+    if(!percent.empty() && percent.back() == '%'){
+        percent.pop_back();
+    }
+    rule.min_age = stol(min_age);
+    rule.percent = stod(percent);
+    rule.max_age = stol(max_age);
+    if(rule.min_age < 0 || rule.percent < 0 || rule.max_age < rule.min_age){
+        throw invalid_argument("expected 0 <= min <= max and a positive percent");
+    }
+
+    rule.pattern = isExtensionList(pattern) ? extensionPattern(pattern) : pattern;
+    RE2 check(rule.pattern, options());
+    if(!check.ok()){
+        throw invalid_argument("bad regex " + pattern + ": " + check.error());
+    }
+    return rule;
+}
+
+/**
+ * Compiles `lines` (valid `refresh_pattern` values) into one automaton.
+ * @param counters Counters by rule line, kept across reloads; missing ones are added.
+ * @throws `std::runtime_error` if the set cannot be compiled (e.g. it outgrows RE2's memory budget).
+ */
+RefreshPatterns::RefreshPatterns(const vector<string>& lines, map<string, RefreshCounters>& counters){
+    if(lines.empty()){
+        return;
+    }
+    automaton = make_unique<RE2::Set>(options(), RE2::UNANCHORED);
+    for(const string& line : lines){
+        RefreshRule rule = parseRule(line);
+        rule.counters = &counters[line];
+        string error;
+        if(automaton->Add(rule.pattern, &error) < 0){
+            throw runtime_error("bad regex " + rule.pattern + ": " + error);
+        }
+        by_line.emplace(line, rules.size());
+        rules.push_back(rule);
+    }
+    if(!automaton->Compile()){
+        throw runtime_error("refresh_pattern rules do not fit in one automaton");
+    }
+}
+
+/**
+ * Recovers the URL from a cache key (`Cache::makeKey()`): the absolute-form target when the
+ * client sent one, otherwise `http://` followed by the host and the origin-form target.
+ */
+string RefreshPatterns::urlOf(const string& key){
+    size_t slash = key.find('/');
+    if(slash != string::npos && slash > 0 && key[slash - 1] == ':'){
+        size_t scheme = key.rfind("http", slash);
+        if(scheme != string::npos && (key.compare(scheme, 7, "http://") == 0 || key.compare(scheme, 8, "https://") == 0)){
+            return key.substr(scheme);
+        }
+    }
+    return "http://" + key;
+}
+
+/**
+ * @return The first rule matching `url`, or `nullptr`.
+ */
+const RefreshRule* RefreshPatterns::match(const string& url) const {
+    if(!automaton){
+        return nullptr;
+    }
+    vector<int> matched;
+    if(!automaton->Match(url, &matched) || matched.empty()){
+        return nullptr;
+    }
+    return &rules[*min_element(matched.begin(), matched.end())];
+}
+
+/**
+ * @return The rule configured as `line`, or `nullptr` if a reload removed it.
+ */
+const RefreshRule* RefreshPatterns::find(const string& line) const {
+    auto it = by_line.find(line);
+    return it == by_line.end() ? nullptr : &rules[it->second];
+}
+
+const vector<RefreshRule>& RefreshPatterns::all() const {
+    return rules;
+}
@@ -0,0 +1,74 @@
+#ifndef _REFRESH_HPP_
+#define _REFRESH_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cctype>
+#include <re2/re2.h>
+#include <re2/set.h>
+
+using namespace std;
+
+/**
+ * Responses a refresh rule set the freshness of, and cache hits that only its
+ * freshness made (the response was stale by its own headers).
+ */
+struct RefreshCounters {
+    atomic<size_t> applied{0};
+    atomic<size_t> hits{0};
+};
+
+/**
+ * One `refresh_pattern` line: `<regex or extensions> <min> <percent>% <max> [override-expire]`,
+ * with `min` and `max` in seconds.
+ */
+struct RefreshRule {
+    string line;                            // as configured, names the rule in /metrics
+    string pattern;                         // RE2 regex
+    long min_age{0};
+    double percent{0};
+    long max_age{0};
+    bool override_expire{false};
+    RefreshCounters* counters{nullptr};
+};
+
+/**
+ * The `refresh_pattern` rules compiled into one `RE2::Set`, a DFA that reports every rule
+ * matching anywhere in a URL in one linear pass; the first of them in configuration order
+ * wins. Matching time does not depend on the number of rules, and there is no length
+ * limit: RE2 never backtracks.
+ *
+ * A pattern that is a list of extensions (`.js,.css`) matches URLs whose path ends with
+ * one of them, in any case, before an optional query string.
+ *
+ * A rule is matched once, when a response is stored; entries remember its line and
+ * `find()` looks it up again, e.g. for copies parsed back from the shared cache.
+ */
+class RefreshPatterns {
+private:
+    vector<RefreshRule> rules;
+    unordered_map<string, size_t> by_line;  // first rule with each line
+    unique_ptr<RE2::Set> automaton;
+
+    static string extensionPattern(const string& extensions);
+    static bool isExtensionList(const string& pattern);
+    static RE2::Options options();
+
+public:
+    RefreshPatterns(const vector<string>& lines, map<string, RefreshCounters>& counters);
+
+    static RefreshRule parseRule(const string& line);
+    static string urlOf(const string& key);
+    const RefreshRule* match(const string& url) const;
+    const RefreshRule* find(const string& line) const;
+    const vector<RefreshRule>& all() const;
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include "relay.hpp"
+
+#define RELAY_MAX_EVENTS 64
+#define RELAY_SWEEP_MS 1000         // idle timeouts are checked this often
+#define RELAY_BUFFER 65536
+
+Relay::Relay(unique_ptr<Logger>& logger) : logger(logger) {}
+
+Relay::~Relay(){
+    stop();
+}
+
+/**
+ * Hands a connected pair to the relay, which owns both descriptors from now on.
+ * The relay thread is started on first use, so a prefork supervisor never runs one.
+ *
+ * @param client_fd The client connection.
+ * @param server_fd The origin connection.
+ * @param request_id The request that opened the pair, for logging.
+ * @param idle_timeout Seconds without traffic in either direction before the pair is closed.
+ * @param on_close Called once the pair is closed.
+ * @throws `std::runtime_error` if the relay cannot be started.
+ */
+void Relay::add(int client_fd, int server_fd, int request_id, double idle_timeout, function<void()> on_close){
+    shared_ptr<Pair> pair = make_shared<Pair>();
+    pair->fds[0] = client_fd;
+    pair->fds[1] = server_fd;
+    pair->request_id = request_id;
+    pair->idle_timeout = idle_timeout;
+    pair->last_active = chrono::steady_clock::now();
+    pair->on_close = on_close;
+    for(int fd : pair->fds){
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    lock_guard<mutex> lock(add_mutex);
+    if(stopping){
+        close(client_fd);
+        close(server_fd);
+        on_close();
+        return;
+    }
+    if(!loop_thread.joinable()){
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(epoll_fd < 0 || wake_fd < 0){
+            throw runtime_error("Failed to create relay event loop");
+        }
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+        loop_thread = thread(&Relay::loop, this);
+    }
+    incoming.push_back(pair);
+    open_pairs++;
+    uint64_t one = 1;
+    if(write(wake_fd, &one, sizeof(one)) < 0){
+        logger->log_error(request_id, "Failed to wake the relay");
+    }
+}
+
+/**
+ * Stops the relay thread and closes every pair.
+ */
+void Relay::stop(){
+    {
+        lock_guard<mutex> lock(add_mutex);
+        if(!loop_thread.joinable()){
+            return;
+        }
+        stopping = true;
+        uint64_t one = 1;
+        if(write(wake_fd, &one, sizeof(one)) < 0){
+            logger->log_error(-1, "Failed to wake the relay");
+        }
+    }
+    loop_thread.join();
+    close(epoll_fd);
+    close(wake_fd);
+}
+
+size_t Relay::size() const {
+    return open_pairs;
+}
+
+/**
+ * The relay thread: registers new pairs, moves bytes as sockets become readable or
+ * writable, and closes idle pairs.
+ */
+void Relay::loop(){
+    struct epoll_event events[RELAY_MAX_EVENTS];
+    auto last_sweep = chrono::steady_clock::now();
+
+    while(!stopping){
+        int count = epoll_wait(epoll_fd, events, RELAY_MAX_EVENTS, RELAY_SWEEP_MS);
+        if(count < 0 && errno != EINTR){
+            logger->log_error(-1, "Relay epoll_wait failed");
+            break;
+        }
+        for(int i = 0; i < count; i++){
+            int fd = events[i].data.fd;
+            if(fd == wake_fd){
+                uint64_t value;
+                while(read(wake_fd, &value, sizeof(value)) > 0){}
+                vector<shared_ptr<Pair>> added;
+                {
+                    lock_guard<mutex> lock(add_mutex);
+                    added.swap(incoming);
+                }
+                for(auto& pair : added){
+                    registerPair(pair);
+                }
+                continue;
+            }
+            auto it = pairs.find(fd);
+            if(it == pairs.end()){
+                continue;   // closed earlier in this batch
+            }
+            shared_ptr<Pair> pair = it->second;
+            int side = (fd == pair->fds[0]) ? 0 : 1;
+            string reason;
+            bool ok = true;
+            if(events[i].events & EPOLLIN){
+                ok = readSide(*pair, side);
+            } else if(events[i].events & (EPOLLHUP | EPOLLERR)){
+                ok = false;
+                logger->log_note(pair->request_id, string("Connection closed by ") + (side == 0 ? "client" : "server"));
+            }
+            if(ok && (events[i].events & EPOLLOUT)){
+                ok = flush(*pair, side);
+            }
+            if(ok){
+                updateInterest(*pair);
+            } else{
+                closePair(pair, "");
+            }
+        }
+
+        auto now = chrono::steady_clock::now();
+        if(now - last_sweep >= chrono::milliseconds(RELAY_SWEEP_MS)){
+            last_sweep = now;
+            vector<shared_ptr<Pair>> idle;
+            for(auto& entry : pairs){
+                const Pair& pair = *entry.second;
+                if(entry.first == pair.fds[0] && now - pair.last_active > chrono::duration<double>(pair.idle_timeout)){
+                    idle.push_back(entry.second);
+                }
+            }
+            for(auto& pair : idle){
+                closePair(pair, "Tunnel timeout after " + to_string(pair->idle_timeout) + " seconds of inactivity");
+            }
+        }
+    }
+
+    vector<shared_ptr<Pair>> remaining;
+    {
+        lock_guard<mutex> lock(add_mutex);
+        remaining.swap(incoming);
+    }
+    for(auto& entry : pairs){
+        if(entry.first == entry.second->fds[0]){
+            remaining.push_back(entry.second);
+        }
+    }
+    for(auto& pair : remaining){
+        closePair(pair, "Relay stopped");
+    }
+}
+
+void Relay::registerPair(shared_ptr<Pair> pair){
+    for(int fd : pair->fds){
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0){
+            logger->log_error(pair->request_id, "Failed to register tunnel with the relay");
+            closePair(pair, "");
+            return;
+        }
+        pairs[fd] = pair;
+    }
+}
+
+/**
+ * Reads what `fds[side]` has and forwards it to the other side.
+ * @return `false` if the connection closed or failed.
+ */
+bool Relay::readSide(Pair& pair, int side){
+    char buffer[RELAY_BUFFER];
+    ssize_t received = recv(pair.fds[side], buffer, sizeof(buffer), 0);
+    if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+        return true;
+    }
+    if(received <= 0){
+        logger->log_note(pair.request_id, string("Connection closed by ") + (side == 0 ? "client" : "server"));
+        return false;
+    }
+    pair.last_active = chrono::steady_clock::now();
+    pair.pending[1 - side].append(buffer, received);
+    return flush(pair, 1 - side);
+}
+
+/**
+ * Writes the bytes pending for `fds[side]` as far as the socket takes them.
+ * @return `false` if the write failed.
+ */
+bool Relay::flush(Pair& pair, int side){
+    string& pending = pair.pending[side];
+    size_t offset = 0;
+    while(offset < pending.size()){
+        ssize_t sent = send(pair.fds[side], pending.data() + offset, pending.size() - offset, MSG_NOSIGNAL);
+        if(sent < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+                break;
+            }
+            logger->log_error(pair.request_id, string("Failed to forward data to ") + (side == 0 ? "client" : "server"));
+            return false;
+        }
+        offset += sent;
+    }
+    pending.erase(0, offset);
+    return true;
+}
+
+/**
+ * Watches each side for reading only while the other side has nothing pending, and for
+ * writing while it has bytes pending itself.
+ */
+void Relay::updateInterest(Pair& pair){
+    for(int side = 0; side < 2; side++){
+        struct epoll_event event = {};
+        event.events = (pair.pending[1 - side].empty() ? EPOLLIN : 0) | (pair.pending[side].empty() ? 0 : EPOLLOUT);
+        event.data.fd = pair.fds[side];
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, pair.fds[side], &event);
+    }
+}
+
+void Relay::closePair(shared_ptr<Pair> pair, const string& reason){
+    if(!reason.empty()){
+        logger->log_note(pair->request_id, reason);
+    }
+    for(int fd : pair->fds){
+        auto it = pairs.find(fd);
+        if(it != pairs.end() && it->second == pair){
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            pairs.erase(it);
+        }
+        close(fd);
+    }
+    logger->log_tunnel_closed(pair->request_id);
+    open_pairs--;
+    if(pair->on_close){
+        pair->on_close();
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef _RELAY_HPP_
+#define _RELAY_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "log.hpp"
+
+using namespace std;
+
+/**
+ * Bidirectional byte relay for long-lived connection pairs: CONNECT tunnels and upgraded
+ * (WebSocket) connections.
+ *
+ * All pairs are served by one epoll thread on non-blocking sockets, so an open tunnel costs
+ * two descriptors and its buffers but no thread. When one side cannot take more data, the
+ * bytes are kept and reading from the other side pauses until they are written. A pair is
+ * closed when either side closes or fails, or after its idle timeout; `on_close` then runs
+ * on the relay thread.
+ */
+class Relay {
+private:
+    struct Pair {
+        int fds[2];                         // client, origin
+        string pending[2];                  // bytes waiting to be written to fds[i]
+        int request_id;
+        double idle_timeout;
+        chrono::steady_clock::time_point last_active;
+        function<void()> on_close;
+    };
+
+    unique_ptr<Logger>& logger;
+    int epoll_fd{-1};
+    int wake_fd{-1};
+    thread loop_thread;
+    mutex add_mutex;
+    vector<shared_ptr<Pair>> incoming;      // added, not yet registered by the loop (add_mutex)
+    map<int, shared_ptr<Pair>> pairs;       // by both descriptors; loop thread only
+    atomic<bool> stopping{false};
+    atomic<size_t> open_pairs{0};
+
+    void loop();
+    void registerPair(shared_ptr<Pair> pair);
+    bool readSide(Pair& pair, int side);
+    bool flush(Pair& pair, int side);
+    void updateInterest(Pair& pair);
+    void closePair(shared_ptr<Pair> pair, const string& reason);
+
+public:
+    explicit Relay(unique_ptr<Logger>& logger);
+    ~Relay();
+
+    void add(int client_fd, int server_fd, int request_id, double idle_timeout, function<void()> on_close);
+    void stop();
+    size_t size() const;
+};
+
+#endif
@@ -0,0 +1,343 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include "capture.hpp"
+
+using namespace std;
+
+/**
+ * Deterministic replay of a capture file written by `./main <port> --capture <file>`.
+ *
+ * usage:  `./replay --proxy <host:port> [--speed <factor>] [--origin-port <port>] <capture file>`
+ *
+ * - Starts a local origin emulator that answers every request with the origin response
+ *   recorded for the same method and URL, in capture order, after the recorded origin delay.
+ * - Sends the recorded client requests to the proxy with their `Host` rewritten to the emulator,
+ *   at the original pace divided by `--speed` (`--speed 0` sends them back to back).
+ *   Absolute-form `https://` requests are sent as `http://`, since the emulator does not speak TLS;
+ *   they are counted in the summary, and their timings leave out the origin handshakes.
+ * - Prints a JSON summary with request latencies through the proxy.
+ */
+
+struct RecordedResponse {
+    string data;
+    chrono::microseconds delay;
+};
+
+struct ReplayRequest {
+    int request_id;
+    uint64_t timestamp_us;
+    string data;
+};
+
+struct ReplayOptions {
+    string proxy_host{"127.0.0.1"};
+    string proxy_port;
+    double speed{1.0};
+    int origin_port{0};
+    string capture_path;
+};
+
+mutex origin_mutex;
+map<string, deque<RecordedResponse>> origin_responses; // "METHOD URL" -> responses in capture order
+map<string, RecordedResponse> last_responses;
+
+/**
+ * Returns "METHOD URL" from the request line of a raw HTTP request.
+ */
+string requestKey(const string& raw_request){
+    string line = raw_request.substr(0, raw_request.find("\r\n"));
+    size_t last_space = line.rfind(' ');
+    return (last_space == string::npos) ? line : line.substr(0, last_space);
+}
+
+/**
+ * Turns an absolute-form `https://` request into an `http://` one.
+ * @return `true` if the request was rewritten.
+ */
+bool downgradeHttps(string& raw_request){
+    size_t space = raw_request.find(' ');
+    if(space == string::npos || raw_request.compare(space + 1, 8, "https://") != 0){
+        return false;
+    }
+    raw_request.erase(space + 5, 1);
+    return true;
+}
+
+/**
+ * Reads one HTTP request (headers and Content-Length body) from a socket.
+ */
+string readRequest(int fd){
+    string data;
+    char buffer[65536];
+    size_t body_start = string::npos;
+    size_t content_length = 0;
+
+    while(true){
+        struct pollfd pfd{fd, POLLIN, 0};
+        if(poll(&pfd, 1, 10000) <= 0){break;}
+        int n = recv(fd, buffer, sizeof(buffer), 0);
+        if(n <= 0){break;}
+        data.append(buffer, n);
+
+        if(body_start == string::npos){
+            size_t end = data.find("\r\n\r\n");
+            if(end == string::npos){continue;}
+            body_start = end + 4;
+            size_t pos = data.find("Content-Length: ");
+            if(pos != string::npos && pos < end){
+                content_length = stoul(data.substr(pos + 16));
+            }
+        }
+        if(data.size() >= body_start + content_length){break;}
+    }
+    return data;
+}
+
+/**
+ * Serves one proxy connection on the origin emulator.
+ */
+void serveOrigin(int fd){
+    string request = readRequest(fd);
+    if(request.empty()){
+        close(fd);
+        return;
+    }
+
+    string key = requestKey(request);
+    RecordedResponse response{"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n", chrono::microseconds(0)};
+    {
+        lock_guard<mutex> lock(origin_mutex);
+        auto it = origin_responses.find(key);
+        if(it != origin_responses.end() && !it->second.empty()){
+            response = it->second.front();
+            it->second.pop_front();
+            last_responses[key] = response;
+        } else if(last_responses.count(key)){
+            response = last_responses[key]; // more requests than recorded: repeat the last answer
+        }
+    }
+
+    this_thread::sleep_for(response.delay);
+    send(fd, response.data.data(), response.data.size(), MSG_NOSIGNAL);
+    close(fd);
+}
+
+/**
+ * Accept loop of the origin emulator.
+ */
+void runOrigin(int listen_fd, atomic<bool>& running){
+    while(running){
+        struct pollfd pfd{listen_fd, POLLIN, 0};
+        if(poll(&pfd, 1, 200) <= 0){continue;}
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0){continue;}
+        thread(serveOrigin, fd).detach();
+    }
+}
+
+/**
+ * Replaces the value of the `Host` header so the proxy fetches from the origin emulator.
+ */
+string rewriteHost(const string& raw_request, const string& origin){
+    size_t pos = raw_request.find("\r\nHost: ");
+    if(pos == string::npos){
+        return raw_request;
+    }
+    size_t value = pos + 8;
+    size_t end = raw_request.find("\r\n", value);
+    return raw_request.substr(0, value) + origin + raw_request.substr(end);
+}
+
+/**
+ * Sends one request through the proxy and reads the response until the proxy closes the connection.
+ * @return The latency in microseconds, or -1 on failure.
+ */
+long long sendThroughProxy(const ReplayOptions& opts, const string& request, string& status_line){
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(opts.proxy_host.c_str(), opts.proxy_port.c_str(), &hints, &res) != 0){
+        return -1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0){
+        freeaddrinfo(res);
+        if(fd >= 0){close(fd);}
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+    string response;
+    char buffer[65536];
+    while(true){
+        struct pollfd pfd{fd, POLLIN, 0};
+        if(poll(&pfd, 1, 30000) <= 0){break;}
+        int n = recv(fd, buffer, sizeof(buffer), 0);
+        if(n <= 0){break;}
+        response.append(buffer, n);
+    }
+    close(fd);
+
+    if(response.empty()){
+        return -1;
+    }
+    status_line = response.substr(0, response.find("\r\n"));
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]){
+    ReplayOptions opts;
+    for(int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if(arg == "--proxy" && i + 1 < argc){
+            string addr = argv[++i];
+            size_t colon = addr.rfind(':');
+            if(colon == string::npos){
+                opts.proxy_port = addr;
+            } else{
+                opts.proxy_host = addr.substr(0, colon);
+                opts.proxy_port = addr.substr(colon + 1);
+            }
+        } else if(arg == "--speed" && i + 1 < argc){
+            opts.speed = stod(argv[++i]);
+        } else if(arg == "--origin-port" && i + 1 < argc){
+            opts.origin_port = stoi(argv[++i]);
+        } else if(opts.capture_path.empty() && arg[0] != '-'){
+            opts.capture_path = arg;
+        } else{
+            opts.capture_path.clear();
+            break;
+        }
+    }
+
+    if(opts.capture_path.empty() || opts.proxy_port.empty()){
+        cerr << "usage: ./replay --proxy <host:port> [--speed <factor>] [--origin-port <port>] <capture file>" << endl;
+        return 1;
+    }
+
+    ifstream in(opts.capture_path, ios::binary);
+    if(!in.is_open() || !Capture::readHeader(in)){
+        cerr << "Error reading capture file: " << opts.capture_path << endl;
+        return 1;
+    }
+
+    // Pair every origin response with the client request of the same ID
+    vector<ReplayRequest> requests;
+    map<int, size_t> request_index;
+    int https_requests = 0;
+    CaptureRecord record;
+    while(Capture::readRecord(in, record)){
+        if(record.type == CAPTURE_CLIENT_REQUEST){
+            if(downgradeHttps(record.data)){
+                https_requests++;
+            }
+            request_index[record.request_id] = requests.size();
+            requests.push_back(ReplayRequest{record.request_id, record.timestamp_us, record.data});
+        } else if(record.type == CAPTURE_ORIGIN_RESPONSE){
+            auto it = request_index.find(record.request_id);
+            if(it == request_index.end()){continue;}
+            const ReplayRequest& req = requests[it->second];
+            auto delay = chrono::microseconds(record.timestamp_us - req.timestamp_us);
+            if(opts.speed > 0){
+                delay = chrono::microseconds((long long)(delay.count() / opts.speed));
+            } else{
+                delay = chrono::microseconds(0);
+            }
+            origin_responses[requestKey(req.data)].push_back(RecordedResponse{record.data, delay});
+        }
+    }
+    if(requests.empty()){
+        cerr << "No client requests in " << opts.capture_path << endl;
+        return 1;
+    }
+
+    // Start the origin emulator
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(opts.origin_port);
+    socklen_t addr_len = sizeof(addr);
+    if(::bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1024) < 0 ||
+       getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len) < 0){
+        cerr << "Failed to start origin emulator" << endl;
+        return 1;
+    }
+    string origin = "127.0.0.1:" + to_string(ntohs(addr.sin_port));
+    atomic<bool> running(true);
+    thread origin_thread(runOrigin, listen_fd, ref(running));
+
+    // Replay client requests on the recorded schedule
+    mutex result_mutex;
+    vector<long long> latencies;
+    int failures = 0;
+    vector<thread> clients;
+    auto start = chrono::steady_clock::now();
+    uint64_t first_ts = requests.front().timestamp_us;
+
+    for(const ReplayRequest& req : requests){
+        if(opts.speed > 0){
+            auto offset = chrono::microseconds((long long)((req.timestamp_us - first_ts) / opts.speed));
+            this_thread::sleep_until(start + offset);
+        }
+        string request = rewriteHost(req.data, origin);
+        clients.emplace_back([&, request](){
+            string status_line;
+            long long latency = sendThroughProxy(opts, request, status_line);
+            lock_guard<mutex> lock(result_mutex);
+            if(latency < 0){
+                failures++;
+            } else{
+                latencies.push_back(latency);
+            }
+        });
+    }
+    for(auto& client : clients){
+        client.join();
+    }
+    double wall_sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    running = false;
+    origin_thread.join();
+    close(listen_fd);
+
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) -> double {
+        if(latencies.empty()){return 0;}
+        size_t idx = min(latencies.size() - 1, (size_t)(p * latencies.size()));
+        return latencies[idx] / 1000.0;
+    };
+
+    cout << "{\"requests\":" << requests.size()
+         << ",\"completed\":" << latencies.size()
+         << ",\"failed\":" << failures
+         << ",\"https_as_http\":" << https_requests
+         << ",\"wall_sec\":" << wall_sec
+         << ",\"p50_ms\":" << percentile(0.50)
+         << ",\"p90_ms\":" << percentile(0.90)
+         << ",\"p99_ms\":" << percentile(0.99)
+         << ",\"max_ms\":" << percentile(1.0) << "}" << endl;
+    return failures == 0 ? 0 : 2;
+}
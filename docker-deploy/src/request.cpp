@@ -15,11 +15,12 @@ Request::Request(const std::string& httpRequest) : httpRequest(httpRequest) {
     port = "";
     IfNoneMatch = "";
     IfModifiedSince = "";
+    upgrade = "";
 }
 
 /**
  * Parses the raw HTTP request string and extracts relevant fields,
- *       such as `Host`, `User-Agent`, `Connection`, `If-None-Match`, and `If-Modified-Since`.
+ *       such as `Host`, `User-Agent`, `Connection`, `If-None-Match`, `If-Modified-Since` and `Upgrade`.
  */
 void Request::parseRequest(){
     istringstream ss(httpRequest);
@@ -51,6 +52,9 @@ void Request::parseRequest(){
         } else if (line.find(IFMODIFIED) == 0){
             IfModifiedSince = line.substr(line.find(":") + 1);
             IfModifiedSince.erase(0, IfModifiedSince.find_first_not_of(" "));
+        } else if (line.find(UPGRADE) == 0){
+            upgrade = line.substr(line.find(":") + 1);
+            upgrade.erase(0, upgrade.find_first_not_of(" "));
         }
     }
 }
@@ -87,6 +91,13 @@ void Request::setHostnameAndPort(const string& line){
     }
 }
 
+/**
+ * Whether the request targets an `https://` origin (absolute-form URL).
+ */
+bool Request::isHttps() const {
+    return url.compare(0, 8, "https://") == 0;
+}
+
 /**
  * Generate a new request line and headers in a valid HTTP format including the newly gotten properties
  *
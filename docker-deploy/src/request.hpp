@@ -22,6 +22,7 @@ public:
 
     string IfNoneMatch;
     string IfModifiedSince;
+    string upgrade;                 // protocol asked for with `Upgrade:` (e.g. websocket)
 
     Request(const string& httpRequest);
 
@@ -30,6 +31,7 @@ public:
     void setHostnameAndPort(const std::string& line);
 
     string Request_line() const; 
+    bool isHttps() const;
 };
 
 #endif
\ No newline at end of file
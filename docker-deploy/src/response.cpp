@@ -98,7 +98,7 @@ void Response::parseCacheControl(){
         }
     }
 
-    if (!no_cache && !no_cache && !must_revalidate){
+    if (!no_store && !no_cache && !must_revalidate){
         cache_mode = CACHE_NORMAL;
     }
 }
@@ -210,6 +210,111 @@ void Response::setExpiredTime(){
         }
     }
 }
+/**
+ * Replaces the expiration time with a refresh rule's (`refresh_pattern`), like Squid:
+ *       1. Without `max-age` or `Expires`, the lifetime is `percent` of (`Date` - `Last-Modified`),
+ *          between `min_age` and `max_lifetime`; without `Last-Modified` it is `min_age`.
+ *       2. With `max-age` or `Expires`, the lifetime is only raised to `min_age`, and only if
+ *          `override_expire` is set.
+ * Responses that must not be served without revalidation (`no-store`, `no-cache`,
+ * `must-revalidate`) are left alone. A response without `Date` gets one, so the lifetime
+ * has a start that survives re-parsing.
+ *
+ * @param min_age Seconds, the shortest lifetime.
+ * @param percent Share of the `Last-Modified` age, in percent.
+ * @param max_lifetime Seconds, the longest heuristic lifetime.
+ * @param override_expire Whether `min_age` also applies to explicit lifetimes.
+ * @return `true` if the expiration time changed.
+ */
+bool Response::applyRefresh(long min_age, double percent, long max_lifetime, bool override_expire){
+    if(status_code != 200 || cache_mode == CACHE_NO_STORE || no_cache || must_revalidate){
+        return false;
+    }
+    bool explicit_lifetime = max_age >= 0 || header.find(HEADER_EXPIRE) != header.end();
+    if(explicit_lifetime && !override_expire){
+        return false;
+    }
+
+    auto date_it = header.find(HEADER_DATE);
+    if(date_it == header.end()){
+        date_it = header.emplace(HEADER_DATE, formatHTTPDate(chrono::system_clock::now())).first;
+    }
+    auto date = parseHttpDate(date_it->second);
+    long long lifetime;
+    if(explicit_lifetime){
+        lifetime = expire_time.empty() ? 0 : chrono::duration_cast<chrono::seconds>(parseHttpDate(expire_time) - date).count();
+        if(lifetime >= min_age){
+            return false;
+        }
+        lifetime = min_age;
+    } else if(header.find(HEADER_LAST_MODIFY) != header.end()){
+        long long age = timeDifference(header[HEADER_LAST_MODIFY], date_it->second);
+        lifetime = min<long long>(max_lifetime, max<long long>(min_age, (long long)(age * percent / 100)));
+    } else{
+        lifetime = min_age;
+    }
+
+    string refreshed = formatHTTPDate(date + chrono::seconds(lifetime));
+    if(refreshed == expire_time){
+        return false;
+    }
+    header_expire_time = expire_time;
+    expire_time = refreshed;
+    return true;
+}
+
+/**
+ * Gives a negative response (`isNegative()`) without `max-age` or `Expires` a lifetime of
+ * `ttl` seconds from its `Date` (added if missing), as RFC 9111 allows for these statuses.
+ * @return `true` if the expiration time changed.
+ */
+bool Response::applyNegativeTtl(double ttl){
+    if(!isNegative() || ttl <= 0 || cache_mode == CACHE_NO_STORE || hasExplicitLifetime()){
+        return false;
+    }
+    auto date_it = header.find(HEADER_DATE);
+    if(date_it == header.end()){
+        date_it = header.emplace(HEADER_DATE, formatHTTPDate(chrono::system_clock::now())).first;
+    }
+    auto expiry = parseHttpDate(date_it->second) + chrono::duration_cast<chrono::system_clock::duration>(chrono::duration<double>(ttl));
+    string negative_expire = formatHTTPDate(expiry);
+    if(negative_expire == expire_time){
+        return false;
+    }
+    expire_time = negative_expire;
+    return true;
+}
+
+/**
+ * Records the refresh rule that set the expire time: its line, kept with the cached copy,
+ * and the counter `refreshHit()` returns.
+ */
+void Response::setRefreshRule(const string& line, atomic<size_t>* hits){
+    refresh_rule = line;
+    refresh_hits = hits;
+}
+
+/**
+ * @return The hit counter of the refresh rule that made this response fresh, or `nullptr`
+ *         if it is fresh by its own headers (or no rule applied).
+ */
+atomic<size_t>* Response::refreshHit() const {
+    if(!refresh_hits){
+        return nullptr;
+    }
+    if(!header_expire_time.empty() && parseHttpDate(header_expire_time) >= chrono::system_clock::now()){
+        return nullptr;
+    }
+    return refresh_hits;
+}
+
+/**
+ * @return The line of the refresh rule that set the expire time, or an empty string.
+ */
+const string& Response::refreshRule() const {
+    return refresh_rule;
+}
+
 /**
  * Appends chunked transfer encoding data to the response body.
  *
@@ -289,17 +394,39 @@ string Response::getTransferEncoding() const {
     return (it != header.end()) ? it->second : "";
 }
 
+/**
+ * Whether the response is a negative one the cache may keep: `301 Moved Permanently`,
+ * `404 Not Found` or `410 Gone`.
+ */
+bool Response::isNegative() const {
+    return status_code == 301 || status_code == 404 || status_code == 410;
+}
+
+/**
+ * Whether the origin gave the response a lifetime: `max-age` (or `s-maxage`) or `Expires`.
+ */
+bool Response::hasExplicitLifetime() const {
+    return max_age >= 0 || header.find(HEADER_EXPIRE) != header.end();
+}
+
 /**
  * Determines whether the response is cacheable based on HTTP caching rules.
  * @param isPrivateCache A boolean indicating whether the cache is private.
+ * @param negative_caching Whether `negative_ttl` is set, so negative responses without a
+ *        lifetime of their own may be cached too.
  * @return `true` if the response can be cached, `false` otherwise.
  * @note A response is considered cacheable if:
- *       - The status code is `200 OK`.
+ *       - The status code is `200 OK`, or a negative one (`isNegative()`) with an explicit
+ *         lifetime or `negative_caching` on.
  *       - And the `Cache-Control: no-store` directive is not set.
  *       - If the response is `private`, it can only be cached in a private cache.
  */
-bool Response::isCacheable(bool isPrivateCache) const {
-    if (status_code != 200 || cache_mode == CACHE_NO_STORE) {
+bool Response::isCacheable(bool isPrivateCache, bool negative_caching) const {
+    if ((status_code != 200 && !isNegative()) || cache_mode == CACHE_NO_STORE) {
+        return false;
+    }
+
+    if (isNegative() && !negative_caching && !hasExplicitLifetime()) {
         return false;
     }
 
@@ -10,6 +10,7 @@
 #include <vector>
 #include <ctime>
 #include <chrono>
+#include <atomic>
 #include <iomanip> 
 #include "util.hpp"
 
@@ -25,6 +26,9 @@ private:
 
     chrono::system_clock::time_point received_time;
     string expire_time;
+    string header_expire_time;              // expire time from the headers alone, before a refresh rule
+    atomic<size_t>* refresh_hits{nullptr};  // hit counter of the refresh rule that set expire_time
+    string refresh_rule;                    // ... and that rule's line
 
     bool is_chunked{false};
     int content_length{-1};
@@ -36,14 +40,19 @@ private:
     int cache_mode{0};
     int cache_visibility{CACHE_PUBLIC};
 
-    void parseCacheControl();
-    chrono::system_clock::time_point parseHttpDate(const string& http_date);
+    static chrono::system_clock::time_point parseHttpDate(const string& http_date);
     string formatHTTPDate(const chrono::system_clock::time_point& tp);
     long long timeDifference(const string& time1, const string& time2);
 
 public:
     void parseResponse(const string& httpResponse);
+    void parseCacheControl();
     void setExpiredTime();
+    bool applyRefresh(long min_age, double percent, long max_lifetime, bool override_expire);
+    bool applyNegativeTtl(double ttl);
+    void setRefreshRule(const string& line, atomic<size_t>* hits);
+    atomic<size_t>* refreshHit() const;
+    const string& refreshRule() const;
     void addChunkedData(const vector<char>& chunk_data);
     void addResponseBody(const string& response_body);
     int getStatusCode() const;
@@ -67,7 +76,9 @@ public:
     bool getNoCache() const;
     bool getMustRevalidate() const;
 
-    bool isCacheable(bool isPrivateCache = false) const;
+    bool isNegative() const;
+    bool isCacheable(bool isPrivateCache = false, bool negative_caching = false) const;
+    bool hasExplicitLifetime() const;
     bool needsRevalidation() const;
     string toString() const;
 
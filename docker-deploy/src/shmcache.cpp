@@ -0,0 +1,317 @@
+#include "shmcache.hpp"
+
+/**
+ * Maps the shared segment and initializes the slot table, its index and its mutex.
+ * Must be called before the workers are forked.
+ *
+ * @param slot_count The number of objects the segment can hold.
+ * @param slot_size The largest object (key, head and body) a slot can hold, in bytes.
+ * @param node The NUMA node to place the segment on, or -1 to leave placement to the kernel.
+ * @throws `std::runtime_error` if the segment cannot be mapped or the mutex cannot be created.
+ */
+ShmCache::ShmCache(size_t slot_count, size_t slot_size, int node){
+    if(slot_count == 0 || slot_size == 0){
+        throw runtime_error("Shared cache needs at least one slot");
+    }
+    size_t index_size = 1;
+    while(index_size < slot_count * 2){
+        index_size <<= 1;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t table = (sizeof(Header) + sizeof(Slot) * slot_count + sizeof(uint32_t) * index_size + page - 1) / page * page;
+    length = table + slot_count * slot_size;
+    base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED){
+        throw runtime_error("Failed to map shared cache of " + to_string(length) + " bytes");
+    }
+    if(node >= 0){
+        Numa::bindMemory(base, length, node); // before the first touch, so every page is node-local
+    }
+
+    header = static_cast<Header*>(base);
+    slots = reinterpret_cast<Slot*>(header + 1);
+    index = reinterpret_cast<uint32_t*>(slots + slot_count);
+    data = static_cast<char*>(base) + table;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(&header->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if(rc != 0){
+        munmap(base, length);
+        throw runtime_error("Failed to create shared cache mutex");
+    }
+
+    header->slot_count = slot_count;
+    header->max_entries = slot_count;
+    header->slot_size = slot_size;
+    header->clock = 0;
+    header->touch_on_hit = 1;
+    header->index_size = index_size;
+    rebuild();
+}
+
+ShmCache::~ShmCache(){
+    munmap(base, length);
+}
+
+/**
+ * Takes the cache mutex, recovering it if its previous owner died.
+ * A previous owner that died mid-update leaves `dirty` set, and the index and lists are rebuilt.
+ * @throws `std::runtime_error` if the mutex cannot be taken.
+ */
+void ShmCache::lock() const{
+    int rc = pthread_mutex_lock(&header->mutex);
+    if(rc == EOWNERDEAD){
+        pthread_mutex_consistent(&header->mutex);
+    } else if(rc != 0){
+        throw runtime_error("Failed to lock shared cache");
+    }
+    if(header->dirty){
+        rebuild();
+    }
+    header->dirty = 1;
+}
+
+void ShmCache::unlock() const{
+    header->dirty = 0;
+    pthread_mutex_unlock(&header->mutex);
+}
+
+/**
+ * Recomputes the index, the LRU and free lists and the used count from the slots themselves.
+ * The LRU order is restored from each slot's `last_used` stamp.
+ */
+void ShmCache::rebuild() const{
+    fill(index, index + header->index_size, NONE);
+    vector<uint32_t> used;
+    header->free_head = NONE;
+    for(uint32_t i = header->slot_count; i-- > 0;){
+        if(slots[i].used){
+            used.push_back(i);
+        } else{
+            slots[i].next = header->free_head;
+            header->free_head = i;
+        }
+    }
+    sort(used.begin(), used.end(), [this](uint32_t a, uint32_t b){return slots[a].last_used < slots[b].last_used;});
+    header->lru_head = header->lru_tail = NONE;
+    header->used = 0;
+    for(uint32_t i : used){
+        pushFront(i);
+        indexInsert(i);
+        header->used++;
+    }
+}
+
+char* ShmCache::slotData(size_t slot) const{
+    return data + slot * header->slot_size;
+}
+
+/**
+ * Finds the slot holding `key` through the index.
+ * @return The slot index, or -1 if the key is not cached.
+ */
+long ShmCache::findSlot(const string& key, uint64_t hash) const{
+    uint32_t mask = header->index_size - 1;
+    for(uint32_t b = hash & mask; index[b] != NONE; b = (b + 1) & mask){
+        const Slot& slot = slots[index[b]];
+        if(slot.hash == hash && slot.key_len == key.size() && memcmp(slotData(index[b]), key.data(), key.size()) == 0){
+            return index[b];
+        }
+    }
+    return -1;
+}
+
+void ShmCache::indexInsert(uint32_t slot) const{
+    uint32_t mask = header->index_size - 1;
+    uint32_t b = slots[slot].hash & mask;
+    while(index[b] != NONE){
+        b = (b + 1) & mask;
+    }
+    index[b] = slot;
+}
+
+/**
+ * Removes a slot from the index, moving later entries of its probe run back so that no
+ * lookup stops early at the hole (no tombstones are needed).
+ */
+void ShmCache::indexErase(uint32_t slot) const{
+    uint32_t mask = header->index_size - 1;
+    uint32_t hole = slots[slot].hash & mask;
+    while(index[hole] != slot){
+        if(index[hole] == NONE){return;}
+        hole = (hole + 1) & mask;
+    }
+    for(uint32_t b = (hole + 1) & mask; index[b] != NONE; b = (b + 1) & mask){
+        uint32_t home = slots[index[b]].hash & mask;
+        // The entry may move to the hole unless its home lies cyclically in (hole, b]
+        bool stays = hole <= b ? (home > hole && home <= b) : (home > hole || home <= b);
+        if(!stays){
+            index[hole] = index[b];
+            hole = b;
+        }
+    }
+    index[hole] = NONE;
+}
+
+void ShmCache::unlink(uint32_t slot) const{
+    Slot& s = slots[slot];
+    if(s.prev != NONE){slots[s.prev].next = s.next;} else{header->lru_head = s.next;}
+    if(s.next != NONE){slots[s.next].prev = s.prev;} else{header->lru_tail = s.prev;}
+}
+
+void ShmCache::pushFront(uint32_t slot) const{
+    Slot& s = slots[slot];
+    s.prev = NONE;
+    s.next = header->lru_head;
+    if(header->lru_head != NONE){slots[header->lru_head].prev = slot;} else{header->lru_tail = slot;}
+    header->lru_head = slot;
+}
+
+/**
+ * Frees the least recently used slot and records its key in `evicted`.
+ * The slot's whole pages are handed back to the kernel, so eviction under memory pressure
+ * really lowers the footprint.
+ */
+void ShmCache::evictOne(vector<string>& evicted){
+    uint32_t victim = header->lru_tail;
+    if(victim != NONE){
+        evicted.push_back(string(slotData(victim), slots[victim].key_len));
+        indexErase(victim);
+        unlink(victim);
+        slots[victim].used = 0;
+        slots[victim].next = header->free_head;
+        header->free_head = victim;
+        header->used--;
+
+        size_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = ((uintptr_t)slotData(victim) + page - 1) / page * page;
+        uintptr_t end = ((uintptr_t)slotData(victim) + header->slot_size) / page * page;
+        if(end > start){
+            madvise((void*)start, end - start, MADV_REMOVE);
+        }
+    }
+}
+
+/**
+ * Copies a cached object out of the segment.
+ * Under LRU the hit also refreshes the object's position.
+ *
+ * @param key The cache key.
+ * @param head Set to the response status line and headers.
+ * @param body Set to the response body.
+ * @param meta Set to the metadata stored with the object.
+ * @return `true` if the key was found.
+ */
+bool ShmCache::get(const string& key, string& head, string& body, string& meta){
+    uint64_t hash = std::hash<string>()(key);
+    lock();
+    long index = findSlot(key, hash);
+    if(index < 0){
+        unlock();
+        return false;
+    }
+    Slot& slot = slots[index];
+    const char* p = slotData(index) + slot.key_len;
+    head.assign(p, slot.head_len);
+    body.assign(p + slot.head_len, slot.body_len);
+    meta.assign(p + slot.head_len + slot.body_len, slot.meta_len);
+    if(header->touch_on_hit){
+        slot.last_used = ++header->clock;
+        unlink(index);
+        pushFront(index);
+    }
+    unlock();
+    return true;
+}
+
+/**
+ * Stores an object, replacing an older copy and evicting the least recently used objects if needed.
+ *
+ * @param key The cache key.
+ * @param head The response status line and headers.
+ * @param body The response body.
+ * @param meta Data about the object, e.g. the refresh rule chosen when it was stored.
+ * @param evicted Receives the keys of the evicted objects.
+ * @return `false` if the object does not fit in a slot or the cache is sized to zero.
+ */
+bool ShmCache::put(const string& key, const string& head, const string& body, const string& meta, vector<string>& evicted){
+    if(key.size() + head.size() + body.size() + meta.size() > header->slot_size){
+        return false;
+    }
+
+    uint64_t hash = std::hash<string>()(key);
+    lock();
+    if(header->max_entries == 0){
+        unlock();
+        return false;
+    }
+    long index = findSlot(key, hash);
+    bool fresh = index < 0;
+    if(fresh){
+        while(header->used >= header->max_entries){
+            evictOne(evicted);
+        }
+        index = header->free_head;
+        header->free_head = slots[index].next;
+    } else{
+        unlink(index);
+    }
+
+    // Mark the slot free while its data is rewritten, so a crash here cannot expose a torn object
+    Slot& slot = slots[index];
+    slot.used = 0;
+    char* p = slotData(index);
+    memcpy(p, key.data(), key.size());
+    memcpy(p + key.size(), head.data(), head.size());
+    memcpy(p + key.size() + head.size(), body.data(), body.size());
+    memcpy(p + key.size() + head.size() + body.size(), meta.data(), meta.size());
+    slot.hash = hash;
+    slot.key_len = key.size();
+    slot.head_len = head.size();
+    slot.body_len = body.size();
+    slot.meta_len = meta.size();
+    slot.last_used = ++header->clock;
+    slot.used = 1;
+    pushFront(index);
+    if(fresh){
+        indexInsert(index);
+        header->used++;
+    }
+    unlock();
+    return true;
+}
+
+/**
+ * Applies new cache settings; shrinking evicts the least recently used objects right away.
+ *
+ * @param max_entries The maximum number of objects, capped at the number of slots.
+ * @param touch_on_hit `false` for FIFO: hits do not refresh an object's position.
+ * @param evicted Receives the keys of the evicted objects.
+ */
+void ShmCache::configure(size_t max_entries, bool touch_on_hit, vector<string>& evicted){
+    lock();
+    header->max_entries = max_entries < header->slot_count ? max_entries : header->slot_count;
+    header->touch_on_hit = touch_on_hit;
+    while(header->used > header->max_entries){
+        evictOne(evicted);
+    }
+    unlock();
+}
+
+/**
+ * Retrieves the number of objects in the segment.
+ */
+size_t ShmCache::size() const{
+    lock();
+    size_t count = header->used;
+    unlock();
+    return count;
+}
+
+size_t ShmCache::slotSize() const{
+    return header->slot_size;
+}
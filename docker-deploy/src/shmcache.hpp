@@ -0,0 +1,97 @@
+#ifndef _SHMCACHE_HPP_
+#define _SHMCACHE_HPP_
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "numa.hpp"
+
+using namespace std;
+
+/**
+ * Response cache stored in an anonymous shared mapping, for the prefork workers.
+ *
+ * The segment is created before the workers are forked, so every worker maps the same memory.
+ * It holds a fixed table of `slot_count` slots of `slot_size` bytes each; a slot stores one
+ * object (key, response head, body and a little metadata). Objects larger than a slot are not shared.
+ * Keys are found through an open-addressed (linear probing) index of slot numbers keyed by the key's
+ * hash, free slots are kept on a free list and used slots on a doubly linked LRU list, so a get, put or
+ * eviction does not scan the table.
+ *
+ * All access goes through a process-shared robust mutex. A worker that dies while holding it
+ * leaves the objects consistent, since a slot is only marked used after its data is written; the
+ * index, lists and count may be half updated, so the next worker to take the lock rebuilds them
+ * from the slots.
+ * With `numa_cache_shards` there is one segment per NUMA node, placed on that node.
+ */
+class ShmCache {
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;    // end of a list, or an empty index bucket
+
+    struct Header {
+        pthread_mutex_t mutex;
+        uint32_t slot_count;
+        uint32_t max_entries;
+        uint64_t slot_size;
+        uint64_t clock;
+        uint8_t touch_on_hit;
+        uint8_t dirty;                  // set while a worker holds the lock; still set after it died
+        uint32_t used;                  // slots holding an object
+        uint32_t index_size;            // index buckets, a power of two at least twice slot_count
+        uint32_t lru_head;              // most recently used slot
+        uint32_t lru_tail;              // least recently used slot, evicted first
+        uint32_t free_head;
+    };
+
+    struct Slot {
+        uint8_t used;
+        uint64_t hash;
+        uint64_t last_used;             // only used to rebuild the LRU order after a crash
+        uint32_t prev;                  // LRU neighbours; `next` also links the free list
+        uint32_t next;
+        uint32_t key_len;
+        uint32_t head_len;
+        uint32_t body_len;
+        uint32_t meta_len;              // caller's data about the object, after the body
+    };
+
+    void* base;
+    size_t length;
+    Header* header;
+    Slot* slots;
+    uint32_t* index;
+    char* data;
+
+    void lock() const;
+    void unlock() const;
+    void rebuild() const;
+    char* slotData(size_t slot) const;
+    long findSlot(const string& key, uint64_t hash) const;
+    void indexInsert(uint32_t slot) const;
+    void indexErase(uint32_t slot) const;
+    void unlink(uint32_t slot) const;
+    void pushFront(uint32_t slot) const;
+    void evictOne(vector<string>& evicted);
+
+public:
+    ShmCache(size_t slot_count, size_t slot_size, int node = -1);
+    ~ShmCache();
+    ShmCache(const ShmCache&) = delete;
+    ShmCache& operator=(const ShmCache&) = delete;
+
+    bool get(const string& key, string& head, string& body, string& meta);
+    bool put(const string& key, const string& head, const string& body, const string& meta, vector<string>& evicted);
+    void configure(size_t max_entries, bool touch_on_hit, vector<string>& evicted);
+    size_t size() const;
+    size_t slotSize() const;
+};
+
+#endif
@@ -0,0 +1,476 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+/**
+ * C10K/C100K soak benchmark for idle keep-alive clients and CONNECT tunnels.
+ *
+ * usage:  `./soak --proxy <host:port> --pid <proxy pid> [options]`
+ *
+ * - Starts a local origin on 127.0.0.1 that echoes tunnel bytes and answers plain HTTP GETs.
+ * - Opens `--idle` client connections that never send a request, and `--tunnels` CONNECT
+ *   tunnels to the origin that exchange one byte every `--ping` seconds, from `--ramp-threads`
+ *   threads.
+ * - While they are held, sends `--rate` GETs per second through the proxy and measures their latency.
+ * - Samples the proxy's RSS, open fds, thread count and CPU time from /proc, and counts only the
+ *   idle connections still open: the proxy closes them after `request_timeout`, and the cost
+ *   per connection is computed against the live ones.
+ *
+ * Options:
+ * - `--idle <n>`, `--tunnels <n>`    background connections (default 1000 each)
+ * - `--ramp-threads <n>`             threads opening them (default 32)
+ * - `--duration <sec>`               how long to hold them (default 30)
+ * - `--rate <n>`                     active requests per second (default 20)
+ * - `--ping <sec>`                   tunnel keep-alive interval (default 5)
+ * - `--max-rss-mb`, `--max-fds`, `--max-threads`, `--max-p99-ms`, `--max-failed`
+ *                                    thresholds; the run fails with exit code 2 when one is exceeded.
+ *                                    Idle connections the proxy closed count as failures.
+ */
+
+struct SoakOptions {
+    string proxy_host{"127.0.0.1"};
+    string proxy_port;
+    int pid{0};
+    int idle{1000};
+    int tunnels{1000};
+    int ramp_threads{32};
+    int duration{30};
+    int rate{20};
+    int ping{5};
+    double max_rss_mb{0};
+    long max_fds{0};
+    long max_threads{0};
+    double max_p99_ms{0};
+    long max_failed{-1};
+};
+
+struct ProcSample {
+    double rss_mb{0};
+    long fds{0};
+    long threads{0};
+    double cpu_sec{0};
+};
+
+/**
+ * Reads memory, fd, thread and CPU usage of a process from /proc.
+ */
+ProcSample sampleProcess(int pid){
+    ProcSample sample;
+    string base = "/proc/" + to_string(pid);
+
+    ifstream status(base + "/status");
+    string line;
+    while(getline(status, line)){
+        if(line.find("VmRSS:") == 0){
+            sample.rss_mb = stol(line.substr(6)) / 1024.0;
+        } else if(line.find("Threads:") == 0){
+            sample.threads = stol(line.substr(8));
+        }
+    }
+
+    DIR* dir = opendir((base + "/fd").c_str());
+    if(dir != NULL){
+        while(readdir(dir) != NULL){
+            sample.fds++;
+        }
+        closedir(dir);
+        sample.fds -= 2; // "." and ".."
+    }
+
+    ifstream stat(base + "/stat");
+    string content((istreambuf_iterator<char>(stat)), istreambuf_iterator<char>());
+    size_t end_comm = content.rfind(')');
+    if(end_comm != string::npos){
+        istringstream ss(content.substr(end_comm + 2));
+        vector<string> fields;
+        string field;
+        while(ss >> field){
+            fields.push_back(field);
+        }
+        // utime and stime are fields 14 and 15 of /proc/pid/stat (index 11 and 12 after the comm)
+        if(fields.size() > 12){
+            sample.cpu_sec = (stod(fields[11]) + stod(fields[12])) / sysconf(_SC_CLK_TCK);
+        }
+    }
+    return sample;
+}
+
+/**
+ * Connects a blocking TCP socket to `host:port`.
+ * @return The socket, or -1 on failure.
+ */
+int connectTo(const string& host, const string& port){
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0){
+        return -1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0){
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/**
+ * Local origin: an epoll loop that answers HTTP GETs and echoes everything else.
+ */
+void runOrigin(int listen_fd, atomic<bool>& running){
+    int ep = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    const string http_response = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok";
+    vector<struct epoll_event> events(1024);
+    char buffer[16384];
+
+    while(running){
+        int n = epoll_wait(ep, events.data(), events.size(), 200);
+        for(int i = 0; i < n; i++){
+            int fd = events[i].data.fd;
+            if(fd == listen_fd){
+                int client = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+                if(client >= 0){
+                    ev.events = EPOLLIN;
+                    ev.data.fd = client;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, client, &ev);
+                }
+                continue;
+            }
+
+            int len = recv(fd, buffer, sizeof(buffer), 0);
+            if(len <= 0){
+                close(fd);
+                continue;
+            }
+            if(len >= 4 && memcmp(buffer, "GET ", 4) == 0){
+                send(fd, http_response.data(), http_response.size(), MSG_NOSIGNAL);
+                close(fd);
+            } else{
+                send(fd, buffer, len, MSG_NOSIGNAL);
+            }
+        }
+    }
+    close(ep);
+}
+
+/**
+ * Opens a CONNECT tunnel through the proxy to the local origin.
+ * @return The tunnel socket, or -1 if the proxy did not answer 200.
+ */
+int openTunnel(const SoakOptions& opts, const string& origin){
+    int fd = connectTo(opts.proxy_host, opts.proxy_port);
+    if(fd < 0){
+        return -1;
+    }
+    string request = "CONNECT " + origin + " HTTP/1.1\r\nHost: " + origin + "\r\n\r\n";
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+
+    char buffer[512];
+    struct pollfd pfd{fd, POLLIN, 0};
+    if(poll(&pfd, 1, 10000) <= 0){
+        close(fd);
+        return -1;
+    }
+    int len = recv(fd, buffer, sizeof(buffer) - 1, 0);
+    if(len <= 0 || string(buffer, len).find(" 200 ") == string::npos){
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/**
+ * Sends one GET through the proxy to the local origin.
+ * @return The latency in milliseconds, or -1 on failure.
+ */
+double activeRequest(const SoakOptions& opts, const string& origin){
+    auto start = chrono::steady_clock::now();
+    int fd = connectTo(opts.proxy_host, opts.proxy_port);
+    if(fd < 0){
+        return -1;
+    }
+    string request = "GET http://" + origin + "/soak HTTP/1.1\r\nHost: " + origin + "\r\n\r\n";
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+
+    string response;
+    char buffer[4096];
+    while(true){
+        struct pollfd pfd{fd, POLLIN, 0};
+        if(poll(&pfd, 1, 30000) <= 0){break;}
+        int len = recv(fd, buffer, sizeof(buffer), 0);
+        if(len <= 0){break;}
+        response.append(buffer, len);
+    }
+    close(fd);
+
+    if(response.find(" 200 ") == string::npos){
+        return -1;
+    }
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Closes and removes the idle connections the proxy has closed (or answered, e.g. with a
+ * timeout error).
+ * @return The number of connections removed.
+ */
+long reapIdle(vector<int>& fds){
+    vector<struct pollfd> pfds;
+    for(int fd : fds){
+        pfds.push_back({fd, POLLIN | POLLRDHUP, 0});
+    }
+    if(pfds.empty() || poll(pfds.data(), pfds.size(), 0) <= 0){
+        return 0;
+    }
+    vector<int> live;
+    for(const struct pollfd& pfd : pfds){
+        if(pfd.revents != 0){
+            close(pfd.fd);
+        } else{
+            live.push_back(pfd.fd);
+        }
+    }
+    long closed = fds.size() - live.size();
+    fds.swap(live);
+    return closed;
+}
+
+void printSample(const string& phase, int idle, int tunnels, const ProcSample& s){
+    cout << "{\"phase\":\"" << phase << "\",\"idle\":" << idle << ",\"tunnels\":" << tunnels
+         << ",\"rss_mb\":" << s.rss_mb << ",\"fds\":" << s.fds << ",\"threads\":" << s.threads
+         << ",\"cpu_sec\":" << s.cpu_sec << "}" << endl;
+}
+
+int main(int argc, char* argv[]){
+    SoakOptions opts;
+    try{
+        for(int i = 1; i + 1 < argc; i += 2){
+            string arg = argv[i];
+            string value = argv[i + 1];
+            if(arg == "--proxy"){
+                size_t colon = value.rfind(':');
+                opts.proxy_host = (colon == string::npos) ? "127.0.0.1" : value.substr(0, colon);
+                opts.proxy_port = (colon == string::npos) ? value : value.substr(colon + 1);
+            } else if(arg == "--pid"){opts.pid = stoi(value);}
+            else if(arg == "--idle"){opts.idle = stoi(value);}
+            else if(arg == "--tunnels"){opts.tunnels = stoi(value);}
+            else if(arg == "--ramp-threads"){opts.ramp_threads = stoi(value);}
+            else if(arg == "--duration"){opts.duration = stoi(value);}
+            else if(arg == "--rate"){opts.rate = stoi(value);}
+            else if(arg == "--ping"){opts.ping = stoi(value);}
+            else if(arg == "--max-rss-mb"){opts.max_rss_mb = stod(value);}
+            else if(arg == "--max-fds"){opts.max_fds = stol(value);}
+            else if(arg == "--max-threads"){opts.max_threads = stol(value);}
+            else if(arg == "--max-p99-ms"){opts.max_p99_ms = stod(value);}
+            else if(arg == "--max-failed"){opts.max_failed = stol(value);}
+            else{throw invalid_argument(arg);}
+        }
+    } catch(const exception& e){
+        cerr << "Invalid argument: " << e.what() << endl;
+        return 1;
+    }
+
+    if(opts.proxy_port.empty() || opts.pid <= 0){
+        cerr << "usage: ./soak --proxy <host:port> --pid <proxy pid> [--idle n] [--tunnels n] [--ramp-threads n] [--duration sec] "
+                "[--rate n] [--ping sec] [--max-rss-mb n] [--max-fds n] [--max-threads n] [--max-p99-ms n] [--max-failed n]" << endl;
+        return 1;
+    }
+
+    // Every background connection costs one fd here; raise the limit as far as allowed
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if(::bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 4096) < 0 ||
+       getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len) < 0){
+        cerr << "Failed to start local origin" << endl;
+        return 1;
+    }
+    string origin = "127.0.0.1:" + to_string(ntohs(addr.sin_port));
+    atomic<bool> running(true);
+    thread origin_thread(runOrigin, listen_fd, ref(running));
+
+    ProcSample baseline = sampleProcess(opts.pid);
+    printSample("baseline", 0, 0, baseline);
+
+    // Ramp up the background connections in parallel, so the first ones are not closed for
+    // idleness before the last ones are open
+    vector<int> idle_fds, tunnel_fds;
+    mutex ramp_mutex;
+    atomic<long> failed_connections(0);
+    atomic<int> rampers_running(0);
+    atomic<bool> ramp_abort(false);
+    int ramp_threads = max(1, min(opts.ramp_threads, max(opts.idle, opts.tunnels)));
+    vector<thread> rampers;
+    for(int t = 0; t < ramp_threads; t++){
+        rampers_running++;
+        rampers.emplace_back([&, t](){
+            int idle = opts.idle / ramp_threads + (t < opts.idle % ramp_threads);
+            int tunnels = opts.tunnels / ramp_threads + (t < opts.tunnels % ramp_threads);
+            while((idle > 0 || tunnels > 0) && !ramp_abort){
+                if(idle > 0){
+                    idle--;
+                    int fd = connectTo(opts.proxy_host, opts.proxy_port);
+                    if(fd < 0){failed_connections++;} else{lock_guard<mutex> lock(ramp_mutex); idle_fds.push_back(fd);}
+                }
+                if(tunnels > 0){
+                    tunnels--;
+                    int fd = openTunnel(opts, origin);
+                    if(fd < 0){failed_connections++;} else{lock_guard<mutex> lock(ramp_mutex); tunnel_fds.push_back(fd);}
+                }
+                if(failed_connections > (opts.idle + opts.tunnels) / 10 + 100){
+                    ramp_abort = true;
+                }
+            }
+            rampers_running--;
+        });
+    }
+    long dropped_idle = 0;
+    while(rampers_running > 0){
+        this_thread::sleep_for(chrono::seconds(1));
+        lock_guard<mutex> lock(ramp_mutex);
+        dropped_idle += reapIdle(idle_fds);
+        printSample("ramp", idle_fds.size(), tunnel_fds.size(), sampleProcess(opts.pid));
+    }
+    for(thread& ramper : rampers){
+        ramper.join();
+    }
+    if(ramp_abort){
+        cerr << "Too many failed connections during ramp-up" << endl;
+    }
+
+    // Hold the background and measure active requests
+    vector<double> latencies;
+    long failed_requests = 0;
+    long broken_tunnels = 0;
+    ProcSample peak = sampleProcess(opts.pid);
+    long peak_connections = idle_fds.size() + tunnel_fds.size();  // live when `peak.rss_mb` was sampled
+    auto start = chrono::steady_clock::now();
+    auto next_ping = start;
+    auto next_sample = start;
+    auto end = start + chrono::seconds(opts.duration);
+    auto interval = chrono::microseconds(1000000 / max(1, opts.rate));
+
+    for(auto next_request = start; chrono::steady_clock::now() < end; next_request += interval){
+        this_thread::sleep_until(next_request);
+        auto now = chrono::steady_clock::now();
+
+        if(now >= next_ping){
+            for(int& fd : tunnel_fds){
+                if(fd < 0){continue;}
+                char ping = 'p', echo;
+                if(recv(fd, &echo, 1, 0) == 0 || send(fd, &ping, 1, MSG_NOSIGNAL) <= 0){
+                    close(fd);
+                    fd = -1;
+                    broken_tunnels++;
+                }
+            }
+            next_ping = now + chrono::seconds(opts.ping);
+        }
+
+        double latency = activeRequest(opts, origin);
+        if(latency < 0){failed_requests++;} else{latencies.push_back(latency);}
+
+        if(now >= next_sample){
+            dropped_idle += reapIdle(idle_fds);
+            ProcSample s = sampleProcess(opts.pid);
+            long live = idle_fds.size() + tunnel_fds.size() - broken_tunnels;
+            printSample("hold", idle_fds.size(), tunnel_fds.size() - broken_tunnels, s);
+            if(s.rss_mb > peak.rss_mb){
+                peak_connections = live;
+            }
+            peak.rss_mb = max(peak.rss_mb, s.rss_mb);
+            peak.fds = max(peak.fds, s.fds);
+            peak.threads = max(peak.threads, s.threads);
+            peak.cpu_sec = s.cpu_sec;
+            next_sample = now + chrono::seconds(1);
+        }
+    }
+
+    dropped_idle += reapIdle(idle_fds);
+    long live_tunnels = tunnel_fds.size() - broken_tunnels;
+    for(int fd : idle_fds){close(fd);}
+    for(int fd : tunnel_fds){if(fd >= 0){close(fd);}}
+    running = false;
+    origin_thread.join();
+    close(listen_fd);
+
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) -> double {
+        if(latencies.empty()){return 0;}
+        return latencies[min(latencies.size() - 1, (size_t)(p * latencies.size()))];
+    };
+    long connections = max<long>(1, peak_connections);
+    double p99 = percentile(0.99);
+    long failures_total = failed_requests + failed_connections + broken_tunnels + dropped_idle;
+
+    cout << "{\"phase\":\"summary\",\"idle\":" << idle_fds.size() << ",\"tunnels\":" << live_tunnels
+         << ",\"failed_connections\":" << failed_connections << ",\"dropped_idle\":" << dropped_idle
+         << ",\"broken_tunnels\":" << broken_tunnels
+         << ",\"peak_rss_mb\":" << peak.rss_mb << ",\"peak_fds\":" << peak.fds << ",\"peak_threads\":" << peak.threads
+         << ",\"rss_kb_per_connection\":" << (peak.rss_mb - baseline.rss_mb) * 1024 / connections
+         << ",\"cpu_sec\":" << peak.cpu_sec - baseline.cpu_sec
+         << ",\"requests\":" << latencies.size() + failed_requests << ",\"failed_requests\":" << failed_requests
+         << ",\"p50_ms\":" << percentile(0.50) << ",\"p99_ms\":" << p99 << ",\"max_ms\":" << percentile(1.0) << "}" << endl;
+
+    // Check the configured thresholds
+    vector<string> failures;
+    if(opts.max_rss_mb > 0 && peak.rss_mb > opts.max_rss_mb){
+        failures.push_back("peak RSS " + to_string(peak.rss_mb) + " MB > " + to_string(opts.max_rss_mb) + " MB");
+    }
+    if(opts.max_fds > 0 && peak.fds > opts.max_fds){
+        failures.push_back("peak fds " + to_string(peak.fds) + " > " + to_string(opts.max_fds));
+    }
+    if(opts.max_threads > 0 && peak.threads > opts.max_threads){
+        failures.push_back("peak threads " + to_string(peak.threads) + " > " + to_string(opts.max_threads));
+    }
+    if(opts.max_p99_ms > 0 && p99 > opts.max_p99_ms){
+        failures.push_back("active p99 " + to_string(p99) + " ms > " + to_string(opts.max_p99_ms) + " ms");
+    }
+    if(opts.max_failed >= 0 && failures_total > opts.max_failed){
+        failures.push_back("failures " + to_string(failures_total) + " > " + to_string(opts.max_failed));
+    }
+
+    for(const string& failure : failures){
+        cerr << "FAIL: " << failure << endl;
+    }
+    if(!failures.empty()){
+        return 2;
+    }
+    cerr << "PASS" << endl;
+    return 0;
+}
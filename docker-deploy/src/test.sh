@@ -46,6 +46,48 @@ curl -s -x http://localhost:12345 http://run.mocky.io/v3/18149ac2-b458-418a-af2e
 # Kill the proxy
 kill $PROXY_PID
 
+echo "Testing https:// origin over TLS against a local stub..."
+TLS_DIR=$(mktemp -d)
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=localhost" -addext "subjectAltName=DNS:localhost" \
+    -keyout $TLS_DIR/stub.key -out $TLS_DIR/stub.crt 2> /dev/null
+# -HTTP sends the file as the whole response, so it carries its own Content-Length; no-store keeps every
+# request going to the stub
+printf 'HTTP/1.0 200 OK\r\nContent-Length: 15\r\nCache-Control: no-store\r\n\r\nhello over tls\n' > $TLS_DIR/index.txt
+(cd $TLS_DIR && exec openssl s_server -quiet -accept 14443 -cert stub.crt -key stub.key -HTTP) &
+STUB_PID=$!
+sed "s/^port = .*/port = 12346/; s/^admin_port = [0-9]*/admin_port = 12347/; s#^tls_ca_file =#tls_ca_file = $TLS_DIR/stub.crt#" \
+    proxy.conf > $TLS_DIR/proxy.conf
+./main --config $TLS_DIR/proxy.conf &
+PROXY_PID=$!
+sleep 2
+# Absolute-form request (curl would tunnel https:// through CONNECT); every one reaches the stub over TLS
+TLS_FAILED=0
+# (in one write: the proxy parses whatever its first read returns)
+printf -v TLS_REQUEST 'GET https://localhost:14443/index.txt HTTP/1.1\r\nHost: localhost:14443\r\nConnection: close\r\n\r\n'
+for i in 1 2 3; do
+    exec 3<>/dev/tcp/localhost/12346
+    printf '%s' "$TLS_REQUEST" >&3
+    if ! cat <&3 | grep -q "hello over tls"; then
+        echo "FAIL: request $i over TLS got no body"
+        TLS_FAILED=1
+    fi
+    exec 3<&-
+done
+# The later requests must have resumed the stub's session or reused a pooled connection
+METRICS=$(curl -s http://127.0.0.1:12347/metrics)
+RESUMED=$(echo "$METRICS" | awk '/^proxy_tls_resumptions_total / {print $2}')
+REUSED=$(echo "$METRICS" | awk '/^proxy_tls_reuses_total / {print $2}')
+echo "TLS resumptions: ${RESUMED:-none}, reuses: ${REUSED:-none}"
+if [ "${RESUMED:-0}" -eq 0 ] && [ "${REUSED:-0}" -eq 0 ]; then
+    echo "FAIL: no TLS session was resumed or reused"
+    TLS_FAILED=1
+fi
+kill $PROXY_PID $STUB_PID
+rm -rf $TLS_DIR
+if [ $TLS_FAILED -ne 0 ]; then
+    exit 1
+fi
+
 # Check the log file
 echo "Proxy log file contents:"
 cat var/log/erss/proxy.log
\ No newline at end of file
@@ -0,0 +1,436 @@
+#include "tls.hpp"
+
+#define TLS_IDLE_TIMEOUT 30     // seconds an idle pooled connection is kept
+#define TLS_READ_BUFFER 16384
+
+TlsConnection::~TlsConnection(){
+    if(ssl){
+        if(SSL_is_init_finished(ssl) && !(SSL_get_shutdown(ssl) & SSL_RECEIVED_SHUTDOWN)){
+            SSL_shutdown(ssl);  // sends close_notify, does not wait for the origin's
+        }
+        SSL_free(ssl);
+    }
+    if(fd >= 0){
+        close(fd);
+    }
+}
+
+/**
+ * Creates the client context: certificates are verified against `ca_file`, or the system
+ * store if it is empty, and sessions are kept per origin by `storeSession()` rather than
+ * in OpenSSL's internal cache, which is keyed for servers.
+ *
+ * @param ca_file PEM file with trusted certificates, or "" for the system default.
+ * @param connector Opens the TCP connection to an origin (the proxy's `connectServer()`).
+ * @throws `std::runtime_error` if the context cannot be created or `ca_file` cannot be loaded.
+ */
+TlsPool::TlsPool(const string& ca_file, function<int(const string&, int)> connector, unique_ptr<Logger>& logger)
+    : connector(connector), logger(logger) {
+    ctx = SSL_CTX_new(TLS_client_method());
+    if(!ctx){
+        throw runtime_error("Failed to create TLS context: " + sslError());
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    bool loaded = ca_file.empty() ? SSL_CTX_set_default_verify_paths(ctx) == 1
+                                  : SSL_CTX_load_verify_locations(ctx, ca_file.c_str(), NULL) == 1;
+    if(!loaded){
+        string error = sslError();
+        SSL_CTX_free(ctx);
+        throw runtime_error("Failed to load TLS trust store " + (ca_file.empty() ? string("(system)") : ca_file) + ": " + error);
+    }
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, storeSession);
+    SSL_CTX_set_app_data(ctx, this);
+}
+
+TlsPool::~TlsPool(){
+    lock_guard<mutex> lock(pool_mutex);
+    idle.clear();
+    for(auto& entry : sessions){
+        SSL_SESSION_free(entry.second);
+    }
+    sessions.clear();
+    SSL_CTX_free(ctx);
+}
+
+/**
+ * OpenSSL callback for a new session (with TLS 1.3, a ticket arriving after the handshake).
+ * Keeps the latest one per origin for the next handshake to resume.
+ * @return 1: the pool keeps the reference.
+ */
+int TlsPool::storeSession(SSL* ssl, SSL_SESSION* session){
+    TlsPool* pool = static_cast<TlsPool*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    TlsConnection* connection = static_cast<TlsConnection*>(SSL_get_app_data(ssl));
+    lock_guard<mutex> lock(pool->pool_mutex);
+    SSL_SESSION*& slot = pool->sessions[connection->key];
+    if(slot){
+        SSL_SESSION_free(slot);
+    }
+    slot = session;
+    return 1;
+}
+
+string TlsPool::sslError(){
+    unsigned long error = ERR_get_error();
+    if(error == 0){
+        return "connection closed";
+    }
+    char buffer[256];
+    ERR_error_string_n(error, buffer, sizeof(buffer));
+    return buffer;
+}
+
+/**
+ * Returns a connection to `host:port`: the most recently used idle one that is still open
+ * if `pooled`, otherwise a new handshake.
+ */
+unique_ptr<TlsConnection> TlsPool::acquire(const string& host, int port, bool verify, bool pooled){
+    if(pooled){
+        string key = host + ":" + to_string(port);
+        vector<unique_ptr<TlsConnection>> closing;  // destroyed after the lock is released
+        lock_guard<mutex> lock(pool_mutex);
+        auto& connections = idle[key];
+        auto now = chrono::steady_clock::now();
+        while(!connections.empty()){
+            unique_ptr<TlsConnection> connection = move(connections.back());
+            connections.pop_back();
+            // An idle connection has nothing to read unless the origin closed it
+            struct pollfd pfd = {connection->fd, POLLIN, 0};
+            if(now - connection->last_used < chrono::seconds(TLS_IDLE_TIMEOUT) && poll(&pfd, 1, 0) == 0){
+                connection->reused = true;
+                reuses++;
+                return connection;
+            }
+            closing.push_back(move(connection));
+        }
+    }
+    return handshake(host, port, verify);
+}
+
+/**
+ * Connects and performs the TLS handshake, resuming the origin's cached session if any.
+ * With `verify`, the certificate chain and the host name (or IP address) are checked.
+ * @return The connection, or `nullptr` after logging the failure.
+ */
+unique_ptr<TlsConnection> TlsPool::handshake(const string& host, int port, bool verify){
+    int fd = connector(host, port);
+    if(fd < 0){
+        return nullptr;
+    }
+    unique_ptr<TlsConnection> connection = make_unique<TlsConnection>();
+    connection->fd = fd;
+    connection->key = host + ":" + to_string(port);
+    connection->last_used = chrono::steady_clock::now();
+    connection->ssl = SSL_new(ctx);
+    if(!connection->ssl){
+        logger->log_error(-1, "Failed to create TLS connection: " + sslError());
+        return nullptr;
+    }
+    SSL_set_fd(connection->ssl, fd);
+    SSL_set_app_data(connection->ssl, connection.get());
+
+    unsigned char address[sizeof(struct in6_addr)];
+    bool is_ip = inet_pton(AF_INET, host.c_str(), address) == 1 || inet_pton(AF_INET6, host.c_str(), address) == 1;
+    if(!is_ip){
+        SSL_set_tlsext_host_name(connection->ssl, host.c_str());
+    }
+    if(verify){
+        SSL_set_verify(connection->ssl, SSL_VERIFY_PEER, NULL);
+        if(is_ip){
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(connection->ssl), host.c_str());
+        } else{
+            SSL_set1_host(connection->ssl, host.c_str());
+        }
+    } else{
+        SSL_set_verify(connection->ssl, SSL_VERIFY_NONE, NULL);
+    }
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        auto it = sessions.find(connection->key);
+        if(it != sessions.end()){
+            SSL_set_session(connection->ssl, it->second);
+        }
+    }
+
+    ERR_clear_error();
+    if(SSL_connect(connection->ssl) != 1){
+        long result = SSL_get_verify_result(connection->ssl);
+        string reason = (verify && result != X509_V_OK) ? X509_verify_cert_error_string(result) : sslError();
+        logger->log_error(-1, "TLS handshake with " + connection->key + " failed: " + reason);
+        return nullptr;
+    }
+    handshakes++;
+    if(SSL_session_reused(connection->ssl)){
+        resumptions++;
+    }
+    return connection;
+}
+
+/**
+ * Puts a connection whose last response was read completely back in the idle pool,
+ * closing the oldest idle connections beyond `max_idle` for the origin.
+ */
+void TlsPool::release(unique_ptr<TlsConnection> connection, size_t max_idle){
+    vector<unique_ptr<TlsConnection>> closing;      // destroyed after the lock is released
+    lock_guard<mutex> lock(pool_mutex);
+    connection->last_used = chrono::steady_clock::now();
+    auto& connections = idle[connection->key];
+    connections.push_back(move(connection));
+    while(connections.size() > max_idle){
+        closing.push_back(move(connections.front()));
+        connections.erase(connections.begin());
+    }
+}
+
+/**
+ * Returns a socket to send one request to the `https://` origin `host:port`.
+ * The TLS connection is taken from the pool or handshaken before returning, so an
+ * unreachable origin or a failed certificate check is reported here.
+ *
+ * @param verify Whether to verify the origin's certificate.
+ * @param max_idle Idle connections kept per origin.
+ * @param timeout Seconds to wait for the request from the proxy.
+ * @return The socket, or -1 if no TLS connection could be established.
+ */
+int TlsPool::open(const string& host, int port, bool verify, size_t max_idle, double timeout){
+    unique_ptr<TlsConnection> connection = acquire(host, port, verify, true);
+    if(!connection){
+        return -1;
+    }
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0){
+        return -1;
+    }
+    struct timeval tv;
+    tv.tv_sec = (time_t)timeout;
+    tv.tv_usec = (suseconds_t)((timeout - tv.tv_sec) * 1000000);
+    setsockopt(pair[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    thread(&TlsPool::carry, this, move(connection), pair[1], host, port, verify, max_idle, timeout).detach();
+    return pair[0];
+}
+
+/**
+ * Carries one request over the TLS connection and writes the response back in plaintext.
+ * A pooled connection the origin closed before answering is replaced by a new one once;
+ * the request had not been processed, so this is safe for POST as well.
+ */
+void TlsPool::carry(unique_ptr<TlsConnection> connection, int fd, string host, int port, bool verify,
+                    size_t max_idle, double timeout){
+    string head, body;
+    if(!H2Pool::readRequest(fd, timeout, head, body)){
+        release(move(connection), max_idle);
+        close(fd);
+        return;
+    }
+    string method;
+    string request = toOriginForm(head, method) + body;
+
+    while(connection){
+        bool reusable = false;
+        bool started = false;
+        if(exchange(*connection, request, method, fd, reusable, started)){
+            if(reusable){
+                release(move(connection), max_idle);
+            }
+            break;
+        }
+        if(started || !connection->reused){
+            break;
+        }
+        logger->log_note(-1, "Pooled TLS connection to " + connection->key + " was closed, reconnecting");
+        connection = acquire(host, port, verify, false);
+    }
+    close(fd);  // EOF ends the response, as with an origin that closes the connection
+}
+
+/**
+ * Sends the request over the TLS connection and relays the response to `fd`; see `relayResponse()`.
+ */
+bool TlsPool::exchange(TlsConnection& connection, const string& request, const string& method, int fd,
+                       bool& reusable, bool& started){
+    ERR_clear_error();
+    if(SSL_write(connection.ssl, request.data(), request.size()) <= 0){
+        return false;
+    }
+    return relayResponse([&connection](char* buffer, size_t size){
+        return (ssize_t)SSL_read(connection.ssl, buffer, (int)size);
+    }, method, fd, reusable, started);
+}
+
+/**
+ * Relays an HTTP/1.1 response to `fd` as it arrives, reading exactly the body framed by
+ * `Content-Length` or chunked encoding so the connection it came from can be reused.
+ * Interim (1xx) responses are relayed and the final one is read after them. Shared by the
+ * TLS and parent proxy pools, which differ only in how they read the connection.
+ *
+ * @param read Reads up to `size` bytes of the response into `buffer`; returns the count, or
+ *        0 or less at EOF or on failure.
+ * @param method The request method, as a `HEAD` response has no body.
+ * @param reusable Set if the connection can carry another request.
+ * @param started Set once any response bytes were received.
+ * @return `false` if the connection failed before the response was complete.
+ */
+bool TlsPool::relayResponse(const function<ssize_t(char*, size_t)>& read, const string& method, int fd,
+                            bool& reusable, bool& started){
+    char buffer[TLS_READ_BUFFER];
+    string data;
+    size_t head_end;
+    int status;
+    while(true){
+        while((head_end = data.find("\r\n\r\n")) == string::npos){
+            ssize_t received = read(buffer, sizeof(buffer));
+            if(received <= 0){
+                return false;
+            }
+            started = true;
+            data.append(buffer, received);
+        }
+        if(data.compare(0, 5, "HTTP/") != 0){
+            return false;
+        }
+        status = atoi(data.c_str() + data.find(' '));
+        if(status >= 200 || status == 101){
+            break;
+        }
+        // Interim (1xx) response: relay it and read the final one
+        if(!H2::sendAll(fd, data.data(), head_end + 4)){
+            return false;
+        }
+        data.erase(0, head_end + 4);
+    }
+
+    string head = H2::toLower(data.substr(0, head_end + 2));
+    size_t body_start = head_end + 4;
+    size_t rest = data.size() - body_start;
+    bool keep_alive = head.compare(0, 8, "http/1.1") == 0;
+    // Proxy-Connection comes from parent proxies
+    for(const char* name : {"\nconnection:", "\nproxy-connection:"}){
+        size_t pos = head.find(name);
+        if(pos != string::npos && head.substr(pos, head.find('\n', pos + 1) - pos).find("close") != string::npos){
+            keep_alive = false;
+        }
+    }
+    size_t pos = head.find("\ntransfer-encoding:");
+    bool chunked = pos != string::npos && head.substr(pos, head.find('\n', pos + 1) - pos).find("chunked") != string::npos;
+    pos = head.find("\ncontent-length:");
+    bool has_length = pos != string::npos;
+    size_t length = has_length ? strtoul(head.c_str() + pos + 16, NULL, 10) : 0;
+
+    if(!H2::sendAll(fd, data.data(), data.size())){
+        return false;
+    }
+    if(method == "HEAD" || status == 204 || status == 304){
+        reusable = keep_alive && rest == 0;
+    } else if(chunked){
+        string body = data.substr(body_start);
+        size_t chunk_pos = 0;
+        while(!chunkedComplete(body, chunk_pos)){
+            ssize_t received = read(buffer, sizeof(buffer));
+            if(received <= 0 || !H2::sendAll(fd, buffer, received)){
+                return false;
+            }
+            body.append(buffer, received);
+        }
+        reusable = keep_alive && chunk_pos == body.size();
+    } else if(has_length){
+        size_t remaining = length > rest ? length - rest : 0;
+        while(remaining > 0){
+            ssize_t received = read(buffer, min(sizeof(buffer), remaining));
+            if(received <= 0 || !H2::sendAll(fd, buffer, received)){
+                return false;
+            }
+            remaining -= received;
+        }
+        reusable = keep_alive && rest <= length;
+    } else{
+        // Body delimited by the other end closing the connection
+        ssize_t received;
+        while((received = read(buffer, sizeof(buffer))) > 0){
+            if(!H2::sendAll(fd, buffer, received)){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Scans a chunked body from the chunk-size line at `pos`.
+ * @param pos Advanced past each complete chunk; past the trailers once complete.
+ * @return `true` once the last chunk and the trailers have been received.
+ */
+bool TlsPool::chunkedComplete(const string& body, size_t& pos){
+    while(true){
+        size_t line_end = body.find("\r\n", pos);
+        if(line_end == string::npos){
+            return false;
+        }
+        size_t size = strtoul(body.c_str() + pos, NULL, 16);
+        if(size == 0){
+            size_t end = body.find("\r\n\r\n", line_end);
+            if(end == string::npos){
+                return false;
+            }
+            pos = end + 4;
+            return true;
+        }
+        size_t next = line_end + 2 + size + 2;
+        if(body.size() < next){
+            return false;
+        }
+        pos = next;
+    }
+}
+
+/**
+ * Rewrites the proxy's request head for the origin: the absolute-form target becomes
+ * origin-form and the connection is asked to stay open.
+ * @param method Set to the request method.
+ */
+string TlsPool::toOriginForm(const string& head, string& method){
+    return keepAliveHead(head, method, [](const string& target){
+        size_t scheme = target.find("://");
+        if(scheme == string::npos){
+            return target;
+        }
+        size_t slash = target.find('/', scheme + 3);
+        return slash == string::npos ? string("/") : target.substr(slash);
+    });
+}
+
+/**
+ * Rebuilds a request head with the target `retarget` returns for the original one, minus
+ * the hop-by-hop connection headers, asking for the connection to stay open.
+ * @param method Set to the request method.
+ */
+string TlsPool::keepAliveHead(const string& head, string& method, const function<string(const string&)>& retarget){
+    istringstream ss(head);
+    string line, target, version;
+    getline(ss, line);
+    istringstream(line) >> method >> target >> version;
+
+    string out = method + " " + retarget(target) + " " + version + "\r\n";
+    while(getline(ss, line)){
+        if(!line.empty() && line.back() == '\r'){line.pop_back();}
+        if(line.empty()){continue;}
+        string name = H2::toLower(line.substr(0, line.find(':')));
+        if(name == "connection" || name == "proxy-connection" || name == "keep-alive"){
+            continue;
+        }
+        out += line + "\r\n";
+    }
+    return out + "Connection: keep-alive\r\n\r\n";
+}
+
+/**
+ * Counts the idle TLS connections kept for reuse.
+ */
+size_t TlsPool::idleConnections(){
+    lock_guard<mutex> lock(pool_mutex);
+    size_t count = 0;
+    for(auto& entry : idle){
+        count += entry.second.size();
+    }
+    return count;
+}
@@ -0,0 +1,83 @@
+#ifndef _TLS_HPP_
+#define _TLS_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <arpa/inet.h>
+#include "h2pool.hpp"
+#include "log.hpp"
+
+using namespace std;
+
+/**
+ * One TLS connection to an origin (`host:port`).
+ */
+struct TlsConnection {
+    int fd{-1};
+    SSL* ssl{nullptr};
+    string key;                         // host:port
+    bool reused{false};                 // taken from the pool rather than freshly handshaken
+    chrono::steady_clock::time_point last_used;
+
+    ~TlsConnection();
+};
+
+/**
+ * TLS client for absolute-form `https://` requests.
+ *
+ * `open()` hands out one end of a socketpair that behaves like a connection from
+ * `connectServer()`: the proxy writes an HTTP/1.1 request and reads the plaintext response
+ * until EOF, so the GET/POST handling and the cache are shared with `http://` origins.
+ * A thread per request carries it over a TLS connection with `Connection: keep-alive`;
+ * once the response is complete, the connection goes back to a per-origin idle pool.
+ * New connections resume the origin's last TLS session (ticket) when one is cached.
+ */
+class TlsPool {
+private:
+    SSL_CTX* ctx{nullptr};
+    function<int(const string&, int)> connector;
+    unique_ptr<Logger>& logger;
+    mutex pool_mutex;
+    map<string, vector<unique_ptr<TlsConnection>>> idle;
+    map<string, SSL_SESSION*> sessions;
+
+    unique_ptr<TlsConnection> acquire(const string& host, int port, bool verify, bool pooled);
+    unique_ptr<TlsConnection> handshake(const string& host, int port, bool verify);
+    void release(unique_ptr<TlsConnection> connection, size_t max_idle);
+    void carry(unique_ptr<TlsConnection> connection, int fd, string host, int port, bool verify,
+               size_t max_idle, double timeout);
+    bool exchange(TlsConnection& connection, const string& request, const string& method, int fd,
+                  bool& reusable, bool& started);
+
+    static int storeSession(SSL* ssl, SSL_SESSION* session);
+    static string toOriginForm(const string& head, string& method);
+    static string sslError();
+
+public:
+    atomic<size_t> handshakes{0};
+    atomic<size_t> resumptions{0};
+    atomic<size_t> reuses{0};
+
+    TlsPool(const string& ca_file, function<int(const string&, int)> connector, unique_ptr<Logger>& logger);
+    ~TlsPool();
+
+    int open(const string& host, int port, bool verify, size_t max_idle, double timeout);
+    size_t idleConnections();
+
+    static bool relayResponse(const function<ssize_t(char*, size_t)>& read, const string& method, int fd,
+                              bool& reusable, bool& started);
+    static bool chunkedComplete(const string& body, size_t& pos);
+    static string keepAliveHead(const string& head, string& method, const function<string(const string&)>& retarget);
+};
+
+#endif
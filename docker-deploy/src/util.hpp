@@ -33,8 +33,11 @@
  * - `CacheStatus::WILL_EXPIRE`: Response will expire soon.
  * - `CacheStatus::REVALIDATION`: Response requires revalidation.
  *
+ * @section Log Levels
+ * - `LOG_LEVEL_NONE`, `LOG_LEVEL_ERROR`, `LOG_LEVEL_NOTE`: which `ERROR`/`NOTE` lines the logger writes.
+ *
  * @section 
- * - `HOST`, `USERAGENT`, `CONNECTION`, `IFNONEMATCH`, `IFMODIFIED`: 
+ * - `HOST`, `USERAGENT`, `CONNECTION`, `IFNONEMATCH`, `IFMODIFIED`, `UPGRADE`: 
  *   Common request headers used for HTTP communication and cache validation.
  *
  */
@@ -68,6 +71,10 @@ const char * const HEADER_CACHECTRL= "Cache-Control";
 #define CACHE_NO_STORE 5
 #define CACHE_NORMAL 6
 
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_NOTE 2
+
 enum class CacheStatus {
     NOT_IN_CACHE = 7, //not in cache
     EXPIRED = 8,  //in cache, but expired at EXPIREDTIME
@@ -78,10 +85,13 @@ enum class CacheStatus {
     REVALIDATION = 13
 };
 
+const char * const CACHE_SNAPSHOT_MAGIC = "PXCACHE1\n";
+
 const char * const HOST = "Host: ";
 const char * const USERAGENT = "User-Agent: ";
 const char * const CONNECTION = "Connection: ";
 const char * const IFNONEMATCH = "If-None-Match: ";
 const char * const IFMODIFIED = "If-Modified-Since: ";
+const char * const UPGRADE = "Upgrade: ";
 
 #endif
\ No newline at end of file